@@ -193,9 +193,7 @@ OutputDebugString(str);
                 pCoreKeyframe.transform.translation = translation;
                 pCoreKeyframe.transform.rotation = rotation;
 
-                                // oh god
-                                CalCoreTrack::KeyframeList& ls = const_cast<CalCoreTrack::KeyframeList&>(coreAnimation.getCoreTrack(pBoneCandidate->GetId())->keyframes);
-                                ls.push_back(pCoreKeyframe);
+                                coreAnimation.findTrack(pBoneCandidate->GetId())->keyframes.push_back(pCoreKeyframe);
             }
         }
 
@@ -168,11 +168,20 @@ namespace cal3d {
     };
 }
 
-template<unsigned i>
-CalIndex getFaceIndex(const CalCoreSubmesh::Face& f) {
+template<typename Face, unsigned i>
+CalIndex32 getFaceIndex(const Face& f) {
     return f.vertexId[i];
 }
 
+// Either index width, as WideTriangles.
+CalCoreSubmesh::VectorWideFace getTriangles(const CalCoreSubmesh& submesh) {
+    CalCoreSubmesh::VectorWideFace faces(submesh.getFaceCount());
+    for (size_t f = 0; f < faces.size(); ++f) {
+        faces[f] = submesh.getFace(f);
+    }
+    return faces;
+}
+
 struct PythonVertex {
     PythonVertex() {}
     PythonVertex(const CalCoreSubmesh::Vertex& v)
@@ -415,13 +424,23 @@ BOOST_PYTHON_MODULE(_cal3d)
     class_<CalCoreSubmesh::Face>("Triangle")
         .def(init<>())
         .def(init<CalIndex, CalIndex, CalIndex>())
-        .add_property("v1", &getFaceIndex<0>)
-        .add_property("v2", &getFaceIndex<1>)
-        .add_property("v3", &getFaceIndex<2>)
+        .add_property("v1", &getFaceIndex<CalCoreSubmesh::Face, 0>)
+        .add_property("v2", &getFaceIndex<CalCoreSubmesh::Face, 1>)
+        .add_property("v3", &getFaceIndex<CalCoreSubmesh::Face, 2>)
         ;
 
     exportVector<CalCoreSubmesh::Face>("TriangleVector");
 
+    class_<CalCoreSubmesh::WideFace>("WideTriangle")
+        .def(init<>())
+        .def(init<CalIndex32, CalIndex32, CalIndex32>())
+        .add_property("v1", &getFaceIndex<CalCoreSubmesh::WideFace, 0>)
+        .add_property("v2", &getFaceIndex<CalCoreSubmesh::WideFace, 1>)
+        .add_property("v3", &getFaceIndex<CalCoreSubmesh::WideFace, 2>)
+        ;
+
+    exportVector<CalCoreSubmesh::WideFace>("WideTriangleVector");
+
     class_<PythonVertex>("Vertex")
         .def_readwrite("position", &PythonVertex::position)
         .def_readwrite("normal", &PythonVertex::normal)
@@ -495,8 +514,9 @@ BOOST_PYTHON_MODULE(_cal3d)
     class_<CalCoreSubmesh, CalCoreSubmeshPtr, boost::noncopyable>("CoreSubmesh", no_init)
         .def(init<int, int, int>())
         .def_readwrite("coreMaterialThreadId", &CalCoreSubmesh::coreMaterialThreadId)
-        .add_property("triangles", make_function(&CalCoreSubmesh::getFaces, return_value_policy<return_by_value>()))
+        .add_property("triangles", &getTriangles)
         .add_property("triangleCount", &CalCoreSubmesh::getFaceCount)
+        .add_property("indexSize", &CalCoreSubmesh::getIndexSize, &CalCoreSubmesh::setIndexSize)
         .add_property("vertices", &getVertices)
         .add_property("vertexCount", &CalCoreSubmesh::getVertexCount)
         .add_property("colors", make_function(&CalCoreSubmesh::getVertexColors, return_value_policy<return_by_value>()))
@@ -505,7 +525,8 @@ BOOST_PYTHON_MODULE(_cal3d)
         .add_property("subMorphTargets", make_function(&CalCoreSubmesh::getMorphTargets, return_value_policy<return_by_value>()))
         .def("addMorphTarget", &CalCoreSubmesh::addMorphTarget)
         .def("addVertex", &addVertex)
-        .def("addTriangle", &CalCoreSubmesh::addFace)
+        .def("addTriangle", static_cast<void (CalCoreSubmesh::*)(const CalCoreSubmesh::Face&)>(&CalCoreSubmesh::addFace))
+        .def("addTriangle", static_cast<void (CalCoreSubmesh::*)(const CalCoreSubmesh::WideFace&)>(&CalCoreSubmesh::addFace))
 
         .def("setTextureCoordinate", &CalCoreSubmesh::setTextureCoordinate)
         .def("hasTextureCoordinates", &CalCoreSubmesh::hasTextureCoordinates)
@@ -513,7 +534,8 @@ BOOST_PYTHON_MODULE(_cal3d)
         .def("hasTextureCoordinatesOutside0_1", &CalCoreSubmesh::hasTextureCoordinatesOutside0_1)
 
         .def("duplicateTriangles", &CalCoreSubmesh::duplicateTriangles)
-        .def("sortTris", &CalCoreSubmesh::sortTris)
+        .def("sortTris", static_cast<void (CalCoreSubmesh::*)(CalCoreSubmesh&)>(&CalCoreSubmesh::sortTris))
+        .def("sortTris", static_cast<void (CalCoreSubmesh::*)(CalCoreSubmesh&, float)>(&CalCoreSubmesh::sortTris))
         .def("simplifySubmesh", &CalCoreSubmesh::simplifySubmesh)
         .def("isStatic", &CalCoreSubmesh::isStatic)
         .def("splitMeshBasedOnBoneLimit", &CalCoreSubmesh::splitMeshBasedOnBoneLimit)
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <stddef.h>
 #include "cal3d/vector.h"
+#include "cal3d/vector4.h"
 
 #ifdef min
 #undef min
@@ -26,3 +28,23 @@ struct CalAABox {
 inline bool operator==(const CalAABox& lhs, const CalAABox& rhs) {
     return lhs.min == rhs.min && lhs.max == rhs.max;
 }
+
+namespace cal3d {
+    // True if the box lies entirely behind one of the planes.  Each plane is
+    // (a, b, c, d) with a*x + b*y + c*z + d >= 0 on the inside, e.g. the six
+    // planes of a view frustum in the box's space.  Conservative: a box
+    // straddling two planes outside a frustum corner is kept.
+    inline bool isOutsidePlanes(const CalAABox& box, const CalVector4* planes, size_t planeCount) {
+        for (size_t i = 0; i < planeCount; ++i) {
+            const CalVector4& p = planes[i];
+            // the box corner furthest along the plane normal
+            const float x = p.x >= 0.0f ? box.max.x : box.min.x;
+            const float y = p.y >= 0.0f ? box.max.y : box.min.y;
+            const float z = p.z >= 0.0f ? box.max.z : box.min.z;
+            if (p.x * x + p.y * y + p.z * z + p.w < 0.0f) {
+                return true;
+            }
+        }
+        return false;
+    }
+}
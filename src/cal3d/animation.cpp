@@ -18,4 +18,66 @@ CalAnimation::CalAnimation(const CalCoreAnimationPtr& pCoreAnimation, float weig
     , rampValue(1.0f)
     , weight(weight)
     , priority(priority)
+    , boundBoneCount(0)
+    , boundGeneration(0)
+    , trackBindingsValid(false)
 {}
+
+void CalAnimation::setBoneMask(const BoneMask& mask) {
+    boneMask = mask;
+    trackBindingsValid = false;
+}
+
+bool CalAnimation::isBound(unsigned boneId, size_t boneCount) const {
+    if (boneId >= boneCount) {
+        return false;
+    }
+    // bones past the end of a short mask are masked out
+    return boneMask.empty() || (boneId < boneMask.size() && boneMask[boneId]);
+}
+
+void CalAnimation::updateBindings(size_t boneCount) {
+    if (trackBindingsValid &&
+        boundBoneCount == boneCount &&
+        boundGeneration == coreAnimation->getGeneration()
+    ) {
+        return;
+    }
+
+    trackBindings.clear();
+    constantTrackBindings.clear();
+
+    const auto& tracks = coreAnimation->tracks;
+    for (size_t i = 0; i < tracks.size(); ++i) {
+        if (isBound(tracks[i].coreBoneId, boneCount)) {
+            TrackBinding binding;
+            binding.trackIndex = i;
+            binding.boneId = tracks[i].coreBoneId;
+            trackBindings.push_back(binding);
+        }
+    }
+
+    const auto& constantTracks = coreAnimation->constantTracks;
+    for (size_t i = 0; i < constantTracks.size(); ++i) {
+        if (isBound(constantTracks[i].coreBoneId, boneCount)) {
+            TrackBinding binding;
+            binding.trackIndex = i;
+            binding.boneId = constantTracks[i].coreBoneId;
+            constantTrackBindings.push_back(binding);
+        }
+    }
+
+    boundBoneCount = boneCount;
+    boundGeneration = coreAnimation->getGeneration();
+    trackBindingsValid = true;
+}
+
+const CalAnimation::TrackBindingList& CalAnimation::getTrackBindings(size_t boneCount) {
+    updateBindings(boneCount);
+    return trackBindings;
+}
+
+const CalAnimation::TrackBindingList& CalAnimation::getConstantTrackBindings(size_t boneCount) {
+    updateBindings(boneCount);
+    return constantTrackBindings;
+}
@@ -7,13 +7,45 @@ CAL3D_PTR(CalCoreAnimation);
 
 class CAL3D_API CalAnimation {
 public:
+    // One bit per CalSkeleton::bones entry.  An empty mask means every bone.
+    typedef std::vector<bool> BoneMask;
+
+    struct TrackBinding {
+        unsigned trackIndex; // into coreAnimation->tracks or constantTracks
+        unsigned boneId;
+    };
+    typedef std::vector<TrackBinding> TrackBindingList;
+
     CalAnimation(const CalCoreAnimationPtr& pCoreAnimation, float weight, unsigned priority);
 
+    void setBoneMask(const BoneMask& mask);
+    const BoneMask& getBoneMask() const {
+        return boneMask;
+    }
+
+    // The tracks that drive bones of a skeleton with boneCount bones,
+    // with absent and masked-out bones already filtered.  Rebuilt only
+    // when the bone count, the mask or the core animation's generation
+    // changes.
+    const TrackBindingList& getTrackBindings(size_t boneCount);
+    const TrackBindingList& getConstantTrackBindings(size_t boneCount);
+
     const CalCoreAnimationPtr coreAnimation;
 
     float time; // current time
     float rampValue; // 0->1 fade in, 1->0 fade out
     const float weight;
     const unsigned priority; // 0 is lowest
+
+private:
+    void updateBindings(size_t boneCount);
+    bool isBound(unsigned boneId, size_t boneCount) const;
+
+    BoneMask boneMask;
+    TrackBindingList trackBindings;
+    TrackBindingList constantTrackBindings;
+    size_t boundBoneCount;
+    unsigned boundGeneration;
+    bool trackBindingsValid;
 };
 CAL3D_PTR(CalAnimation);
@@ -54,7 +54,8 @@ void CalBone::resetPose() {
     transformAccumulator.reset(coreRelativeTransform); // if no animations are applied, use this
     currentAttenuation = 1.0f;
     scale.setIdentity();
-    absoluteScale.setIdentity();
+    // absoluteScale is left alone: a bone skipped by an incremental
+    // CalSkeleton::calculateAbsolutePose still passes it to its children
 }
 
 /*****************************************************************************/
@@ -110,3 +111,10 @@ void CalBone::calculateAbsolutePose(const CalBone* bones) {
     absoluteScale = parentScale * scale;
     absoluteTransform = removeScale(parentTransform * getRelativeTransform()) * absoluteScale;
 }
+
+void CalBone::calculateAbsolutePoseScaleFree(const CalBone* bones) {
+    absoluteRotateTranslate = (parentId == -1)
+        ? getRelativeTransform()
+        : bones[parentId].absoluteRotateTranslate * getRelativeTransform();
+    absoluteTransform = cal3d::Transform(absoluteRotateTranslate);
+}
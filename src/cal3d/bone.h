@@ -39,6 +39,8 @@ class CAL3D_API CalBone {
 public:
     const int parentId;
     cal3d::Transform absoluteTransform;
+    // only maintained by calculateAbsolutePoseScaleFree
+    cal3d::RotateTranslate absoluteRotateTranslate;
     cal3d::Scale scale;
 
     CalBone(const CalCoreBone& coreBone);
@@ -59,7 +61,13 @@ public:
 
     void calculateAbsolutePose(const CalBone* bones);
 
+    // Same result as calculateAbsolutePose, provided no bone up the chain
+    // is scaled, but composes quaternions instead of matrices.
+    void calculateAbsolutePoseScaleFree(const CalBone* bones);
+
 private:
+    friend class CalSkeleton;
+
     // from core bone. stored locally for better cache locality
     const cal3d::RotateTranslate coreRelativeTransform;
 
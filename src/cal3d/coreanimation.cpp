@@ -29,30 +29,75 @@ size_t sizeInBytes(const CalCoreTrack& t) {
     return t.sizeInBytes();
 }
 
+CAL3D_DEFINE_SIZE(CalCoreAnimation::ConstantTrack);
+CAL3D_DEFINE_SIZE(float);
+
 size_t CalCoreAnimation::sizeInBytes() const {
-    return sizeof(*this) + ::sizeInBytes(tracks);
+    return sizeof(*this) +
+           ::sizeInBytes(tracks) +
+           ::sizeInBytes(constantTracks) +
+           ::sizeInBytes(constantKeyframeTimes);
 }
 
-const CalCoreTrack* CalCoreAnimation::getCoreTrack(unsigned coreBoneId) const {
+CalCoreTrackPtr CalCoreAnimation::getCoreTrack(unsigned coreBoneId) const {
     for (
         TrackList::const_iterator iteratorCoreTrack = tracks.begin();
         iteratorCoreTrack != tracks.end();
         ++iteratorCoreTrack
     ) {
         if (iteratorCoreTrack->coreBoneId == coreBoneId) {
-            return &*iteratorCoreTrack;
+            return CalCoreTrackPtr(new CalCoreTrack(*iteratorCoreTrack));
+        }
+    }
+
+    for (auto i = constantTracks.begin(); i != constantTracks.end(); ++i) {
+        if (i->coreBoneId == coreBoneId) {
+            return CalCoreTrackPtr(new CalCoreTrack(rebuildTrack(*i)));
         }
     }
 
     // no match found
+    return CalCoreTrackPtr();
+}
+
+CalCoreTrack* CalCoreAnimation::findTrack(unsigned coreBoneId) {
+    for (auto i = tracks.begin(); i != tracks.end(); ++i) {
+        if (i->coreBoneId == coreBoneId) {
+            return &*i;
+        }
+    }
     return 0;
 }
 
+CalCoreTrack CalCoreAnimation::rebuildTrack(const ConstantTrack& constantTrack) const {
+    CalCoreTrack::KeyframeList keyframes;
+    keyframes.reserve(constantTrack.keyframeCount);
+    for (unsigned k = 0; k < constantTrack.keyframeCount; ++k) {
+        keyframes.push_back(CalCoreKeyframe(
+            constantKeyframeTimes[constantTrack.firstKeyframeTime + k],
+            constantTrack.transform.translation,
+            constantTrack.transform.rotation));
+    }
+
+    CalCoreTrack track(constantTrack.coreBoneId, keyframes);
+    track.translationRequired = constantTrack.translationRequired;
+    track.translationIsDynamic = constantTrack.translationIsDynamic;
+    track.translationIsConstant = true;
+    track.rotationIsConstant = true;
+    return track;
+}
+
 void CalCoreAnimation::scale(float factor) {
     std::for_each(
         tracks.begin(),
         tracks.end(),
         std::bind2nd(std::mem_fun_ref(&CalCoreTrack::scale), factor));
+    for (auto i = constantTracks.begin(); i != constantTracks.end(); ++i) {
+        // don't scale the 'invalid translation' sentinel
+        if (!exactlyEqual(i->transform.translation, InvalidTranslation)) {
+            i->transform.translation *= factor;
+        }
+    }
 }
 
 void CalCoreAnimation::optimize() {
@@ -62,7 +107,71 @@ void CalCoreAnimation::optimize() {
         std::mem_fun_ref(&CalCoreTrack::optimize));
 }
 
+void CalCoreAnimation::foldConstantTracks(double translationTolerance, double rotationToleranceDegrees) {
+    // trackIndex must refer to the unfolded order
+    unfoldConstantTracks();
+
+    TrackList animated;
+    animated.reserve(tracks.size());
+
+    for (size_t i = 0; i < tracks.size(); ++i) {
+        CalCoreTrack& track = tracks[i];
+        track.classify(translationTolerance, rotationToleranceDegrees);
+        if (!track.isConstant() || track.keyframes.empty()) {
+            animated.push_back(track);
+            continue;
+        }
+
+        ConstantTrack ct;
+        ct.trackIndex = unsigned(i);
+        ct.coreBoneId = track.coreBoneId;
+        ct.keyframeCount = unsigned(track.keyframes.size());
+        ct.translationRequired = track.translationRequired;
+        ct.translationIsDynamic = track.translationIsDynamic;
+        ct.transform = track.keyframes[0].transform;
+
+        // bones are usually sampled together, so reuse the previous run
+        // of times when it matches
+        bool sameTimes = !constantTracks.empty() && constantTracks.back().keyframeCount == ct.keyframeCount;
+        for (unsigned k = 0; sameTimes && k < ct.keyframeCount; ++k) {
+            sameTimes = constantKeyframeTimes[constantTracks.back().firstKeyframeTime + k] == track.keyframes[k].time;
+        }
+        if (sameTimes) {
+            ct.firstKeyframeTime = constantTracks.back().firstKeyframeTime;
+        } else {
+            ct.firstKeyframeTime = unsigned(constantKeyframeTimes.size());
+            for (auto k = track.keyframes.begin(); k != track.keyframes.end(); ++k) {
+                constantKeyframeTimes.push_back(k->time);
+            }
+        }
+        constantTracks.push_back(ct);
+    }
+
+    swap(tracks, animated);
+    tracksChanged();
+}
+
+void CalCoreAnimation::unfoldConstantTracks() {
+    if (constantTracks.empty()) {
+        return;
+    }
+
+    TrackList merged;
+    merged.reserve(getTrackCount());
+    visitTracks([&](const CalCoreTrack& track) {
+        merged.push_back(track);
+        return true;
+    });
+
+    swap(tracks, merged);
+    constantTracks.clear();
+    constantKeyframeTimes.clear();
+    tracksChanged();
+}
+
 void CalCoreAnimation::fixup(const CalCoreSkeletonPtr& skeleton, cal3d::RotateTranslate rt, bool doFingerFix) {
+    cal3d::verify(constantTracks.empty(), "fixup must run before foldConstantTracks");
+
     const auto& coreBones = skeleton->coreBones;
 
     TrackList output;
@@ -177,4 +286,5 @@ void CalCoreAnimation::fixup(const CalCoreSkeletonPtr& skeleton, cal3d::RotateTr
     }
 
     swap(tracks, output);
+    tracksChanged();
 }
@@ -21,10 +21,35 @@ class CAL3D_API CalCoreAnimation {
 public:
     CalCoreAnimation()
         : duration(0.0f)
+        , generation(0)
     {}
 
     size_t sizeInBytes() const;
-    const CalCoreTrack* getCoreTrack(unsigned coreBoneId) const;
+    // A copy of the track driving coreBoneId, rebuilt if it was folded, or
+    // null.
+    CalCoreTrackPtr getCoreTrack(unsigned coreBoneId) const;
+    // The unfolded track driving coreBoneId, to edit in place, or null.
+    CalCoreTrack* findTrack(unsigned coreBoneId);
+
+    // tracks plus constantTracks
+    size_t getTrackCount() const {
+        return tracks.size() + constantTracks.size();
+    }
+    // Calls visit(const CalCoreTrack&) on every track in its order before
+    // folding, rebuilding folded tracks one at a time, until visit returns
+    // false.  Returns whether every visit succeeded.
+    template<typename Visitor>
+    bool visitTracks(Visitor visit) const;
+
+    // Changes whenever tracks or constantTracks gain, lose or reorder
+    // entries, so CalAnimation knows when to rebind.  Code that edits the
+    // lists directly must call tracksChanged() afterwards.
+    unsigned getGeneration() const {
+        return generation;
+    }
+    void tracksChanged() {
+        ++generation;
+    }
 
     void scale(float factor);
     void fixup(
@@ -33,13 +58,67 @@ public:
         bool doFingerFix = false);
     void optimize();
 
+    // Classifies every track and moves the fully constant ones into
+    // constantTracks.  Call after fixup().  Folding again first unfolds.
+    void foldConstantTracks(double translationTolerance, double rotationToleranceDegrees);
+    // Puts folded tracks back into tracks at their original positions.
+    void unfoldConstantTracks();
+
+    // What unfolding needs besides the pose: the track's position and
+    // flags, and its keyframe times as a run of constantKeyframeTimes.
+    struct ConstantTrack {
+        unsigned trackIndex; // position in tracks before folding
+        unsigned coreBoneId;
+        unsigned firstKeyframeTime;
+        unsigned keyframeCount;
+        bool translationRequired;
+        bool translationIsDynamic;
+        cal3d::RotateTranslate transform;
+    };
+    CalCoreTrack rebuildTrack(const ConstantTrack& constantTrack) const;
+
     float duration;
     typedef std::vector<CalCoreTrack> TrackList;
     TrackList tracks;
+    typedef std::vector<ConstantTrack> ConstantTrackList;
+    ConstantTrackList constantTracks;
+    // shared by folded tracks sampled at the same times
+    std::vector<float> constantKeyframeTimes;
+
+private:
+    unsigned generation;
 };
 CAL3D_PTR(CalCoreAnimation);
 
+template<typename Visitor>
+bool CalCoreAnimation::visitTracks(Visitor visit) const {
+    auto animated = tracks.begin();
+    auto folded = constantTracks.begin();
+    for (size_t i = 0; i < getTrackCount(); ++i) {
+        if (folded != constantTracks.end() && folded->trackIndex == i) {
+            if (!visit(rebuildTrack(*folded++))) {
+                return false;
+            }
+        } else if (!visit(*animated++)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool operator==(const CalCoreAnimation::ConstantTrack& lhs, const CalCoreAnimation::ConstantTrack& rhs) {
+    return lhs.trackIndex == rhs.trackIndex &&
+           lhs.coreBoneId == rhs.coreBoneId &&
+           lhs.firstKeyframeTime == rhs.firstKeyframeTime &&
+           lhs.keyframeCount == rhs.keyframeCount &&
+           lhs.translationRequired == rhs.translationRequired &&
+           lhs.translationIsDynamic == rhs.translationIsDynamic &&
+           lhs.transform == rhs.transform;
+}
+
 inline bool operator==(const CalCoreAnimation& lhs, const CalCoreAnimation& rhs) {
     return lhs.duration == rhs.duration &&
-           lhs.tracks == rhs.tracks;
+           lhs.tracks == rhs.tracks &&
+           lhs.constantTracks == rhs.constantTracks &&
+           lhs.constantKeyframeTimes == rhs.constantKeyframeTimes;
 }
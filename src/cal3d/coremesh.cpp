@@ -13,6 +13,8 @@
 #endif
 
 #include <stdio.h>
+#include <limits>
+#include <set>
 #include "cal3d/coremesh.h"
 #include "cal3d/error.h"
 #include "cal3d/coresubmesh.h"
@@ -96,3 +98,71 @@ void CalCoreMesh::fixup(const CalCoreSkeletonPtr& skeleton) {
         (*i)->fixup(skeleton);
     }
 }
+
+CalCoreMesh::SubmeshRemapVector CalCoreMesh::mergeSubmeshes(size_t boneLimit, unsigned indexSize) {
+    cal3d::verify(indexSize == 2 || indexSize == 4, "Index size must be 2 or 4 bytes");
+    const size_t vertexLimit = indexSize == 2 ? 65536 : std::numeric_limits<size_t>::max();
+
+    struct Group {
+        std::vector<size_t> members;
+        std::set<unsigned> bones;
+        size_t vertexCount;
+        size_t faceCount;
+    };
+    std::vector<Group> groups;
+
+    SubmeshRemapVector remaps(submeshes.size());
+    for (size_t s = 0; s < submeshes.size(); ++s) {
+        const CalCoreSubmesh& submesh = *submeshes[s];
+        const std::vector<unsigned>& bones = submesh.getPaletteBoneIds();
+
+        // only onto the group before it, so submeshes draw in the same order
+        size_t g = groups.size();
+        if (!groups.empty() && submesh.getLodCount() == 0) {
+            const Group& group = groups.back();
+            const CalCoreSubmesh& first = *submeshes[group.members[0]];
+            if (
+                first.coreMaterialThreadId == submesh.coreMaterialThreadId &&
+                first.getLodCount() == 0 &&
+                group.vertexCount + submesh.getVertexCount() <= vertexLimit
+            ) {
+                size_t newBones = 0;
+                for (auto b = bones.begin(); b != bones.end(); ++b) {
+                    newBones += group.bones.count(*b) ? 0 : 1;
+                }
+                if (group.bones.size() + newBones <= boneLimit) {
+                    g = groups.size() - 1;
+                }
+            }
+        }
+        if (g == groups.size()) {
+            groups.push_back(Group());
+            groups.back().vertexCount = 0;
+            groups.back().faceCount = 0;
+        }
+
+        Group& group = groups[g];
+        SubmeshRemap remap = { g, group.vertexCount, group.faceCount };
+        remaps[s] = remap;
+        group.members.push_back(s);
+        group.bones.insert(bones.begin(), bones.end());
+        group.vertexCount += submesh.getVertexCount();
+        group.faceCount += submesh.getFaceCount();
+    }
+
+    CalCoreSubmeshVector merged(groups.size());
+    for (size_t g = 0; g < groups.size(); ++g) {
+        const std::vector<size_t>& members = groups[g].members;
+        if (members.size() == 1) {
+            merged[g] = submeshes[members[0]];
+            continue;
+        }
+        merged[g].reset(new CalCoreSubmesh(0, false, 0));
+        merged[g]->coreMaterialThreadId = submeshes[members[0]]->coreMaterialThreadId;
+        for (auto m = members.begin(); m != members.end(); ++m) {
+            merged[g]->appendSubmesh(*submeshes[*m]);
+        }
+    }
+    submeshes.swap(merged);
+    return remaps;
+}
@@ -20,11 +20,28 @@ class CAL3D_API CalCoreMesh {
 public:
     typedef std::vector<CalCoreSubmeshPtr> CalCoreSubmeshVector;
 
+    // Where mergeSubmeshes() put one of the submeshes it was given.
+    struct SubmeshRemap {
+        size_t submesh;     // index into submeshes
+        size_t firstVertex; // of its vertices, now contiguous
+        size_t firstFace;   // likewise
+    };
+    typedef std::vector<SubmeshRemap> SubmeshRemapVector;
+
     size_t sizeInBytes() const;
     bool addAsMorphTarget(CalCoreMesh* pCoreMesh, std::string const& morphTargetName);
     
     void replaceMeshWithMorphTarget(const std::string& morphTargetName);
 
+    // Appends each submesh to the one before it if they have the same
+    // coreMaterialThreadId and fit together: at most boneLimit palette
+    // bones and, for indexSize 2, at most 65536 vertices.  Only neighbours
+    // merge, so the draw order is kept.  Submeshes with level of detail
+    // collapses are left alone.  Merged
+    // submeshes are new, so CalSubmeshes made from the old ones stay
+    // valid.  Returns where each submesh went, by its old index.
+    SubmeshRemapVector mergeSubmeshes(size_t boneLimit, unsigned indexSize = 2);
+
     void scale(float factor);
     void fixup(const CalCoreSkeletonPtr& skeleton);
 
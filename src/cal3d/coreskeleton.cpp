@@ -12,11 +12,18 @@
 #include "config.h"
 #endif
 
+#include <float.h>
+#include <math.h>
 #include <queue>
 #include <set>
+#ifndef IMVU_NO_INTRINSICS
+#include <xmmintrin.h>
+#endif
+#include "cal3d/bonetransform.h"
 #include "cal3d/error.h"
 #include "cal3d/coreskeleton.h"
 #include "cal3d/corebone.h"
+#include "cal3d/coresubmesh.h"
 
 std::vector<CalCoreBonePtr> findInvalidParents(
     const std::vector<CalCoreBonePtr>& bones,
@@ -171,6 +178,23 @@ std::vector<int> CalCoreSkeleton::getChildIds(const CalCoreBone* coreBone) const
     return rv;
 }
 
+std::vector<bool> CalCoreSkeleton::getSubtreeMask(int boneId) const {
+    std::vector<bool> mask(coreBones.size(), false);
+    if (boneId < 0 || size_t(boneId) >= coreBones.size()) {
+        return mask;
+    }
+
+    // bones are stored in topological order, so parents are visited first
+    mask[boneId] = true;
+    for (size_t i = boneId + 1; i < coreBones.size(); ++i) {
+        int parentId = coreBones[i]->parentId;
+        if (parentId != -1 && mask[parentId]) {
+            mask[i] = true;
+        }
+    }
+    return mask;
+}
+
  void CalCoreSkeleton::rotateTranslate(cal3d::RotateTranslate& rt) {
     for (size_t i = 0; i < m_coreBones.size(); ++i) {
         if (m_coreBones[i]->parentId == -1) {
@@ -183,4 +207,147 @@ std::vector<int> CalCoreSkeleton::getChildIds(const CalCoreBone* coreBone) const
 void CalCoreSkeleton::rotate(CalQuaternion &rot) {
     cal3d::RotateTranslate rt(rot, CalVector(0, 0, 0));
     rotateTranslate(rt);
-}
\ No newline at end of file
+}
+
+static CalVector principalAxis(const std::vector<CalVector>& points, const CalVector& mean) {
+    float xx = 0, xy = 0, xz = 0, yy = 0, yz = 0, zz = 0;
+    for (auto p = points.begin(); p != points.end(); ++p) {
+        const CalVector d = *p - mean;
+        xx += d.x * d.x;
+        xy += d.x * d.y;
+        xz += d.x * d.z;
+        yy += d.y * d.y;
+        yz += d.y * d.z;
+        zz += d.z * d.z;
+    }
+
+    // power iteration, starting from the axis of greatest variance
+    CalVector axis(
+        (xx >= yy && xx >= zz) ? 1.0f : 0.0f,
+        (yy > xx && yy >= zz) ? 1.0f : 0.0f,
+        (zz > xx && zz > yy) ? 1.0f : 0.0f);
+    for (int i = 0; i < 16; ++i) {
+        const CalVector next(
+            xx * axis.x + xy * axis.y + xz * axis.z,
+            xy * axis.x + yy * axis.y + yz * axis.z,
+            xz * axis.x + yz * axis.y + zz * axis.z);
+        const float length = next.length();
+        if (length == 0.0f) {
+            break;
+        }
+        axis = next / length;
+    }
+    return axis;
+}
+
+void CalCoreSkeleton::fitBoneCapsules(const std::vector<CalCoreSubmeshPtr>& submeshes) {
+    std::vector<std::vector<CalVector>> points(coreBones.size());
+    for (auto submesh = submeshes.begin(); submesh != submeshes.end(); ++submesh) {
+        const CalCoreSubmesh::VectorVertex& vertices = (*submesh)->getVectorVertex();
+        const CalCoreSubmesh::InfluenceVector& influences = (*submesh)->getInfluences();
+
+        // influences are sorted by descending weight, so the first is dominant
+        size_t influence = 0;
+        for (size_t v = 0; v < vertices.size() && influence < influences.size(); ++v) {
+            const CalCoreSubmesh::Influence& dominant = influences[influence];
+            if (dominant.weight > 0.0f) {
+                cal3d::verify(dominant.boneId < coreBones.size(), "influence refers to a bone outside the skeleton");
+                points[dominant.boneId].push_back(vertices[v].position.asCalVector());
+            }
+            while (!influences[influence++].lastInfluenceForThisVertex) {
+            }
+        }
+    }
+
+    boneCapsules.destructive_resize(coreBones.size());
+    for (size_t b = 0; b < points.size(); ++b) {
+        CalBoneCapsule& capsule = boneCapsules[b];
+        capsule.a = CalPoint4(0.0f, 0.0f, 0.0f);
+        capsule.b = CalPoint4(0.0f, 0.0f, 0.0f);
+        capsule.radius = 0.0f;
+        if (points[b].empty()) {
+            continue;
+        }
+
+        CalVector mean;
+        for (auto p = points[b].begin(); p != points[b].end(); ++p) {
+            mean += *p;
+        }
+        mean /= float(points[b].size());
+        const CalVector axis = principalAxis(points[b], mean);
+
+        float radiusSquared = 0.0f;
+        for (auto p = points[b].begin(); p != points[b].end(); ++p) {
+            const CalVector d = *p - mean;
+            const float t = dot(d, axis);
+            radiusSquared = std::max(radiusSquared, d.lengthSquared() - t * t);
+        }
+
+        // pull the ends in as far as the hemispherical caps still contain
+        // every point; lo > hi is possible and means a shorter segment
+        float lo = FLT_MAX;
+        float hi = -FLT_MAX;
+        for (auto p = points[b].begin(); p != points[b].end(); ++p) {
+            const CalVector d = *p - mean;
+            const float t = dot(d, axis);
+            const float cap = sqrtf(std::max(0.0f, radiusSquared - (d.lengthSquared() - t * t)));
+            lo = std::min(lo, t + cap);
+            hi = std::max(hi, t - cap);
+        }
+        if (lo > hi) {
+            std::swap(lo, hi);
+        }
+
+        capsule.a = CalPoint4(mean + axis * lo);
+        capsule.b = CalPoint4(mean + axis * hi);
+        capsule.radius = sqrtf(radiusSquared);
+    }
+}
+
+void cal3d::transformBoneCapsules(
+    const BoneTransform* boneTransforms,
+    size_t count,
+    const CalBoneCapsule* capsules,
+    CalBoneCapsule* output
+) {
+#ifndef IMVU_NO_INTRINSICS
+    const __m128 unitW = _mm_set_ps(1.0f, 0.0f, 0.0f, 0.0f);
+    for (size_t i = 0; i < count; ++i) {
+        // columns of the bone transform; the last is (translation, 1)
+        __m128 c0 = _mm_load_ps(&boneTransforms[i].rowx.x);
+        __m128 c1 = _mm_load_ps(&boneTransforms[i].rowy.x);
+        __m128 c2 = _mm_load_ps(&boneTransforms[i].rowz.x);
+        __m128 c3 = unitW;
+        _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+
+        const __m128 a = _mm_load_ps(&capsules[i].a.x);
+        const __m128 b = _mm_load_ps(&capsules[i].b.x);
+        _mm_store_ps(&output[i].a.x, _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(c0, _mm_shuffle_ps(a, a, _MM_SHUFFLE(0, 0, 0, 0))),
+                       _mm_mul_ps(c1, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 1, 1, 1)))),
+            _mm_add_ps(_mm_mul_ps(c2, _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 2, 2, 2))), c3)));
+        _mm_store_ps(&output[i].b.x, _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(c0, _mm_shuffle_ps(b, b, _MM_SHUFFLE(0, 0, 0, 0))),
+                       _mm_mul_ps(c1, _mm_shuffle_ps(b, b, _MM_SHUFFLE(1, 1, 1, 1)))),
+            _mm_add_ps(_mm_mul_ps(c2, _mm_shuffle_ps(b, b, _MM_SHUFFLE(2, 2, 2, 2))), c3)));
+        output[i].radius = capsules[i].radius;
+    }
+#else
+    for (size_t i = 0; i < count; ++i) {
+        const BoneTransform& m = boneTransforms[i];
+        const CalPoint4& a = capsules[i].a;
+        const CalPoint4& b = capsules[i].b;
+        output[i].a.set(
+            m.rowx.x * a.x + m.rowx.y * a.y + m.rowx.z * a.z + m.rowx.w,
+            m.rowy.x * a.x + m.rowy.y * a.y + m.rowy.z * a.z + m.rowy.w,
+            m.rowz.x * a.x + m.rowz.y * a.y + m.rowz.z * a.z + m.rowz.w,
+            1.0f);
+        output[i].b.set(
+            m.rowx.x * b.x + m.rowx.y * b.y + m.rowx.z * b.z + m.rowx.w,
+            m.rowy.x * b.x + m.rowy.y * b.y + m.rowy.z * b.z + m.rowy.w,
+            m.rowz.x * b.x + m.rowz.y * b.y + m.rowz.z * b.z + m.rowz.w,
+            1.0f);
+        output[i].radius = capsules[i].radius;
+    }
+#endif
+}
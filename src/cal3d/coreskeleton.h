@@ -15,11 +15,27 @@
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
 #include "cal3d/global.h"
+#include "cal3d/memory.h"
 #include "cal3d/vector.h"
+#include "cal3d/vector4.h"
 #include "cal3d/transform.h"
 
 CAL3D_PTR(CalCoreBone);
+CAL3D_PTR(CalCoreSubmesh);
 class CalQuaternion;
+struct BoneTransform;
+
+// A coarse collision proxy for one bone: every point within radius of the
+// segment [a, b].  Fitted capsules live in mesh bind-pose space, the space
+// BoneTransforms map from.
+CAL3D_ALIGN_HEAD(16)
+struct CalBoneCapsule {
+    CalPoint4 a;
+    CalPoint4 b;
+    float radius; // 0 for bones that dominate no vertices
+    float padding[3];
+}
+CAL3D_ALIGN_TAIL(16);
 
 class CAL3D_API CalCoreSkeleton : private boost::noncopyable {
 public:
@@ -44,8 +60,19 @@ public:
 
     std::vector<int> getChildIds(const CalCoreBone* coreBone) const;
 
+    // One entry per bone, true for boneId and all of its descendants.
+    // Suitable for CalAnimation::setBoneMask.
+    std::vector<bool> getSubtreeMask(int boneId) const;
+
     CalVector sceneAmbientColor;
 
+    // Fits boneCapsules around the bind-pose vertices each bone dominantly
+    // influences, along their principal axis.
+    void fitBoneCapsules(const std::vector<CalCoreSubmeshPtr>& submeshes);
+
+    // One per bone once fitted; may also be assigned directly from offline data.
+    cal3d::SSEArray<CalBoneCapsule> boneCapsules;
+
 private:
     cal3d::RotateTranslate inverseOriginalRootTransform;
     std::set<size_t> adjustedRoots;
@@ -53,3 +80,14 @@ private:
 };
 
 CAL3D_PTR(CalCoreSkeleton);
+
+namespace cal3d {
+    // Poses capsules[i] by boneTransforms[i] for i < count, so collision
+    // costs one transform per bone rather than per skinned vertex.  Bone
+    // scale is not applied to the radius.
+    CAL3D_API void transformBoneCapsules(
+        const BoneTransform* boneTransforms,
+        size_t count,
+        const CalBoneCapsule* capsules,
+        CalBoneCapsule* output);
+}
@@ -25,13 +25,17 @@
 #include <cstring>
 #include <iostream>
 #include <limits>
+#include <queue>
 #include <set>
+#include <unordered_map>
 
 CalCoreSubmesh::CalCoreSubmesh(int vertexCount, bool hasTextureCoordinates, int faceCount)
     : coreMaterialThreadId(0)
     , m_currentVertexId(0)
     , m_vertices(vertexCount)
     , m_isStatic(false)
+    , m_influenceSetCount(0)
+    , m_wideIndices(vertexCount > 65536)
     , m_minimumVertexBufferSize(0)
 {
     m_vertexColors.resize(vertexCount);
@@ -40,11 +44,21 @@ CalCoreSubmesh::CalCoreSubmesh(int vertexCount, bool hasTextureCoordinates, int
         m_textureCoordinates.resize(vertexCount);
     }
 
-    m_faces.reserve(faceCount);
+    if (m_wideIndices) {
+        m_wideFaces.reserve(faceCount);
+    } else {
+        m_faces.reserve(faceCount);
+    }
 }
 
 CAL3D_DEFINE_SIZE(CalCoreSubmesh::Face);
+CAL3D_DEFINE_SIZE(CalCoreSubmesh::WideFace);
 CAL3D_DEFINE_SIZE(CalCoreSubmesh::Influence);
+CAL3D_DEFINE_SIZE(CalCoreSubmesh::VertexRange);
+CAL3D_DEFINE_SIZE(CalAABox);
+CAL3D_DEFINE_SIZE(CalCoreSubmesh::Cluster);
+CAL3D_DEFINE_SIZE(CalCoreSubmesh::LodCollapse);
+CAL3D_DEFINE_SIZE(CalVector);
 
 size_t sizeInBytes(const CalCoreSubmesh::InfluenceSet& is) {
     return sizeof(is) + sizeInBytes(is.influences);
@@ -55,16 +69,84 @@ size_t CalCoreSubmesh::sizeInBytes() const {
     r += ::sizeInBytes(m_vertices);
     r += ::sizeInBytes(m_vertexColors);
     r += ::sizeInBytes(m_faces);
+    r += ::sizeInBytes(m_wideFaces);
     r += ::sizeInBytes(m_staticInfluenceSet);
     r += ::sizeInBytes(m_influences);
+    r += ::sizeInBytes(m_boneVertexRanges);
+    r += ::sizeInBytes(m_paletteBoneIds);
+    r += ::sizeInBytes(m_paletteInfluences);
+    r += ::sizeInBytes(m_paletteBounds);
+    r += ::sizeInBytes(m_vertexMorphReach);
+    r += ::sizeInBytes(m_paletteMorphReach);
+    r += ::sizeInBytes(m_influenceSets);
+    r += ::sizeInBytes(m_vertexInfluenceSets);
+    r += ::sizeInBytes(m_clusters);
+    r += ::sizeInBytes(m_clusterBones);
+    r += ::sizeInBytes(m_clusterVertexRanges);
+    r += ::sizeInBytes(m_clusterRangeIndices);
+    r += ::sizeInBytes(m_lodCollapses);
     return r;
 }
 
 void CalCoreSubmesh::addFace(const CalCoreSubmesh::Face& face) {
+    if (m_wideIndices) {
+        addFace(WideFace(face.vertexId[0], face.vertexId[1], face.vertexId[2]));
+        return;
+    }
     for (int i = 0; i < 3; ++i) {
         m_minimumVertexBufferSize = std::max(m_minimumVertexBufferSize, size_t(1 + face.vertexId[i]));
     }
     m_faces.push_back(face);
+    discardClusters();
+    m_lodCollapses.clear();
+}
+
+void CalCoreSubmesh::addFace(const CalCoreSubmesh::WideFace& face) {
+    if (!m_wideIndices) {
+        cal3d::verify(
+            face.vertexId[0] <= 0xFFFF && face.vertexId[1] <= 0xFFFF && face.vertexId[2] <= 0xFFFF,
+            "Face indices exceed 16 bits; call setIndexSize(4) first");
+        addFace(Face(CalIndex(face.vertexId[0]), CalIndex(face.vertexId[1]), CalIndex(face.vertexId[2])));
+        return;
+    }
+    for (int i = 0; i < 3; ++i) {
+        m_minimumVertexBufferSize = std::max(m_minimumVertexBufferSize, size_t(1) + face.vertexId[i]);
+    }
+    m_wideFaces.push_back(face);
+    discardClusters();
+    m_lodCollapses.clear();
+}
+
+CalCoreSubmesh::WideFace CalCoreSubmesh::getFace(size_t faceId) const {
+    if (m_wideIndices) {
+        return m_wideFaces[faceId];
+    }
+    const Face& face = m_faces[faceId];
+    return WideFace(face.vertexId[0], face.vertexId[1], face.vertexId[2]);
+}
+
+void CalCoreSubmesh::setIndexSize(unsigned indexSize) {
+    cal3d::verify(indexSize == 2 || indexSize == 4, "Index size must be 2 or 4 bytes");
+    if (indexSize == getIndexSize()) {
+        return;
+    }
+    if (indexSize == 4) {
+        m_wideFaces.reserve(m_faces.size());
+        for (auto f = m_faces.begin(); f != m_faces.end(); ++f) {
+            m_wideFaces.push_back(WideFace(f->vertexId[0], f->vertexId[1], f->vertexId[2]));
+        }
+        VectorFace().swap(m_faces);
+    } else {
+        cal3d::verify(m_vertices.size() <= 65536, "16-bit indices can't address more than 65536 vertices");
+        m_faces.reserve(m_wideFaces.size());
+        for (auto f = m_wideFaces.begin(); f != m_wideFaces.end(); ++f) {
+            m_faces.push_back(Face(CalIndex(f->vertexId[0]), CalIndex(f->vertexId[1]), CalIndex(f->vertexId[2])));
+        }
+        VectorWideFace().swap(m_wideFaces);
+    }
+    m_wideIndices = indexSize == 4;
+    discardClusters();
+    m_lodCollapses.clear();
 }
 
 void CalCoreSubmesh::setTextureCoordinate(int vertexId, const TextureCoordinate& textureCoordinate) {
@@ -73,9 +155,10 @@ void CalCoreSubmesh::setTextureCoordinate(int vertexId, const TextureCoordinate&
 
 bool CalCoreSubmesh::validateSubmesh() const {
     size_t vertexCount = m_vertices.size(); 
-    size_t numFaces = m_faces.size();
+    size_t numFaces = getFaceCount();
     for (size_t f = 0; f < numFaces; ++f) {
-        if (m_faces[f].vertexId[0] >= vertexCount || m_faces[f].vertexId[1] >= vertexCount || m_faces[f].vertexId[2] >= vertexCount) {
+        const WideFace face = getFace(f);
+        if (face.vertexId[0] >= vertexCount || face.vertexId[1] >= vertexCount || face.vertexId[2] >= vertexCount) {
             return false;
         }
     }
@@ -142,7 +225,437 @@ void CalCoreSubmesh::addVertex(const Vertex& vertex, CalColor32 vertexColor, con
     }
     inf[inf.size() - 1].lastInfluenceForThisVertex = 1;
 
+    const unsigned firstInfluence = m_influences.size();
     m_influences.insert(m_influences.end(), inf.begin(), inf.end());
+    addBoneVertexRanges(vertexId, firstInfluence);
+    addPaletteInfluences(vertexId, firstInfluence);
+
+    m_influenceSets.clear();
+    m_influenceSetCount = 0;
+    m_vertexInfluenceSets.clear();
+    discardClusters();
+    m_lodCollapses.clear();
+}
+
+// Vertices arrive in order, so each bone's runs only ever grow at the end.
+// Zero-weight influences (including the placeholder for uninfluenced
+// vertices) don't make a vertex depend on the bone.
+void CalCoreSubmesh::addBoneVertexRanges(unsigned vertexId, unsigned firstInfluence) {
+    unsigned i = firstInfluence;
+    do {
+        if (m_influences[i].weight == 0.0f) {
+            continue;
+        }
+
+        const unsigned boneId = m_influences[i].boneId;
+        if (boneId >= m_boneVertexRanges.size()) {
+            m_boneVertexRanges.resize(boneId + 1);
+        }
+
+        VertexRangeVector& ranges = m_boneVertexRanges[boneId];
+        if (!ranges.empty() && ranges.back().end == vertexId) {
+            ranges.back().end = vertexId + 1;
+        } else if (ranges.empty() || ranges.back().end != vertexId + 1) {
+            VertexRange range = { vertexId, vertexId + 1, firstInfluence };
+            ranges.push_back(range);
+        }
+    } while (!m_influences[i++].lastInfluenceForThisVertex);
+}
+
+void CalCoreSubmesh::rebuildBoneVertexRanges() {
+    m_boneVertexRanges.clear();
+    unsigned firstInfluence = 0;
+    for (unsigned vertexId = 0; firstInfluence < m_influences.size(); ++vertexId) {
+        addBoneVertexRanges(vertexId, firstInfluence);
+        while (!m_influences[firstInfluence++].lastInfluenceForThisVertex) {
+        }
+    }
+}
+
+static CalAABox emptyBox() {
+    const float inf = std::numeric_limits<float>::infinity();
+    return CalAABox(CalVector(inf, inf, inf), CalVector(-inf, -inf, -inf));
+}
+
+static void extendBox(CalAABox& box, const CalPoint4& p) {
+    box.min.x = std::min(box.min.x, p.x);
+    box.min.y = std::min(box.min.y, p.y);
+    box.min.z = std::min(box.min.z, p.z);
+    box.max.x = std::max(box.max.x, p.x);
+    box.max.y = std::max(box.max.y, p.y);
+    box.max.z = std::max(box.max.z, p.z);
+}
+
+// Submeshes reference few enough bones that a linear search beats a map.
+void CalCoreSubmesh::addPaletteInfluences(unsigned firstVertex, unsigned firstInfluence) {
+    unsigned vertexId = firstVertex;
+    for (size_t i = firstInfluence; i < m_influences.size(); ++i) {
+        Influence influence = m_influences[i];
+        const auto entry = std::find(m_paletteBoneIds.begin(), m_paletteBoneIds.end(), influence.boneId);
+        influence.boneId = static_cast<unsigned>(entry - m_paletteBoneIds.begin());
+        if (entry == m_paletteBoneIds.end()) {
+            m_paletteBoneIds.push_back(m_influences[i].boneId);
+            m_paletteBounds.push_back(emptyBox());
+        }
+        m_paletteInfluences.push_back(influence);
+
+        if (influence.weight != 0.0f) {
+            extendBox(m_paletteBounds[influence.boneId], m_vertices[vertexId].position);
+        }
+        if (influence.lastInfluenceForThisVertex) {
+            ++vertexId;
+        }
+    }
+}
+
+void CalCoreSubmesh::rebuildBonePalette() {
+    m_paletteBoneIds.clear();
+    m_paletteInfluences.clear();
+    m_paletteBounds.clear();
+    addPaletteInfluences(0, 0);
+
+    // the morph targets may have been remapped along with the vertices
+    m_vertexMorphReach.clear();
+    for (auto i = m_morphTargets.begin(); i != m_morphTargets.end(); ++i) {
+        addMorphReach(**i);
+    }
+    rebuildPaletteMorphReach();
+
+    if (hasInfluenceSets()) {
+        dedupeInfluenceSets();
+    }
+    refreshClusters();
+}
+
+void CalCoreSubmesh::dedupeInfluenceSets() {
+    m_influenceSets.clear();
+    m_influenceSetCount = 0;
+    m_vertexInfluenceSets.clear();
+    m_vertexInfluenceSets.reserve(m_vertices.size());
+
+    // keyed on exact weights, as sharing a set means sharing its blend
+    typedef std::vector<std::pair<unsigned, float> > SetKey;
+    std::map<SetKey, unsigned> setIndices;
+    SetKey key;
+    auto first = m_paletteInfluences.begin();
+    while (first != m_paletteInfluences.end()) {
+        auto last = first;
+        while (!last++->lastInfluenceForThisVertex) {
+        }
+
+        key.clear();
+        for (auto i = first; i != last; ++i) {
+            key.push_back(std::make_pair(i->boneId, i->weight));
+        }
+        std::sort(key.begin(), key.end());
+        auto entry = setIndices.insert(std::make_pair(key, static_cast<unsigned>(m_influenceSetCount)));
+        if (entry.second) {
+            m_influenceSets.insert(m_influenceSets.end(), first, last);
+            ++m_influenceSetCount;
+        }
+        m_vertexInfluenceSets.push_back(Influence(entry.first->second, 1.0f, true));
+
+        first = last;
+    }
+}
+
+float CalCoreSubmesh::getInfluenceSetDedupeRatio() const {
+    return m_influenceSetCount
+        ? float(m_vertexInfluenceSets.size()) / float(m_influenceSetCount)
+        : 0.0f;
+}
+
+// CSR: the faces around vertex v are adjacency[starts[v], starts[v + 1]).
+template<typename FaceType>
+static void buildVertexFaceAdjacency(
+    const std::vector<FaceType>& faces,
+    size_t vertexCount,
+    std::vector<unsigned>& starts,
+    std::vector<unsigned>& adjacency
+) {
+    starts.assign(vertexCount + 1, 0);
+    for (size_t f = 0; f < faces.size(); ++f) {
+        for (int k = 0; k < 3; ++k) {
+            ++starts[faces[f].vertexId[k] + 1];
+        }
+    }
+    for (size_t v = 1; v < starts.size(); ++v) {
+        starts[v] += starts[v - 1];
+    }
+    adjacency.resize(starts.back());
+    std::vector<unsigned> cursors(starts.begin(), starts.end() - 1);
+    for (size_t f = 0; f < faces.size(); ++f) {
+        for (int k = 0; k < 3; ++k) {
+            adjacency[cursors[faces[f].vertexId[k]]++] = f;
+        }
+    }
+}
+
+// Greedy, meshoptimizer-style: grow each cluster from a seed face through
+// faces sharing its vertices, preferring those adding the fewest vertices
+// and then those nearest its center, so clusters come out compact and
+// their normal cones narrow.  Reorders faces cluster by cluster and
+// returns each cluster's face count.
+template<typename FaceType>
+static std::vector<unsigned> clusterFaces(
+    std::vector<FaceType>& faces,
+    const CalCoreSubmesh::VectorVertex& vertices,
+    unsigned maxVertices,
+    unsigned maxFaces
+) {
+    std::vector<unsigned> clusterFaceCounts;
+    const size_t faceCount = faces.size();
+    std::vector<unsigned> adjacencyStarts;
+    std::vector<unsigned> adjacency;
+    buildVertexFaceAdjacency(faces, vertices.size(), adjacencyStarts, adjacency);
+
+    std::vector<bool> used(faceCount, false);
+    // a vertex belongs to the current cluster if it is marked with its index
+    std::vector<unsigned> marks(vertices.size(), static_cast<unsigned>(-1));
+    std::vector<unsigned> clusterVertices;
+    std::vector<FaceType> newFaces;
+    newFaces.reserve(faceCount);
+
+    size_t nextSeed = 0;
+    while (newFaces.size() < faceCount) {
+        const unsigned cluster = clusterFaceCounts.size();
+        clusterVertices.clear();
+        CalVector centerSum;
+        unsigned clusterFaces = 0;
+
+        unsigned face = static_cast<unsigned>(-1);
+        while (used[nextSeed]) {
+            ++nextSeed;
+        }
+        face = nextSeed;
+
+        for (;;) {
+            used[face] = true;
+            newFaces.push_back(faces[face]);
+            ++clusterFaces;
+            for (int k = 0; k < 3; ++k) {
+                const unsigned v = faces[face].vertexId[k];
+                if (marks[v] != cluster) {
+                    marks[v] = cluster;
+                    clusterVertices.push_back(v);
+                    centerSum += vertices[v].position.asCalVector();
+                }
+            }
+            if (clusterFaces == maxFaces) {
+                break;
+            }
+
+            const CalVector center = centerSum / float(clusterVertices.size());
+            face = static_cast<unsigned>(-1);
+            unsigned bestNewVertices = 4;
+            float bestDistance = 0.0f;
+            for (size_t i = 0; i < clusterVertices.size(); ++i) {
+                const unsigned v = clusterVertices[i];
+                for (unsigned a = adjacencyStarts[v]; a < adjacencyStarts[v + 1]; ++a) {
+                    const unsigned candidate = adjacency[a];
+                    if (used[candidate]) {
+                        continue;
+                    }
+                    const FaceType& f = faces[candidate];
+                    const unsigned newVertices =
+                        (marks[f.vertexId[0]] != cluster) +
+                        (marks[f.vertexId[1]] != cluster && f.vertexId[1] != f.vertexId[0]) +
+                        (marks[f.vertexId[2]] != cluster && f.vertexId[2] != f.vertexId[0] && f.vertexId[2] != f.vertexId[1]);
+                    if (clusterVertices.size() + newVertices > maxVertices || newVertices > bestNewVertices) {
+                        continue;
+                    }
+                    const CalVector centroid = (
+                        vertices[f.vertexId[0]].position.asCalVector() +
+                        vertices[f.vertexId[1]].position.asCalVector() +
+                        vertices[f.vertexId[2]].position.asCalVector()) / 3.0f;
+                    const float distance = (centroid - center).lengthSquared();
+                    if (newVertices < bestNewVertices || distance < bestDistance) {
+                        face = candidate;
+                        bestNewVertices = newVertices;
+                        bestDistance = distance;
+                    }
+                }
+            }
+
+            // disconnected pieces: carry on with the next face in order if it fits
+            if (face == static_cast<unsigned>(-1)) {
+                while (nextSeed < faceCount && used[nextSeed]) {
+                    ++nextSeed;
+                }
+                if (nextSeed == faceCount) {
+                    break;
+                }
+                const FaceType& f = faces[nextSeed];
+                const unsigned newVertices =
+                    (marks[f.vertexId[0]] != cluster) +
+                    (marks[f.vertexId[1]] != cluster && f.vertexId[1] != f.vertexId[0]) +
+                    (marks[f.vertexId[2]] != cluster && f.vertexId[2] != f.vertexId[0] && f.vertexId[2] != f.vertexId[1]);
+                if (clusterVertices.size() + newVertices > maxVertices) {
+                    break;
+                }
+                face = nextSeed;
+            }
+        }
+        clusterFaceCounts.push_back(clusterFaces);
+    }
+
+    faces.swap(newFaces);
+    return clusterFaceCounts;
+}
+
+void CalCoreSubmesh::buildClusters(unsigned maxVertices, unsigned maxFaces) {
+    cal3d::verify(maxVertices >= 3 && maxFaces >= 1, "clusters must hold at least one face");
+    m_clusters.clear();
+    m_clusterBones.clear();
+    m_clusterVertexRanges.clear();
+    m_clusterRangeIndices.clear();
+    if (!getFaceCount()) {
+        return;
+    }
+
+    const std::vector<unsigned> clusterFaceCounts = m_wideIndices
+        ? clusterFaces(m_wideFaces, m_vertices, maxVertices, maxFaces)
+        : clusterFaces(m_faces, m_vertices, maxVertices, maxFaces);
+    unsigned firstFace = 0;
+    for (size_t c = 0; c < clusterFaceCounts.size(); ++c) {
+        Cluster cluster;
+        cluster.firstFace = firstFace;
+        cluster.faceCount = clusterFaceCounts[c];
+        m_clusters.push_back(cluster);
+        firstFace += clusterFaceCounts[c];
+    }
+    refreshClusters();
+}
+
+// Recomputes everything but the face ranges, after vertices were moved or
+// renumbered.
+void CalCoreSubmesh::refreshClusters() {
+    m_clusterBones.clear();
+    m_clusterVertexRanges.clear();
+    m_clusterRangeIndices.clear();
+
+    std::vector<unsigned> firstInfluences(m_vertices.size());
+    unsigned firstInfluence = 0;
+    for (size_t v = 0; v < m_vertices.size() && firstInfluence < m_influences.size(); ++v) {
+        firstInfluences[v] = firstInfluence;
+        while (!m_influences[firstInfluence++].lastInfluenceForThisVertex) {
+        }
+    }
+
+    std::vector<unsigned> vertices;
+    VertexRangeVector runs;
+    for (auto cluster = m_clusters.begin(); cluster != m_clusters.end(); ++cluster) {
+        vertices.clear();
+        for (unsigned f = cluster->firstFace; f < cluster->firstFace + cluster->faceCount; ++f) {
+            const WideFace face = getFace(f);
+            vertices.insert(vertices.end(), face.vertexId, face.vertexId + 3);
+        }
+        std::sort(vertices.begin(), vertices.end());
+        vertices.erase(std::unique(vertices.begin(), vertices.end()), vertices.end());
+
+        CalAABox box = emptyBox();
+        for (auto v = vertices.begin(); v != vertices.end(); ++v) {
+            extendBox(box, m_vertices[*v].position);
+        }
+        cluster->center = 0.5f * (box.min + box.max);
+        float radiusSquared = 0.0f;
+        for (auto v = vertices.begin(); v != vertices.end(); ++v) {
+            radiusSquared = std::max(radiusSquared, (m_vertices[*v].position.asCalVector() - cluster->center).lengthSquared());
+        }
+        cluster->radius = sqrtf(radiusSquared);
+
+        CalVector normalSum;
+        for (unsigned f = cluster->firstFace; f < cluster->firstFace + cluster->faceCount; ++f) {
+            normalSum += faceNormal(getFace(f));
+        }
+        const float sumLength = normalSum.length();
+        cluster->coneAxis = sumLength > 0.0f ? normalSum / sumLength : CalVector(0.0f, 0.0f, 1.0f);
+        float minDot = sumLength > 0.0f ? 1.0f : -1.0f;
+        for (unsigned f = cluster->firstFace; f < cluster->firstFace + cluster->faceCount; ++f) {
+            const CalVector n = faceNormal(getFace(f));
+            const float length = n.length();
+            if (length > 0.0f) {
+                minDot = std::min(minDot, dot(n, cluster->coneAxis) / length);
+            }
+        }
+        cluster->coneCutoff = minDot > 0.0f ? sqrtf(std::max(0.0f, 1.0f - minDot * minDot)) : 2.0f;
+
+        cluster->firstBone = m_clusterBones.size();
+        for (auto v = vertices.begin(); v != vertices.end(); ++v) {
+            unsigned i = firstInfluences[*v];
+            do {
+                const Influence& influence = m_paletteInfluences[i];
+                if (influence.weight != 0.0f &&
+                    std::find(m_clusterBones.begin() + cluster->firstBone, m_clusterBones.end(), influence.boneId) == m_clusterBones.end()
+                ) {
+                    m_clusterBones.push_back(influence.boneId);
+                }
+            } while (!m_paletteInfluences[i++].lastInfluenceForThisVertex);
+        }
+        cluster->boneCount = m_clusterBones.size() - cluster->firstBone;
+
+        cluster->firstRange = runs.size();
+        for (auto v = vertices.begin(); v != vertices.end(); ++v) {
+            if (runs.size() > cluster->firstRange && runs.back().end == *v) {
+                ++runs.back().end;
+            } else {
+                VertexRange run = { *v, *v + 1, 0 };
+                runs.push_back(run);
+            }
+        }
+        cluster->rangeCount = runs.size() - cluster->firstRange;
+    }
+
+    // Clusters share their border vertices, so their runs overlap; split
+    // them at every run's ends into disjoint ranges.
+    std::vector<unsigned> bounds;
+    bounds.reserve(2 * runs.size());
+    for (auto run = runs.begin(); run != runs.end(); ++run) {
+        bounds.push_back(run->begin);
+        bounds.push_back(run->end);
+    }
+    std::sort(bounds.begin(), bounds.end());
+    bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+
+    const unsigned Uncovered = static_cast<unsigned>(-1);
+    std::vector<unsigned> pieces(bounds.size(), Uncovered);
+    for (auto run = runs.begin(); run != runs.end(); ++run) {
+        for (size_t b = std::lower_bound(bounds.begin(), bounds.end(), run->begin) - bounds.begin(); bounds[b] != run->end; ++b) {
+            pieces[b] = 0;
+        }
+    }
+    for (size_t b = 0; b + 1 < bounds.size(); ++b) {
+        if (pieces[b] != Uncovered) {
+            pieces[b] = m_clusterVertexRanges.size();
+            VertexRange range = { bounds[b], bounds[b + 1], firstInfluences[bounds[b]] };
+            m_clusterVertexRanges.push_back(range);
+        }
+    }
+
+    for (auto cluster = m_clusters.begin(); cluster != m_clusters.end(); ++cluster) {
+        const unsigned firstRun = cluster->firstRange;
+        cluster->firstRange = m_clusterRangeIndices.size();
+        for (unsigned r = firstRun; r < firstRun + cluster->rangeCount; ++r) {
+            for (size_t b = std::lower_bound(bounds.begin(), bounds.end(), runs[r].begin) - bounds.begin(); bounds[b] != runs[r].end; ++b) {
+                m_clusterRangeIndices.push_back(pieces[b]);
+            }
+        }
+        cluster->rangeCount = m_clusterRangeIndices.size() - cluster->firstRange;
+    }
+}
+
+CalVector CalCoreSubmesh::faceNormal(const WideFace& face) const {
+    const CalVector a = m_vertices[face.vertexId[0]].position.asCalVector();
+    const CalVector b = m_vertices[face.vertexId[1]].position.asCalVector();
+    const CalVector c = m_vertices[face.vertexId[2]].position.asCalVector();
+    return cross(b - a, c - a);
+}
+
+void CalCoreSubmesh::discardClusters() {
+    m_clusters.clear();
+    m_clusterBones.clear();
+    m_clusterVertexRanges.clear();
+    m_clusterRangeIndices.clear();
 }
 
 void CalCoreSubmesh::scale(float factor) {
@@ -156,9 +669,23 @@ void CalCoreSubmesh::scale(float factor) {
     m_boundingVolume.min *= factor;
     m_boundingVolume.max *= factor;
 
+    for (auto i = m_paletteBounds.begin(); i != m_paletteBounds.end(); ++i) {
+        i->min *= factor;
+        i->max *= factor;
+    }
+    const float reachFactor = std::fabs(factor);
+    for (auto i = m_vertexMorphReach.begin(); i != m_vertexMorphReach.end(); ++i) {
+        *i *= reachFactor;
+    }
+    for (auto i = m_paletteMorphReach.begin(); i != m_paletteMorphReach.end(); ++i) {
+        *i *= reachFactor;
+    }
+
     for (MorphTargetArray::iterator i = m_morphTargets.begin(); i != m_morphTargets.end(); ++i) {
         (*i)->scale(factor);
     }
+
+    refreshClusters();
 }
 
 
@@ -181,6 +708,40 @@ void CalCoreSubmesh::fixup(const CalCoreSkeletonPtr& skeleton) {
     }
 
     std::swap(m_staticInfluenceSet.influences, staticInfluenceSet);
+
+    rebuildBoneVertexRanges();
+    rebuildBonePalette();
+}
+
+// widens [lo, hi] to hold one axis of a center/extent box under an affine row
+static void extendTransformedBox(const CalVector4& row, const CalVector& center, const CalVector& extent, float& lo, float& hi) {
+    const float c = row.x * center.x + row.y * center.y + row.z * center.z + row.w;
+    const float e = std::fabs(row.x) * extent.x + std::fabs(row.y) * extent.y + std::fabs(row.z) * extent.z;
+    lo = std::min(lo, c - e);
+    hi = std::max(hi, c + e);
+}
+
+CalAABox CalCoreSubmesh::getAnimatedBoundingVolume(const BoneTransform* boneTransforms) const {
+    CalAABox result = emptyBox();
+    for (size_t i = 0; i < m_paletteBoneIds.size(); ++i) {
+        const CalAABox& bounds = m_paletteBounds[i];
+        if (bounds.min.x > bounds.max.x) {
+            continue;
+        }
+
+        const BoneTransform& bt = boneTransforms[m_paletteBoneIds[i]];
+        const CalVector center = 0.5f * (bounds.min + bounds.max);
+        CalVector extent = 0.5f * (bounds.max - bounds.min);
+        if (i < m_paletteMorphReach.size()) {
+            extent += m_paletteMorphReach[i];
+        }
+        extendTransformedBox(bt.rowx, center, extent, result.min.x, result.max.x);
+        extendTransformedBox(bt.rowy, center, extent, result.min.y, result.max.y);
+        extendTransformedBox(bt.rowz, center, extent, result.min.z, result.max.z);
+    }
+
+    // nothing influenced: fall back on the bind pose
+    return result.min.x > result.max.x ? m_boundingVolume : result;
 }
 
 bool CalCoreSubmesh::isStatic() const {
@@ -206,6 +767,42 @@ BoneTransform CalCoreSubmesh::getStaticTransform(const BoneTransform* bones) con
 void CalCoreSubmesh::addMorphTarget(const CalCoreMorphTargetPtr& morphTarget) {
     if (morphTarget->vertexOffsets.size() > 0) {
         m_morphTargets.push_back(morphTarget);
+        addMorphReach(*morphTarget);
+        rebuildPaletteMorphReach();
+    }
+}
+
+void CalCoreSubmesh::addMorphReach(const CalCoreMorphTarget& morphTarget) {
+    if (m_vertexMorphReach.size() != m_vertices.size()) {
+        m_vertexMorphReach.resize(m_vertices.size());
+    }
+    const CalCoreMorphTarget::VertexOffsetArray& offsets = morphTarget.vertexOffsets;
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        if (offsets[i].vertexId < m_vertexMorphReach.size()) {
+            const CalPoint4& p = offsets[i].position;
+            m_vertexMorphReach[offsets[i].vertexId] += CalVector(std::fabs(p.x), std::fabs(p.y), std::fabs(p.z));
+        }
+    }
+}
+
+void CalCoreSubmesh::rebuildPaletteMorphReach() {
+    m_paletteMorphReach.assign(m_vertexMorphReach.empty() ? 0 : m_paletteBoneIds.size(), CalVector());
+    if (m_paletteMorphReach.empty()) {
+        return;
+    }
+
+    unsigned vertexId = 0;
+    for (auto i = m_paletteInfluences.begin(); i != m_paletteInfluences.end() && vertexId < m_vertexMorphReach.size(); ++i) {
+        if (i->weight != 0.0f) {
+            CalVector& reach = m_paletteMorphReach[i->boneId];
+            const CalVector& vertexReach = m_vertexMorphReach[vertexId];
+            reach.x = std::max(reach.x, vertexReach.x);
+            reach.y = std::max(reach.y, vertexReach.y);
+            reach.z = std::max(reach.z, vertexReach.z);
+        }
+        if (i->lastInfluenceForThisVertex) {
+            ++vertexId;
+        }
     }
 }
 
@@ -219,6 +816,17 @@ void CalCoreSubmesh::replaceMeshWithMorphTarget(const std::string& morphTargetNa
             }
         }
     }
+
+    // the moved vertices need new bounds, per bone and per cluster too
+    for (size_t v = 0; v < m_vertices.size(); ++v) {
+        if (v == 0) {
+            m_boundingVolume.min = m_vertices[v].position.asCalVector();
+            m_boundingVolume.max = m_vertices[v].position.asCalVector();
+        } else {
+            extendBox(m_boundingVolume, m_vertices[v].position);
+        }
+    }
+    rebuildBonePalette();
 }
 
 /*
@@ -475,111 +1083,206 @@ CalCoreSubmeshPtr MakeCube() {
 #define PRINT_MOD 200
 #define PRINT_STATUS 0
 
-void CalCoreSubmesh::addVertices(CalCoreSubmesh& submeshTo, unsigned submeshToVertexOffset, float normalMul) {
-    size_t c = 0;
-    size_t i = 0;
-    for (size_t v = 0; v < getVertexCount(); v++) {
-        const Vertex& oldVert = m_vertices[v];
-        Vertex newVert;
-        newVert.position = oldVert.position;
-        newVert.normal = oldVert.normal;
-        newVert.normal *= normalMul;
-
-        InfluenceVector newInfs;
-        while (!m_influences[i].lastInfluenceForThisVertex) {
-            Influence inf(m_influences[i].boneId, m_influences[i].weight, false);
-            newInfs.push_back(inf);
-            i++;
-        }
-
-        Influence infLast(m_influences[i].boneId, m_influences[i].weight, true);
-        newInfs.push_back(infLast);
-        i++;
-
-        submeshTo.addVertex(newVert, getVertexColors()[c], newInfs);
-        if (getTextureCoordinates().size() > 0) {
-            submeshTo.setTextureCoordinate(submeshToVertexOffset + c, getTextureCoordinates()[c]);
-        }
-        c++;
-    }
-}
-
-void CalCoreSubmesh::duplicateTriangles() {
-    size_t faceCount = m_faces.size();
+template<typename FaceType>
+static void duplicateFaces(std::vector<FaceType>& faces) {
+    size_t faceCount = faces.size();
 
-    std::vector<Face> newFaces;
+    std::vector<FaceType> newFaces;
     newFaces.reserve(2 * faceCount);
 
     for (size_t i = 0; i < faceCount; ++i) {
-        const auto& face = m_faces[i];
+        const auto& face = faces[i];
         newFaces.push_back(face);
-        newFaces.push_back(Face(face.vertexId[0], face.vertexId[2], face.vertexId[1]));
+        newFaces.push_back(FaceType(face.vertexId[0], face.vertexId[2], face.vertexId[1]));
     }
 
-    std::swap(m_faces, newFaces);
+    std::swap(faces, newFaces);
+}
+
+void CalCoreSubmesh::duplicateTriangles() {
+    if (m_wideIndices) {
+        duplicateFaces(m_wideFaces);
+    } else {
+        duplicateFaces(m_faces);
+    }
+    discardClusters();
+    m_lodCollapses.clear();
 }
 
 struct FaceSortRef {
     float fscore;
-    unsigned short face;
+    unsigned face;
 };
 
 struct FaceSort {
-    unsigned short ix[3];       //  the face
-    unsigned short nfront;      //  how many faces I am in front of
-    FaceSortRef *infront;       //  refs to faces I am in front of, with scores
+    CalIndex32 ix[3];           //  the face
+    unsigned firstFront;        //  my refs to faces I am in front of, with scores
+    unsigned endFront;
     CalVector fnorm;            //  the face normal
     float fdist;                //  the face distance from origin in the direction of the normal
     float score;                //  the current cost of this face (sum of other faces behind)
     float area;
 };
 
+// A uniform grid over face bounds grown by half of each face's longest
+// edge and half the reach; only faces whose grown bounds overlap are
+// tested against each other.
+struct FaceSortGrid {
+    CalVector origin;
+    float inverseCellSize;
+    int dims[3];
+    std::vector<unsigned> cellStarts; // CSR: cell -> faces
+    std::vector<unsigned> cellFaces;
+
+    void cellRange(const CalAABox& box, int lo[3], int hi[3]) const {
+        const float* boxMin = &box.min.x;
+        const float* boxMax = &box.max.x;
+        const float* o = &origin.x;
+        for (int k = 0; k < 3; ++k) {
+            lo[k] = std::min(dims[k] - 1, std::max(0, int((boxMin[k] - o[k]) * inverseCellSize)));
+            hi[k] = std::min(dims[k] - 1, std::max(0, int((boxMax[k] - o[k]) * inverseCellSize)));
+        }
+    }
+
+    template<typename F>
+    void forEachCell(const CalAABox& box, F f) const {
+        int lo[3], hi[3];
+        cellRange(box, lo, hi);
+        for (int z = lo[2]; z <= hi[2]; ++z) {
+            for (int y = lo[1]; y <= hi[1]; ++y) {
+                for (int x = lo[0]; x <= hi[0]; ++x) {
+                    f((z * dims[1] + y) * dims[0] + x);
+                }
+            }
+        }
+    }
+
+    void build(const std::vector<CalAABox>& bounds) {
+        CalAABox all = bounds[0];
+        float extentSum = 0.0f;
+        for (auto b = bounds.begin(); b != bounds.end(); ++b) {
+            all.min.x = std::min(all.min.x, b->min.x);
+            all.min.y = std::min(all.min.y, b->min.y);
+            all.min.z = std::min(all.min.z, b->min.z);
+            all.max.x = std::max(all.max.x, b->max.x);
+            all.max.y = std::max(all.max.y, b->max.y);
+            all.max.z = std::max(all.max.z, b->max.z);
+            extentSum += std::max(b->max.x - b->min.x, std::max(b->max.y - b->min.y, b->max.z - b->min.z));
+        }
+
+        // cells about as big as a face's grown bounds, but no more cells
+        // than faces
+        origin = all.min;
+        const CalVector size = all.max - all.min;
+        float cellSize = std::max(extentSum / bounds.size(), 1e-6f);
+        for (;;) {
+            const double cellCount =
+                (floor(size.x / cellSize) + 1) *
+                (floor(size.y / cellSize) + 1) *
+                (floor(size.z / cellSize) + 1);
+            if (cellCount <= bounds.size()) {
+                break;
+            }
+            cellSize *= 1.25f;
+        }
+        inverseCellSize = 1.0f / cellSize;
+        dims[0] = int(size.x * inverseCellSize) + 1;
+        dims[1] = int(size.y * inverseCellSize) + 1;
+        dims[2] = int(size.z * inverseCellSize) + 1;
+
+        cellStarts.assign(dims[0] * dims[1] * dims[2] + 1, 0);
+        for (size_t f = 0; f < bounds.size(); ++f) {
+            forEachCell(bounds[f], [&](int cell) { ++cellStarts[cell + 1]; });
+        }
+        for (size_t c = 1; c < cellStarts.size(); ++c) {
+            cellStarts[c] += cellStarts[c - 1];
+        }
+        cellFaces.resize(cellStarts.back());
+        std::vector<unsigned> cursors(cellStarts.begin(), cellStarts.end() - 1);
+        for (size_t f = 0; f < bounds.size(); ++f) {
+            forEachCell(bounds[f], [&](int cell) { cellFaces[cursors[cell]++] = f; });
+        }
+    }
+};
+
+static bool overlaps(const CalAABox& a, const CalAABox& b) {
+    return a.min.x <= b.max.x && b.min.x <= a.max.x
+        && a.min.y <= b.max.y && b.min.y <= a.max.y
+        && a.min.z <= b.max.z && b.min.z <= a.max.z;
+}
+
+// Lowest score first, then lowest face index.
+struct FaceSortQueueEntry {
+    float score;
+    unsigned face;
+
+    bool operator<(const FaceSortQueueEntry& rhs) const {
+        return score > rhs.score || (score == rhs.score && face > rhs.face);
+    }
+};
+
 // http://www.mindcontrol.org/~hplus/graphics/sort-alpha.html
+//
+// Every face is duplicated with its winding flipped, and each face's
+// score is the weight of the faces it sits behind.  Faces are emitted
+// lowest score first, each one releasing the faces it was in front of.
+// Only faces within about a face's size plus reach of each other are
+// compared, so distant faces don't constrain each other.  The doubled
+// vertices can outgrow 16 bits; submeshTo then gets 32-bit indices.
 void CalCoreSubmesh::sortTris(CalCoreSubmesh& submeshTo) {
+    sortTris(submeshTo, 0.0f);
+}
+
+void CalCoreSubmesh::sortTris(CalCoreSubmesh& submeshTo, float reach) {
     size_t numVertices = getVertexCount();
-    size_t numFaces = m_faces.size();
+    size_t numFaces = getFaceCount();
 
 #if PRINT_STATUS > 0
     std::cout << "\n\nCalCoreSubmesh::sortTris\n" <<
             "Input submesh numVertices: " <<  numVertices <<
             ", numFaces: " << numFaces << "\n" <<
             "Output submesh numVertices: " <<  submeshTo.getVertexCount() <<
-            ", numFaces: " << submeshTo.getFaces().size() << "\n";
+            ", numFaces: " << submeshTo.getFaceCount() << "\n";
 #endif
 
-    addVertices(submeshTo, 0, 1.f);
-    addVertices(submeshTo, numVertices, -1.f);
-    for (size_t mt = 0; mt < getMorphTargets().size(); ++mt) {
-        const CalCoreMorphTargetPtr& mtPtr = getMorphTargets()[mt];
-        CalCoreMorphTarget::VertexOffsetArray voDup;
-        for (CalCoreMorphTarget::VertexOffsetArray::const_iterator voi = mtPtr->vertexOffsets.begin(); voi != mtPtr->vertexOffsets.end(); ++voi) {
-            voDup.push_back(VertexOffset(voi->vertexId, voi->position, voi->normal));
-        }
-        for (CalCoreMorphTarget::VertexOffsetArray::const_iterator voi = mtPtr->vertexOffsets.begin(); voi != mtPtr->vertexOffsets.end(); ++voi) {
-            voDup.push_back(VertexOffset(voi->vertexId + numVertices, voi->position, voi->normal));
-        }
-        CalCoreMorphTargetPtr mtPtrDup(new CalCoreMorphTarget(mtPtr->name, numVertices * 2, voDup));
-        submeshTo.addMorphTarget(mtPtrDup);
+    // every vertex twice, the second copy facing the other way
+    std::vector<unsigned> newToOld(2 * numVertices);
+    for (size_t v = 0; v < numVertices; ++v) {
+        newToOld[v] = v;
+        newToOld[numVertices + v] = v;
+    }
+    submeshTo.copyVertices(*this, newToOld);
+    for (size_t v = numVertices; v < 2 * numVertices; ++v) {
+        submeshTo.m_vertices[v].normal *= -1.f;
     }
     submeshTo.coreMaterialThreadId = coreMaterialThreadId;
+    if (2 * numVertices > 65536) {
+        submeshTo.setIndexSize(4);
+    }
+    if (!numFaces) {
+        return;
+    }
 
-    FaceSort *faces = new FaceSort[numFaces * 2];
-    memset(faces, 0, sizeof(FaceSort)*(numFaces * 2));
-    FaceSortRef *frefs = new FaceSortRef[numFaces * 2 * numFaces * 2];
-    memset(frefs, 0, sizeof(FaceSortRef) * numFaces * 2 * numFaces * 2);
-    size_t frtop = 0;
-
+    std::vector<FaceSort> faces(numFaces * 2);
+    std::vector<CalAABox> bounds(numFaces);
+    std::vector<CalVector> corners(3 * numFaces); // shared by both windings
     for (size_t f = 0; f < numFaces; ++f) {
-        faces[f].ix[0] = m_faces[f].vertexId[0];
-        faces[f].ix[1] = m_faces[f].vertexId[1];
-        faces[f].ix[2] = m_faces[f].vertexId[2];
-
-        faces[f].nfront = 0;
-        faces[f].infront = 0;
+        const WideFace face = getFace(f);
+        faces[f].ix[0] = face.vertexId[0];
+        faces[f].ix[1] = face.vertexId[1];
+        faces[f].ix[2] = face.vertexId[2];
+
+        CalVector a = m_vertices[face.vertexId[0]].position.asCalVector();
+        CalVector b = m_vertices[face.vertexId[1]].position.asCalVector();
+        CalVector c = m_vertices[face.vertexId[2]].position.asCalVector();
+
+        corners[3 * f + 0] = a;
+        corners[3 * f + 1] = b;
+        corners[3 * f + 2] = c;
+        const float grow = 0.5f * (sqrtf(std::max((b - a).lengthSquared(), std::max((c - b).lengthSquared(), (a - c).lengthSquared()))) + reach);
+        bounds[f].min = CalVector(std::min(a.x, std::min(b.x, c.x)) - grow, std::min(a.y, std::min(b.y, c.y)) - grow, std::min(a.z, std::min(b.z, c.z)) - grow);
+        bounds[f].max = CalVector(std::max(a.x, std::max(b.x, c.x)) + grow, std::max(a.y, std::max(b.y, c.y)) + grow, std::max(a.z, std::max(b.z, c.z)) + grow);
 
-        CalVector a = m_vertices[m_faces[f].vertexId[0]].position.asCalVector();
-        CalVector b = m_vertices[m_faces[f].vertexId[1]].position.asCalVector();
-        CalVector c = m_vertices[m_faces[f].vertexId[2]].position.asCalVector();
         b = b - a;
         c = c - a;
         a = cross(b, c);
@@ -588,45 +1291,68 @@ void CalCoreSubmesh::sortTris(CalCoreSubmesh& submeshTo) {
         a.normalize();
         faces[f].fnorm = a;
 
-        a = m_vertices[m_faces[f].vertexId[0]].position.asCalVector();
+        a = m_vertices[face.vertexId[0]].position.asCalVector();
         faces[f].fdist = dot(a, faces[f].fnorm);
         //  delay score calculation
         faces[f].score = 0;
     }
 
-    memcpy(faces + numFaces, faces, sizeof(FaceSort) * numFaces);
     for (size_t f = numFaces; f < numFaces * 2; ++f) {
-        unsigned short s = faces[f].ix[0];
-        faces[f].ix[0] = (unsigned short)(faces[f].ix[1] + numVertices);
-        faces[f].ix[1] = (unsigned short)(s + numVertices);
-        faces[f].ix[2] = (unsigned short)(faces[f].ix[2] + numVertices);
-        faces[f].nfront = 0;
-        faces[f].infront = 0;
+        faces[f] = faces[f - numFaces];
+        CalIndex32 s = faces[f].ix[0];
+        faces[f].ix[0] = CalIndex32(faces[f].ix[1] + numVertices);
+        faces[f].ix[1] = CalIndex32(s + numVertices);
+        faces[f].ix[2] = CalIndex32(faces[f].ix[2] + numVertices);
         faces[f].fnorm *= -1;
         faces[f].fdist *= -1;
-        faces[f].score = 0;
     }
 
+    FaceSortGrid grid;
+    grid.build(bounds);
+
+    std::vector<FaceSortRef> frefs;
+    std::vector<unsigned> candidates;
+    std::vector<unsigned> stamps(numFaces, static_cast<unsigned>(-1));
     unsigned totalSearch = 0;
     for (size_t g = 0; g < numFaces * 2; ++g) {
         assert(faces[g].ix[0] != faces[g].ix[1]);
-        faces[g].infront = frefs + frtop;
+        faces[g].firstFront = frefs.size();
+
+        // candidates are visited in index order, as the scores are sums
+        // whose rounding depends on it
+        const unsigned original = g % numFaces;
+        candidates.clear();
+        grid.forEachCell(bounds[original], [&](int cell) {
+            for (unsigned i = grid.cellStarts[cell]; i < grid.cellStarts[cell + 1]; ++i) {
+                const unsigned f = grid.cellFaces[i];
+                if (stamps[f] != g && overlaps(bounds[original], bounds[f])) {
+                    stamps[f] = g;
+                    candidates.push_back(f);
+                }
+            }
+        });
+        std::sort(candidates.begin(), candidates.end());
+        const size_t candidateCount = candidates.size();
+        for (size_t i = 0; i < candidateCount; ++i) {
+            candidates.push_back(candidates[i] + numFaces);
+        }
 
-        for (size_t f = 0; f < numFaces * 2; ++f) {
+        for (auto candidate = candidates.begin(); candidate != candidates.end(); ++candidate) {
+            const size_t f = *candidate;
             if (f == g) {
               continue;
             }
 
+            const CalVector* gCorners = &corners[3 * original];
+            const CalVector* fCorners = &corners[3 * (f % numFaces)];
             int vfront = 0, gfront = 0;
             for (int i = 0; i < 3; ++i) {
-                CalVector v = submeshTo.getVectorVertex()[faces[g].ix[i]].position.asCalVector();
-                float d = dot(v, faces[f].fnorm) - faces[f].fdist;
+                float d = dot(gCorners[i], faces[f].fnorm) - faces[f].fdist;
                 if (d < -1e-4) {
                   vfront++;
                 }
 
-                v = submeshTo.getVectorVertex()[faces[f].ix[i]].position.asCalVector();
-                d = dot(v, faces[g].fnorm) - faces[g].fdist;
+                d = dot(fCorners[i], faces[g].fnorm) - faces[g].fdist;
                 if (d < 1e-4) {
                   gfront++;
                 }
@@ -635,14 +1361,14 @@ void CalCoreSubmesh::sortTris(CalCoreSubmesh& submeshTo) {
             }
 
             if (vfront && (gfront < 3)) {
-              FaceSortRef &fr = faces[g].infront[faces[g].nfront];
-              fr.face = (unsigned short)f;
+              FaceSortRef fr;
+              fr.face = f;
               fr.fscore = (float)(std::max(faces[f].area, faces[g].area) * (1 + dot(faces[f].fnorm, faces[g].fnorm)) * 0.5 * vfront / 3);
-              faces[g].nfront++;
+              frefs.push_back(fr);
               faces[f].score += fr.fscore;
-              ++frtop;
             }
         }
+        faces[g].endFront = frefs.size();
 
 
 #if PRINT_STATUS > 0
@@ -653,28 +1379,39 @@ void CalCoreSubmesh::sortTris(CalCoreSubmesh& submeshTo) {
 
     }
 
-    Face newFace;
+    // Scores only drop, so stale queue entries are skipped when popped.
+    // Face i goes first at step i whenever it ties for the lowest score.
+    std::priority_queue<FaceSortQueueEntry> queue;
+    for (size_t f = 0; f < numFaces * 2; ++f) {
+        FaceSortQueueEntry entry = { faces[f].score, unsigned(f) };
+        queue.push(entry);
+    }
+
+    WideFace newFace;
+    std::vector<bool> emitted(numFaces * 2, false);
     for (size_t i = 0; i < numFaces * 2; ++i) {
-        float lowest = faces[i].score;
-        size_t lowestIx = i;
-        for (size_t f = 0; f < numFaces * 2; ++f) {
-            if (faces[f].score < lowest) {
-                lowest = faces[f].score;
-                lowestIx = f;
-            }
+        while (emitted[queue.top().face] || queue.top().score != faces[queue.top().face].score) {
+            queue.pop();
+        }
+        size_t lowestIx = queue.top().face;
+        if (!emitted[i] && faces[i].score <= queue.top().score) {
+            lowestIx = i;
         }
-        assert(lowest < 1e20f);
         assert(faces[lowestIx].ix[0] != faces[lowestIx].ix[1]);
-        assert(faces[lowestIx].score == lowest);
 
         newFace.vertexId[0] = faces[lowestIx].ix[0];
         newFace.vertexId[1] = faces[lowestIx].ix[1];
         newFace.vertexId[2] = faces[lowestIx].ix[2];
         submeshTo.addFace(newFace);
 
-        faces[lowestIx].score = 1e20f;
-        for (size_t q = 0; q < faces[lowestIx].nfront; ++q) {
-          faces[faces[lowestIx].infront[q].face].score -= faces[lowestIx].infront[q].fscore;
+        emitted[lowestIx] = true;
+        for (unsigned q = faces[lowestIx].firstFront; q < faces[lowestIx].endFront; ++q) {
+            FaceSort& behind = faces[frefs[q].face];
+            behind.score -= frefs[q].fscore;
+            if (!emitted[frefs[q].face]) {
+                FaceSortQueueEntry entry = { behind.score, frefs[q].face };
+                queue.push(entry);
+            }
         }
 
 #if PRINT_STATUS > 0
@@ -686,259 +1423,1165 @@ void CalCoreSubmesh::sortTris(CalCoreSubmesh& submeshTo) {
     }
 }
 
-typedef std::vector<std::vector<CalCoreSubmesh::Influence>> InfluenceVectorVector;
+static unsigned countBits(unsigned word) {
+    word = word - ((word >> 1) & 0x55555555);
+    word = (word & 0x33333333) + ((word >> 2) & 0x33333333);
+    return (((word + (word >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
 
-static InfluenceVectorVector extractInfluenceVector(const CalCoreSubmesh::InfluenceVector& iv) {
-    InfluenceVectorVector result;
-    std::vector<CalCoreSubmesh::Influence> current;
-    for (size_t i = 0; i < iv.size(); ++i) {
-        auto& inf = iv[i];
-        current.push_back(inf);
-        if (inf.lastInfluenceForThisVertex) {
-            result.push_back(current);
-            current.clear();
+// Bone sets as bitsets over the submesh's bones, numbered densely: a row
+// of words per vertex, and the set being grown.
+class BoneSetTracker {
+public:
+    BoneSetTracker(const CalCoreSubmesh::InfluenceVector& influences, size_t vertexCount) {
+        std::vector<unsigned> bones;
+        bones.reserve(influences.size());
+        for (auto i = influences.begin(); i != influences.end(); ++i) {
+            bones.push_back(i->boneId);
         }
-    }
-    return result;
-}
-static CalCoreSubmesh::InfluenceVector generateInfluenceVector(const InfluenceVectorVector& iv) {
-    CalCoreSubmesh::InfluenceVector result;
-    for (auto influences = iv.begin(); influences != iv.end(); ++influences) {
-        for (size_t i = 0; i + 1 < influences->size(); ++i) {
-            auto j = (*influences)[i];
-            j.lastInfluenceForThisVertex = false;
-            result.push_back(j);
+        std::sort(bones.begin(), bones.end());
+        bones.erase(std::unique(bones.begin(), bones.end()), bones.end());
+
+        wordCount = std::max<size_t>(1, (bones.size() + 31) / 32);
+        vertexBones.assign(vertexCount * wordCount, 0);
+        size_t v = 0;
+        for (auto i = influences.begin(); i != influences.end() && v < vertexCount; ++i) {
+            const size_t bone = std::lower_bound(bones.begin(), bones.end(), i->boneId) - bones.begin();
+            vertexBones[v * wordCount + bone / 32] |= 1u << (bone % 32);
+            if (i->lastInfluenceForThisVertex) {
+                ++v;
+            }
         }
-        auto j = influences->back();
-        j.lastInfluenceForThisVertex = true;
-        result.push_back(j);
+        current.assign(wordCount, 0);
+        currentCount = 0;
     }
-    return result;
-}
 
-CalCoreSubmeshPtr CalCoreSubmesh::emitSubmesh(VerticesSet & verticesSetThisSplit, VectorFace & trianglesThisSplit, SplitMeshBasedOnBoneLimitType& rc) {
-    auto influencesVector = extractInfluenceVector(m_influences);
+    void clear() {
+        std::fill(current.begin(), current.end(), 0);
+        currentCount = 0;
+    }
 
-    typedef std::map<int, int> VertexMap;
-    VertexMap vertexMapper;
-    int vIdx = 0;
-    int numTris;
-    for (std::set<int>::iterator it = verticesSetThisSplit.begin(); it != verticesSetThisSplit.end(); ++it) {
-        vertexMapper[*it] = vIdx++;
+    unsigned count() const {
+        return currentCount;
     }
-    numTris = trianglesThisSplit.size();
-    for (int x = 0; x < numTris; ++x) {
-        if (verticesSetThisSplit.find(trianglesThisSplit[x].vertexId[0]) == verticesSetThisSplit.end()
-            || verticesSetThisSplit.find(trianglesThisSplit[x].vertexId[1]) == verticesSetThisSplit.end()
-            || verticesSetThisSplit.find(trianglesThisSplit[x].vertexId[2]) == verticesSetThisSplit.end()) {
-            rc = SplitMeshBoneLimitVtxTrglMismatch;
-            CalCoreSubmeshPtr newSubmesh;
-            return newSubmesh;
+
+    // the size of the set with face's bones added
+    template<typename FaceType>
+    unsigned countWith(const FaceType& face) const {
+        const unsigned* a = &vertexBones[face.vertexId[0] * wordCount];
+        const unsigned* b = &vertexBones[face.vertexId[1] * wordCount];
+        const unsigned* c = &vertexBones[face.vertexId[2] * wordCount];
+        unsigned count = 0;
+        for (size_t w = 0; w < wordCount; ++w) {
+            count += countBits(current[w] | a[w] | b[w] | c[w]);
+        }
+        return count;
+    }
+
+    template<typename FaceType>
+    void add(const FaceType& face) {
+        currentCount = 0;
+        for (size_t w = 0; w < wordCount; ++w) {
+            current[w] |=
+                vertexBones[face.vertexId[0] * wordCount + w] |
+                vertexBones[face.vertexId[1] * wordCount + w] |
+                vertexBones[face.vertexId[2] * wordCount + w];
+            currentCount += countBits(current[w]);
         }
-        trianglesThisSplit[x].vertexId[0] = vertexMapper[trianglesThisSplit[x].vertexId[0]];
-        trianglesThisSplit[x].vertexId[1] = vertexMapper[trianglesThisSplit[x].vertexId[1]];
-        trianglesThisSplit[x].vertexId[2] = vertexMapper[trianglesThisSplit[x].vertexId[2]];
     }
 
-    CalCoreSubmeshPtr newSubmesh(new CalCoreSubmesh(verticesSetThisSplit.size(), m_textureCoordinates.size() > 0, numTris)); 
+private:
+    size_t wordCount;
+    std::vector<unsigned> vertexBones;
+    std::vector<unsigned> current;
+    unsigned currentCount;
+};
 
-    vIdx = 0;
-    for (auto it = verticesSetThisSplit.begin(); it != verticesSetThisSplit.end(); ++it) {
-        int v = *it;
-        struct Vertex originalVertex = m_vertices[v];
-        newSubmesh->addVertex(originalVertex, m_vertexColors[v], influencesVector[v]);
-        newSubmesh->setTextureCoordinate(vIdx, m_textureCoordinates[v]);
-        ++vIdx;
-    }
-    for (int x = 0; x < numTris; ++x) {
-        newSubmesh->addFace(trianglesThisSplit[x]);
+// Splits a submesh into pieces using at most boneLimit bones each.  Each
+// piece starts at the first face not yet taken and grows across shared
+// vertices, taking faces that bring no new bones as it finds them and
+// otherwise the one bringing the fewest, until none fit.  Faces
+// elsewhere in the mesh that still fit top it up before it is emitted.
+template<typename FaceType>
+class BoneLimitPartitioner {
+public:
+    BoneLimitPartitioner(const CalCoreSubmesh& submesh, const std::vector<FaceType>& faces, size_t boneLimit)
+        : submesh(submesh)
+        , faces(faces)
+        , boneLimit(boneLimit)
+        , bones(submesh.getInfluences(), submesh.getVertexCount())
+        , used(faces.size(), false)
+        , frontierStamps(faces.size(), None)
+        , vertexMap(submesh.getVertexCount(), None)
+    {
+        buildVertexFaceAdjacency(faces, submesh.getVertexCount(), adjacencyStarts, adjacency);
+    }
+
+    void split(CalCoreSubmesh::CalCoreSubmeshPtrVector& newSubmeshes) {
+        size_t nextSeed = 0;
+        for (unsigned piece = 0; ; ++piece) {
+            while (nextSeed < faces.size() && used[nextSeed]) {
+                ++nextSeed;
+            }
+            if (nextSeed == faces.size()) {
+                break;
+            }
+
+            bones.clear();
+            pieceFaces.clear();
+            frontier.clear();
+            // a face too big for the limit on its own still gets a piece
+            add(nextSeed, piece);
+            for (size_t scan = nextSeed + 1; ; ++scan) {
+                grow(piece);
+                while (scan < faces.size() && (used[scan] || bones.countWith(faces[scan]) > boneLimit)) {
+                    ++scan;
+                }
+                if (scan == faces.size()) {
+                    break;
+                }
+                add(scan, piece);
+            }
+
+            std::sort(pieceFaces.begin(), pieceFaces.end());
+            newSubmeshes.push_back(emit());
+        }
     }
-    newSubmesh->coreMaterialThreadId = coreMaterialThreadId;
-    rc = SplitMeshBoneLimitOK;
-    return newSubmesh;
-}
 
-static void getBoneIndicesFromFace(InfluenceVectorVector& influences, std::set<int>& bSet, CalCoreSubmesh::Face& t) {
-    for (int i = 0; i < 3; ++i) {
-        auto& iv = influences[t.vertexId[i]];
-        for (size_t indx = 0; indx < iv.size(); ++indx) {
-            bSet.insert(iv[indx].boneId);
+private:
+    static const unsigned None = ~0u;
+
+    const CalCoreSubmesh& submesh;
+    const std::vector<FaceType>& faces;
+    const size_t boneLimit;
+    BoneSetTracker bones;
+
+    // CSR: vertex -> faces
+    std::vector<unsigned> adjacencyStarts;
+    std::vector<unsigned> adjacency;
+
+    std::vector<bool> used;
+    std::vector<unsigned> frontierStamps; // the piece a face was queued for
+    std::vector<unsigned> frontier;
+    std::vector<unsigned> pieceFaces;
+    std::vector<unsigned> vertexMap; // original -> piece vertex
+
+    void add(unsigned face, unsigned piece) {
+        used[face] = true;
+        pieceFaces.push_back(face);
+        bones.add(faces[face]);
+        for (int k = 0; k < 3; ++k) {
+            const unsigned v = faces[face].vertexId[k];
+            for (unsigned a = adjacencyStarts[v]; a < adjacencyStarts[v + 1]; ++a) {
+                const unsigned neighbour = adjacency[a];
+                if (!used[neighbour] && frontierStamps[neighbour] != piece) {
+                    frontierStamps[neighbour] = piece;
+                    frontier.push_back(neighbour);
+                }
+            }
         }
     }
-}
 
-SplitMeshBasedOnBoneLimitType CalCoreSubmesh::splitMeshBasedOnBoneLimit(CalCoreSubmeshPtrVector& newSubmeshes, size_t boneLimit) {
-    std::set<int> boneIndicesThisMesh_New;
-    std::set<int> boneIndicesTemp;
-    std::set<int> boneIndicesThisMesh;
-    VerticesSet verticesForThisSplit;
-    std::vector<Face> trianglesForThisSplit;
-    SplitMeshBasedOnBoneLimitType rc;
-    CalCoreSubmeshPtr newSubmeshSP;
-
-    auto influencesVector = extractInfluenceVector(m_influences);
-
-    VectorFace::size_type sz = m_faces.size();
-    for (unsigned i = 0; i < sz; i++) {
-        Face& t = m_faces[i];
-        getBoneIndicesFromFace(influencesVector, boneIndicesTemp, t);
-        boneIndicesThisMesh_New.insert(boneIndicesTemp.begin(), boneIndicesTemp.end());
-
-        if (boneIndicesThisMesh_New.size() > boneLimit) {
-            newSubmeshSP = emitSubmesh(verticesForThisSplit, trianglesForThisSplit, rc);
-            if (rc != SplitMeshBoneLimitOK) {
-                return rc;
+    // Adding faces only grows the set, so a face that doesn't fit now
+    // never will and leaves the frontier for good.
+    void grow(unsigned piece) {
+        for (;;) {
+            unsigned best = None;
+            unsigned bestCount = 0;
+            for (size_t i = 0; i < frontier.size();) {
+                const unsigned face = frontier[i];
+                const unsigned count = used[face] ? 0 : bones.countWith(faces[face]);
+                if (used[face] || count > boneLimit || count == bones.count()) {
+                    frontier[i] = frontier.back();
+                    frontier.pop_back();
+                    if (!used[face] && count <= boneLimit) {
+                        add(face, piece);
+                    }
+                    continue;
+                }
+                if (best == None || count < bestCount || (count == bestCount && face < best)) {
+                    best = face;
+                    bestCount = count;
+                }
+                ++i;
             }
-            boneIndicesThisMesh_New.clear();
-            boneIndicesThisMesh_New.insert(boneIndicesTemp.begin(), boneIndicesTemp.end());
-            verticesForThisSplit.clear();
-            trianglesForThisSplit.clear();
-            newSubmeshes.push_back(newSubmeshSP);
+            if (best == None) {
+                return;
+            }
+            add(best, piece);
         }
-        verticesForThisSplit.insert(t.vertexId[0]);
-        verticesForThisSplit.insert(t.vertexId[1]);
-        verticesForThisSplit.insert(t.vertexId[2]);
-        trianglesForThisSplit.push_back(t);
-        boneIndicesTemp.clear();
     }
-    if (!trianglesForThisSplit.empty()) {
-        if (verticesForThisSplit.empty()) {
-            return SplitMeshBoneLimitEmptyVertices;
+
+    CalCoreSubmeshPtr emit() {
+        std::vector<unsigned> vertices;
+        for (size_t i = 0; i < pieceFaces.size(); ++i) {
+            for (int k = 0; k < 3; ++k) {
+                const unsigned v = faces[pieceFaces[i]].vertexId[k];
+                if (vertexMap[v] == None) {
+                    vertexMap[v] = 0;
+                    vertices.push_back(v);
+                }
+            }
         }
-        newSubmeshSP = emitSubmesh(verticesForThisSplit, trianglesForThisSplit, rc);
-        if (rc != SplitMeshBoneLimitOK) {
-            return rc;
+        std::sort(vertices.begin(), vertices.end());
+
+        CalCoreSubmeshPtr newSubmesh(new CalCoreSubmesh(vertices.size(), submesh.hasTextureCoordinates(), pieceFaces.size()));
+        newSubmesh->copyVertices(submesh, vertices);
+        for (size_t i = 0; i < vertices.size(); ++i) {
+            vertexMap[vertices[i]] = i;
+        }
+        for (size_t i = 0; i < pieceFaces.size(); ++i) {
+            const FaceType& face = faces[pieceFaces[i]];
+            newSubmesh->addFace(CalCoreSubmesh::WideFace(
+                vertexMap[face.vertexId[0]],
+                vertexMap[face.vertexId[1]],
+                vertexMap[face.vertexId[2]]));
         }
-        verticesForThisSplit.clear();
-        trianglesForThisSplit.clear();
-        boneIndicesThisMesh_New.clear();
-        newSubmeshes.push_back(newSubmeshSP);
+        for (size_t i = 0; i < vertices.size(); ++i) {
+            vertexMap[vertices[i]] = None;
+        }
+        newSubmesh->coreMaterialThreadId = submesh.coreMaterialThreadId;
+        return newSubmesh;
     }
+};
 
+template<typename FaceType>
+const unsigned BoneLimitPartitioner<FaceType>::None;
+
+SplitMeshBasedOnBoneLimitType CalCoreSubmesh::splitMeshBasedOnBoneLimit(CalCoreSubmeshPtrVector& newSubmeshes, size_t boneLimit) {
+    if (!validateSubmesh()) {
+        return SplitMeshBoneLimitVtxTrglMismatch;
+    }
+    if (m_wideIndices) {
+        BoneLimitPartitioner<WideFace>(*this, m_wideFaces, boneLimit).split(newSubmeshes);
+    } else {
+        BoneLimitPartitioner<Face>(*this, m_faces, boneLimit).split(newSubmeshes);
+    }
     return SplitMeshBoneLimitOK;
 }
 
-void CalCoreSubmesh::optimizeVertexCache() {
-    if (m_faces.empty()) {
+template<typename FaceType>
+static void optimizeFaceRange(std::vector<FaceType>& faces, size_t faceStartIndex, size_t faceCount, size_t vertexCount) {
+    if (!faceCount) {
         return;
     }
 
-    std::vector<Face> newFaces(m_faces.size());
+    std::vector<FaceType> newFaces(faceCount);
 
     Forsyth::OptimizeFaces(
-        m_faces[0].vertexId,
-        3 * m_faces.size(),
-        m_vertices.size(),
+        faces[faceStartIndex].vertexId,
+        3 * faceCount,
+        vertexCount,
         newFaces[0].vertexId,
         32);
 
-    m_faces.swap(newFaces);
+    std::copy(newFaces.begin(), newFaces.end(), faces.begin() + faceStartIndex);
+}
+
+void CalCoreSubmesh::optimizeVertexCache() {
+    optimizeVertexCacheSubset(0, getFaceCount());
 }
 
 void CalCoreSubmesh::optimizeVertexCacheSubset(
     unsigned int faceStartIndex,
     unsigned int faceCount
 ) {
-    if (m_faces.empty()) {
+    if (!getFaceCount()) {
         return;
     }
-    assert(faceStartIndex + faceCount <= m_faces.size());
+    assert(faceStartIndex + faceCount <= getFaceCount());
 
-    std::vector<Face> newFaces(faceCount);
+    if (m_wideIndices) {
+        optimizeFaceRange(m_wideFaces, faceStartIndex, faceCount, m_vertices.size());
+    } else {
+        optimizeFaceRange(m_faces, faceStartIndex, faceCount, m_vertices.size());
+    }
+    discardClusters();
+    m_lodCollapses.clear();
+}
+
+// Counts vertex transforms through a simulated post-transform cache.
+class VertexCacheSimulator {
+public:
+    VertexCacheSimulator(const CalCoreSubmesh::VertexCacheModel& model, size_t vertexCount)
+        : model(model)
+        , cachedAt(model.replacement == CalCoreSubmesh::VertexCacheModel::FIFO ? vertexCount : 0, 0)
+        , clock(model.size + 1)
+    {
+        entries.reserve(model.size);
+    }
+
+    void flush() {
+        entries.clear();
+        clock += model.size + 1;
+    }
+
+    // the vertices face misses
+    template<typename FaceType>
+    unsigned addFace(const FaceType& face) {
+        return add(face.vertexId[0]) + add(face.vertexId[1]) + add(face.vertexId[2]);
+    }
+
+private:
+    const CalCoreSubmesh::VertexCacheModel model;
+    std::vector<unsigned> cachedAt; // FIFO: clock when each vertex entered
+    unsigned clock;
+    std::vector<unsigned> entries;  // LRU: most recent last
+
+    unsigned add(unsigned v) {
+        if (model.replacement == CalCoreSubmesh::VertexCacheModel::FIFO) {
+            if (clock - cachedAt[v] <= model.size) {
+                return 0;
+            }
+            cachedAt[v] = clock++;
+            return 1;
+        }
+
+        auto hit = std::find(entries.begin(), entries.end(), v);
+        if (hit != entries.end()) {
+            entries.erase(hit);
+            entries.push_back(v);
+            return 0;
+        }
+        if (entries.size() == model.size) {
+            entries.erase(entries.begin());
+        }
+        entries.push_back(v);
+        return 1;
+    }
+};
+
+// Fragments shaded over pixels covered, rasterizing front faces in order
+// with a depth test from each axis direction, as in meshoptimizer's
+// analyzeOverdraw.
+template<typename FaceType>
+static float estimateOverdraw(const CalCoreSubmesh::VectorVertex& vertices, const std::vector<FaceType>& faces) {
+    const int Resolution = 256;
+
+    CalAABox box = emptyBox();
+    for (auto f = faces.begin(); f != faces.end(); ++f) {
+        for (int k = 0; k < 3; ++k) {
+            extendBox(box, vertices[f->vertexId[k]].position);
+        }
+    }
+    const float extent = std::max(box.max.x - box.min.x, std::max(box.max.y - box.min.y, box.max.z - box.min.z));
+    if (faces.empty() || extent <= 0.0f) {
+        return 1.0f;
+    }
+    const float scale = (Resolution - 1) / extent;
+
+    std::vector<float> depth(Resolution * Resolution);
+    size_t shaded = 0;
+    size_t covered = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+        const int u = (axis + 1) % 3;
+        const int v = (axis + 2) % 3;
+        for (int sign = -1; sign <= 1; sign += 2) {
+            std::fill(depth.begin(), depth.end(), std::numeric_limits<float>::max());
+            for (auto f = faces.begin(); f != faces.end(); ++f) {
+                float x[3], y[3], z[3];
+                for (int k = 0; k < 3; ++k) {
+                    const float* p = &vertices[f->vertexId[k]].position.x;
+                    const float* lo = &box.min.x;
+                    x[k] = (p[u] - lo[u]) * scale;
+                    y[k] = (p[v] - lo[v]) * scale;
+                    z[k] = sign * p[axis];
+                }
+                // the viewer is on the -sign side of the axis
+                const float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+                if (sign * area >= 0.0f) {
+                    continue;
+                }
+
+                const int x0 = std::max(0, int(ceilf(std::min(x[0], std::min(x[1], x[2])))));
+                const int x1 = std::min(Resolution - 1, int(floorf(std::max(x[0], std::max(x[1], x[2])))));
+                const int y0 = std::max(0, int(ceilf(std::min(y[0], std::min(y[1], y[2])))));
+                const int y1 = std::min(Resolution - 1, int(floorf(std::max(y[0], std::max(y[1], y[2])))));
+                const float inverseArea = 1.0f / area;
+                for (int py = y0; py <= y1; ++py) {
+                    for (int px = x0; px <= x1; ++px) {
+                        const float w0 = ((x[1] - px) * (y[2] - py) - (x[2] - px) * (y[1] - py)) * inverseArea;
+                        const float w1 = ((x[2] - px) * (y[0] - py) - (x[0] - px) * (y[2] - py)) * inverseArea;
+                        const float w2 = 1.0f - w0 - w1;
+                        if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f) {
+                            continue;
+                        }
+                        float& d = depth[py * Resolution + px];
+                        const float fragment = w0 * z[0] + w1 * z[1] + w2 * z[2];
+                        if (fragment < d) {
+                            covered += d == std::numeric_limits<float>::max();
+                            d = fragment;
+                            ++shaded;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return covered ? float(shaded) / float(covered) : 1.0f;
+}
+
+template<typename FaceType>
+static CalCoreSubmesh::MeshStatistics analyzeFaces(
+    const CalCoreSubmesh::VectorVertex& vertices,
+    const std::vector<FaceType>& faces,
+    const CalCoreSubmesh::VertexCacheModel& cache
+) {
+    VertexCacheSimulator simulator(cache, vertices.size());
+    unsigned transformed = 0;
+    std::vector<unsigned char> used(vertices.size(), 0);
+    size_t usedCount = 0;
+    for (auto f = faces.begin(); f != faces.end(); ++f) {
+        transformed += simulator.addFace(*f);
+        for (int k = 0; k < 3; ++k) {
+            usedCount += !used[f->vertexId[k]];
+            used[f->vertexId[k]] = 1;
+        }
+    }
+
+    CalCoreSubmesh::MeshStatistics statistics;
+    statistics.acmr = faces.empty() ? 0.0f : float(transformed) / faces.size();
+    statistics.atvr = usedCount ? float(transformed) / usedCount : 0.0f;
+    statistics.overdraw = estimateOverdraw(vertices, faces);
+    return statistics;
+}
 
+CalCoreSubmesh::MeshStatistics CalCoreSubmesh::analyzeMesh(const VertexCacheModel& cache) const {
+    return m_wideIndices
+        ? analyzeFaces(m_vertices, m_wideFaces, cache)
+        : analyzeFaces(m_vertices, m_faces, cache);
+}
+
+// Sander, Nehab and Barczak, "Fast Triangle Reordering for Vertex
+// Locality and Reduced Overdraw" (2007): cut the cache-ordered faces
+// into patches wherever a face misses all three vertices, and within
+// those wherever the ACMR so far is within threshold of the whole run's,
+// then draw the patches facing furthest out of the mesh first.
+template<typename FaceType>
+static std::vector<FaceType> reorderPatchesForOverdraw(
+    const CalCoreSubmesh::VectorVertex& vertices,
+    const std::vector<FaceType>& faces,
+    const CalCoreSubmesh::VertexCacheModel& cache,
+    float threshold
+) {
+    std::vector<unsigned> runStarts(1, 0);
+    {
+        VertexCacheSimulator simulator(cache, vertices.size());
+        simulator.addFace(faces[0]);
+        for (size_t f = 1; f < faces.size(); ++f) {
+            if (simulator.addFace(faces[f]) == 3) {
+                runStarts.push_back(f);
+            }
+        }
+        runStarts.push_back(faces.size());
+    }
+
+    std::vector<unsigned> patchStarts;
+    VertexCacheSimulator simulator(cache, vertices.size());
+    for (size_t r = 0; r + 1 < runStarts.size(); ++r) {
+        const unsigned begin = runStarts[r];
+        const unsigned end = runStarts[r + 1];
+
+        simulator.flush();
+        unsigned runMisses = 0;
+        for (unsigned f = begin; f < end; ++f) {
+            runMisses += simulator.addFace(faces[f]);
+        }
+        const float target = threshold * runMisses / (end - begin);
+
+        const size_t firstPatch = patchStarts.size();
+        patchStarts.push_back(begin);
+        simulator.flush();
+        unsigned misses = 0;
+        unsigned count = 0;
+        for (unsigned f = begin; f < end; ++f) {
+            misses += simulator.addFace(faces[f]);
+            ++count;
+            if (float(misses) / count <= target && f + 1 < end) {
+                patchStarts.push_back(f + 1);
+                simulator.flush();
+                misses = 0;
+                count = 0;
+            }
+        }
+        // a tail that never got down to the target joins the patch before
+        if (count && patchStarts.size() - firstPatch > 1 && float(misses) / count > target) {
+            patchStarts.pop_back();
+        }
+    }
+    patchStarts.push_back(faces.size());
+
+    CalVector meshCentre(0, 0, 0);
+    for (auto f = faces.begin(); f != faces.end(); ++f) {
+        for (int k = 0; k < 3; ++k) {
+            meshCentre += vertices[f->vertexId[k]].position.asCalVector();
+        }
+    }
+    meshCentre /= float(3 * faces.size());
+
+    const size_t patchCount = patchStarts.size() - 1;
+    std::vector<float> outwardness(patchCount);
+    for (size_t p = 0; p < patchCount; ++p) {
+        CalVector centroid(0, 0, 0);
+        CalVector normal(0, 0, 0);
+        float area = 0.0f;
+        for (unsigned f = patchStarts[p]; f < patchStarts[p + 1]; ++f) {
+            const CalVector a = vertices[faces[f].vertexId[0]].position.asCalVector();
+            const CalVector b = vertices[faces[f].vertexId[1]].position.asCalVector();
+            const CalVector c = vertices[faces[f].vertexId[2]].position.asCalVector();
+            const CalVector n = cross(b - a, c - a);
+            const float faceArea = n.length();
+            centroid += (a + b + c) * (faceArea / 3.0f);
+            normal += n;
+            area += faceArea;
+        }
+        if (area > 0.0f && normal.length() > 0.0f) {
+            normal.normalize();
+            outwardness[p] = dot(centroid / area - meshCentre, normal);
+        } else {
+            outwardness[p] = 0.0f;
+        }
+    }
+
+    std::vector<unsigned> order(patchCount);
+    for (size_t p = 0; p < patchCount; ++p) {
+        order[p] = p;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+        return outwardness[a] > outwardness[b];
+    });
+
+    std::vector<FaceType> result;
+    result.reserve(faces.size());
+    for (auto p = order.begin(); p != order.end(); ++p) {
+        result.insert(result.end(), faces.begin() + patchStarts[*p], faces.begin() + patchStarts[*p + 1]);
+    }
+    return result;
+}
+
+template<typename FaceType>
+static void optimizeFaces(
+    std::vector<FaceType>& faces,
+    const CalCoreSubmesh::VectorVertex& vertices,
+    const CalCoreSubmesh::MeshOptimizationOptions& options
+) {
+    // OptimizeFaces models an LRU cache of at most 64 entries; it still
+    // orders well for FIFO caches of the same size.
+    std::vector<FaceType> newFaces(faces.size());
     Forsyth::OptimizeFaces(
-        m_faces[faceStartIndex].vertexId,
-        3 * faceCount,
-        m_vertices.size(),
+        faces[0].vertexId,
+        3 * faces.size(),
+        vertices.size(),
         newFaces[0].vertexId,
-        32);
+        std::min(options.cache.size, 64u));
+    faces.swap(newFaces);
 
-    // Without these temp variable castings, MSVC 2010 will insert bounds
-    // asserts into std::copy() in debug builds, to keep us from abusing our
-    // fixed length arrays.  Presumably this will be better in C++11.
-    const CalIndex* srcStart = &(newFaces[0].vertexId[0]);
-    const CalIndex* srcEnd = srcStart + faceCount * 3;
-    CalIndex* destStart = &(m_faces[faceStartIndex].vertexId[0]);
-    std::copy(srcStart, srcEnd, destStart);
+    if (options.overdrawThreshold >= 1.0f) {
+        faces = reorderPatchesForOverdraw(vertices, faces, options.cache, options.overdrawThreshold);
+    }
 }
 
-void CalCoreSubmesh::renumberIndices() {
-    // just because operator[] is invalid on an empty vector. in C++11
-    // we could use .data().
-    if (m_faces.empty()) {
+CalCoreSubmesh::MeshOptimizationReport CalCoreSubmesh::optimizeMesh(const MeshOptimizationOptions& options) {
+    cal3d::verify(options.cache.size >= 4, "vertex cache models need at least 4 entries");
+
+    MeshOptimizationReport report;
+    report.before = analyzeMesh(options.cache);
+    if (!getFaceCount()) {
+        report.after = report.before;
+        return report;
+    }
+
+    if (m_wideIndices) {
+        optimizeFaces(m_wideFaces, m_vertices, options);
+    } else {
+        optimizeFaces(m_faces, m_vertices, options);
+    }
+    discardClusters();
+    m_lodCollapses.clear();
+
+    switch (options.vertexOrder) {
+        case FetchVertexOrder:
+            renumberIndices();
+            break;
+        case BoneVertexOrder:
+            sortVerticesByBone();
+            break;
+        case KeepVertexOrder:
+            break;
+    }
+
+    report.after = analyzeMesh(options.cache);
+    return report;
+}
+
+// Vertex v's influences are influences[starts[v], starts[v + 1]).
+static void findInfluenceRuns(const CalCoreSubmesh::InfluenceVector& influences, size_t vertexCount, std::vector<unsigned>& starts) {
+    starts.assign(vertexCount + 1, 0);
+    size_t runs = 0;
+    for (size_t i = 0; i < influences.size(); ++i) {
+        if (influences[i].lastInfluenceForThisVertex) {
+            starts[++runs] = i + 1;
+        }
+    }
+    assert(runs == vertexCount);
+}
+
+void CalCoreSubmesh::permuteVertices(const std::vector<unsigned>& newToOld) {
+    copyVertices(*this, newToOld);
+}
+
+// Everything is gathered into fresh arrays before any of this submesh's
+// are replaced, so source may be this submesh.  Influence runs and morph
+// offsets are found through prefix sums over the source vertices.
+void CalCoreSubmesh::copyVertices(const CalCoreSubmesh& source, const std::vector<unsigned>& newToOld) {
+    const size_t vertexCount = newToOld.size();
+    const size_t sourceVertexCount = source.m_vertices.size();
+
+    std::vector<unsigned> starts;
+    findInfluenceRuns(source.m_influences, sourceVertexCount, starts);
+
+    size_t influenceCount = 0;
+    for (size_t v = 0; v < vertexCount; ++v) {
+        influenceCount += starts[newToOld[v] + 1] - starts[newToOld[v]];
+    }
+
+    VectorVertex vertices(vertexCount);
+    std::vector<CalColor32> colors(vertexCount);
+    VectorTextureCoordinate textureCoordinates(source.hasTextureCoordinates() ? vertexCount : 0);
+    InfluenceVector influences(influenceCount);
+    CalAABox boundingVolume = m_boundingVolume;
+    bool isStatic = vertexCount > 0;
+    const Influence* staticInfluences = vertexCount ? &source.m_influences[starts[newToOld[0]]] : 0;
+    const unsigned staticInfluenceCount = vertexCount ? starts[newToOld[0] + 1] - starts[newToOld[0]] : 0;
+
+    size_t influence = 0;
+    for (size_t v = 0; v < vertexCount; ++v) {
+        const unsigned old = newToOld[v];
+        vertices[v] = source.m_vertices[old];
+        colors[v] = source.m_vertexColors[old];
+        if (!textureCoordinates.empty()) {
+            textureCoordinates[v] = source.m_textureCoordinates[old];
+        }
+
+        const Influence* run = &source.m_influences[starts[old]];
+        const unsigned runLength = starts[old + 1] - starts[old];
+        std::copy(run, run + runLength, influences.begin() + influence);
+        influence += runLength;
+
+        // as addVertex: one influence set throughout, and no vertex
+        // given the placeholder for missing influences
+        if (isStatic && !source.m_isStatic) {
+            isStatic = runLength == staticInfluenceCount && !(runLength == 1 && run[0].boneId == 0 && run[0].weight == 0.0f);
+            for (unsigned i = 0; isStatic && i < runLength; ++i) {
+                isStatic = run[i] == staticInfluences[i];
+            }
+        }
+
+        const CalVector position = vertices[v].position.asCalVector();
+        if (v == 0) {
+            boundingVolume.min = position;
+            boundingVolume.max = position;
+        } else {
+            extendBox(boundingVolume, vertices[v].position);
+        }
+    }
+
+    MorphTargetArray morphTargets;
+    std::vector<unsigned> offsetStarts(sourceVertexCount + 1);
+    std::vector<unsigned> offsetOrder;
+    for (size_t t = 0; t < source.m_morphTargets.size(); ++t) {
+        const CalCoreMorphTarget& target = *source.m_morphTargets[t];
+        const CalCoreMorphTarget::VertexOffsetArray& offsets = target.vertexOffsets;
+
+        // offsetStarts ends up holding where each vertex's offsets start
+        // in offsetOrder, filled back to front to keep their order
+        std::fill(offsetStarts.begin(), offsetStarts.end(), 0);
+        for (size_t i = 0; i < offsets.size(); ++i) {
+            ++offsetStarts[offsets[i].vertexId];
+        }
+        for (size_t v = 1; v <= sourceVertexCount; ++v) {
+            offsetStarts[v] += offsetStarts[v - 1];
+        }
+        offsetOrder.resize(offsets.size());
+        for (size_t i = offsets.size(); i--; ) {
+            offsetOrder[--offsetStarts[offsets[i].vertexId]] = unsigned(i);
+        }
+
+        size_t offsetCount = 0;
+        for (size_t v = 0; v < vertexCount; ++v) {
+            offsetCount += offsetStarts[newToOld[v] + 1] - offsetStarts[newToOld[v]];
+        }
+        CalCoreMorphTarget::VertexOffsetArray newOffsets(offsetCount);
+        size_t offset = 0;
+        for (size_t v = 0; v < vertexCount; ++v) {
+            for (unsigned i = offsetStarts[newToOld[v]]; i < offsetStarts[newToOld[v] + 1]; ++i) {
+                const VertexOffset& vo = offsets[offsetOrder[i]];
+                newOffsets[offset++] = VertexOffset(v, vo.position, vo.normal);
+            }
+        }
+        morphTargets.push_back(CalCoreMorphTargetPtr(new CalCoreMorphTarget(target.name, vertexCount, newOffsets)));
+    }
+
+    if (vertexCount) {
+        InfluenceSet staticInfluenceSet;
+        staticInfluenceSet.influences.insert(staticInfluences, staticInfluences + staticInfluenceCount);
+        m_staticInfluenceSet = staticInfluenceSet;
+    }
+    m_isStatic = isStatic;
+    m_boundingVolume = boundingVolume;
+    m_vertices.swap(vertices);
+    m_vertexColors.swap(colors);
+    m_textureCoordinates.swap(textureCoordinates);
+    m_influences.swap(influences);
+    m_morphTargets.swap(morphTargets);
+    m_currentVertexId = vertexCount;
+    m_lodCollapses.clear();
+    rebuildBoneVertexRanges();
+    rebuildBonePalette();
+}
+
+static void appendShiftedOffsets(
+    CalCoreMorphTarget::VertexOffsetArray& offsets,
+    const CalCoreMorphTarget::VertexOffsetArray& source,
+    size_t vertexBase
+) {
+    for (auto o = source.begin(); o != source.end(); ++o) {
+        offsets.push_back(VertexOffset(vertexBase + o->vertexId, o->position, o->normal));
+    }
+}
+
+void CalCoreSubmesh::appendSubmesh(const CalCoreSubmesh& other) {
+    cal3d::verify(&other != this, "A submesh cannot be appended to itself");
+
+    const bool influenceSets = hasInfluenceSets() || other.hasInfluenceSets();
+    const size_t base = m_vertices.size();
+    const size_t otherVertexCount = other.m_vertices.size();
+    const size_t vertexCount = base + otherVertexCount;
+    if (!otherVertexCount) {
         return;
     }
 
-    std::vector<Face> newFaces(m_faces.size());
-    size_t indexCount = m_faces.size() * 3;
+    VectorVertex vertices(vertexCount);
+    std::copy(m_vertices.begin(), m_vertices.end(), vertices.begin());
+    std::copy(other.m_vertices.begin(), other.m_vertices.end(), vertices.begin() + base);
+
+    std::vector<CalColor32> colors(m_vertexColors);
+    colors.insert(colors.end(), other.m_vertexColors.begin(), other.m_vertexColors.end());
+
+    // the side without texture coordinates gets (0, 0)
+    VectorTextureCoordinate textureCoordinates;
+    if (hasTextureCoordinates() || other.hasTextureCoordinates()) {
+        textureCoordinates = m_textureCoordinates;
+        textureCoordinates.resize(base);
+        textureCoordinates.insert(textureCoordinates.end(), other.m_textureCoordinates.begin(), other.m_textureCoordinates.end());
+        textureCoordinates.resize(vertexCount);
+    }
+
+    InfluenceVector influences(m_influences);
+    influences.insert(influences.end(), other.m_influences.begin(), other.m_influences.end());
+
+    // targets of the same name become one
+    MorphTargetArray morphTargets;
+    std::vector<bool> joined(other.m_morphTargets.size(), false);
+    for (auto t = m_morphTargets.begin(); t != m_morphTargets.end(); ++t) {
+        CalCoreMorphTarget::VertexOffsetArray offsets((*t)->vertexOffsets);
+        for (size_t u = 0; u < other.m_morphTargets.size(); ++u) {
+            if (!joined[u] && other.m_morphTargets[u]->name == (*t)->name) {
+                appendShiftedOffsets(offsets, other.m_morphTargets[u]->vertexOffsets, base);
+                joined[u] = true;
+                break;
+            }
+        }
+        morphTargets.push_back(CalCoreMorphTargetPtr(new CalCoreMorphTarget((*t)->name, vertexCount, offsets)));
+    }
+    for (size_t u = 0; u < other.m_morphTargets.size(); ++u) {
+        if (!joined[u]) {
+            CalCoreMorphTarget::VertexOffsetArray offsets;
+            appendShiftedOffsets(offsets, other.m_morphTargets[u]->vertexOffsets, base);
+            morphTargets.push_back(CalCoreMorphTargetPtr(new CalCoreMorphTarget(other.m_morphTargets[u]->name, vertexCount, offsets)));
+        }
+    }
+
+    if (!base) {
+        m_isStatic = other.m_isStatic;
+        m_staticInfluenceSet = other.m_staticInfluenceSet;
+        m_boundingVolume = other.m_boundingVolume;
+    } else {
+        m_isStatic = m_isStatic && other.m_isStatic && m_staticInfluenceSet == other.m_staticInfluenceSet;
+        m_boundingVolume.min.x = std::min(m_boundingVolume.min.x, other.m_boundingVolume.min.x);
+        m_boundingVolume.min.y = std::min(m_boundingVolume.min.y, other.m_boundingVolume.min.y);
+        m_boundingVolume.min.z = std::min(m_boundingVolume.min.z, other.m_boundingVolume.min.z);
+        m_boundingVolume.max.x = std::max(m_boundingVolume.max.x, other.m_boundingVolume.max.x);
+        m_boundingVolume.max.y = std::max(m_boundingVolume.max.y, other.m_boundingVolume.max.y);
+        m_boundingVolume.max.z = std::max(m_boundingVolume.max.z, other.m_boundingVolume.max.z);
+    }
+
+    m_vertices.swap(vertices);
+    m_vertexColors.swap(colors);
+    m_textureCoordinates.swap(textureCoordinates);
+    m_influences.swap(influences);
+    m_morphTargets.swap(morphTargets);
+    m_currentVertexId = vertexCount;
+
+    if (vertexCount > 65536) {
+        setIndexSize(4);
+    }
+    const size_t otherFaceCount = other.getFaceCount();
+    if (m_wideIndices) {
+        m_wideFaces.reserve(m_wideFaces.size() + otherFaceCount);
+    } else {
+        m_faces.reserve(m_faces.size() + otherFaceCount);
+    }
+    for (size_t f = 0; f < otherFaceCount; ++f) {
+        const WideFace face = other.getFace(f);
+        addFace(WideFace(base + face.vertexId[0], base + face.vertexId[1], base + face.vertexId[2]));
+    }
+
+    discardClusters();
+    m_lodCollapses.clear();
+    rebuildBoneVertexRanges();
+    rebuildBonePalette();
+    // rebuildBonePalette() only redoes sets this side already had
+    if (influenceSets && !hasInfluenceSets()) {
+        dedupeInfluenceSets();
+    }
+}
 
-    std::vector<CalIndex> mapping(m_vertices.size(), -1); // old -> new
-    std::vector<bool> populated(m_vertices.size(), false); // used index
-    const CalIndex* oldIndices = m_faces[0].vertexId;
-    CalIndex* newIndices = newFaces[0].vertexId;
+// Numbers vertices in the order faces first use them; returns how many
+// are used.
+template<typename FaceType>
+static unsigned renumberFaceVertices(std::vector<FaceType>& faces, std::vector<unsigned>& mapping) {
     unsigned int outputVertexCount = 0;
+    for (auto f = faces.begin(); f != faces.end(); ++f) {
+        for (int k = 0; k < 3; ++k) {
+            const unsigned oldIndex = f->vertexId[k];
+            if (mapping[oldIndex] == static_cast<unsigned>(-1)) {
+                mapping[oldIndex] = outputVertexCount++;
+            }
+            f->vertexId[k] = mapping[oldIndex];
+        }
+    }
+    return outputVertexCount;
+}
 
-    for (size_t i = 0; i < indexCount; ++i) {
-        CalIndex oldIndex = oldIndices[i];
-        CalIndex newIndex = mapping[oldIndex];
-        if (!populated[oldIndex]) {
-            populated[oldIndex] = true;
-            mapping[oldIndex] = static_cast<CalIndex> (outputVertexCount);
-            newIndex = static_cast<CalIndex> (outputVertexCount);
-            outputVertexCount++;
+template<typename FaceType>
+static void remapFaceVertices(std::vector<FaceType>& faces, const std::vector<unsigned>& mapping) {
+    for (auto f = faces.begin(); f != faces.end(); ++f) {
+        for (int i = 0; i < 3; ++i) {
+            f->vertexId[i] = mapping[f->vertexId[i]];
         }
-        *newIndices = newIndex;
-        newIndices++;
+    }
+}
+
+// Drops faces using a vertex twice; returns how many.
+template<typename FaceType>
+static size_t removeDegenerateFaces(std::vector<FaceType>& faces) {
+    const size_t faceCount = faces.size();
+    faces.erase(std::remove_if(faces.begin(), faces.end(), [](const FaceType& face) {
+        return face.vertexId[0] == face.vertexId[1]
+            || face.vertexId[1] == face.vertexId[2]
+            || face.vertexId[2] == face.vertexId[0];
+    }), faces.end());
+    return faceCount - faces.size();
+}
+
+void CalCoreSubmesh::renumberIndices() {
+    if (!getFaceCount()) {
+        return;
     }
 
-    m_faces.swap(newFaces);
+    std::vector<unsigned> mapping(m_vertices.size(), -1); // old -> new, -1 if unused
+    const unsigned int outputVertexCount = m_wideIndices
+        ? renumberFaceVertices(m_wideFaces, mapping)
+        : renumberFaceVertices(m_faces, mapping);
 
     // now that the new indices are in place, reorder the vertices
+    std::vector<unsigned> newToOld(outputVertexCount);
+    for (size_t oldIndex = 0; oldIndex < mapping.size(); ++oldIndex) {
+        if (mapping[oldIndex] != static_cast<unsigned>(-1)) {
+            newToOld[mapping[oldIndex]] = oldIndex;
+        }
+    }
+    permuteVertices(newToOld);
 
-    auto oldInfluences = extractInfluenceVector(m_influences);
-    assert(m_vertices.size() == m_vertexColors.size());
-    assert(m_vertices.size() == oldInfluences.size());
+    m_minimumVertexBufferSize = outputVertexCount;
+}
 
-    VectorVertex newVertices(outputVertexCount);
-    std::vector<CalColor32> newColors(outputVertexCount);
-    InfluenceVectorVector newInfluences(outputVertexCount);
-    VectorTextureCoordinate newTexCoords(hasTextureCoordinates() ? outputVertexCount : 0); // may be empty
+void CalCoreSubmesh::sortVerticesByBone() {
+    const size_t vertexCount = m_vertices.size();
+    if (m_influences.empty()) {
+        return;
+    }
 
-    for (size_t oldIndex = 0; oldIndex < mapping.size(); ++oldIndex) {
-        CalIndex newIndex = mapping[oldIndex];
-        if (!populated[oldIndex]) {
-            continue;
+    // each vertex's first influence, which is its dominant one
+    std::vector<unsigned> starts;
+    findInfluenceRuns(m_influences, vertexCount, starts);
+
+    // rank influence sets in InfluenceSet order so equal sets sort together
+    std::vector<InfluenceSet> sets(vertexCount);
+    std::map<InfluenceSet, unsigned> setRanks;
+    for (size_t i = 0; i < vertexCount; ++i) {
+        sets[i].influences.insert(m_influences.begin() + starts[i], m_influences.begin() + starts[i + 1]);
+        setRanks.insert(std::make_pair(sets[i], 0u));
+    }
+    unsigned rank = 0;
+    for (auto i = setRanks.begin(); i != setRanks.end(); ++i) {
+        i->second = rank++;
+    }
+
+    // (dominant bone, set rank, old index): ties keep their old order
+    typedef std::pair<std::pair<unsigned, unsigned>, unsigned> VertexKey;
+    std::vector<VertexKey> keys(vertexCount);
+    for (size_t i = 0; i < vertexCount; ++i) {
+        const unsigned dominantBone = m_influences[starts[i]].boneId;
+        keys[i] = VertexKey(std::make_pair(dominantBone, setRanks[sets[i]]), i);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<unsigned> newToOld(vertexCount);
+    std::vector<unsigned> mapping(vertexCount); // old -> new
+    for (size_t newIndex = 0; newIndex < vertexCount; ++newIndex) {
+        newToOld[newIndex] = keys[newIndex].second;
+        mapping[keys[newIndex].second] = static_cast<unsigned>(newIndex);
+    }
+
+    remapFaceVertices(m_faces, mapping);
+    remapFaceVertices(m_wideFaces, mapping);
+    permuteVertices(newToOld);
+}
+
+// Buckets vertices by position cells 2 * epsilon wide, so every point
+// within epsilon of p lies in p's cell or the neighbour on the nearer
+// side along each axis: eight cells.  With epsilon 0 a cell is one exact
+// position.  Cells are hashed, so distinct ones may share a bucket;
+// that only adds candidates.
+class VertexWeldGrid {
+public:
+    static const unsigned None = ~0u;
+
+    VertexWeldGrid(float epsilon, size_t vertexCount)
+        : m_inverseCellSize(epsilon > 0.0f ? 0.5f / epsilon : 0.0f)
+        , m_next(vertexCount, None)
+    {
+        m_heads.reserve(vertexCount);
+    }
+
+    // Writes the buckets near p, p's own first, and returns how many.
+    unsigned nearBuckets(const CalPoint4& p, unsigned long long buckets[8]) const {
+        const float coordinates[3] = { p.x, p.y, p.z };
+        long long cell[3];
+        long long side[3];
+        for (int k = 0; k < 3; ++k) {
+            if (m_inverseCellSize == 0.0f) {
+                // + 0.0f folds -0 into 0
+                const float c = coordinates[k] + 0.0f;
+                unsigned bits;
+                memcpy(&bits, &c, sizeof(bits));
+                cell[k] = bits;
+                side[k] = 0;
+            } else {
+                // clamped so the cast can't overflow; far cells sharing
+                // the bound only add candidates
+                const float CellLimit = 4.0e18f;
+                float scaled = coordinates[k] * m_inverseCellSize;
+                if (!(scaled > -CellLimit)) {
+                    scaled = -CellLimit;
+                } else if (scaled > CellLimit) {
+                    scaled = CellLimit;
+                }
+                const float lower = floorf(scaled);
+                cell[k] = static_cast<long long>(lower);
+                side[k] = scaled - lower < 0.5f ? -1 : 1;
+            }
+        }
+        if (m_inverseCellSize == 0.0f) {
+            buckets[0] = hash(cell[0], cell[1], cell[2]);
+            return 1;
+        }
+        for (unsigned i = 0; i < 8; ++i) {
+            buckets[i] = hash(
+                cell[0] + ((i & 1) ? side[0] : 0),
+                cell[1] + ((i & 2) ? side[1] : 0),
+                cell[2] + ((i & 4) ? side[2] : 0));
         }
+        return 8;
+    }
+
+    unsigned first(unsigned long long bucket) const {
+        const auto head = m_heads.find(bucket);
+        return head == m_heads.end() ? None : head->second;
+    }
 
-        newVertices[newIndex] = m_vertices[oldIndex];
-        newColors[newIndex] = m_vertexColors[oldIndex];
-        newInfluences[newIndex] = oldInfluences[oldIndex];
-        if (!newTexCoords.empty()) {
-            newTexCoords[newIndex] = m_textureCoordinates[oldIndex];
+    unsigned next(unsigned vertex) const {
+        return m_next[vertex];
+    }
+
+    void add(unsigned long long bucket, unsigned vertex) {
+        const auto head = m_heads.insert(std::make_pair(bucket, vertex));
+        if (!head.second) {
+            m_next[vertex] = head.first->second;
+            head.first->second = vertex;
         }
     }
 
-    MorphTargetArray newMorphTargets;
+private:
+    static unsigned long long hash(long long x, long long y, long long z) {
+        return static_cast<unsigned long long>(x) * 73856093ull
+             ^ static_cast<unsigned long long>(y) * 19349663ull
+             ^ static_cast<unsigned long long>(z) * 83492791ull;
+    }
+
+    float m_inverseCellSize;
+    std::unordered_map<unsigned long long, unsigned> m_heads; // bucket -> last vertex added
+    std::vector<unsigned> m_next;
+};
 
-    for (size_t i = 0; i < m_morphTargets.size(); ++i) {
-        const auto& mt = m_morphTargets[i];
-        CalCoreMorphTarget::VertexOffsetArray newOffsets;
-        for (auto vo = mt->vertexOffsets.begin(); vo != mt->vertexOffsets.end(); ++vo) {
-            CalIndex newIndex = mapping[vo->vertexId];
-            if (populated[vo->vertexId]) {
-                newOffsets.push_back(VertexOffset(newIndex, vo->position, vo->normal));
+const unsigned VertexWeldGrid::None;
+
+static bool within(float a, float b, float epsilon) {
+    return fabsf(a - b) <= epsilon;
+}
+
+static bool within(const CalVector4& a, const CalVector4& b, float epsilon) {
+    return within(a.x, b.x, epsilon) && within(a.y, b.y, epsilon) && within(a.z, b.z, epsilon);
+}
+
+// Only vertices already kept are candidates, so each vertex welds onto
+// the first kept vertex it matches, and every merged group keeps its
+// first vertex's attributes.
+CalCoreSubmesh::WeldReport CalCoreSubmesh::weldVertices(float epsilon) {
+    cal3d::verify(epsilon >= 0.0f && epsilon <= std::numeric_limits<float>::max(), "weld epsilon must be finite and not negative");
+    cal3d::verify(validateSubmesh(), "cannot weld a submesh whose faces reference missing vertices");
+
+    const size_t vertexCount = m_vertices.size();
+    WeldReport report;
+    report.verticesBefore = vertexCount;
+    report.verticesAfter = vertexCount;
+    report.facesRemoved = 0;
+    if (vertexCount < 2) {
+        return report;
+    }
+
+    // each vertex's influences by bone, so their order doesn't matter
+    std::vector<unsigned> starts;
+    findInfluenceRuns(m_influences, vertexCount, starts);
+    std::vector<std::pair<unsigned, float> > influences(m_influences.size());
+    for (size_t i = 0; i < m_influences.size(); ++i) {
+        influences[i] = std::make_pair(m_influences[i].boneId, m_influences[i].weight);
+    }
+    for (size_t v = 0; v < vertexCount; ++v) {
+        std::sort(influences.begin() + starts[v], influences.begin() + starts[v + 1]);
+    }
+
+    // each vertex's morph offsets as (target, index into its offsets), by
+    // target: CSR over vertices, only as big as the offsets themselves
+    const size_t targetCount = m_morphTargets.size();
+    std::vector<unsigned> morphStarts(vertexCount + 1, 0);
+    for (size_t t = 0; t < targetCount; ++t) {
+        const CalCoreMorphTarget::VertexOffsetArray& targetOffsets = m_morphTargets[t]->vertexOffsets;
+        for (size_t i = 0; i < targetOffsets.size(); ++i) {
+            ++morphStarts[targetOffsets[i].vertexId + 1];
+        }
+    }
+    for (size_t v = 1; v <= vertexCount; ++v) {
+        morphStarts[v] += morphStarts[v - 1];
+    }
+    std::vector<std::pair<unsigned, unsigned> > morphOffsets(morphStarts.back());
+    std::vector<unsigned> cursors(morphStarts.begin(), morphStarts.end() - 1);
+    for (size_t t = 0; t < targetCount; ++t) {
+        const CalCoreMorphTarget::VertexOffsetArray& targetOffsets = m_morphTargets[t]->vertexOffsets;
+        for (size_t i = 0; i < targetOffsets.size(); ++i) {
+            morphOffsets[cursors[targetOffsets[i].vertexId]++] = std::make_pair(unsigned(t), unsigned(i));
+        }
+    }
+
+    auto matches = [&](unsigned a, unsigned b) {
+        if (
+            !within(m_vertices[a].position, m_vertices[b].position, epsilon) ||
+            !within(m_vertices[a].normal, m_vertices[b].normal, epsilon) ||
+            !(m_vertexColors[a] == m_vertexColors[b])
+        ) {
+            return false;
+        }
+        if (hasTextureCoordinates() && (
+            !within(m_textureCoordinates[a].u, m_textureCoordinates[b].u, epsilon) ||
+            !within(m_textureCoordinates[a].v, m_textureCoordinates[b].v, epsilon)
+        )) {
+            return false;
+        }
+        if (starts[a + 1] - starts[a] != starts[b + 1] - starts[b]) {
+            return false;
+        }
+        for (unsigned i = starts[a], j = starts[b]; i < starts[a + 1]; ++i, ++j) {
+            if (influences[i].first != influences[j].first || !within(influences[i].second, influences[j].second, epsilon)) {
+                return false;
+            }
+        }
+        if (morphStarts[a + 1] - morphStarts[a] != morphStarts[b + 1] - morphStarts[b]) {
+            return false;
+        }
+        for (unsigned i = morphStarts[a], j = morphStarts[b]; i < morphStarts[a + 1]; ++i, ++j) {
+            if (morphOffsets[i].first != morphOffsets[j].first) {
+                return false;
+            }
+            const CalCoreMorphTarget::VertexOffsetArray& targetOffsets = m_morphTargets[morphOffsets[i].first]->vertexOffsets;
+            const VertexOffset& offsetA = targetOffsets[morphOffsets[i].second];
+            const VertexOffset& offsetB = targetOffsets[morphOffsets[j].second];
+            if (
+                !within(offsetA.position, offsetB.position, epsilon) ||
+                !within(offsetA.normal, offsetB.normal, epsilon)
+            ) {
+                return false;
             }
         }
-        newMorphTargets.push_back(CalCoreMorphTargetPtr(new CalCoreMorphTarget(mt->name, newVertices.size(), newOffsets)));
+        return true;
+    };
+
+    VertexWeldGrid grid(epsilon, vertexCount);
+    std::vector<unsigned> mapping(vertexCount); // old -> new
+    std::vector<unsigned> newToOld;
+    newToOld.reserve(vertexCount);
+    for (unsigned v = 0; v < vertexCount; ++v) {
+        unsigned long long buckets[8];
+        const unsigned bucketCount = grid.nearBuckets(m_vertices[v].position, buckets);
+        unsigned kept = VertexWeldGrid::None;
+        for (unsigned b = 0; b < bucketCount && kept == VertexWeldGrid::None; ++b) {
+            for (unsigned u = grid.first(buckets[b]); u != VertexWeldGrid::None; u = grid.next(u)) {
+                if (matches(u, v)) {
+                    kept = u;
+                    break;
+                }
+            }
+        }
+        if (kept == VertexWeldGrid::None) {
+            mapping[v] = unsigned(newToOld.size());
+            newToOld.push_back(v);
+            grid.add(buckets[0], v);
+        } else {
+            mapping[v] = mapping[kept];
+        }
+    }
+    report.verticesAfter = newToOld.size();
+    if (report.verticesAfter == vertexCount) {
+        return report;
     }
 
-    m_vertices.swap(newVertices);
-    m_vertexColors.swap(newColors);
-    m_influences = generateInfluenceVector(newInfluences);
-    m_textureCoordinates.swap(newTexCoords);
-    m_morphTargets.swap(newMorphTargets);
+    remapFaceVertices(m_faces, mapping);
+    remapFaceVertices(m_wideFaces, mapping);
+    report.facesRemoved = m_wideIndices
+        ? removeDegenerateFaces(m_wideFaces)
+        : removeDegenerateFaces(m_faces);
+    if (report.facesRemoved) {
+        discardClusters();
+    }
+    permuteVertices(newToOld);
 
-    m_minimumVertexBufferSize = outputVertexCount;
+    m_minimumVertexBufferSize = 0;
+    for (size_t f = 0; f < getFaceCount(); ++f) {
+        const WideFace face = getFace(f);
+        m_minimumVertexBufferSize = std::max<size_t>(m_minimumVertexBufferSize, 1 + *std::max_element(face.vertexId, face.vertexId + 3));
+    }
+    return report;
 }
 
 void CalCoreSubmesh::normalizeNormals() {
@@ -959,15 +2602,25 @@ void CalCoreSubmesh::normalizeNormals() {
 }
 
 void CalCoreSubmesh::sortForBlending() {
-    if (m_faces.empty()) {
+    if (!getFaceCount()) {
         return;
     }
 
-    sortTrianglesBackToFront(
-        m_faces.size(),
-        m_faces[0].vertexId,
-        &m_vertices[0].position.x,
-        sizeof(Vertex) / sizeof(float));
+    if (m_wideIndices) {
+        sortTrianglesBackToFront(
+            m_wideFaces.size(),
+            m_wideFaces[0].vertexId,
+            &m_vertices[0].position.x,
+            sizeof(Vertex) / sizeof(float));
+    } else {
+        sortTrianglesBackToFront(
+            m_faces.size(),
+            m_faces[0].vertexId,
+            &m_vertices[0].position.x,
+            sizeof(Vertex) / sizeof(float));
+    }
+    discardClusters();
+    m_lodCollapses.clear();
 }
 
 CalExportedInfluences CalCoreSubmesh::exportInfluences(unsigned int influenceLimit) {
@@ -1022,431 +2675,575 @@ CalExportedInfluences CalCoreSubmesh::exportInfluences(unsigned int influenceLim
 }
 
 /*
- *  Mesh Polygon Reduction Algorithm from Progressive Mesh code
- *  by Stan Melax (c) 1998
- *  Permission to use any of this code wherever you want is granted..
- *  Although, please do acknowledge authorship if appropriate.
+ *  Quadric error edge collapse (Garland & Heckbert 1997) over flat
+ *  arrays, cheapest collapse first from a heap.
  *
- *  See the header file progmesh.h for a description of this module
- *  Ported to STL & Cal3D by IMVU (c) 2014 - progressive permutation
- *  removed.
+ *  Every collapse moves one position onto a neighbouring position that
+ *  already exists (a half-edge collapse), so surviving vertices keep
+ *  their influences, texture coordinates and morph target offsets
+ *  unchanged.  Vertices sharing a position (the copies on either side of
+ *  a texture seam) move together, each onto the copy it shares a face
+ *  with, so seams can shorten but never open.
  */
 
-/*
- *  For the polygon reduction algorithm we use data structures
- *  that contain a little bit more information than the usual
- *  indexed face set type of data structure.
- *  From a vertex we wish to be able to quickly get the
- *  neighbouring faces and vertices.
- */
+struct SimplifyQuadric {
+    double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
 
-CalCoreSubmesh::Triangle::Triangle(std::vector<reduxVertex *> &vertices, std::vector<Triangle *> &triangles, reduxVertex *v0, reduxVertex *v1, reduxVertex *v2)
-    : parent_vertices(vertices)
-    , parent_triangles(triangles)
-{
-    vertex[0] = v0;
-    vertex[1] = v1;
-    vertex[2] = v2;
-    ComputeNormal();
-    ComputeTB();
-    for (int i = 0; i<3; i++) {
-        vertex[i]->face.push_back(this);
-        for (int j = 0; j<3; j++) if (i != j) {
-            VECTOR_ADD_UNIQUE(vertex[i]->neighbor, vertex[j]);
-        }
-    }
-}
-
-CalCoreSubmesh::Triangle::~Triangle(){
-    int i;
-    VECTOR_REMOVE_VALUE(parent_triangles, this);
-    for (i = 0; i<3; i++) {
-        if (vertex[i])
-        {
-            VECTOR_REMOVE_VALUE(vertex[i]->face, this);
-        }
-    }
-    for (i = 0; i<3; i++) {
-        int i2 = (i + 1) % 3;
-        if (!vertex[i] || !vertex[i2]) continue;
-        vertex[i]->RemoveIfNonNeighbor(vertex[i2]);
-        vertex[i2]->RemoveIfNonNeighbor(vertex[i]);
-    }
-}
-int CalCoreSubmesh::Triangle::HasVertex(reduxVertex *v) {
-    return (v == vertex[0] || v == vertex[1] || v == vertex[2]);
-}
-void CalCoreSubmesh::Triangle::ComputeNormal(){
-    CalVector v0 = vertex[0]->position;
-    CalVector v1 = vertex[1]->position;
-    CalVector v2 = vertex[2]->position;
-    normal = cross((v1 - v0), (v2 - v1));
-    normal.normalize();
-}
-void CalCoreSubmesh::Triangle::ComputeTB(){
-    //Calculate Tangent and Bitangent (AKA binormal)
-
-    float dx1 = vertex[1]->position.x - vertex[0]->position.x;
-    float dx2 = vertex[2]->position.x - vertex[0]->position.x;
-    float dy1 = vertex[1]->position.y - vertex[0]->position.y;
-    float dy2 = vertex[2]->position.y - vertex[0]->position.y;
-    float dz1 = vertex[1]->position.z - vertex[0]->position.z;
-    float dz2 = vertex[2]->position.z - vertex[0]->position.z;
-    
-    float du1 = vertex[1]->u - vertex[0]->u;
-    float du2 = vertex[2]->u - vertex[0]->u;
-    float dv1 = vertex[1]->u - vertex[0]->v;
-    float dv2 = vertex[2]->v - vertex[0]->v;
-        
-    float recip = 1.0f / (du1 * dv2 - du2 * dv1);
-    T = CalVector((dv2 * dx1 - dv1 * dx2) * recip, (dv2 * dy1 - dv1 * dy2) * recip, (dv2 * dz1 - dv1 * dz2) * recip);
-    B = CalVector((du1 * dx2 - du2 * dx1) * recip, (du1 * dy2 - du2 * dy1) * recip, (du1 * dz2 - du2 * dz1) * recip);
-    // this means dot product later only accounts for angular changes
-    // in texture derivative, that'll do for now
-    T.normalize();
-    B.normalize();
-}
-void CalCoreSubmesh::Triangle::ReplaceVertex(reduxVertex *vold, reduxVertex *vnew) {
-    assert(vold && vnew);
-    assert(vold == vertex[0] || vold == vertex[1] || vold == vertex[2]);
-    assert(vnew != vertex[0] && vnew != vertex[1] && vnew != vertex[2]);
-    if (vold == vertex[0]){
-        vertex[0] = vnew;
-    }
-    else if (vold == vertex[1]){
-        vertex[1] = vnew;
-    }
-    else {
-        assert(vold == vertex[2]);
-        vertex[2] = vnew;
-    }
-    int i;
-    VECTOR_REMOVE_VALUE(vold->face, this);
-    assert(!VECTOR_CONTAINS(vnew->face, this));
-    vnew->face.push_back(this);
-    for (i = 0; i<3; i++) {
-        vold->RemoveIfNonNeighbor(vertex[i]);
-        vertex[i]->RemoveIfNonNeighbor(vold);
-    }
-    for (i = 0; i<3; i++) {
-        assert(VECTOR_CONTAINS(vertex[i]->face, this));
-        for (int j = 0; j<3; j++) if (i != j) {
-            VECTOR_ADD_UNIQUE(vertex[i]->neighbor, vertex[j]);
-        }
-    }
-    ComputeNormal();
-    ComputeTB();
-}
-
-CalCoreSubmesh::reduxVertex::reduxVertex(std::vector<reduxVertex *> &vertices, const CalPoint4 &p, int _id)
-    : parent_vertices(vertices)
-{
-    position.x = p.x;
-    position.y = p.y;
-    position.z = p.z;
-    u = v = 0.0f;
-    id = _id;
-}
-CalCoreSubmesh::reduxVertex::reduxVertex(std::vector<reduxVertex *> &vertices, const CalPoint4 &p, float _u, float _v, int _id)
-    : parent_vertices(vertices)
-{
-    position.x = p.x;
-    position.y = p.y;
-    position.z = p.z;
-    u = _u;
-    v = _v;
-    id = _id;
-}
+    SimplifyQuadric()
+        : a2(0), ab(0), ac(0), ad(0), b2(0), bc(0), bd(0), c2(0), cd(0), d2(0)
+    {}
 
-CalCoreSubmesh::reduxVertex::~reduxVertex(){
-    assert(face.size() == 0);
-    while (neighbor.size()) {
-        VECTOR_REMOVE_VALUE(neighbor[0]->neighbor, this);
-        VECTOR_REMOVE_VALUE(neighbor, neighbor[0]);
+    // the squared distance to the plane n.p + d = 0, times weight
+    void addPlane(const CalVector& n, float d, float weight) {
+        a2 += weight * n.x * n.x; ab += weight * n.x * n.y; ac += weight * n.x * n.z; ad += weight * n.x * d;
+        b2 += weight * n.y * n.y; bc += weight * n.y * n.z; bd += weight * n.y * d;
+        c2 += weight * n.z * n.z; cd += weight * n.z * d;
+        d2 += weight * d * d;
     }
-    VECTOR_REMOVE_VALUE(parent_vertices, this);
-}
 
-bool CalCoreSubmesh::reduxVertex::isBorder() {
-    unsigned int i, j;
-    
-    for(i=0; i< neighbor.size(); i++) {
-        int count = 0;
-        for(j=0; j< face.size(); j++) {
-            if(face[j]->HasVertex(neighbor[i])) {
-                count++;
+    void add(const SimplifyQuadric& q) {
+        a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+        b2 += q.b2; bc += q.bc; bd += q.bd;
+        c2 += q.c2; cd += q.cd;
+        d2 += q.d2;
+    }
+
+    double error(const CalVector& p) const {
+        const double x = p.x, y = p.y, z = p.z;
+        return x * (a2 * x + 2 * (ab * y + ac * z + ad))
+             + y * (b2 * y + 2 * (bc * z + bd))
+             + z * (c2 * z + 2 * cd)
+             + d2;
+    }
+};
+
+// Cheapest error first; entries whose version is stale are skipped.
+struct SimplifyQueueEntry {
+    double error;
+    unsigned group;
+    unsigned target;
+    unsigned version;
+
+    bool operator<(const SimplifyQueueEntry& rhs) const {
+        return error > rhs.error || (error == rhs.error && group > rhs.group);
+    }
+};
+
+class QuadricSimplifier {
+public:
+    explicit QuadricSimplifier(const CalCoreSubmesh& submesh);
+
+    size_t getFaceCount() const {
+        return liveFaceCount;
+    }
+
+    // Performs the cheapest remaining collapse if its error is at most
+    // maxError.
+    bool collapseNext(double maxError);
+
+    // The faces left, in either width.
+    template<typename FaceType>
+    void getFaces(std::vector<FaceType>& out) const {
+        out.clear();
+        out.reserve(liveFaceCount);
+        for (size_t f = 0; f < faces.size(); ++f) {
+            if (faceAlive[f]) {
+                out.push_back(FaceType(faces[f].vertexId[0], faces[f].vertexId[1], faces[f].vertexId[2]));
             }
         }
-        assert(count > 0);
-        if(count==1) {
-            return true;
+    }
+
+private:
+    static const unsigned NoVertex = ~0u;
+    static const float BorderWeight;
+
+    struct Neighbour {
+        unsigned group;
+        unsigned faceCount;
+        unsigned lastFace;
+    };
+
+    const CalCoreSubmesh::VectorVertex& vertices;
+    CalCoreSubmesh::VectorWideFace faces; // either width, widened
+    std::vector<unsigned char> faceAlive;
+    size_t liveFaceCount;
+
+    // CSR: original vertex -> faces
+    std::vector<unsigned> vertexFaceStarts;
+    std::vector<unsigned> vertexFaces;
+    // Original vertices whose faces now use each vertex, as linked lists.
+    std::vector<unsigned> memberNext;
+    std::vector<unsigned> memberTail;
+    // Vertices at the same position form a group, named after its first
+    // vertex; wedgeNext links the rest.
+    std::vector<unsigned> groupOf;
+    std::vector<unsigned> wedgeNext;
+
+    std::vector<SimplifyQuadric> quadrics;
+    std::vector<unsigned> versions;
+    std::vector<unsigned char> groupAlive;
+    std::priority_queue<SimplifyQueueEntry> queue;
+
+    std::vector<Neighbour> neighbours;
+    std::vector<unsigned> wedgeTargets;
+    std::vector<unsigned> touched;
+    std::vector<unsigned> touchedStamp;
+    unsigned stamp;
+
+    CalVector position(unsigned vertex) const {
+        const CalPoint4& p = vertices[vertex].position;
+        return CalVector(p.x, p.y, p.z);
+    }
+
+    template<typename F>
+    void forEachFace(unsigned vertex, F f) const {
+        for (unsigned m = vertex; m != NoVertex; m = memberNext[m]) {
+            for (unsigned i = vertexFaceStarts[m]; i < vertexFaceStarts[m + 1]; ++i) {
+                if (faceAlive[vertexFaces[i]]) {
+                    f(vertexFaces[i]);
+                }
+            }
         }
     }
-    return false;
-}
 
-void CalCoreSubmesh::reduxVertex::RemoveIfNonNeighbor(reduxVertex *n) {
-    // removes n from neighbor list if n isn't a neighbor.
-    if (!VECTOR_CONTAINS(neighbor, n)) return;
-    for (unsigned int i = 0; i<face.size(); i++) {
-        if (face[i]->HasVertex(n)) return;
-    }
-    VECTOR_REMOVE_VALUE(neighbor, n);
-}
-
-float CalCoreSubmesh::ComputeEdgeCollapseCost(reduxVertex *u, reduxVertex *v) {
-    // if we collapse edge uv by moving u to v then how 
-    // much different will the model change, i.e. how much "error".
-    // Texture, vertex normal, and border vertex code was removed
-    // to keep this demo as simple as possible.
-    // The method of determining cost was designed in order 
-    // to exploit small and coplanar regions for
-    // effective polygon reduction.
-    // Is is possible to add some checks here to see if "folds"
-    // would be generated.  i.e. normal of a remaining face gets
-    // flipped.  I never seemed to run into this problem and
-    // therefore never added code to detect this case.
-    unsigned int i;
-    float edgelength = (v->position - u->position).length();
-    float curvature = 0;
-
-    // find the "sides" triangles that are on the edge uv
-    std::vector<Triangle *> sides;
-    for (i = 0; i<u->face.size(); i++) {
-        if (u->face[i]->HasVertex(v)){
-            sides.push_back(u->face[i]);
-        }
-    }
-
-    // use the triangle facing most away from the sides 
-    // to determine our curvature term
-    for (i = 0; i<u->face.size(); i++) {
-        float mincurv = 1.0f; // curve for face i and closer side to it
-        for (unsigned int j = 0; j<sides.size(); j++) {
-            // use dot product of face normals.
-            float dotprod = dot(u->face[i]->normal, sides[j]->normal);
-            float dotprodT = dot(u->face[i]->T, sides[j]->T);
-            float dotprodB = dot(u->face[i]->B, sides[j]->B);
-            mincurv = std::min(mincurv, (1.0f - dotprodT) / 8.0f + (1.0f - dotprodB) / 8.0f + (1.0f - dotprod) / 2.0f);
-        }
-        curvature = std::max(curvature, mincurv);
+    template<typename F>
+    void forEachGroupFace(unsigned group, F f) const {
+        for (unsigned w = group; w != NoVertex; w = wedgeNext[w]) {
+            forEachFace(w, f);
+        }
     }
-    
-    // the more coplanar the lower the curvature term 
-    // but adjust for border adjacency
-    bool uedge = u->isBorder();
-    bool vedge = v->isBorder();
-    if(u->face.size() == 1) {
-        curvature += 5.0;
-        m_isolateds++;
+
+    CalVector faceNormal(const CalCoreSubmesh::WideFace& face) const {
+        const CalVector p0 = position(face.vertexId[0]);
+        return cross(position(face.vertexId[1]) - p0, position(face.vertexId[2]) - p0);
+    }
+
+    void gatherNeighbours(unsigned group);
+    bool mapWedges(unsigned group, unsigned target);
+    bool flips(unsigned group, unsigned target) const;
+    void evaluate(unsigned group);
+    void collapse(unsigned group, unsigned target);
+};
+
+const unsigned QuadricSimplifier::NoVertex;
+const float QuadricSimplifier::BorderWeight = 10.0f;
+
+QuadricSimplifier::QuadricSimplifier(const CalCoreSubmesh& submesh)
+    : vertices(submesh.getVectorVertex())
+    , faces(submesh.getFaceCount())
+    , faceAlive(submesh.getFaceCount(), 1)
+    , liveFaceCount(submesh.getFaceCount())
+    , stamp(0)
+{
+    const unsigned vertexCount = vertices.size();
+    for (size_t f = 0; f < faces.size(); ++f) {
+        faces[f] = submesh.getFace(f);
+    }
+
+    // group vertices by exact position
+    std::vector<unsigned> byPosition(vertexCount);
+    for (unsigned v = 0; v < vertexCount; ++v) {
+        byPosition[v] = v;
+    }
+    std::sort(byPosition.begin(), byPosition.end(), [&](unsigned a, unsigned b) {
+        const CalPoint4& pa = vertices[a].position;
+        const CalPoint4& pb = vertices[b].position;
+        if (pa.x != pb.x) return pa.x < pb.x;
+        if (pa.y != pb.y) return pa.y < pb.y;
+        if (pa.z != pb.z) return pa.z < pb.z;
+        return a < b;
+    });
+    groupOf.resize(vertexCount);
+    wedgeNext.assign(vertexCount, NoVertex);
+    for (unsigned i = 0; i < vertexCount; ++i) {
+        const unsigned v = byPosition[i];
+        const unsigned previous = i > 0 ? byPosition[i - 1] : v;
+        const CalPoint4& p = vertices[v].position;
+        const CalPoint4& q = vertices[previous].position;
+        if (i > 0 && p.x == q.x && p.y == q.y && p.z == q.z) {
+            groupOf[v] = groupOf[previous];
+            wedgeNext[previous] = v;
+        } else {
+            groupOf[v] = v;
+        }
     }
-    else if (u->face.size() == 2) {
-        if( matchFaces(u->face[0], u->face[1]) ) {
-            curvature += 5.0;
-            m_isolateds++;
+
+    vertexFaceStarts.assign(vertexCount + 1, 0);
+    for (size_t f = 0; f < faces.size(); ++f) {
+        const CalIndex32* ix = faces[f].vertexId;
+        if (groupOf[ix[0]] == groupOf[ix[1]] || groupOf[ix[1]] == groupOf[ix[2]] || groupOf[ix[2]] == groupOf[ix[0]]) {
+            faceAlive[f] = 0;
+            --liveFaceCount;
+            continue;
+        }
+        for (int k = 0; k < 3; ++k) {
+            ++vertexFaceStarts[ix[k] + 1];
         }
     }
-    if(uedge) {
-        curvature += 4.5;
-        if(vedge) {
-            curvature -= 2.75;
+    for (unsigned v = 0; v < vertexCount; ++v) {
+        vertexFaceStarts[v + 1] += vertexFaceStarts[v];
+    }
+    vertexFaces.resize(vertexFaceStarts.back());
+    std::vector<unsigned> cursors(vertexFaceStarts.begin(), vertexFaceStarts.end() - 1);
+    for (size_t f = 0; f < faces.size(); ++f) {
+        if (faceAlive[f]) {
+            for (int k = 0; k < 3; ++k) {
+                vertexFaces[cursors[faces[f].vertexId[k]]++] = f;
+            }
         }
     }
-    return edgelength * curvature;
-}
 
-bool CalCoreSubmesh::matchFaces(Triangle *t0, Triangle *t1)
-{
-    if( (t0->vertex[0] == t1->vertex[0] || t0->vertex[0] == t1->vertex[1] || t0->vertex[0] == t1->vertex[2]) &&
-        (t0->vertex[1] == t1->vertex[0] || t0->vertex[1] == t1->vertex[1] || t0->vertex[1] == t1->vertex[2]) &&
-        (t0->vertex[2] == t1->vertex[0] || t0->vertex[2] == t1->vertex[1] || t0->vertex[2] == t1->vertex[2]) ) {
-        return true;
+    memberNext.assign(vertexCount, NoVertex);
+    memberTail.resize(vertexCount);
+    for (unsigned v = 0; v < vertexCount; ++v) {
+        memberTail[v] = v;
     }
-    return false;
-}
 
-bool CalCoreSubmesh::ComputeEdgeCostAtVertex(reduxVertex *v) {
-    // compute the edge collapse cost for all edges that start
-    // from vertex v.  Since we are only interested in reducing
-    // the object by selecting the min cost edge at each step, we
-    // only cache the cost of the least cost edge at this vertex
-    // (in member variable collapse) as well as the value of the 
-    // cost (in member variable objdist).
-    if (v->neighbor.size() == 0) {
-        // v doesn't have neighbors so it costs nothing to collapse
-        v->collapse = NULL;
-        v->objdist = -0.01f;
-        return true;
+    quadrics.resize(vertexCount);
+    versions.assign(vertexCount, 0);
+    groupAlive.resize(vertexCount);
+    touchedStamp.assign(vertexCount, 0);
+    for (unsigned v = 0; v < vertexCount; ++v) {
+        groupAlive[v] = groupOf[v] == v;
     }
-    v->objdist = 1000000;
-    v->collapse = NULL;
-    if(v->neighbor.size() > 25) {
-        return false; // abort
+
+    for (size_t f = 0; f < faces.size(); ++f) {
+        if (faceAlive[f]) {
+            CalVector n = faceNormal(faces[f]);
+            if (n.length() > 0.0f) {
+                n.normalize();
+                const float d = -dot(n, position(faces[f].vertexId[0]));
+                for (int k = 0; k < 3; ++k) {
+                    quadrics[groupOf[faces[f].vertexId[k]]].addPlane(n, d, 1.0f);
+                }
+            }
+        }
+    }
+
+    // Edges with a single face are borders: hold them in place with a
+    // plane through the edge, perpendicular to the face.
+    for (unsigned g = 0; g < vertexCount; ++g) {
+        if (!groupAlive[g]) {
+            continue;
+        }
+        gatherNeighbours(g);
+        for (auto n = neighbours.begin(); n != neighbours.end(); ++n) {
+            if (n->faceCount != 1 || n->group < g) {
+                continue;
+            }
+            const CalVector edge = position(n->group) - position(g);
+            CalVector normal = cross(edge, faceNormal(faces[n->lastFace]));
+            if (normal.length() > 0.0f) {
+                normal.normalize();
+                const float d = -dot(normal, position(g));
+                quadrics[g].addPlane(normal, d, BorderWeight);
+                quadrics[n->group].addPlane(normal, d, BorderWeight);
+            }
+        }
     }
-    // search all neighboring edges for "least cost" edge
-    for (unsigned int i = 0; i<v->neighbor.size(); i++) {
-        float dist;
-        dist = ComputeEdgeCollapseCost(v, v->neighbor[i]);
-        if (dist<v->objdist) {
-            v->collapse = v->neighbor[i];  // candidate for edge collapse
-            v->objdist = dist;             // cost of the collapse
+
+    for (unsigned g = 0; g < vertexCount; ++g) {
+        if (groupAlive[g]) {
+            evaluate(g);
         }
     }
-    return true;
 }
 
-bool CalCoreSubmesh::ComputeAllEdgeCollapseCosts() {
-    // For all the edges, compute the difference it would make
-    // to the model if it was collapsed.  The least of these
-    // per vertex is cached in each vertex object.
-    for (unsigned int i = 0; i<vertices.size(); i++) {
-        if(! ComputeEdgeCostAtVertex(vertices[i])) {
-            return false; // abort
+void QuadricSimplifier::gatherNeighbours(unsigned group) {
+    neighbours.clear();
+    forEachGroupFace(group, [&](unsigned f) {
+        for (int k = 0; k < 3; ++k) {
+            const unsigned g = groupOf[faces[f].vertexId[k]];
+            if (g == group) {
+                continue;
+            }
+            auto n = neighbours.begin();
+            while (n != neighbours.end() && n->group != g) {
+                ++n;
+            }
+            if (n == neighbours.end()) {
+                Neighbour added = { g, 1, f };
+                neighbours.push_back(added);
+            } else {
+                ++n->faceCount;
+                n->lastFace = f;
+            }
+        }
+    });
+}
+
+// Picks, for each vertex of group, the vertex of target it shares faces
+// with; fails if one has faces but no such vertex, or more than one.
+bool QuadricSimplifier::mapWedges(unsigned group, unsigned target) {
+    wedgeTargets.clear();
+    for (unsigned w = group; w != NoVertex; w = wedgeNext[w]) {
+        unsigned mapped = NoVertex;
+        bool hasFaces = false;
+        bool consistent = true;
+        forEachFace(w, [&](unsigned f) {
+            hasFaces = true;
+            for (int k = 0; k < 3; ++k) {
+                const unsigned v = faces[f].vertexId[k];
+                if (groupOf[v] == target) {
+                    consistent = consistent && (mapped == NoVertex || mapped == v);
+                    mapped = v;
+                }
+            }
+        });
+        if (!consistent || (hasFaces && mapped == NoVertex)) {
+            return false;
         }
+        wedgeTargets.push_back(mapped);
     }
     return true;
 }
 
-void CalCoreSubmesh::Collapse(reduxVertex *u, reduxVertex *v){
-    // Collapse the edge uv by moving vertex u onto v
-    // Actually remove tris on uv, then update tris that
-    // have u to have v, and then remove u.
-    if (!v) {
-        // u is a vertex all by itself so just delete it
-        delete u;
-        return;
-    }
-    int i;
-    std::vector<reduxVertex *>tmp;
-    // make tmp a list of all the neighbors of u
-    for (i = 0; i<static_cast<int>(u->neighbor.size()); i++) {
-        tmp.push_back(u->neighbor[i]);
-    }
-    // delete triangles on edge uv:
-    for (i = static_cast<int>(u->face.size()) - 1; i >= 0; i--) {
-        if (u->face[i]->HasVertex(v)) {
-            delete(u->face[i]);
+bool QuadricSimplifier::flips(unsigned group, unsigned target) const {
+    const CalVector to = position(target);
+    bool flipped = false;
+    forEachGroupFace(group, [&](unsigned f) {
+        const CalIndex32* ix = faces[f].vertexId;
+        CalVector p[3];
+        bool hasTarget = false;
+        for (int k = 0; k < 3; ++k) {
+            p[k] = position(ix[k]);
+            hasTarget = hasTarget || groupOf[ix[k]] == target;
         }
+        if (hasTarget) {
+            return;
+        }
+        const CalVector before = cross(p[1] - p[0], p[2] - p[0]);
+        for (int k = 0; k < 3; ++k) {
+            if (groupOf[ix[k]] == group) {
+                p[k] = to;
+            }
+        }
+        const CalVector after = cross(p[1] - p[0], p[2] - p[0]);
+        // more than about 75 degrees of rotation counts as a flip
+        flipped = flipped || dot(before, after) <= 0.25f * before.length() * after.length();
+    });
+    return flipped;
+}
+
+// Queues the cheapest valid collapse of group.  A border position only
+// slides along the border.
+void QuadricSimplifier::evaluate(unsigned group) {
+    gatherNeighbours(group);
+    bool border = false;
+    for (auto n = neighbours.begin(); n != neighbours.end(); ++n) {
+        border = border || n->faceCount == 1;
     }
-    // update remaining triangles to have v instead of u
-    for (i = static_cast<int>(u->face.size()) - 1; i >= 0; i--) {
-        u->face[i]->ReplaceVertex(u, v);
+
+    SimplifyQueueEntry best = { std::numeric_limits<double>::max(), group, NoVertex, versions[group] };
+    for (auto n = neighbours.begin(); n != neighbours.end(); ++n) {
+        if (border && n->faceCount != 1) {
+            continue;
+        }
+        SimplifyQuadric q = quadrics[group];
+        q.add(quadrics[n->group]);
+        const double error = std::max(0.0, q.error(position(n->group)));
+        if (error < best.error && mapWedges(group, n->group) && !flips(group, n->group)) {
+            best.error = error;
+            best.target = n->group;
+        }
     }
-    delete u;
-    // recompute the edge collapse costs for neighboring vertices
-    for (i = 0; i<static_cast<int>(tmp.size()); i++) {
-        ComputeEdgeCostAtVertex(tmp[i]);
+    if (best.target != NoVertex) {
+        queue.push(best);
     }
 }
 
-void CalCoreSubmesh::reduxAddVertices(const CalCoreSubmesh::VectorVertex &vert, const CalCoreSubmesh::VectorTextureCoordinate &tex){
-    if(tex.size() == vert.size()) {
-        for (unsigned int i = 0; i<vert.size(); i++) {
-            vertices.push_back(new reduxVertex(vertices, vert[i].position, tex[i].u, tex[i].v, i));
+void QuadricSimplifier::collapse(unsigned group, unsigned target) {
+    // re-evaluate everything around both ends afterwards
+    ++stamp;
+    touched.clear();
+    gatherNeighbours(group);
+    for (auto n = neighbours.begin(); n != neighbours.end(); ++n) {
+        touchedStamp[n->group] = stamp;
+        touched.push_back(n->group);
+    }
+
+    mapWedges(group, target);
+    unsigned wedge = group;
+    for (auto t = wedgeTargets.begin(); t != wedgeTargets.end(); ++t, wedge = wedgeNext[wedge]) {
+        const unsigned to = *t;
+        if (to == NoVertex) {
+            continue;
+        }
+        forEachFace(wedge, [&](unsigned f) {
+            CalIndex32* ix = faces[f].vertexId;
+            for (int k = 0; k < 3; ++k) {
+                if (ix[k] == wedge) {
+                    ix[k] = to;
+                }
+            }
+            if (groupOf[ix[0]] == groupOf[ix[1]] || groupOf[ix[1]] == groupOf[ix[2]] || groupOf[ix[2]] == groupOf[ix[0]]) {
+                faceAlive[f] = 0;
+                --liveFaceCount;
+            }
+        });
+        memberNext[memberTail[to]] = wedge;
+        memberTail[to] = memberTail[wedge];
+    }
+
+    quadrics[target].add(quadrics[group]);
+    groupAlive[group] = 0;
+
+    gatherNeighbours(target);
+    for (auto n = neighbours.begin(); n != neighbours.end(); ++n) {
+        if (touchedStamp[n->group] != stamp) {
+            touchedStamp[n->group] = stamp;
+            touched.push_back(n->group);
         }
     }
-    else
-    { 
-        for (unsigned int i = 0; i<vert.size(); i++) {
-            vertices.push_back(new reduxVertex(vertices, vert[i].position, i));
+    ++versions[target];
+    evaluate(target);
+    for (auto g = touched.begin(); g != touched.end(); ++g) {
+        if (*g != target) {
+            ++versions[*g];
+            evaluate(*g);
         }
     }
 }
 
-void CalCoreSubmesh::reduxAddFaces(const CalCoreSubmesh::VectorFace &tri){
-    for (unsigned int i = 0; i<tri.size(); i++) {
-        if(!(tri[i].vertexId[0] == tri[i].vertexId[1] ||
-             tri[i].vertexId[1] == tri[i].vertexId[2] ||
-             tri[i].vertexId[2] == tri[i].vertexId[0])) {
-                    
-                triangles.push_back(
-                    new Triangle(vertices, triangles,
-                        vertices[tri[i].vertexId[0]],
-                        vertices[tri[i].vertexId[1]],
-                        vertices[tri[i].vertexId[2]]));
+bool QuadricSimplifier::collapseNext(double maxError) {
+    while (!queue.empty()) {
+        const SimplifyQueueEntry top = queue.top();
+        if (!groupAlive[top.group] || !groupAlive[top.target] || versions[top.group] != top.version) {
+            queue.pop();
+            continue;
+        }
+        if (top.error > maxError) {
+            return false;
         }
+        queue.pop();
+        collapse(top.group, top.target);
+        return true;
     }
+    return false;
 }
 
-void CalCoreSubmesh::ApplyFaces(const CalCoreSubmesh::VectorFace &tris){
-    int gone = m_faces.size() - tris.size();
+void CalCoreSubmesh::ApplyFaces(const CalCoreSubmesh::VectorWideFace &tris){
+    int gone = getFaceCount() - tris.size();
     if(gone >0){
         m_faces.clear();
+        m_wideFaces.clear();
         
         //m_faces.push_back(CalCoreSubmesh::Face(0, 1, 2));
         for (unsigned int i = 0; i<tris.size(); i++) {
-            m_faces.push_back(tris[i]);
+            if (m_wideIndices) {
+                m_wideFaces.push_back(tris[i]);
+            } else {
+                m_faces.push_back(Face(CalIndex(tris[i].vertexId[0]), CalIndex(tris[i].vertexId[1]), CalIndex(tris[i].vertexId[2])));
+            }
         }
+        discardClusters();
+        m_lodCollapses.clear();
     }
 }
 
-CalCoreSubmesh::reduxVertex *CalCoreSubmesh::MinimumCostEdge(){
-    // Find the edge that when collapsed will affect model the least.
-    // This funtion actually returns a reduxVertex, the second vertex
-    // of the edge (collapse candidate) is stored in the vertex data.
-    // Serious optimization opportunity here: this function currently
-    // does a sequential search through an unsorted list :-(
-    // Our algorithm could be O(n*lg(n)) instead of O(n*n)
-    CalCoreSubmesh::reduxVertex *mn = vertices[0];
-    for (unsigned int i = 0; i<vertices.size(); i++) {
-        if (vertices[i]->objdist < mn->objdist) {
-            mn = vertices[i];
+template<typename FaceType>
+static std::vector<std::vector<FaceType> > buildLodLevels(const CalCoreSubmesh& submesh, const std::vector<size_t>& faceCounts) {
+    cal3d::verify(std::is_sorted(faceCounts.rbegin(), faceCounts.rend()), "LOD face counts must be in decreasing order");
+
+    std::vector<std::vector<FaceType> > levels(faceCounts.size());
+    QuadricSimplifier simplifier(submesh);
+    for (size_t level = 0; level < faceCounts.size(); ++level) {
+        while (simplifier.getFaceCount() > faceCounts[level] &&
+               simplifier.collapseNext(std::numeric_limits<double>::max())) {
         }
+        simplifier.getFaces(levels[level]);
     }
-    return mn;
+    return levels;
+}
+
+std::vector<CalCoreSubmesh::VectorFace> CalCoreSubmesh::buildLodChain(const std::vector<size_t>& faceCounts) const {
+    cal3d::verify(!m_wideIndices, "Use buildWideLodChain() for submeshes with 32-bit indices");
+    return buildLodLevels<Face>(*this, faceCounts);
+}
+
+std::vector<CalCoreSubmesh::VectorWideFace> CalCoreSubmesh::buildWideLodChain(const std::vector<size_t>& faceCounts) const {
+    return buildLodLevels<WideFace>(*this, faceCounts);
 }
 
+// Collapses down to target_tri_count faces, then keeps going while the
+// error stays under a threshold set by quality (0-100), down to half of
+// target_tri_count.
 bool CalCoreSubmesh::simplifySubmesh(unsigned int target_tri_count, unsigned int quality) {
-    bool retval = false;
-    if(target_tri_count < m_faces.size()) {
-        vertices.clear();
-        triangles.clear();
-        reduxAddVertices(getVectorVertex(), getTextureCoordinates());  // put input data into our data structures
-        reduxAddFaces(getFaces());
-        float lastError, error;
-        m_isolateds = 0;
-        
-        lastError = error = (100.0f-quality ) * 0.00001f;
+    if(target_tri_count >= getFaceCount()) {
+        return false;
+    }
 
-        if (ComputeAllEdgeCollapseCosts()) { // cache all edge collapse costs
-            if(m_isolateds / static_cast<float>(m_faces.size()) < 0.4f) {
-                if(m_isolateds / static_cast<float>(m_faces.size()) > 0.21f) { // boost poly count if isolateds are high
-                    target_tri_count += ( m_faces.size() - target_tri_count) /2;
-                }
-                while (triangles.size() > target_tri_count || vertices.size() > 65535 ||
-                      ( lastError < error && triangles.size() > (target_tri_count/2)) ) {
-                    // get the next vertex to collapse
-                    reduxVertex *mn = MinimumCostEdge();
-                    lastError = mn->objdist;
-                    Collapse(mn, mn->collapse);
-                }
+    QuadricSimplifier simplifier(*this);
+    while (simplifier.getFaceCount() > target_tri_count &&
+           simplifier.collapseNext(std::numeric_limits<double>::max())) {
+    }
+    const double error = (100.0f - quality) * 0.00001f;
+    while (simplifier.getFaceCount() > target_tri_count / 2 &&
+           simplifier.collapseNext(error * error)) {
+    }
 
-                CalCoreSubmesh::VectorFace tris;
-                tris.reserve(triangles.size());
-                for (unsigned int i = 0; i<triangles.size(); i++) {
-                    tris.push_back( CalCoreSubmesh::Face(   triangles[i]->vertex[0]->id,
-                                                            triangles[i]->vertex[1]->id,
-                                                            triangles[i]->vertex[2]->id ));
-                }
-                ApplyFaces(tris);
-                retval = true;
-            }
+    VectorWideFace tris;
+    simplifier.getFaces(tris);
+    ApplyFaces(tris);
+    return true;
+}
+
+bool CalCoreSubmesh::setLodCollapses(const LodCollapseVector& collapses) {
+    m_lodCollapses.clear();
+    if (collapses.size() > m_vertices.size()) {
+        return false;
+    }
+
+    const size_t firstCollapsed = m_vertices.size() - collapses.size();
+    size_t collapsedFaces = 0;
+    for (size_t i = 0; i < collapses.size(); ++i) {
+        if (collapses[i].collapseId >= firstCollapsed + i) {
+            return false;
         }
-        
-        // cleanup memory
-        //while (triangles.size() > 0) {
-            // get the next vertex to collapse
-        //    reduxVertex *mn = MinimumCostEdge();
-        //    Collapse(mn, mn->collapse);
-        //}
-        for(unsigned int i = 0; i < triangles.size(); i++)
-        {
-            delete triangles[i];
+        collapsedFaces += collapses[i].faceCollapseCount;
+    }
+    if (collapsedFaces > getFaceCount()) {
+        return false;
+    }
+
+    m_lodCollapses = collapses;
+    return true;
+}
+
+CalCoreSubmesh::LodPrefix CalCoreSubmesh::getLodPrefix(float lodLevel) const {
+    lodLevel = std::min(1.0f, std::max(0.0f, lodLevel));
+    const size_t collapseCount = size_t((1.0f - lodLevel) * m_lodCollapses.size());
+
+    LodPrefix prefix;
+    prefix.vertexCount = unsigned(m_vertices.size() - collapseCount);
+    prefix.faceCount = unsigned(getFaceCount());
+    for (size_t i = m_lodCollapses.size() - collapseCount; i < m_lodCollapses.size(); ++i) {
+        prefix.faceCount -= m_lodCollapses[i].faceCollapseCount;
+    }
+    return prefix;
+}
+
+template<typename FaceType>
+static void writeLodFaces(const CalCoreSubmesh& submesh, const CalCoreSubmesh::LodPrefix& prefix, FaceType* faces) {
+    const CalCoreSubmesh::LodCollapseVector& collapses = submesh.getLodCollapses();
+    const size_t firstCollapsed = submesh.getVertexCount() - collapses.size();
+    for (unsigned f = 0; f < prefix.faceCount; ++f) {
+        const CalCoreSubmesh::WideFace face = submesh.getFace(f);
+        for (int k = 0; k < 3; ++k) {
+            CalIndex32 v = face.vertexId[k];
+            while (v >= prefix.vertexCount) {
+                v = collapses[v - firstCollapsed].collapseId;
+            }
+            faces[f].vertexId[k] = v;
         }
-        vertices.clear();
-        triangles.clear();
     }
-    return retval;
 }
 
- 
+void CalCoreSubmesh::getLodFaces(const LodPrefix& prefix, Face* faces) const {
+    cal3d::verify(!m_wideIndices, "Use WideFace output for submeshes with 32-bit indices");
+    writeLodFaces(*this, prefix, faces);
+}
+
+void CalCoreSubmesh::getLodFaces(const LodPrefix& prefix, WideFace* faces) const {
+    writeLodFaces(*this, prefix, faces);
+}
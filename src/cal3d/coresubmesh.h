@@ -42,10 +42,6 @@ enum SplitMeshBasedOnBoneLimitType {
 
 CAL3D_PTR(CalCoreSubmesh);
 
-#define VECTOR_CONTAINS(a, b)       (std::find(a.begin(), a.end(), b)!=a.end())
-#define VECTOR_REMOVE_VALUE(a, b)   (a.erase(std::find(a.begin(), a.end(), b)))
-#define VECTOR_ADD_UNIQUE(a, b)     do {  if(std::find(a.begin(), a.end(), b)==a.end())  a.push_back(b); } while(0)
-
 // NOTE: Influence extraction could probably be done more efficiently with fixed-length
 // arrays, if we're willing to settle on a fixed number of influences.
 class CAL3D_API CalWeightsBoneIdsPair {
@@ -144,45 +140,14 @@ public:
 
             return true;
         }
-    };
 
-    struct Triangle;
-    struct reduxVertex;
-
-    struct reduxVertex {
-    public:
-        CalVector       position; // location of point in euclidean space
-        float           u, v; // texture coordinates
-        int             id;       // place of vertex in original list
-        std::vector<reduxVertex *>   neighbor; // adjacent vertices
-        std::vector<Triangle *> face;     // adjacent triangles
-        float            objdist;  // cached cost of collapsing edge
-        reduxVertex *         collapse; // candidate vertex for collapse
-        std::vector<reduxVertex *> &parent_vertices;
-        bool isBorder(); // test if vertex is on border
-        reduxVertex(std::vector<reduxVertex *> &vertices, const CalPoint4 &p, int _id);
-        reduxVertex(std::vector<reduxVertex *> &vertices, const CalPoint4 &p, float _u, float _v, int _id);
-        ~reduxVertex();
-        void             RemoveIfNonNeighbor(reduxVertex *n);
-    };
-
-    struct Triangle {
-    public:
-        reduxVertex *         vertex[3]; // the 3 points that make this tri
-        CalVector        normal;    // unit vector othogonal to this face
-        CalVector        T;    // vector tangent (delta u)
-        CalVector        B;    // vector bitangent (delta v)
-        std::vector<reduxVertex *> &parent_vertices;
-        std::vector<Triangle *> &parent_triangles;
-        Triangle(std::vector<reduxVertex *> &vertices, std::vector<Triangle *> &triangles, reduxVertex *v0, reduxVertex *v1, reduxVertex *v2);
-        ~Triangle();
-        void             ComputeNormal();
-        void             ComputeTB();
-        void             ReplaceVertex(reduxVertex *vold, reduxVertex *vnew);
-        int              HasVertex(reduxVertex *v);
+        bool operator<(const InfluenceSet& rhs) const {
+            return std::lexicographical_compare(
+                influences.begin(), influences.end(),
+                rhs.influences.begin(), rhs.influences.end());
+        }
     };
 
-    
     CAL3D_ALIGN_HEAD(16)
     struct Vertex {
         CalPoint4 position;
@@ -194,23 +159,130 @@ public:
     }
     CAL3D_ALIGN_TAIL(16);
 
-    struct Face {
-        Face(){}
-        Face(CalIndex v0, CalIndex v1, CalIndex v2){vertexId[0]=v0; vertexId[1]= v1; vertexId[2]=v2;}
-        CalIndex vertexId[3];
+    template<typename Index>
+    struct BasicFace {
+        BasicFace(){}
+        BasicFace(Index v0, Index v1, Index v2){vertexId[0]=v0; vertexId[1]= v1; vertexId[2]=v2;}
+        Index vertexId[3];
 
-        bool operator==(const Face& rhs) const {
+        bool operator==(const BasicFace& rhs) const {
             return std::equal(vertexId, vertexId + 3, rhs.vertexId);
         }
     };
+    // Faces are 16-bit unless the submesh has more than 65536 vertices.
+    typedef BasicFace<CalIndex> Face;
+    typedef BasicFace<CalIndex32> WideFace;
+
+    // One step of the exporter's progressive mesh: a vertex collapsing
+    // onto collapseId, taking faceCollapseCount faces with it.
+    struct LodCollapse {
+        LodCollapse() {}
+        LodCollapse(CalIndex32 collapseId, CalIndex32 faceCollapseCount)
+            : collapseId(collapseId)
+            , faceCollapseCount(faceCollapseCount)
+        {}
+
+        CalIndex32 collapseId;
+        CalIndex32 faceCollapseCount;
+    };
+    typedef std::vector<LodCollapse> LodCollapseVector;
+
+    // The leading vertices and faces to skin and draw at one level of
+    // detail.
+    struct LodPrefix {
+        unsigned vertexCount;
+        unsigned faceCount;
+    };
+
+    // A run of consecutive vertices.  firstInfluence is the index into
+    // getInfluences() of the first influence of vertex begin.
+    struct VertexRange {
+        unsigned begin;
+        unsigned end;
+        unsigned firstInfluence;
+
+        bool operator==(const VertexRange& rhs) const {
+            return begin == rhs.begin && end == rhs.end && firstInfluence == rhs.firstInfluence;
+        }
+    };
+    typedef std::vector<VertexRange> VertexRangeVector;
+
+    // A run of consecutive faces whose vertices stay within the limits
+    // given to buildClusters(), with bind-pose bounds for culling.
+    struct Cluster {
+        CalVector center; // bounding sphere
+        float radius;
+        CalVector coneAxis; // unit, area-weighted mean face normal
+        float coneCutoff; // sine of the normal cone's half angle; > 1 if it spans a hemisphere
+        unsigned firstFace;
+        unsigned faceCount;
+        unsigned firstBone; // into getClusterBones()
+        unsigned boneCount;
+        unsigned firstRange; // into getClusterRangeIndices()
+        unsigned rangeCount;
+    };
+    typedef std::vector<Cluster> ClusterVector;
+
+    // A post-transform vertex cache, as simulated by analyzeMesh() and
+    // targeted by optimizeMesh().
+    struct VertexCacheModel {
+        enum Replacement {
+            LRU,
+            FIFO
+        };
+
+        VertexCacheModel(Replacement replacement = LRU, unsigned size = 32)
+            : replacement(replacement)
+            , size(size)
+        {}
+
+        Replacement replacement;
+        unsigned size;
+    };
+
+    struct MeshStatistics {
+        float acmr;     // vertices transformed per face; 0.5 at best
+        float atvr;     // vertices transformed per vertex used; 1 at best
+        float overdraw; // fragments shaded per pixel covered; 1 at best
+    };
+
+    struct WeldReport {
+        size_t verticesBefore;
+        size_t verticesAfter;
+        size_t facesRemoved; // left using one vertex twice
+    };
+
+    enum VertexOrder {
+        KeepVertexOrder,
+        FetchVertexOrder, // as renumberIndices()
+        BoneVertexOrder   // as sortVerticesByBone()
+    };
+
+    struct MeshOptimizationOptions {
+        MeshOptimizationOptions()
+            : overdrawThreshold(1.05f)
+            , vertexOrder(FetchVertexOrder)
+        {}
+
+        VertexCacheModel cache;
+        // How much worse than the cache order's ACMR the overdraw pass may
+        // make it; below 1 skips that pass.
+        float overdrawThreshold;
+        VertexOrder vertexOrder;
+    };
+
+    struct MeshOptimizationReport {
+        MeshStatistics before;
+        MeshStatistics after;
+    };
 
     typedef std::vector<CalCoreMorphTargetPtr> MorphTargetArray;
     typedef std::vector<boost::shared_ptr<CalCoreSubmesh>> CalCoreSubmeshPtrVector;
     typedef std::vector<Face> VectorFace;
+    typedef std::vector<WideFace> VectorWideFace;
     typedef std::vector<TextureCoordinate> VectorTextureCoordinate;
     typedef cal3d::SSEArray<Vertex> VectorVertex;
     typedef std::vector<Influence> InfluenceVector;
-    typedef std::set<int> VerticesSet;
 
     CalCoreSubmesh(int vertexCount, bool hasTextureCoordinates, int faceCount);
 
@@ -218,18 +290,38 @@ public:
 
     int coreMaterialThreadId;
 
+    // 2 or 4, the bytes per index of the faces.  Submeshes start out
+    // 4-byte only when constructed with more than 65536 vertices.
+    unsigned getIndexSize() const {
+        return m_wideIndices ? 4 : 2;
+    }
+    // Converts the faces; 2 needs at most 65536 vertices.  Discards
+    // clusters and level of detail data.
+    void setIndexSize(unsigned indexSize);
+
+    // Only for 2-byte submeshes; the mesh tools all take either width.
     const VectorFace& getFaces() const {
+        cal3d::verify(!m_wideIndices, "Use getWideFaces() for submeshes with 32-bit indices");
         return m_faces;
     }
+    // Only for 4-byte submeshes.
+    const VectorWideFace& getWideFaces() const {
+        cal3d::verify(m_wideIndices, "Use getFaces() for submeshes with 16-bit indices");
+        return m_wideFaces;
+    }
+    // Either width.
+    WideFace getFace(size_t faceId) const;
 
     size_t getFaceCount() const {
-        return m_faces.size();
+        return m_wideIndices ? m_wideFaces.size() : m_faces.size();
     }
 
     size_t getMinimumVertexBufferSize() const {
         return m_minimumVertexBufferSize;
     }
     void addFace(const Face&);
+    // A 2-byte submesh takes wide faces whose indices fit 16 bits.
+    void addFace(const WideFace&);
 
     bool hasTextureCoordinates() const {
         return !m_textureCoordinates.empty();
@@ -272,32 +364,212 @@ public:
         return m_influences;
     }
 
+    // Indexed by bone id: the sorted runs of vertices that bone influences.
+    const std::vector<VertexRangeVector>& getBoneVertexRanges() const {
+        return m_boneVertexRanges;
+    }
+
+    // The skeleton bone ids this submesh references, in first-use order,
+    // and getInfluences() with each bone id replaced by its index in that
+    // list.  Skinning against the gathered palette touches only these
+    // transforms.
+    const std::vector<unsigned>& getPaletteBoneIds() const {
+        return m_paletteBoneIds;
+    }
+
+    const InfluenceVector& getPaletteInfluences() const {
+        return m_paletteInfluences;
+    }
+
+    // Parallel to getPaletteBoneIds(): the bind-pose box of the vertices
+    // each bone influences with nonzero weight.  Empty boxes have min > max.
+    const std::vector<CalAABox>& getPaletteBounds() const {
+        return m_paletteBounds;
+    }
+
+    // A box around the skinned submesh in O(bones): the union of each
+    // palette bone's bounds, grown by how far morph targets can move its
+    // vertices, moved by its transform.  Every skinned vertex is a convex
+    // blend of points inside those boxes, so the result is conservative as
+    // long as influence weights are non-negative and sum to one and morph
+    // target weights lie in [0, 1].
+    CalAABox getAnimatedBoundingVolume(const BoneTransform* boneTransforms) const;
+
+    // Collapses vertices with the same influence set (exactly the same
+    // bones and weights, in any order) into a table of unique sets, so
+    // skinning can blend each set's matrix once.  getInfluenceSets() holds the sets back to
+    // back over palette indices.  getVertexInfluenceSets() gives each vertex
+    // one unit-weight influence whose boneId is its set index, so the
+    // ordinary kernels can apply the blended matrices.  addVertex discards
+    // the table; fixup and renumberIndices rebuild it.
+    void dedupeInfluenceSets();
+
+    bool hasInfluenceSets() const {
+        return !m_vertexInfluenceSets.empty();
+    }
+
+    const InfluenceVector& getInfluenceSets() const {
+        return m_influenceSets;
+    }
+
+    size_t getInfluenceSetCount() const {
+        return m_influenceSetCount;
+    }
+
+    const InfluenceVector& getVertexInfluenceSets() const {
+        return m_vertexInfluenceSets;
+    }
+
+    // vertices per unique influence set, 0 before dedupeInfluenceSets()
+    float getInfluenceSetDedupeRatio() const;
+
+    // Groups spatially adjacent faces into clusters of at most maxVertices
+    // distinct vertices and maxFaces faces, reordering the faces so each
+    // cluster's are contiguous.  renumberIndices() afterwards makes each
+    // cluster's vertices nearly contiguous too.  Anything that rewrites
+    // faces (addFace, optimizeVertexCache, sortForBlending, ...) or adds
+    // vertices discards the clusters; renumbering or scaling vertices
+    // updates them.
+    void buildClusters(unsigned maxVertices = 64, unsigned maxFaces = 124);
+
+    bool hasClusters() const {
+        return !m_clusters.empty();
+    }
+
+    const ClusterVector& getClusters() const {
+        return m_clusters;
+    }
+
+    // Palette indices (see getPaletteBoneIds()) of the bones influencing
+    // each cluster with nonzero weight.
+    const std::vector<unsigned>& getClusterBones() const {
+        return m_clusterBones;
+    }
+
+    // Sorted, disjoint vertex runs, split wherever one cluster's vertices
+    // start or stop, so every cluster's vertices are a union of them.
+    const VertexRangeVector& getClusterVertexRanges() const {
+        return m_clusterVertexRanges;
+    }
+
+    // Indices into getClusterVertexRanges() of each cluster's runs.
+    const std::vector<unsigned>& getClusterRangeIndices() const {
+        return m_clusterRangeIndices;
+    }
+
     CalAABox getBoundingVolume() const {
         return m_boundingVolume;
     }
     
     void duplicateTriangles();
-    void sortTris(CalCoreSubmesh&);
+
+    // Writes every vertex twice to submeshTo, the copies with flipped
+    // normals, and every face once per winding, ordered to draw back to
+    // front from any view.  Only faces whose bounds come within reach plus
+    // half their longest edges of each other are ordered against each
+    // other, so layers further apart than that, such as hair cards off a
+    // scalp, are only ordered through the faces between them.  Pass the
+    // widest gap that must stay ordered as reach; a larger reach compares
+    // more pairs.
+    void sortTris(CalCoreSubmesh& submeshTo);
+    void sortTris(CalCoreSubmesh& submeshTo, float reach);
     bool simplifySubmesh(unsigned int tri_count, unsigned int quality);
 
-    boost::shared_ptr<CalCoreSubmesh> emitSubmesh(VerticesSet & verticesSetThisSplit, VectorFace & trianglesThisSplit, SplitMeshBasedOnBoneLimitType& rc);
+    // Collapses edges cheapest quadric error first and returns the faces
+    // left as the count first reaches each of faceCounts (decreasing),
+    // all from one pass.  Vertices only ever collapse onto neighbouring
+    // vertices, so influences, texture coordinates and morph targets
+    // apply unchanged at every level; vertices no level uses are kept.
+    // Only for 2-byte submeshes.
+    std::vector<VectorFace> buildLodChain(const std::vector<size_t>& faceCounts) const;
+    // The same, for either width.
+    std::vector<VectorWideFace> buildWideLodChain(const std::vector<size_t>& faceCounts) const;
+
+    // Keeps the exporter's collapses of the last collapses.size()
+    // vertices, last vertex first: each vertex collapses onto an earlier
+    // one and its faces are the last ones still left.  Returns false, and
+    // keeps none, if the collapses don't fit the submesh.  Anything that
+    // reorders vertices or faces drops them.
+    bool setLodCollapses(const LodCollapseVector& collapses);
+
+    const LodCollapseVector& getLodCollapses() const {
+        return m_lodCollapses;
+    }
+
+    size_t getLodCount() const {
+        return m_lodCollapses.size();
+    }
+
+    // The prefix to skin and draw at lodLevel, from 0 (every collapse)
+    // to 1 (full detail).
+    LodPrefix getLodPrefix(float lodLevel) const;
 
+    // Writes the prefix's faces with vertices past it replaced by the
+    // ones they collapse onto, e.g. straight into an index buffer.
+    // Only for 2-byte submeshes.
+    void getLodFaces(const LodPrefix& prefix, Face* faces) const;
+    // The same, for either width.
+    void getLodFaces(const LodPrefix& prefix, WideFace* faces) const;
+
+    // Appends submeshes using at most boneLimit bones each, grown across
+    // shared vertices so each is one or a few connected pieces.  A face
+    // whose vertices alone use more bones gets its own submesh.
     SplitMeshBasedOnBoneLimitType splitMeshBasedOnBoneLimit(CalCoreSubmeshPtrVector& newSubmeshes, size_t boneLimit);
 
     void optimizeVertexCache();
     void optimizeVertexCacheSubset(unsigned int faceStartIndex, unsigned int faceCount);
     void renumberIndices();
+
+    // Makes vertex i a copy of source's vertex newToOld[i]: position,
+    // color, texture coordinate, influences and morph target offsets.
+    // Vertices may repeat or be left out, and source may be this
+    // submesh.  Faces are the caller's to remap, beforehand so clusters
+    // follow; level of detail data is discarded.
+    void copyVertices(const CalCoreSubmesh& source, const std::vector<unsigned>& newToOld);
+    void permuteVertices(const std::vector<unsigned>& newToOld);
+
+    // Adds other's vertices after this submesh's, and its faces renumbered
+    // to match, going 4-byte past 65536 vertices.  Morph targets of the
+    // same name are joined; one only a side has doesn't move the other
+    // side's vertices.  Texture coordinates missing on one side are
+    // (0, 0).  Influence sets are rebuilt if either side had them.
+    // Discards clusters and level of detail data.
+    void appendSubmesh(const CalCoreSubmesh& other);
+
+    // Simulates drawing the faces through cache, and estimates overdraw
+    // by rasterizing them from the six axis directions.
+    MeshStatistics analyzeMesh(const VertexCacheModel& cache) const;
+
+    // Orders faces for options.cache, then regroups runs of them so
+    // those facing out of the mesh draw first, then orders vertices as
+    // options.vertexOrder asks.  Reports analyzeMesh() before and after.
+    MeshOptimizationReport optimizeMesh(const MeshOptimizationOptions& options = MeshOptimizationOptions());
+
+    // Renumbers vertices so those with the same dominant bone, and within
+    // that the same influence set, are adjacent; skinning then streams
+    // through a few BoneTransforms at a time.  Triangle order, and so the
+    // post-transform cache order from optimizeVertexCache(), is kept.
+    void sortVerticesByBone();
+
+    // Merges vertices whose positions, normals, texture coordinates,
+    // influence weights and morph target offsets are within epsilon per
+    // component and whose colors and influence bone ids are the same.
+    // Influences match in any order.  Merged vertices take the first one's attributes; the rest keep
+    // their order.  Faces and morph targets are remapped, and faces left
+    // using a vertex twice are dropped.  Candidates are found by hashing
+    // position cells, so this runs in expected linear time.  A 4-byte
+    // submesh stays 4-byte; see setIndexSize().
+    WeldReport weldVertices(float epsilon = 0.0f);
+
     void normalizeNormals();
+    // sortTrianglesBackToFront() at its default reach, so layers further
+    // apart than their faces are wide stay unordered; see trisort.h.
     void sortForBlending();
 
     CalExportedInfluences exportInfluences(unsigned int influenceLimit);
 
 private:
     unsigned int m_currentVertexId;
-    int m_isolateds;
-    std::vector<reduxVertex *> vertices;
-    std::vector<Triangle *> triangles;
-
 
     // The following arrays should always be the same size.
     VectorVertex m_vertices;
@@ -312,23 +584,40 @@ private:
     InfluenceSet m_staticInfluenceSet;
 
     InfluenceVector m_influences;
+    std::vector<VertexRangeVector> m_boneVertexRanges;
+    std::vector<unsigned> m_paletteBoneIds;
+    InfluenceVector m_paletteInfluences; // parallel to m_influences
+    std::vector<CalAABox> m_paletteBounds;
+    // per axis, the summed size of every morph offset of a vertex, and its
+    // maximum over the vertices of each palette bone
+    std::vector<CalVector> m_vertexMorphReach;
+    std::vector<CalVector> m_paletteMorphReach;
+    InfluenceVector m_influenceSets;
+    size_t m_influenceSetCount;
+    InfluenceVector m_vertexInfluenceSets;
+    ClusterVector m_clusters;
+    std::vector<unsigned> m_clusterBones;
+    VertexRangeVector m_clusterVertexRanges;
+    std::vector<unsigned> m_clusterRangeIndices;
+    LodCollapseVector m_lodCollapses;
     CalAABox m_boundingVolume;
 
-    VectorFace m_faces;
+    bool m_wideIndices;
+    VectorFace m_faces;         // if !m_wideIndices
+    VectorWideFace m_wideFaces; // if m_wideIndices
     size_t m_minimumVertexBufferSize;
 
-    void addVertices(CalCoreSubmesh& submeshTo, unsigned submeshToVertexOffset, float normalMul);
-
-    // internal simplification prototypes
-    float ComputeEdgeCollapseCost(reduxVertex *u, reduxVertex *v);
-    bool ComputeEdgeCostAtVertex(reduxVertex *v);
-    bool ComputeAllEdgeCollapseCosts();
-    void Collapse(reduxVertex *u, reduxVertex *v);
-    void reduxAddFaces(const VectorFace &tri);
-    void reduxAddVertices(const VectorVertex &vert, const VectorTextureCoordinate &tex);
-    void ApplyFaces(const VectorFace &tris);
-    bool matchFaces(Triangle *t0, Triangle *t1);
-    reduxVertex *MinimumCostEdge();
+    void addBoneVertexRanges(unsigned vertexId, unsigned firstInfluence);
+    void rebuildBoneVertexRanges();
+    void addPaletteInfluences(unsigned firstVertex, unsigned firstInfluence);
+    void rebuildBonePalette();
+    void addMorphReach(const CalCoreMorphTarget& morphTarget);
+    void rebuildPaletteMorphReach();
+    void refreshClusters();
+    void discardClusters();
+    CalVector faceNormal(const WideFace& face) const;
+
+    void ApplyFaces(const VectorWideFace &tris);
 };
 
 inline std::ostream& operator<<(std::ostream& os, const CalCoreSubmesh::Influence& influence) {
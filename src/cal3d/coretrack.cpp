@@ -34,6 +34,8 @@ CalCoreTrack::CalCoreTrack(int coreBone, const KeyframeList& kf)
     , keyframes(sorted(kf)) {
     translationRequired = true;
     translationIsDynamic = true;
+    translationIsConstant = false;
+    rotationIsConstant = false;
 }
 
 size_t sizeInBytes(const CalCoreKeyframe&) {
@@ -302,11 +304,44 @@ void CalCoreTrack::translationCompressibility(
     }
 }
 
+void CalCoreTrack::classify(double translationTolerance, double rotationToleranceDegrees) {
+    translationIsConstant = true;
+    rotationIsConstant = true;
+    if (keyframes.empty()) {
+        return;
+    }
+
+    const cal3d::RotateTranslate first = keyframes[0].transform;
+    for (size_t i = 1; i < keyframes.size(); ++i) {
+        const cal3d::RotateTranslate& t = keyframes[i].transform;
+        if (translationIsConstant && Distance(first.translation, t.translation) > translationTolerance) {
+            translationIsConstant = false;
+        }
+        if (rotationIsConstant && DistanceDegrees(first.rotation, t.rotation) > rotationToleranceDegrees) {
+            rotationIsConstant = false;
+        }
+    }
+
+    // snap the constant components so every sample agrees exactly
+    for (auto i = keyframes.begin(); i != keyframes.end(); ++i) {
+        if (translationIsConstant) {
+            i->transform.translation = first.translation;
+        }
+        if (rotationIsConstant) {
+            i->transform.rotation = first.rotation;
+        }
+    }
+}
+
 cal3d::RotateTranslate CalCoreTrack::getCurrentTransform(float time) const {
     if (keyframes.empty()) {
         return cal3d::RotateTranslate();
     }
 
+    if (isConstant()) {
+        return keyframes[0].transform;
+    }
+
     KeyframeList::const_iterator iteratorCoreKeyframeAfter = getUpperBound(time);
 
     if (iteratorCoreKeyframeAfter == keyframes.end()) {
@@ -329,6 +364,16 @@ cal3d::RotateTranslate CalCoreTrack::getCurrentTransform(float time) const {
         blendFactor = (time - pCoreKeyframeBefore.time) / (pCoreKeyframeAfter.time - pCoreKeyframeBefore.time);
     }
 
+    if (translationIsConstant) {
+        return cal3d::RotateTranslate(
+            slerp(blendFactor, pCoreKeyframeBefore.transform.rotation, pCoreKeyframeAfter.transform.rotation),
+            pCoreKeyframeBefore.transform.translation);
+    }
+    if (rotationIsConstant) {
+        return cal3d::RotateTranslate(
+            pCoreKeyframeBefore.transform.rotation,
+            lerp(blendFactor, pCoreKeyframeBefore.transform.translation, pCoreKeyframeAfter.transform.translation));
+    }
     return blend(blendFactor, pCoreKeyframeBefore.transform, pCoreKeyframeAfter.transform);
 }
 
@@ -31,6 +31,11 @@ public:
     bool translationRequired;
     bool translationIsDynamic;
 
+    // Set by classify().  A constant component has been snapped to
+    // keyframes[0] in every keyframe, so it is never interpolated.
+    bool translationIsConstant;
+    bool rotationIsConstant;
+
     CalCoreTrack(int coreBoneId, const KeyframeList& keyframes);
 
     size_t sizeInBytes() const;
@@ -41,6 +46,11 @@ public:
         const CalCoreBone& bone,
         const cal3d::RotateTranslate& adjustedRootTransform);
     void rotateTranslate(cal3d::RotateTranslate &rt);
+    void classify(double translationTolerance, double rotationToleranceDegrees);
+
+    bool isConstant() const {
+        return translationIsConstant && rotationIsConstant;
+    }
 
     cal3d::RotateTranslate getCurrentTransform(float time) const;
 
@@ -21,6 +21,7 @@
 #include "cal3d/platform.h"
 
 typedef unsigned short CalIndex;
+typedef unsigned int CalIndex32;
 
 const float EPSILON = 1e-5f;
 
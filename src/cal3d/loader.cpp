@@ -903,6 +903,10 @@ CalCoreSubmeshPtr CalLoader::loadCoreSubmesh(CalBufferSource& dataSrc, int versi
     CalCoreSubmeshPtr pCoreSubmesh(new CalCoreSubmesh(vertexCount, textureCoordinateCount ? true : false, faceCount));
     pCoreSubmesh->coreMaterialThreadId = coreMaterialThreadId;
 
+    // the exporter's progressive mesh collapses the last lodCount vertices
+    CalCoreSubmesh::LodCollapseVector lodCollapses;
+    const int firstCollapsedVertex = vertexCount - lodCount;
+
     for (int vertexId = 0; vertexId < vertexCount; ++vertexId) {
         CalCoreSubmesh::Vertex vertex;
         CalColor32 vertexColor;
@@ -926,6 +930,11 @@ CalCoreSubmeshPtr CalLoader::loadCoreSubmesh(CalBufferSource& dataSrc, int versi
         int faceCollapseCount;
         dataSrc.readInteger(collapseId);
         dataSrc.readInteger(faceCollapseCount);
+        if (lodCount > 0 && vertexId >= firstCollapsedVertex &&
+            collapseId >= 0 && collapseId < vertexId &&
+            faceCollapseCount >= 0) {
+            lodCollapses.push_back(CalCoreSubmesh::LodCollapse(collapseId, faceCollapseCount));
+        }
 
         for (int textureCoordinateId = 0; textureCoordinateId < textureCoordinateCount; ++textureCoordinateId) {
             CalCoreSubmesh::TextureCoordinate textureCoordinate;
@@ -1007,18 +1016,28 @@ CalCoreSubmeshPtr CalLoader::loadCoreSubmesh(CalBufferSource& dataSrc, int versi
         pCoreSubmesh->addMorphTarget(morphTarget);
     }
 
+    // faces are stored as 32-bit integers; submeshes with more than 65536
+    // vertices keep them that wide
+    const unsigned maxIndex = pCoreSubmesh->getIndexSize() == 2 ? 0xFFFF : 0xFFFFFFFF;
     for (int faceId = 0; faceId < faceCount; ++faceId) {
         int tmp[3];
         dataSrc.readInteger(tmp[0]);
         dataSrc.readInteger(tmp[1]);
         dataSrc.readInteger(tmp[2]);
 
-        if (tmp[0] > 65535 || tmp[1] > 65535 || tmp[2] > 65535) {
+        if (tmp[0] < 0 || tmp[1] < 0 || tmp[2] < 0 ||
+            unsigned(tmp[0]) > maxIndex || unsigned(tmp[1]) > maxIndex || unsigned(tmp[2]) > maxIndex) {
             CalError::setLastError(CalError::INVALID_FILE_FORMAT, __FILE__, __LINE__);
             return CalCoreSubmeshPtr();
         }
 
-        pCoreSubmesh->addFace(CalCoreSubmesh::Face(tmp[0], tmp[1], tmp[2]));
+        pCoreSubmesh->addFace(CalCoreSubmesh::WideFace(tmp[0], tmp[1], tmp[2]));
+    }
+
+    // Collapse data that doesn't fit is dropped; the full mesh still
+    // loads.
+    if (lodCount > 0 && int(lodCollapses.size()) == lodCount) {
+        pCoreSubmesh->setLodCollapses(lodCollapses);
     }
 
     return pCoreSubmesh;
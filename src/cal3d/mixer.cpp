@@ -52,18 +52,27 @@ void CalMixer::updateSkeleton(
     for (auto itaa = activeAnimations.begin(); itaa != activeAnimations.end(); ++itaa) {
         const auto& animation = itaa->get();
 
-        const auto& tracks = animation->coreAnimation->tracks;
+        const float weight = animation->weight * animation->rampValue;
+        // higher priority animations replace 0-priority animations
+        const float attenuation = animation->priority != 0 ? animation->rampValue : 0.0f;
 
-        for (auto track = tracks.begin(); track != tracks.end(); ++track) {
-            if (track->coreBoneId >= bones.size()) {
-                continue;
-            }
+        const auto& tracks = animation->coreAnimation->tracks;
+        const auto& bindings = animation->getTrackBindings(bones.size());
+        for (auto binding = bindings.begin(); binding != bindings.end(); ++binding) {
+            bones[binding->boneId].blendPose(
+                weight,
+                tracks[binding->trackIndex].getCurrentTransform(animation->time),
+                attenuation);
+        }
 
-            bones[track->coreBoneId].blendPose(
-                animation->weight * animation->rampValue,
-                track->getCurrentTransform(animation->time),
-                // higher priority animations replace 0-priority animations
-                animation->priority != 0 ? animation->rampValue : 0.0f);
+        // folded tracks need no keyframe search or interpolation
+        const auto& constantTracks = animation->coreAnimation->constantTracks;
+        const auto& constantBindings = animation->getConstantTrackBindings(bones.size());
+        for (auto binding = constantBindings.begin(); binding != constantBindings.end(); ++binding) {
+            bones[binding->boneId].blendPose(
+                weight,
+                constantTracks[binding->trackIndex].transform,
+                attenuation);
         }
     }
 
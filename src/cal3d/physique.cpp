@@ -12,7 +12,9 @@
 #include "config.h"
 #endif
 
+#include <algorithm>
 #include <assert.h>
+#include <math.h>
 #ifndef IMVU_NO_INTRINSICS
 #include <xmmintrin.h>
 #endif
@@ -408,8 +410,24 @@ void automaticallyDetectSkinRoutine(
 
 namespace {
     cal3d::SSEArray<CalCoreSubmesh::Vertex> MorphSubmeshCache;
+    cal3d::SSEArray<BoneTransform> BonePaletteCache;
+    cal3d::SSEArray<BoneTransform> InfluenceSetTransformCache;
+    std::vector<unsigned char> VisibleRangeMask;
+
+    const BoneTransform* gatherBonePaletteCache(
+        const BoneTransform* boneTransforms,
+        const CalCoreSubmesh& coreSubmesh
+    ) {
+        const size_t paletteSize = coreSubmesh.getPaletteBoneIds().size();
+        if (paletteSize > BonePaletteCache.size()) {
+            BonePaletteCache.destructive_resize(paletteSize);
+        }
+        CalPhysique::gatherBonePalette(boneTransforms, coreSubmesh, BonePaletteCache.data());
+        return BonePaletteCache.data();
+    }
 
     void accumulateMorphTarget(
+        size_t vertexCount,
         const cal3d::MorphTarget* morphTarget
     ) {
         // VC++ isn't hoisting this SSE register out of the loop, so do it manually.
@@ -420,6 +438,9 @@ namespace {
         const VertexOffset* lastMorphVertex = morphVertex + vertexOffsets.size();
         for (; morphVertex != lastMorphVertex; ++morphVertex) {
             size_t i = morphVertex->vertexId;
+            if (i >= vertexCount) {
+                continue; // past the level of detail's prefix
+            }
             MorphSubmeshCache[i].position += weight * morphVertex->position;
             MorphSubmeshCache[i].normal   += weight * morphVertex->normal;
         }
@@ -446,7 +467,7 @@ namespace {
         // Now find active morph targets and accumulate them
         while (morphTarget != morphTargetEnd) {
             if (morphTarget->weight != 0.0f) {
-                accumulateMorphTarget(morphTarget);
+                accumulateMorphTarget(vertexCount, morphTarget);
             }
             ++morphTarget;
         }
@@ -455,13 +476,388 @@ namespace {
     }
 }
 
+void CalPhysique::gatherBonePalette(
+    const BoneTransform* boneTransforms,
+    const CalCoreSubmesh& coreSubmesh,
+    BoneTransform* palette
+) {
+    const std::vector<unsigned>& boneIds = coreSubmesh.getPaletteBoneIds();
+    for (size_t i = 0; i < boneIds.size(); ++i) {
+        palette[i] = boneTransforms[boneIds[i]];
+    }
+}
+
+static bool hasActiveMorphTargets(const CalSubmesh* submesh) {
+    for (auto i = submesh->morphTargets.begin(); i != submesh->morphTargets.end(); ++i) {
+        if (i->weight != 0.0f) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool byRangeBegin(const CalCoreSubmesh::VertexRange& lhs, const CalCoreSubmesh::VertexRange& rhs) {
+    return lhs.begin < rhs.begin;
+}
+
+// sorts, then merges overlapping and adjacent ranges in place
+static void mergeVertexRanges(CalCoreSubmesh::VertexRangeVector& ranges) {
+    if (ranges.empty()) {
+        return;
+    }
+    std::sort(ranges.begin(), ranges.end(), byRangeBegin);
+    auto merged = ranges.begin();
+    for (auto i = ranges.begin() + 1; i != ranges.end(); ++i) {
+        if (i->begin <= merged->end) {
+            merged->end = std::max(merged->end, i->end);
+        } else {
+            *++merged = *i;
+        }
+    }
+    ranges.erase(merged + 1, ranges.end());
+}
+
+// drops what lies past a level of detail's vertex prefix from sorted ranges
+static void clipVertexRanges(CalCoreSubmesh::VertexRangeVector& ranges, unsigned vertexCount) {
+    while (!ranges.empty() && ranges.back().begin >= vertexCount) {
+        ranges.pop_back();
+    }
+    if (!ranges.empty()) {
+        ranges.back().end = std::min(ranges.back().end, vertexCount);
+    }
+}
+
+// The vertices a raised level of detail added since the last skin, which
+// the buffer has never held, or nothing.
+static bool grownVertexRange(
+    const CalCoreSubmesh& coreSubmesh,
+    unsigned skinnedCount,
+    unsigned vertexCount,
+    CalCoreSubmesh::VertexRange& range
+) {
+    if (vertexCount <= skinnedCount) {
+        return false;
+    }
+
+    // step back from the end, since the collapsed tail is usually short
+    const CalCoreSubmesh::InfluenceVector& influences = coreSubmesh.getPaletteInfluences();
+    size_t firstInfluence = influences.size();
+    for (size_t v = coreSubmesh.getVertexCount(); v > skinnedCount; --v) {
+        --firstInfluence;
+        while (firstInfluence > 0 && !influences[firstInfluence - 1].lastInfluenceForThisVertex) {
+            --firstInfluence;
+        }
+    }
+
+    range.begin = skinnedCount;
+    range.end = vertexCount;
+    range.firstInfluence = unsigned(firstInfluence);
+    return true;
+}
+
+static void skinVertexRanges(
+    const BoneTransform* palette,
+    const CalCoreSubmesh& coreSubmesh,
+    const CalCoreSubmesh::VertexRangeVector& ranges,
+    float* pVertexBuffer
+) {
+    const CalCoreSubmesh::Vertex* vertices = cal3d::pointerFromVector(coreSubmesh.getVectorVertex());
+    const CalCoreSubmesh::Influence* influences = cal3d::pointerFromVector(coreSubmesh.getPaletteInfluences());
+    CalVector4* output = reinterpret_cast<CalVector4*>(pVertexBuffer);
+    for (auto range = ranges.begin(); range != ranges.end(); ++range) {
+        optimizedSkinRoutine(
+            palette,
+            range->end - range->begin,
+            vertices + range->begin,
+            influences + range->firstInfluence,
+            output + 2 * range->begin);
+    }
+}
+
+void CalPhysique::calculateDirtyVerticesAndNormals(
+    const BoneTransform* boneTransforms,
+    const CalSubmesh* submesh,
+    const std::vector<unsigned>& dirtyBones,
+    float* pVertexBuffer,
+    CalCoreSubmesh::VertexRangeVector& dirtyRanges
+) {
+    CalCoreSubmesh* coreSubmesh = submesh->coreSubmesh.get();
+    const unsigned vertexCount = submesh->getLodPrefix().vertexCount;
+    const unsigned skinnedCount = submesh->skinnedVertexCount;
+    submesh->skinnedVertexCount = vertexCount;
+    dirtyRanges.clear();
+
+    // once the last morph target turns off, vertices under clean bones
+    // still hold their morphed positions
+    const bool morphed = hasActiveMorphTargets(submesh);
+    const bool wasMorphed = submesh->morphedLastDirtySkin;
+    submesh->morphedLastDirtySkin = morphed;
+    if (morphed || wasMorphed) {
+        calculateVerticesAndNormals(boneTransforms, submesh, pVertexBuffer);
+        if (vertexCount) {
+            CalCoreSubmesh::VertexRange everything = { 0, vertexCount, 0 };
+            dirtyRanges.push_back(everything);
+        }
+        return;
+    }
+
+    // a partial update leaves the buffer matching no single remembered pose
+    submesh->skinningCache.invalidate();
+
+    const std::vector<CalCoreSubmesh::VertexRangeVector>& boneVertexRanges = coreSubmesh->getBoneVertexRanges();
+    for (auto bone = dirtyBones.begin(); bone != dirtyBones.end(); ++bone) {
+        if (*bone < boneVertexRanges.size()) {
+            const CalCoreSubmesh::VertexRangeVector& ranges = boneVertexRanges[*bone];
+            dirtyRanges.insert(dirtyRanges.end(), ranges.begin(), ranges.end());
+        }
+    }
+    CalCoreSubmesh::VertexRange grown;
+    if (grownVertexRange(*coreSubmesh, skinnedCount, vertexCount, grown)) {
+        dirtyRanges.push_back(grown);
+    }
+    if (dirtyRanges.empty()) {
+        return;
+    }
+    mergeVertexRanges(dirtyRanges);
+    clipVertexRanges(dirtyRanges, vertexCount);
+    if (dirtyRanges.empty()) {
+        return;
+    }
+
+    const BoneTransform* palette = gatherBonePaletteCache(boneTransforms, *coreSubmesh);
+    skinVertexRanges(palette, *coreSubmesh, dirtyRanges, pVertexBuffer);
+}
+
+// How far a bone transform can stretch a unit vector.  Exact when the
+// columns are orthogonal (a rotation times a scale); otherwise the
+// Frobenius norm, which bounds it.  uniform is set when every direction is
+// stretched alike, so normals keep their angles.
+static float boneStretch(const BoneTransform& bt, bool& uniform) {
+    const CalVector c0(bt.rowx.x, bt.rowy.x, bt.rowz.x);
+    const CalVector c1(bt.rowx.y, bt.rowy.y, bt.rowz.y);
+    const CalVector c2(bt.rowx.z, bt.rowy.z, bt.rowz.z);
+    const float l0 = c0.length();
+    const float l1 = c1.length();
+    const float l2 = c2.length();
+    const float Tolerance = 1e-3f;
+    const bool orthogonal =
+        fabsf(dot(c0, c1)) <= Tolerance * l0 * l1 &&
+        fabsf(dot(c0, c2)) <= Tolerance * l0 * l2 &&
+        fabsf(dot(c1, c2)) <= Tolerance * l1 * l2;
+    if (!orthogonal) {
+        uniform = false;
+        return sqrtf(l0 * l0 + l1 * l1 + l2 * l2);
+    }
+    const float longest = std::max(l0, std::max(l1, l2));
+    const float shortest = std::min(l0, std::min(l1, l2));
+    uniform = longest - shortest <= Tolerance * longest;
+    return longest;
+}
+
+// Poses a cluster's bind-pose sphere and normal cone.  Each bone's copy
+// of the sphere grows by how far that bone stretches.  Every skinned
+// vertex is a convex blend of its position under each bone, so a sphere
+// around all the per-bone spheres holds it, and the cone widens by the
+// spread of the per-bone axes.  A bone that scales unevenly bends normals
+// by an amount the cone can't bound, so the cone is dropped.
+static void poseCluster(
+    const CalCoreSubmesh::Cluster& cluster,
+    const unsigned* bones,
+    const BoneTransform* palette,
+    CalVector& center,
+    float& radius,
+    CalVector& coneAxis,
+    float& coneCutoff
+) {
+    const CalBase4 bindCenter(cluster.center.x, cluster.center.y, cluster.center.z, 1.0f);
+    const CalBase4 bindAxis(cluster.coneAxis.x, cluster.coneAxis.y, cluster.coneAxis.z, 0.0f);
+    CalVector4 c;
+    CalVector4 a;
+    CalVector centerSum;
+    CalVector axisSum;
+    float stretch = 0.0f;
+    bool allUniform = true;
+    for (unsigned i = 0; i < cluster.boneCount; ++i) {
+        const BoneTransform& bt = palette[bones[i]];
+        TransformPoint(c, bt, bindCenter);
+        TransformVector(a, bt, bindAxis);
+        centerSum += c.asCalVector();
+        const float axisLength = a.asCalVector().length();
+        if (axisLength > 0.0f) {
+            axisSum += a.asCalVector() / axisLength;
+        }
+        bool uniform;
+        stretch = std::max(stretch, boneStretch(bt, uniform));
+        allUniform = allUniform && uniform;
+    }
+    center = centerSum / float(cluster.boneCount);
+    radius = cluster.radius * stretch;
+    coneCutoff = allUniform ? cluster.coneCutoff : 2.0f;
+
+    const float axisLength = axisSum.length();
+    if (axisLength > 0.0f) {
+        coneAxis = axisSum / axisLength;
+    } else {
+        coneAxis = axisSum;
+        coneCutoff = 2.0f;
+    }
+    if (cluster.boneCount == 1) {
+        return;
+    }
+
+    float spread = 0.0f;
+    float cosSpread = 1.0f;
+    for (unsigned i = 0; i < cluster.boneCount; ++i) {
+        TransformPoint(c, palette[bones[i]], bindCenter);
+        TransformVector(a, palette[bones[i]], bindAxis);
+        spread = std::max(spread, (c.asCalVector() - center).length());
+        const float length = a.asCalVector().length();
+        cosSpread = std::min(cosSpread, length > 0.0f ? dot(a.asCalVector(), coneAxis) / length : -1.0f);
+    }
+    radius += spread;
+
+    // the sine of the cluster's half angle plus the spread, unless that
+    // reaches a hemisphere
+    const float sinCone = coneCutoff;
+    const float cosCone = sqrtf(std::max(0.0f, 1.0f - sinCone * sinCone));
+    const float sinSpread = sqrtf(std::max(0.0f, 1.0f - cosSpread * cosSpread));
+    if (sinCone > 1.0f || cosSpread <= 0.0f || cosCone * cosSpread - sinCone * sinSpread <= 0.0f) {
+        coneCutoff = 2.0f;
+    } else {
+        coneCutoff = sinCone * cosSpread + cosCone * sinSpread;
+    }
+}
+
+static bool isClusterCulled(
+    const CalVector& center,
+    float radius,
+    const CalVector& coneAxis,
+    float coneCutoff,
+    const CalVector& cameraPosition,
+    const CalVector4* planes,
+    size_t planeCount,
+    bool cullBackFacing
+) {
+    for (size_t i = 0; i < planeCount; ++i) {
+        // planes need not be normalized, so the radius is scaled to match
+        const CalVector4& p = planes[i];
+        const float normalLength = sqrtf(p.x * p.x + p.y * p.y + p.z * p.z);
+        if (p.x * center.x + p.y * center.y + p.z * center.z + p.w < -radius * normalLength) {
+            return true;
+        }
+    }
+
+    // Every normal in the cone points away from every point in the sphere
+    // when the angle from the axis to the sphere's center, plus the angle
+    // the sphere subtends, plus the cone's half angle is under 90 degrees.
+    if (cullBackFacing && coneCutoff <= 1.0f) {
+        const CalVector toCenter = center - cameraPosition;
+        const float distanceSquared = toCenter.lengthSquared();
+        const float radiusSquared = radius * radius;
+        if (distanceSquared <= radiusSquared) {
+            return false;
+        }
+        const float cosCone = sqrtf(1.0f - coneCutoff * coneCutoff);
+        return dot(toCenter, coneAxis) > coneCutoff * sqrtf(distanceSquared - radiusSquared) + cosCone * radius;
+    }
+    return false;
+}
+
+void CalPhysique::calculateVisibleVerticesAndNormals(
+    const BoneTransform* boneTransforms,
+    const CalSubmesh* submesh,
+    const CalVector& cameraPosition,
+    const CalVector4* planes,
+    size_t planeCount,
+    bool cullBackFacing,
+    float* pVertexBuffer,
+    CalCoreSubmesh::VertexRangeVector& skinnedRanges
+) {
+    CalCoreSubmesh* coreSubmesh = submesh->coreSubmesh.get();
+    cal3d::verify(coreSubmesh->hasClusters() || !coreSubmesh->getFaceCount(), "Call buildClusters() before skinning visible clusters");
+    const unsigned vertexCount = submesh->getLodPrefix().vertexCount;
+    const unsigned skinnedCount = submesh->skinnedVertexCount;
+    submesh->skinnedVertexCount = vertexCount;
+    skinnedRanges.clear();
+
+    // morphs move vertices outside the bind-pose bounds, and once the
+    // last morph target turns off, vertices of culled clusters still hold
+    // their morphed positions
+    const bool morphed = hasActiveMorphTargets(submesh);
+    const bool wasMorphed = submesh->morphedLastDirtySkin;
+    submesh->morphedLastDirtySkin = morphed;
+    if (morphed || wasMorphed) {
+        calculateVerticesAndNormals(boneTransforms, submesh, pVertexBuffer);
+        if (vertexCount) {
+            CalCoreSubmesh::VertexRange everything = { 0, vertexCount, 0 };
+            skinnedRanges.push_back(everything);
+        }
+        return;
+    }
+
+    submesh->skinningCache.invalidate();
+
+    const BoneTransform* palette = gatherBonePaletteCache(boneTransforms, *coreSubmesh);
+    const CalCoreSubmesh::ClusterVector& clusters = coreSubmesh->getClusters();
+    const unsigned* clusterBones = cal3d::pointerFromVector(coreSubmesh->getClusterBones());
+    const unsigned* rangeIndices = cal3d::pointerFromVector(coreSubmesh->getClusterRangeIndices());
+    const CalCoreSubmesh::VertexRangeVector& clusterRanges = coreSubmesh->getClusterVertexRanges();
+
+    // Clusters share vertices, so mark the disjoint ranges they're made of
+    // and emit the marked ones in order, rather than sorting.
+    VisibleRangeMask.assign(clusterRanges.size(), 0);
+    for (auto cluster = clusters.begin(); cluster != clusters.end(); ++cluster) {
+        if (cluster->boneCount) {
+            CalVector center;
+            float radius;
+            CalVector coneAxis;
+            float coneCutoff;
+            poseCluster(*cluster, clusterBones + cluster->firstBone, palette, center, radius, coneAxis, coneCutoff);
+            if (isClusterCulled(center, radius, coneAxis, coneCutoff, cameraPosition, planes, planeCount, cullBackFacing)) {
+                continue;
+            }
+        }
+        for (unsigned r = cluster->firstRange; r < cluster->firstRange + cluster->rangeCount; ++r) {
+            VisibleRangeMask[rangeIndices[r]] = 1;
+        }
+    }
+
+    for (size_t r = 0; r < clusterRanges.size(); ++r) {
+        if (VisibleRangeMask[r]) {
+            if (!skinnedRanges.empty() && skinnedRanges.back().end == clusterRanges[r].begin) {
+                skinnedRanges.back().end = clusterRanges[r].end;
+            } else {
+                skinnedRanges.push_back(clusterRanges[r]);
+            }
+        }
+    }
+    clipVertexRanges(skinnedRanges, vertexCount);
+
+    // culled or not, vertices a raised level of detail added must not be
+    // left uninitialized
+    CalCoreSubmesh::VertexRange grown;
+    if (grownVertexRange(*coreSubmesh, skinnedCount, vertexCount, grown)) {
+        skinnedRanges.push_back(grown);
+        mergeVertexRanges(skinnedRanges);
+    }
+
+    skinVertexRanges(palette, *coreSubmesh, skinnedRanges, pVertexBuffer);
+}
+
 void CalPhysique::calculateVerticesAndNormals(
     const BoneTransform* boneTransforms,
     const CalSubmesh* submesh,
     float* pVertexBuffer
 ) {
     CalCoreSubmesh* coreSubmesh = submesh->coreSubmesh.get();
-    const size_t vertexCount = coreSubmesh->getVertexCount();
+    const BoneTransform* palette = gatherBonePaletteCache(boneTransforms, *coreSubmesh);
+    if (submesh->skinningCache.enabled && submesh->skinningCache.lookup(palette, *submesh, pVertexBuffer)) {
+        return;
+    }
+
+    // the level of detail's prefix; its influences are a prefix too
+    const size_t vertexCount = submesh->getLodPrefix().vertexCount;
+    submesh->skinnedVertexCount = unsigned(vertexCount);
     const CalCoreSubmesh::Vertex* sourceVertices = cal3d::pointerFromVector(coreSubmesh->getVectorVertex());
 
     // TODO: We could kill the O(PossibleMorphTargets) loop by maintaining
@@ -479,10 +875,58 @@ void CalPhysique::calculateVerticesAndNormals(
     }
 
     return optimizedSkinRoutine(
-        boneTransforms,
+        palette,
+        vertexCount,
+        sourceVertices,
+        cal3d::pointerFromVector(coreSubmesh->getPaletteInfluences()),
+        reinterpret_cast<CalVector4*>(pVertexBuffer));
+}
+
+void CalPhysique::calculateVerticesAndNormalsByInfluenceSet(
+    const BoneTransform* boneTransforms,
+    const CalSubmesh* submesh,
+    float* pVertexBuffer
+) {
+    CalCoreSubmesh* coreSubmesh = submesh->coreSubmesh.get();
+    cal3d::verify(coreSubmesh->hasInfluenceSets() || !coreSubmesh->getVertexCount(), "Call dedupeInfluenceSets() before skinning by influence set");
+
+    const BoneTransform* palette = gatherBonePaletteCache(boneTransforms, *coreSubmesh);
+    if (submesh->skinningCache.enabled && submesh->skinningCache.lookup(palette, *submesh, pVertexBuffer)) {
+        return;
+    }
+
+    const size_t setCount = coreSubmesh->getInfluenceSetCount();
+    if (setCount > InfluenceSetTransformCache.size()) {
+        InfluenceSetTransformCache.destructive_resize(setCount);
+    }
+
+    const CalCoreSubmesh::Influence* influence = cal3d::pointerFromVector(coreSubmesh->getInfluenceSets());
+    for (size_t i = 0; i < setCount; ++i) {
+        BoneTransform& transform = InfluenceSetTransformCache[i];
+        ScaleMatrix(transform, palette[influence->boneId], influence->weight);
+        while (!influence++->lastInfluenceForThisVertex) {
+            AddScaledMatrix(transform, palette[influence->boneId], influence->weight);
+        }
+    }
+
+    const size_t vertexCount = submesh->getLodPrefix().vertexCount;
+    submesh->skinnedVertexCount = unsigned(vertexCount);
+    const CalCoreSubmesh::Vertex* sourceVertices = cal3d::pointerFromVector(coreSubmesh->getVectorVertex());
+    if (hasActiveMorphTargets(submesh)) {
+        const cal3d::MorphTarget* morphTarget = cal3d::pointerFromVector(submesh->morphTargets);
+        const cal3d::MorphTarget* morphTargetEnd = morphTarget + submesh->morphTargets.size();
+        while (morphTarget->weight == 0.0f) {
+            ++morphTarget;
+        }
+        sourceVertices = accumulateMorphTargets(vertexCount, sourceVertices, morphTarget, morphTargetEnd);
+    }
+
+    // one unit-weight influence per vertex: just the 3x4 transform
+    optimizedSkinRoutine(
+        InfluenceSetTransformCache.data(),
         vertexCount,
         sourceVertices,
-        cal3d::pointerFromVector(coreSubmesh->getInfluences()),
+        cal3d::pointerFromVector(coreSubmesh->getVertexInfluenceSets()),
         reinterpret_cast<CalVector4*>(pVertexBuffer));
 }
 
@@ -49,8 +49,66 @@ namespace CalPhysique {
         CalVector4* output_vertices);
 #endif
 
+    // Copies the transforms of coreSubmesh.getPaletteBoneIds() into
+    // palette, which needs room for that many.  Upload the result with
+    // coreSubmesh.getPaletteInfluences() instead of the full skeleton.
+    CAL3D_API void gatherBonePalette(
+        const BoneTransform* boneTransforms,
+        const CalCoreSubmesh& coreSubmesh,
+        BoneTransform* palette);
+
+    // Skins against the submesh's compact palette, gathered from
+    // boneTransforms.  Only the vertices of the submesh's level of detail
+    // (CalSubmesh::getLodPrefix()) are written.
     CAL3D_API void calculateVerticesAndNormals(
         const BoneTransform* boneTransforms,
         const CalSubmesh* pSubmesh,
         float* pVertexBuffer);
+
+    // Blends each of the submesh's deduplicated influence sets once, then
+    // transforms every vertex of the level of detail's prefix by its set's
+    // matrix.  Requires CalCoreSubmesh::dedupeInfluenceSets().
+    CAL3D_API void calculateVerticesAndNormalsByInfluenceSet(
+        const BoneTransform* boneTransforms,
+        const CalSubmesh* pSubmesh,
+        float* pVertexBuffer);
+
+    // Re-skins only the vertices influenced by dirtyBones (e.g.
+    // CalSkeleton::getDirtyBones()), leaving the rest of pVertexBuffer as
+    // the previous call for this submesh wrote it.  dirtyRanges receives
+    // the sorted, merged vertex ranges that were rewritten, clipped to the
+    // level of detail's prefix.  Vertices the prefix gained since the last
+    // call (CalSubmesh::skinnedVertexCount) are skinned too.  Submeshes
+    // with active morph targets, or with some active on the previous call,
+    // are skinned in full.
+    CAL3D_API void calculateDirtyVerticesAndNormals(
+        const BoneTransform* boneTransforms,
+        const CalSubmesh* pSubmesh,
+        const std::vector<unsigned>& dirtyBones,
+        float* pVertexBuffer,
+        CalCoreSubmesh::VertexRangeVector& dirtyRanges);
+
+    // Skins only the vertices of clusters (see CalCoreSubmesh::buildClusters)
+    // that may be visible.  Each cluster's bounding sphere and normal cone
+    // are posed by the bones influencing it, which may scale; clusters
+    // whose sphere lies behind one of the planes, or, if cullBackFacing,
+    // whose faces all face away from cameraPosition, are skipped and their
+    // vertices keep whatever pVertexBuffer held.  Each plane (a, b, c, d)
+    // keeps a*x + b*y + c*z + d >= 0 on the inside and need not be
+    // normalized, so frustum planes can come straight from a
+    // view-projection matrix.  cameraPosition and the planes are in the
+    // space boneTransforms map to.
+    // skinnedRanges receives the sorted, merged vertex ranges written,
+    // clipped to the level of detail's prefix; vertices the prefix gained
+    // since the last call are always written.  Submeshes with active
+    // morph targets are always skinned in full.
+    CAL3D_API void calculateVisibleVerticesAndNormals(
+        const BoneTransform* boneTransforms,
+        const CalSubmesh* pSubmesh,
+        const CalVector& cameraPosition,
+        const CalVector4* planes,
+        size_t planeCount,
+        bool cullBackFacing,
+        float* pVertexBuffer,
+        CalCoreSubmesh::VertexRangeVector& skinnedRanges);
 };
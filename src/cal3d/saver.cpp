@@ -131,25 +131,17 @@ bool CalSaver::saveCoreAnimation(std::ostream& file, CalCoreAnimation* pCoreAnim
         return false;
     }
 
-    // get core track list
-    CalCoreAnimation::TrackList& listCoreTrack = pCoreAnimation->tracks;
-
     // write the number of tracks
-    if (!CalPlatform::writeInteger(file, listCoreTrack.size())) {
+    if (!CalPlatform::writeInteger(file, pCoreAnimation->getTrackCount())) {
         CalError::setLastError(CalError::FILE_WRITING_FAILED, __FILE__, __LINE__, strFilename);
         return 0;
     }
 
-    // write all core bones
-    CalCoreAnimation::TrackList::iterator iteratorCoreTrack;
-    for (iteratorCoreTrack = listCoreTrack.begin(); iteratorCoreTrack != listCoreTrack.end(); ++iteratorCoreTrack) {
-        // save core track
-        if (!saveCoreTrack(file, strFilename, &*iteratorCoreTrack)) {
-            return false;
-        }
-    }
-
-    return true;
+    // write all core bones, folded ones back in their original order so
+    // the file format doesn't change
+    return pCoreAnimation->visitTracks([&](const CalCoreTrack& coreTrack) {
+        return saveCoreTrack(file, strFilename, &coreTrack);
+    });
 }
 
 
@@ -584,12 +576,12 @@ bool CalSaver::saveCoreSubmesh(std::ostream& os, CalCoreSubmesh* pCoreSubmesh) {
     // get the vertex, face, physical property and spring vector
     const cal3d::SSEArray<CalCoreSubmesh::Vertex>& vectorVertex = pCoreSubmesh->getVectorVertex();
     const std::vector<CalColor32>& vertexColors = pCoreSubmesh->getVertexColors();
-    const std::vector<CalCoreSubmesh::Face>& vectorFace = pCoreSubmesh->getFaces();
+    const size_t faceCount = pCoreSubmesh->getFaceCount();
 
     // write the number of vertices, faces, level-of-details and springs
     CalPlatform::writeInteger(os, vectorVertex.size());
-    CalPlatform::writeInteger(os, vectorFace.size());
-    CalPlatform::writeInteger(os, 0); // lod count
+    CalPlatform::writeInteger(os, faceCount);
+    CalPlatform::writeInteger(os, pCoreSubmesh->getLodCount());
     CalPlatform::writeInteger(os, 0); // spring count
 
     // get the texture coordinate vector vector
@@ -613,6 +605,8 @@ bool CalSaver::saveCoreSubmesh(std::ostream& os, CalCoreSubmesh* pCoreSubmesh) {
     }
 
     // write all vertices
+    const CalCoreSubmesh::LodCollapseVector& lodCollapses = pCoreSubmesh->getLodCollapses();
+    const int firstCollapsedVertex = int(vectorVertex.size() - lodCollapses.size());
     const CalCoreSubmesh::Influence* currentInfluence = cal3d::pointerFromVector(pCoreSubmesh->getInfluences());
     for (int vertexId = 0; vertexId < (int)vectorVertex.size(); ++vertexId) {
         const CalCoreSubmesh::Vertex& vertex = vectorVertex[vertexId];
@@ -628,8 +622,14 @@ bool CalSaver::saveCoreSubmesh(std::ostream& os, CalCoreSubmesh* pCoreSubmesh) {
         CalPlatform::writeFloat(os, vc.x);
         CalPlatform::writeFloat(os, vc.y);
         CalPlatform::writeFloat(os, vc.z);
-        CalPlatform::writeInteger(os, -1); // collapseId
-        CalPlatform::writeInteger(os, 0); // faceCollapseCount
+        if (vertexId >= firstCollapsedVertex) {
+            const CalCoreSubmesh::LodCollapse& collapse = lodCollapses[vertexId - firstCollapsedVertex];
+            CalPlatform::writeInteger(os, collapse.collapseId);
+            CalPlatform::writeInteger(os, collapse.faceCollapseCount);
+        } else {
+            CalPlatform::writeInteger(os, -1); // collapseId
+            CalPlatform::writeInteger(os, 0); // faceCollapseCount
+        }
 
         // write all texture coordinates of this vertex
         int textureCoordinateId;
@@ -698,8 +698,9 @@ bool CalSaver::saveCoreSubmesh(std::ostream& os, CalCoreSubmesh* pCoreSubmesh) {
         CalPlatform::writeInteger(os, vectorVertex.size() + 1);
     }
 
-    for (int faceId = 0; faceId < (int)vectorFace.size(); ++faceId) {
-        const CalCoreSubmesh::Face& face = vectorFace[faceId];
+    // faces of either index width are written as 32-bit integers
+    for (int faceId = 0; faceId < (int)faceCount; ++faceId) {
+        const CalCoreSubmesh::WideFace face = pCoreSubmesh->getFace(faceId);
 
         CalPlatform::writeInteger(os, face.vertexId[0]);
         CalPlatform::writeInteger(os, face.vertexId[1]);
@@ -945,16 +946,13 @@ bool CalSaver::saveXmlCoreAnimation(std::ostream& os, CalCoreAnimation* pCoreAni
     str << pCoreAnimation->duration;
     animation.SetAttribute("DURATION", str.str());
 
-    // get core track list
-    CalCoreAnimation::TrackList& listCoreTrack = pCoreAnimation->tracks;
-
-    animation.SetAttribute("NUMTRACKS", listCoreTrack.size());
+    animation.SetAttribute("NUMTRACKS", pCoreAnimation->getTrackCount());
 
 
-    // write all core bones
-    CalCoreAnimation::TrackList::iterator iteratorCoreTrack;
-    for (iteratorCoreTrack = listCoreTrack.begin(); iteratorCoreTrack != listCoreTrack.end(); ++iteratorCoreTrack) {
-        const CalCoreTrack* pCoreTrack = &*iteratorCoreTrack;
+    // write all core bones, folded ones back in their original order so
+    // the file format doesn't change
+    pCoreAnimation->visitTracks([&](const CalCoreTrack& coreTrack) {
+        const CalCoreTrack* pCoreTrack = &coreTrack;
 
         TiXmlElement track("TRACK");
         track.SetAttribute("BONEID", pCoreTrack->coreBoneId);
@@ -1013,7 +1011,8 @@ bool CalSaver::saveXmlCoreAnimation(std::ostream& os, CalCoreAnimation* pCoreAni
         }
 
         animation.InsertEndChild(track);
-    }
+        return true;
+    });
 
     doc.InsertEndChild(animation);
 
@@ -1162,17 +1161,17 @@ bool CalSaver::saveXmlCoreMesh(std::ostream& os, CalCoreMesh* pCoreMesh) {
         }
 
         submesh.SetAttribute("NUMVERTICES", pCoreSubmesh->getVertexCount());
-        submesh.SetAttribute("NUMFACES", pCoreSubmesh->getFaces().size());
+        submesh.SetAttribute("NUMFACES", pCoreSubmesh->getFaceCount());
         submesh.SetAttribute("MATERIAL", pCoreSubmesh->coreMaterialThreadId);
-        submesh.SetAttribute("NUMLODSTEPS", 0);
+        submesh.SetAttribute("NUMLODSTEPS", pCoreSubmesh->getLodCount());
         submesh.SetAttribute("NUMSPRINGS", 0);
         submesh.SetAttribute("NUMMORPHS", vectorMorphs.size());
         submesh.SetAttribute("NUMTEXCOORDS", vectorvectorTextureCoordinate.size());
 
         const cal3d::SSEArray<CalCoreSubmesh::Vertex>& vectorVertex = pCoreSubmesh->getVectorVertex();
         const std::vector<CalColor32>& vertexColors = pCoreSubmesh->getVertexColors();
-
-        const std::vector<CalCoreSubmesh::Face>& vectorFace = pCoreSubmesh->getFaces();
+        const CalCoreSubmesh::LodCollapseVector& lodCollapses = pCoreSubmesh->getLodCollapses();
+        const int firstCollapsedVertex = int(vectorVertex.size() - lodCollapses.size());
 
         const CalCoreSubmesh::Influence* currentInfluence = cal3d::pointerFromVector(pCoreSubmesh->getInfluences());
         for (int vertexId = 0; vertexId < (int)vectorVertex.size(); ++vertexId) {
@@ -1226,6 +1225,25 @@ bool CalSaver::saveXmlCoreMesh(std::ostream& os, CalCoreMesh* pCoreMesh) {
             vertColor.InsertEndChild(colordata);
             vertex.InsertEndChild(vertColor);
 
+            // only the collapsing vertices carry collapse data
+            if (vertexId >= firstCollapsedVertex) {
+                const CalCoreSubmesh::LodCollapse& lodCollapse = lodCollapses[vertexId - firstCollapsedVertex];
+
+                TiXmlElement collapseId("COLLAPSEID");
+                str.str("");
+                str << lodCollapse.collapseId;
+                TiXmlText collapseIdData(str.str());
+                collapseId.InsertEndChild(collapseIdData);
+                vertex.InsertEndChild(collapseId);
+
+                TiXmlElement collapseCount("COLLAPSECOUNT");
+                str.str("");
+                str << lodCollapse.faceCollapseCount;
+                TiXmlText collapseCountData(str.str());
+                collapseCount.InsertEndChild(collapseCountData);
+                vertex.InsertEndChild(collapseCount);
+            }
+
             // write all texture coordinates of this vertex
             int textureCoordinateId;
             for (textureCoordinateId = 0; textureCoordinateId < (int)vectorvectorTextureCoordinate.size(); ++textureCoordinateId) {
@@ -1333,8 +1351,8 @@ bool CalSaver::saveXmlCoreMesh(std::ostream& os, CalCoreMesh* pCoreMesh) {
 
         // write all faces
         int faceId;
-        for (faceId = 0; faceId < (int)vectorFace.size(); ++faceId) {
-            const CalCoreSubmesh::Face& Face = vectorFace[faceId];
+        for (faceId = 0; faceId < (int)pCoreSubmesh->getFaceCount(); ++faceId) {
+            const CalCoreSubmesh::WideFace Face = pCoreSubmesh->getFace(faceId);
 
             TiXmlElement face("FACE");
 
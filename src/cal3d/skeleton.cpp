@@ -14,13 +14,19 @@
 
 #include <algorithm>
 #include <utility>
+#ifndef IMVU_NO_INTRINSICS
+#include <xmmintrin.h>
+#endif
 #include "cal3d/skeleton.h"
 #include "cal3d/error.h"
 #include "cal3d/bone.h"
 #include "cal3d/coreskeleton.h"
 #include "cal3d/corebone.h" // DEBUG
 
-CalSkeleton::CalSkeleton(const CalCoreSkeletonPtr& coreSkeleton) {
+CalSkeleton::CalSkeleton(const CalCoreSkeletonPtr& coreSkeleton)
+    : poseSolved(false)
+    , solvedScaleFree(false)
+{
     // clone the skeleton structure of the core skeleton
     const auto& coreBones = coreSkeleton->coreBones;
 
@@ -37,16 +43,417 @@ CalSkeleton::CalSkeleton(const CalCoreSkeletonPtr& coreSkeleton) {
     }
 
     boneTransforms.destructive_resize(boneCount);
+
+    solvedRelativeTransforms.resize(boneCount);
+    solvedScales.resize(boneCount);
+    dirtyFlags.resize(boneCount);
+
+    // bucket the bones by depth; parents always precede children, so a
+    // bone's depth is known by the time we reach it
+    std::vector<unsigned> depths(boneCount);
+    unsigned maxDepth = 0;
+    for (size_t boneId = 0; boneId < boneCount; ++boneId) {
+        int parentId = bones[boneId].parentId;
+        depths[boneId] = (parentId == -1) ? 0 : depths[parentId] + 1;
+        maxDepth = std::max(maxDepth, depths[boneId]);
+    }
+
+    levelStarts.assign(boneCount ? maxDepth + 2 : 1, 0);
+    for (size_t boneId = 0; boneId < boneCount; ++boneId) {
+        ++levelStarts[depths[boneId] + 1];
+    }
+    for (size_t level = 1; level < levelStarts.size(); ++level) {
+        levelStarts[level] += levelStarts[level - 1];
+    }
+
+    std::vector<size_t> next(levelStarts.begin(), levelStarts.end() - 1);
+    levelOrder.resize(boneCount);
+    for (size_t boneId = 0; boneId < boneCount; ++boneId) {
+        levelOrder[next[depths[boneId]]++] = boneId;
+    }
 }
 
 void CalSkeleton::resetPose() {
     std::for_each(bones.begin(), bones.end(), std::mem_fun_ref(&CalBone::resetPose));
 }
 
+bool CalSkeleton::isScaleFree() const {
+    for (auto i = bones.begin(); i != bones.end(); ++i) {
+        if (!i->scale.isIdentity()) {
+            return false;
+        }
+    }
+    return true;
+}
+
 void CalSkeleton::calculateAbsolutePose() {
+    const bool scaleFree = isScaleFree();
+    findDirtyBones(scaleFree);
+    if (!dirtyBoneIds.empty()) {
+        solveDirtyBones(scaleFree);
+    }
+}
+
+// A bone is dirty if its local pose or scale differs from the last solve,
+// or if its parent is dirty.
+void CalSkeleton::findDirtyBones(bool scaleFree) {
+    const bool everything = !poseSolved || scaleFree != solvedScaleFree;
+    poseSolved = true;
+    solvedScaleFree = scaleFree;
+
+    dirtyBoneIds.clear();
+    for (size_t boneId = 0; boneId < bones.size(); ++boneId) {
+        const CalBone& bone = bones[boneId];
+        bool dirty = everything
+            || (bone.parentId != -1 && dirtyFlags[bone.parentId])
+            || !(bone.getRelativeTransform() == solvedRelativeTransforms[boneId])
+            || !(bone.scale.scale == solvedScales[boneId].scale);
+        dirtyFlags[boneId] = dirty;
+        if (dirty) {
+            solvedRelativeTransforms[boneId] = bone.getRelativeTransform();
+            solvedScales[boneId] = bone.scale;
+            dirtyBoneIds.push_back(boneId);
+        }
+    }
+
+    dirtyLevelOrder.clear();
+    dirtyLevelStarts.assign(1, 0);
+    for (size_t level = 0; level + 1 < levelStarts.size(); ++level) {
+        for (size_t i = levelStarts[level]; i < levelStarts[level + 1]; ++i) {
+            if (dirtyFlags[levelOrder[i]]) {
+                dirtyLevelOrder.push_back(levelOrder[i]);
+            }
+        }
+        dirtyLevelStarts.push_back(dirtyLevelOrder.size());
+    }
+}
+
+#ifndef IMVU_NO_INTRINSICS
+
+namespace {
+    // Four affine transforms, one per SSE lane: c[column][row] is the
+    // basis and t[row] the translation.
+    struct Transform4 {
+        __m128 c[3][3];
+        __m128 t[3];
+    };
+
+    inline void loadColumn(__m128* out, const CalVector* const* v) {
+        out[0] = _mm_setr_ps(v[0]->x, v[1]->x, v[2]->x, v[3]->x);
+        out[1] = _mm_setr_ps(v[0]->y, v[1]->y, v[2]->y, v[3]->y);
+        out[2] = _mm_setr_ps(v[0]->z, v[1]->z, v[2]->z, v[3]->z);
+    }
+
+    Transform4 loadTransform(const cal3d::Transform* const* t) {
+        Transform4 r;
+        const CalVector* cx[4] = { &t[0]->basis.cx, &t[1]->basis.cx, &t[2]->basis.cx, &t[3]->basis.cx };
+        const CalVector* cy[4] = { &t[0]->basis.cy, &t[1]->basis.cy, &t[2]->basis.cy, &t[3]->basis.cy };
+        const CalVector* cz[4] = { &t[0]->basis.cz, &t[1]->basis.cz, &t[2]->basis.cz, &t[3]->basis.cz };
+        const CalVector* tr[4] = { &t[0]->translation, &t[1]->translation, &t[2]->translation, &t[3]->translation };
+        loadColumn(r.c[0], cx);
+        loadColumn(r.c[1], cy);
+        loadColumn(r.c[2], cz);
+        loadColumn(r.t, tr);
+        return r;
+    }
+
+    // Four RotateTranslates, one per SSE lane: q is the rotation's x, y,
+    // z and w, t the translation.
+    struct RotateTranslate4 {
+        __m128 q[4];
+        __m128 t[3];
+    };
+
+    RotateTranslate4 loadRotateTranslate4(const cal3d::RotateTranslate* const* rt) {
+        RotateTranslate4 r;
+        r.q[0] = _mm_setr_ps(rt[0]->rotation.x, rt[1]->rotation.x, rt[2]->rotation.x, rt[3]->rotation.x);
+        r.q[1] = _mm_setr_ps(rt[0]->rotation.y, rt[1]->rotation.y, rt[2]->rotation.y, rt[3]->rotation.y);
+        r.q[2] = _mm_setr_ps(rt[0]->rotation.z, rt[1]->rotation.z, rt[2]->rotation.z, rt[3]->rotation.z);
+        r.q[3] = _mm_setr_ps(rt[0]->rotation.w, rt[1]->rotation.w, rt[2]->rotation.w, rt[3]->rotation.w);
+        const CalVector* tr[4] = { &rt[0]->translation, &rt[1]->translation, &rt[2]->translation, &rt[3]->translation };
+        loadColumn(r.t, tr);
+        return r;
+    }
+
+    // same products as CalQuaternion's operator*
+    void multiplyQuaternions(__m128* r, const __m128* outer, const __m128* inner) {
+        const __m128 x = outer[0], y = outer[1], z = outer[2], w = outer[3];
+        r[0] = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(w, inner[0]), _mm_mul_ps(x, inner[3])), _mm_mul_ps(y, inner[2])), _mm_mul_ps(z, inner[1]));
+        r[1] = _mm_add_ps(_mm_add_ps(_mm_sub_ps(_mm_mul_ps(w, inner[1]), _mm_mul_ps(x, inner[2])), _mm_mul_ps(y, inner[3])), _mm_mul_ps(z, inner[0]));
+        r[2] = _mm_add_ps(_mm_sub_ps(_mm_add_ps(_mm_mul_ps(w, inner[2]), _mm_mul_ps(x, inner[1])), _mm_mul_ps(y, inner[0])), _mm_mul_ps(z, inner[3]));
+        r[3] = _mm_sub_ps(_mm_sub_ps(_mm_sub_ps(_mm_mul_ps(w, inner[3]), _mm_mul_ps(x, inner[0])), _mm_mul_ps(y, inner[1])), _mm_mul_ps(z, inner[2]));
+    }
+
+    // cal3d::RotateTranslate's operator*: the rotation turns the inner
+    // translation as q * v * conjugate(q), like CalQuaternion * CalVector.
+    RotateTranslate4 multiply(const RotateTranslate4& outer, const RotateTranslate4& inner) {
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 negative = _mm_set1_ps(-0.0f);
+        const __m128 v[4] = { inner.t[0], inner.t[1], inner.t[2], zero };
+        const __m128 conjugate[4] = {
+            _mm_xor_ps(outer.q[0], negative),
+            _mm_xor_ps(outer.q[1], negative),
+            _mm_xor_ps(outer.q[2], negative),
+            outer.q[3],
+        };
+        __m128 temp[4];
+        __m128 rotated[4];
+        multiplyQuaternions(temp, v, conjugate);
+        multiplyQuaternions(rotated, outer.q, temp);
+
+        RotateTranslate4 r;
+        multiplyQuaternions(r.q, outer.q, inner.q);
+        for (int row = 0; row < 3; ++row) {
+            r.t[row] = _mm_add_ps(rotated[row], outer.t[row]);
+        }
+        return r;
+    }
+
+    void storeRotateTranslate(cal3d::RotateTranslate* const* out, const RotateTranslate4& rt) {
+        CAL3D_ALIGN_HEAD(16) float lanes[7][4] CAL3D_ALIGN_TAIL(16);
+        for (int i = 0; i < 4; ++i) {
+            _mm_store_ps(lanes[i], rt.q[i]);
+        }
+        for (int row = 0; row < 3; ++row) {
+            _mm_store_ps(lanes[4 + row], rt.t[row]);
+        }
+        for (int lane = 0; lane < 4; ++lane) {
+            out[lane]->rotation = CalQuaternion(lanes[0][lane], lanes[1][lane], lanes[2][lane], lanes[3][lane]);
+            out[lane]->translation = CalVector(lanes[4][lane], lanes[5][lane], lanes[6][lane]);
+        }
+    }
+
+    // same expansion as CalMatrix(const CalQuaternion&)
+    Transform4 expand(const RotateTranslate4& rt) {
+        const __m128 two = _mm_set1_ps(2.0f);
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 x = rt.q[0];
+        const __m128 y = rt.q[1];
+        const __m128 z = rt.q[2];
+        const __m128 w = rt.q[3];
+
+        const __m128 x2 = _mm_mul_ps(x, two);
+        const __m128 y2 = _mm_mul_ps(y, two);
+        const __m128 z2 = _mm_mul_ps(z, two);
+        const __m128 xx2 = _mm_mul_ps(x, x2);
+        const __m128 yy2 = _mm_mul_ps(y, y2);
+        const __m128 zz2 = _mm_mul_ps(z, z2);
+        const __m128 xy2 = _mm_mul_ps(x, y2);
+        const __m128 zw2 = _mm_mul_ps(w, z2);
+        const __m128 xz2 = _mm_mul_ps(x, z2);
+        const __m128 yw2 = _mm_mul_ps(w, y2);
+        const __m128 yz2 = _mm_mul_ps(y, z2);
+        const __m128 xw2 = _mm_mul_ps(w, x2);
+
+        Transform4 r;
+        r.c[0][0] = _mm_sub_ps(_mm_sub_ps(one, yy2), zz2);
+        r.c[1][0] = _mm_sub_ps(xy2, zw2);
+        r.c[2][0] = _mm_add_ps(xz2, yw2);
+        r.c[0][1] = _mm_add_ps(xy2, zw2);
+        r.c[1][1] = _mm_sub_ps(_mm_sub_ps(one, xx2), zz2);
+        r.c[2][1] = _mm_sub_ps(yz2, xw2);
+        r.c[0][2] = _mm_sub_ps(xz2, yw2);
+        r.c[1][2] = _mm_add_ps(yz2, xw2);
+        r.c[2][2] = _mm_sub_ps(_mm_sub_ps(one, xx2), yy2);
+
+        for (int row = 0; row < 3; ++row) {
+            r.t[row] = rt.t[row];
+        }
+        return r;
+    }
+
+    Transform4 loadRotateTranslate(const cal3d::RotateTranslate* const* rt) {
+        return expand(loadRotateTranslate4(rt));
+    }
+
+    inline __m128 dot3(__m128 a0, __m128 a1, __m128 a2, __m128 b0, __m128 b1, __m128 b2) {
+        return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a0, b0), _mm_mul_ps(a1, b1)), _mm_mul_ps(a2, b2));
+    }
+
+    Transform4 multiply(const Transform4& outer, const Transform4& inner) {
+        Transform4 r;
+        for (int row = 0; row < 3; ++row) {
+            for (int column = 0; column < 3; ++column) {
+                r.c[column][row] = dot3(
+                    outer.c[0][row], outer.c[1][row], outer.c[2][row],
+                    inner.c[column][0], inner.c[column][1], inner.c[column][2]);
+            }
+            r.t[row] = _mm_add_ps(
+                dot3(
+                    outer.c[0][row], outer.c[1][row], outer.c[2][row],
+                    inner.t[0], inner.t[1], inner.t[2]),
+                outer.t[row]);
+        }
+        return r;
+    }
+
+    // removeScale() followed by the bone's absolute scale.  Returns false
+    // if some column is too short for CalVector::normalize's fast case.
+    bool rescaleColumns(Transform4& t, const __m128* scale) {
+        const __m128 epsilon = _mm_set1_ps(0.0001f);
+        for (int column = 0; column < 3; ++column) {
+            __m128 length = _mm_sqrt_ps(dot3(
+                t.c[column][0], t.c[column][1], t.c[column][2],
+                t.c[column][0], t.c[column][1], t.c[column][2]));
+            if (_mm_movemask_ps(_mm_cmplt_ps(length, epsilon))) {
+                return false;
+            }
+            __m128 factor = _mm_div_ps(scale[column], length);
+            t.c[column][0] = _mm_mul_ps(t.c[column][0], factor);
+            t.c[column][1] = _mm_mul_ps(t.c[column][1], factor);
+            t.c[column][2] = _mm_mul_ps(t.c[column][2], factor);
+        }
+        return true;
+    }
+
+    void storeTransform(cal3d::Transform* const* out, const Transform4& t) {
+        CAL3D_ALIGN_HEAD(16) float lanes[12][4] CAL3D_ALIGN_TAIL(16);
+        for (int row = 0; row < 3; ++row) {
+            _mm_store_ps(lanes[row], t.c[0][row]);
+            _mm_store_ps(lanes[3 + row], t.c[1][row]);
+            _mm_store_ps(lanes[6 + row], t.c[2][row]);
+            _mm_store_ps(lanes[9 + row], t.t[row]);
+        }
+        for (int lane = 0; lane < 4; ++lane) {
+            cal3d::Transform& o = *out[lane];
+            o.basis.cx = CalVector(lanes[0][lane], lanes[1][lane], lanes[2][lane]);
+            o.basis.cy = CalVector(lanes[3][lane], lanes[4][lane], lanes[5][lane]);
+            o.basis.cz = CalVector(lanes[6][lane], lanes[7][lane], lanes[8][lane]);
+            o.translation = CalVector(lanes[9][lane], lanes[10][lane], lanes[11][lane]);
+        }
+    }
+
+    // BoneTransform rows are the SoA rows transposed.
+    void storeBoneTransforms(BoneTransform* const* out, const Transform4& t) {
+        __m128 rows[3][4];
+        for (int row = 0; row < 3; ++row) {
+            __m128 r0 = t.c[0][row];
+            __m128 r1 = t.c[1][row];
+            __m128 r2 = t.c[2][row];
+            __m128 r3 = t.t[row];
+            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+            rows[row][0] = r0;
+            rows[row][1] = r1;
+            rows[row][2] = r2;
+            rows[row][3] = r3;
+        }
+        for (int lane = 0; lane < 4; ++lane) {
+            _mm_store_ps(&out[lane]->rowx.x, rows[0][lane]);
+            _mm_store_ps(&out[lane]->rowy.x, rows[1][lane]);
+            _mm_store_ps(&out[lane]->rowz.x, rows[2][lane]);
+        }
+    }
+}
+
+// Bones at the same depth only depend on the previous level, so each level
+// is solved four siblings at a time, one per SSE lane.  The absolute pose and
+// the inverse-bind multiply are fused so the palette is written directly.
+// Without scale, poses compose as quaternions, as in
+// CalBone::calculateAbsolutePoseScaleFree, and only the results are
+// expanded into matrices.
+void CalSkeleton::solveDirtyBones(bool scaleFree) {
+    CalBone* bones_ptr = cal3d::pointerFromVector(bones);
+    const cal3d::Transform identity;
+    const cal3d::RotateTranslate identityRotateTranslate;
+
+    for (size_t level = 0; level + 1 < dirtyLevelStarts.size(); ++level) {
+        const size_t end = dirtyLevelStarts[level + 1];
+        for (size_t first = dirtyLevelStarts[level]; first < end; first += 4) {
+            if (first + 1 == end) {
+                // a lone bone isn't worth the gather and scatter
+                unsigned id = dirtyLevelOrder[first];
+                CalBone& bone = bones_ptr[id];
+                if (scaleFree) {
+                    bone.calculateAbsolutePoseScaleFree(bones_ptr);
+                    boneTransforms[id] = bone.absoluteRotateTranslate * inverseBindPoseTransforms[id];
+                } else {
+                    bone.calculateAbsolutePose(bones_ptr);
+                    boneTransforms[id] = bone.absoluteTransform * inverseBindPoseTransforms[id];
+                }
+                continue;
+            }
+
+            // pad a short group by repeating its last bone
+            unsigned ids[4];
+            for (size_t lane = 0; lane < 4; ++lane) {
+                ids[lane] = dirtyLevelOrder[std::min(first + lane, end - 1)];
+            }
+
+            const cal3d::RotateTranslate* relatives[4];
+            const cal3d::RotateTranslate* inverseBinds[4];
+            cal3d::Transform* absolutes[4];
+            BoneTransform* palette[4];
+            for (int lane = 0; lane < 4; ++lane) {
+                CalBone& bone = bones_ptr[ids[lane]];
+                relatives[lane] = &bone.getRelativeTransform();
+                inverseBinds[lane] = &inverseBindPoseTransforms[ids[lane]];
+                absolutes[lane] = &bone.absoluteTransform;
+                palette[lane] = &boneTransforms[ids[lane]];
+            }
+
+            if (scaleFree) {
+                const cal3d::RotateTranslate* parents[4];
+                cal3d::RotateTranslate* absoluteRotateTranslates[4];
+                for (int lane = 0; lane < 4; ++lane) {
+                    CalBone& bone = bones_ptr[ids[lane]];
+                    parents[lane] = (bone.parentId == -1) ? &identityRotateTranslate : &bones_ptr[bone.parentId].absoluteRotateTranslate;
+                    absoluteRotateTranslates[lane] = &bone.absoluteRotateTranslate;
+                }
+                const RotateTranslate4 absolute = multiply(loadRotateTranslate4(parents), loadRotateTranslate4(relatives));
+                storeRotateTranslate(absoluteRotateTranslates, absolute);
+                storeTransform(absolutes, expand(absolute));
+                storeBoneTransforms(palette, expand(multiply(absolute, loadRotateTranslate4(inverseBinds))));
+                continue;
+            }
+
+            const cal3d::Transform* parents[4];
+            for (int lane = 0; lane < 4; ++lane) {
+                CalBone& bone = bones_ptr[ids[lane]];
+                parents[lane] = (bone.parentId == -1) ? &identity : &bones_ptr[bone.parentId].absoluteTransform;
+            }
+            Transform4 absolute = multiply(loadTransform(parents), loadRotateTranslate(relatives));
+
+            const CalVector* scales[4];
+            for (int lane = 0; lane < 4; ++lane) {
+                CalBone& bone = bones_ptr[ids[lane]];
+                bone.absoluteScale = (bone.parentId == -1)
+                    ? bone.scale
+                    : bones_ptr[bone.parentId].absoluteScale * bone.scale;
+                scales[lane] = &bone.absoluteScale.scale;
+            }
+            __m128 scale[3];
+            loadColumn(scale, scales);
+
+            if (!rescaleColumns(absolute, scale)) {
+                // degenerate basis; let CalVector::normalize pick an axis
+                for (int lane = 0; lane < 4; ++lane) {
+                    bones_ptr[ids[lane]].calculateAbsolutePose(bones_ptr);
+                    boneTransforms[ids[lane]] = bones_ptr[ids[lane]].absoluteTransform * inverseBindPoseTransforms[ids[lane]];
+                }
+                continue;
+            }
+
+            storeTransform(absolutes, absolute);
+            storeBoneTransforms(palette, multiply(absolute, loadRotateTranslate(inverseBinds)));
+        }
+    }
+}
+
+#else
+
+// dirtyBoneIds is in bone id order, which is already topological
+void CalSkeleton::solveDirtyBones(bool scaleFree) {
     CalBone* bones_ptr = cal3d::pointerFromVector(bones);
-    for (unsigned i = 0; i < bones.size(); ++i) {
-        bones_ptr[i].calculateAbsolutePose(bones_ptr);
-        boneTransforms[i] = bones_ptr[i].absoluteTransform * inverseBindPoseTransforms[i];
+
+    for (auto i = dirtyBoneIds.begin(); i != dirtyBoneIds.end(); ++i) {
+        if (scaleFree) {
+            bones_ptr[*i].calculateAbsolutePoseScaleFree(bones_ptr);
+            boneTransforms[*i] = bones_ptr[*i].absoluteRotateTranslate * inverseBindPoseTransforms[*i];
+        } else {
+            bones_ptr[*i].calculateAbsolutePose(bones_ptr);
+            boneTransforms[*i] = bones_ptr[*i].absoluteTransform * inverseBindPoseTransforms[*i];
+        }
     }
 }
+
+#endif
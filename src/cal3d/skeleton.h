@@ -27,10 +27,48 @@ public:
     CalSkeleton(const CalCoreSkeletonPtr& coreSkeleton);
 
     void resetPose();
+
+    // Only bones whose local pose or scale changed since the last call, and
+    // their descendants, are recomputed.
     void calculateAbsolutePose();
+    // Forces the next calculateAbsolutePose to recompute every bone, e.g.
+    // after editing inverseBindPoseTransforms.
+    void invalidatePose() {
+        poseSolved = false;
+    }
+
+    // The bones recomputed by the last calculateAbsolutePose, in id order.
+    // Their boneTransforms entries are the only ones that changed.
+    const std::vector<unsigned>& getDirtyBones() const {
+        return dirtyBoneIds;
+    }
+
+    // True when no bone carries a scale, so calculateAbsolutePose can
+    // stay in quaternion space.
+    bool isScaleFree() const;
 
     // same length
     BoneArray bones;
     std::vector<cal3d::RotateTranslate> inverseBindPoseTransforms;
     cal3d::SSEArray<BoneTransform> boneTransforms;
+
+private:
+    void findDirtyBones(bool scaleFree);
+    void solveDirtyBones(bool scaleFree);
+
+    // bone ids sorted by depth; level d is levelOrder[levelStarts[d]..levelStarts[d + 1])
+    std::vector<unsigned> levelOrder;
+    std::vector<size_t> levelStarts;
+
+    // local pose as of the last solve
+    bool poseSolved;
+    bool solvedScaleFree;
+    std::vector<cal3d::RotateTranslate> solvedRelativeTransforms;
+    std::vector<cal3d::Scale> solvedScales;
+
+    std::vector<bool> dirtyFlags;
+    std::vector<unsigned> dirtyBoneIds;
+    // dirtyBoneIds bucketed like levelOrder
+    std::vector<unsigned> dirtyLevelOrder;
+    std::vector<size_t> dirtyLevelStarts;
 };
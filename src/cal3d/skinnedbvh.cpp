@@ -0,0 +1,373 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <algorithm>
+#include <math.h>
+#ifndef IMVU_NO_INTRINSICS
+#include <xmmintrin.h>
+#endif
+#include "cal3d/skinnedbvh.h"
+#include "cal3d/error.h"
+
+namespace {
+    struct CentroidLess {
+        explicit CentroidLess(int axis)
+            : axis(axis)
+        {}
+
+        template<typename T>
+        bool operator()(const T& lhs, const T& rhs) const {
+            return component(lhs.centroid) < component(rhs.centroid);
+        }
+
+        float component(const CalVector& v) const {
+            return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+        }
+
+        int axis;
+    };
+
+    bool rayHitsBox(
+        const CalSkinnedBVH::Node& node,
+        const CalVector& origin,
+        const CalVector& inverseDirection,
+        float maxDistance
+    ) {
+        float t0 = (node.min.x - origin.x) * inverseDirection.x;
+        float t1 = (node.max.x - origin.x) * inverseDirection.x;
+        float tmin = std::min(t0, t1);
+        float tmax = std::max(t0, t1);
+
+        t0 = (node.min.y - origin.y) * inverseDirection.y;
+        t1 = (node.max.y - origin.y) * inverseDirection.y;
+        tmin = std::max(tmin, std::min(t0, t1));
+        tmax = std::min(tmax, std::max(t0, t1));
+
+        t0 = (node.min.z - origin.z) * inverseDirection.z;
+        t1 = (node.max.z - origin.z) * inverseDirection.z;
+        tmin = std::max(tmin, std::min(t0, t1));
+        tmax = std::min(tmax, std::max(t0, t1));
+
+        return tmax >= std::max(tmin, 0.0f) && tmin <= maxDistance;
+    }
+
+    // Moller-Trumbore, accepting both windings
+    bool rayHitsTriangle(
+        const CalVector& origin,
+        const CalVector& direction,
+        const CalVector& a,
+        const CalVector& b,
+        const CalVector& c,
+        float& t,
+        float& u,
+        float& v
+    ) {
+        const CalVector e1 = b - a;
+        const CalVector e2 = c - a;
+        const CalVector p = cross(direction, e2);
+        const float det = dot(e1, p);
+        if (det == 0.0f) {
+            return false;
+        }
+        const float inverseDet = 1.0f / det;
+
+        const CalVector s = origin - a;
+        u = dot(s, p) * inverseDet;
+        if (u < 0.0f || u > 1.0f) {
+            return false;
+        }
+
+        const CalVector q = cross(s, e1);
+        v = dot(direction, q) * inverseDet;
+        if (v < 0.0f || u + v > 1.0f) {
+            return false;
+        }
+
+        t = dot(e2, q) * inverseDet;
+        return true;
+    }
+}
+
+struct CalSkinnedBVH::BuildTriangle {
+    Triangle triangle;
+    CalVector centroid;
+};
+
+template<typename F>
+void CalSkinnedBVH::forEachLeafVertex(F f) const {
+    for (unsigned n = 0; n < nodes.size(); ++n) {
+        const Node& node = nodes[n];
+        for (unsigned i = node.first; node.count && i < node.first + node.count; ++i) {
+            const CalCoreSubmesh::WideFace face = submeshes[triangles[i].submesh]->getFace(triangles[i].face);
+            for (int k = 0; k < 3; ++k) {
+                f(n, triangles[i].submesh, face.vertexId[k]);
+            }
+        }
+    }
+}
+
+CalSkinnedBVH::CalSkinnedBVH(const std::vector<CalCoreSubmeshPtr>& submeshes_)
+    : submeshes(submeshes_)
+{
+    std::vector<BuildTriangle> buildTriangles;
+    for (unsigned s = 0; s < submeshes.size(); ++s) {
+        const CalCoreSubmesh::VectorVertex& vertices = submeshes[s]->getVectorVertex();
+        // a Vertex is laid out like a skinned output vertex
+        positions.push_back(vertices.size() ? &vertices[0].position.x : 0);
+
+        const size_t faceCount = submeshes[s]->getFaceCount();
+        for (unsigned f = 0; f < faceCount; ++f) {
+            const CalCoreSubmesh::WideFace face = submeshes[s]->getFace(f);
+            BuildTriangle bt;
+            bt.triangle.submesh = s;
+            bt.triangle.face = f;
+            bt.centroid =
+                (vertices[face.vertexId[0]].position.asCalVector() +
+                 vertices[face.vertexId[1]].position.asCalVector() +
+                 vertices[face.vertexId[2]].position.asCalVector()) / 3.0f;
+            buildTriangles.push_back(bt);
+        }
+    }
+
+    if (buildTriangles.empty()) {
+        return;
+    }
+
+    nodes.push_back(Node());
+    build(0, 0, buildTriangles.size(), buildTriangles);
+
+    triangles.resize(buildTriangles.size());
+    for (size_t i = 0; i < buildTriangles.size(); ++i) {
+        triangles[i] = buildTriangles[i].triangle;
+    }
+
+    // count, then fill, the leaves touching each vertex
+    vertexLeafStarts.resize(submeshes.size());
+    vertexLeaves.resize(submeshes.size());
+    for (unsigned s = 0; s < submeshes.size(); ++s) {
+        vertexLeafStarts[s].assign(submeshes[s]->getVertexCount() + 1, 0);
+    }
+    forEachLeafVertex([this](unsigned, unsigned submesh, unsigned vertex) {
+        ++vertexLeafStarts[submesh][vertex + 1];
+    });
+
+    std::vector<std::vector<unsigned>> cursors(submeshes.size());
+    for (unsigned s = 0; s < submeshes.size(); ++s) {
+        std::vector<unsigned>& starts = vertexLeafStarts[s];
+        for (size_t v = 1; v < starts.size(); ++v) {
+            starts[v] += starts[v - 1];
+        }
+        vertexLeaves[s].resize(starts.back());
+        cursors[s] = starts;
+    }
+    forEachLeafVertex([this, &cursors](unsigned leaf, unsigned submesh, unsigned vertex) {
+        vertexLeaves[submesh][cursors[submesh][vertex]++] = leaf;
+    });
+    dirtyNodes.assign(nodes.size(), false);
+
+    refitNodes(false);
+}
+
+void CalSkinnedBVH::build(unsigned node, unsigned first, unsigned count, std::vector<BuildTriangle>& buildTriangles) {
+    if (count <= MaxLeafTriangles) {
+        nodes[node].first = first;
+        nodes[node].count = count;
+        return;
+    }
+
+    CalVector lo = buildTriangles[first].centroid;
+    CalVector hi = lo;
+    for (unsigned i = first + 1; i < first + count; ++i) {
+        const CalVector& c = buildTriangles[i].centroid;
+        lo.set(std::min(lo.x, c.x), std::min(lo.y, c.y), std::min(lo.z, c.z));
+        hi.set(std::max(hi.x, c.x), std::max(hi.y, c.y), std::max(hi.z, c.z));
+    }
+    const CalVector extent = hi - lo;
+    const int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z ? 1 : 2);
+
+    // median split keeps the tree balanced and shallow
+    const unsigned half = count / 2;
+    std::nth_element(
+        buildTriangles.begin() + first,
+        buildTriangles.begin() + first + half,
+        buildTriangles.begin() + first + count,
+        CentroidLess(axis));
+
+    const unsigned left = nodes.size();
+    nodes.push_back(Node());
+    nodes.push_back(Node());
+    nodes[node].first = left;
+    nodes[node].count = 0;
+
+    build(left, first, half, buildTriangles);
+    build(left + 1, first + half, count - half, buildTriangles);
+}
+
+const CalVector4& CalSkinnedBVH::position(unsigned submesh, unsigned vertex) const {
+    return *reinterpret_cast<const CalVector4*>(positions[submesh] + 8 * vertex);
+}
+
+void CalSkinnedBVH::refitLeaf(Node& node) const {
+    const Triangle* triangle = &triangles[node.first];
+    const Triangle* end = triangle + node.count;
+    CalCoreSubmesh::WideFace face = submeshes[triangle->submesh]->getFace(triangle->face);
+
+#ifndef IMVU_NO_INTRINSICS
+    // skinned buffers are only guaranteed float alignment
+    __m128 lo = _mm_loadu_ps(&position(triangle->submesh, face.vertexId[0]).x);
+    __m128 hi = lo;
+    for (; triangle != end; ++triangle) {
+        face = submeshes[triangle->submesh]->getFace(triangle->face);
+        for (int k = 0; k < 3; ++k) {
+            const __m128 p = _mm_loadu_ps(&position(triangle->submesh, face.vertexId[k]).x);
+            lo = _mm_min_ps(lo, p);
+            hi = _mm_max_ps(hi, p);
+        }
+    }
+    _mm_store_ps(&node.min.x, lo);
+    _mm_store_ps(&node.max.x, hi);
+#else
+    CalVector4 lo = position(triangle->submesh, face.vertexId[0]);
+    CalVector4 hi = lo;
+    for (; triangle != end; ++triangle) {
+        face = submeshes[triangle->submesh]->getFace(triangle->face);
+        for (int k = 0; k < 3; ++k) {
+            const CalVector4& p = position(triangle->submesh, face.vertexId[k]);
+            lo.set(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z), 0.0f);
+            hi.set(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z), 0.0f);
+        }
+    }
+    node.min = lo;
+    node.max = hi;
+#endif
+}
+
+void CalSkinnedBVH::refitInterior(Node& node) const {
+    const Node& left = nodes[node.first];
+    const Node& right = nodes[node.first + 1];
+#ifndef IMVU_NO_INTRINSICS
+    _mm_store_ps(&node.min.x, _mm_min_ps(_mm_load_ps(&left.min.x), _mm_load_ps(&right.min.x)));
+    _mm_store_ps(&node.max.x, _mm_max_ps(_mm_load_ps(&left.max.x), _mm_load_ps(&right.max.x)));
+#else
+    node.min.set(
+        std::min(left.min.x, right.min.x),
+        std::min(left.min.y, right.min.y),
+        std::min(left.min.z, right.min.z),
+        0.0f);
+    node.max.set(
+        std::max(left.max.x, right.max.x),
+        std::max(left.max.y, right.max.y),
+        std::max(left.max.z, right.max.z),
+        0.0f);
+#endif
+}
+
+// Children follow their parents, so walking backwards is bottom-up.
+void CalSkinnedBVH::refitNodes(bool onlyDirty) {
+    for (size_t i = nodes.size(); i--;) {
+        Node& node = nodes[i];
+        if (onlyDirty) {
+            if (!node.count) {
+                dirtyNodes[i] = dirtyNodes[node.first] || dirtyNodes[node.first + 1];
+            }
+            if (!dirtyNodes[i]) {
+                continue;
+            }
+        }
+
+        if (node.count) {
+            refitLeaf(node);
+        } else {
+            refitInterior(node);
+        }
+    }
+
+    if (onlyDirty) {
+        dirtyNodes.assign(nodes.size(), false);
+    }
+}
+
+void CalSkinnedBVH::refit(const std::vector<const float*>& vertexBuffers) {
+    cal3d::verify(vertexBuffers.size() == submeshes.size(), "refit needs one vertex buffer per submesh");
+    positions = vertexBuffers;
+    refitNodes(false);
+}
+
+void CalSkinnedBVH::refitDirty(
+    const std::vector<const float*>& vertexBuffers,
+    const std::vector<CalCoreSubmesh::VertexRangeVector>& dirtyRanges
+) {
+    cal3d::verify(vertexBuffers.size() == submeshes.size(), "refit needs one vertex buffer per submesh");
+    cal3d::verify(dirtyRanges.size() == submeshes.size(), "refitDirty needs dirty ranges per submesh");
+    positions = vertexBuffers;
+    if (!nodes.size()) {
+        return;
+    }
+
+    for (size_t s = 0; s < dirtyRanges.size(); ++s) {
+        const std::vector<unsigned>& starts = vertexLeafStarts[s];
+        const std::vector<unsigned>& leaves = vertexLeaves[s];
+        for (auto range = dirtyRanges[s].begin(); range != dirtyRanges[s].end(); ++range) {
+            for (unsigned i = starts[range->begin]; i < starts[range->end]; ++i) {
+                dirtyNodes[leaves[i]] = true;
+            }
+        }
+    }
+
+    refitNodes(true);
+}
+
+bool CalSkinnedBVH::intersectRay(const CalVector& origin, const CalVector& direction, float maxDistance, Hit& hit) const {
+    if (!nodes.size()) {
+        return false;
+    }
+
+    const CalVector inverseDirection(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+    float nearest = maxDistance;
+    bool found = false;
+
+    // a median split tree is at most 32 levels deep for 2^32 leaves
+    unsigned stack[64];
+    unsigned stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize) {
+        const Node& node = nodes[stack[--stackSize]];
+        if (!rayHitsBox(node, origin, inverseDirection, nearest)) {
+            continue;
+        }
+
+        if (!node.count) {
+            stack[stackSize++] = node.first + 1;
+            stack[stackSize++] = node.first;
+            continue;
+        }
+
+        for (unsigned i = node.first; i < node.first + node.count; ++i) {
+            const Triangle& triangle = triangles[i];
+            const CalCoreSubmesh::WideFace face = submeshes[triangle.submesh]->getFace(triangle.face);
+            float t, u, v;
+            if (rayHitsTriangle(
+                    origin, direction,
+                    position(triangle.submesh, face.vertexId[0]).asCalVector(),
+                    position(triangle.submesh, face.vertexId[1]).asCalVector(),
+                    position(triangle.submesh, face.vertexId[2]).asCalVector(),
+                    t, u, v) &&
+                t >= 0.0f && t <= nearest
+            ) {
+                nearest = t;
+                hit.submesh = triangle.submesh;
+                hit.face = triangle.face;
+                hit.distance = t;
+                hit.u = u;
+                hit.v = v;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+bool CalSkinnedBVH::intersectSegment(const CalVector& from, const CalVector& to, Hit& hit) const {
+    return intersectRay(from, to - from, 1.0f, hit);
+}
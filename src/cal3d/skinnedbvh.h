@@ -0,0 +1,86 @@
+#pragma once
+
+#include <vector>
+#include "cal3d/coresubmesh.h"
+#include "cal3d/global.h"
+#include "cal3d/memory.h"
+#include "cal3d/vector.h"
+#include "cal3d/vector4.h"
+
+// A bounding volume hierarchy over the faces of a set of core submeshes,
+// built once in the bind pose and refit from skinned vertex buffers every
+// frame, so picking and hit tests don't have to test every triangle.  The
+// tree topology never changes; only node bounds do, so queries stay
+// correct but slow down if the pose strays far from the bind pose.
+class CAL3D_API CalSkinnedBVH {
+public:
+    struct Hit {
+        unsigned submesh; // index into the submeshes given to the constructor
+        unsigned face;    // that submesh's getFace() index
+        float distance;   // along the query direction, in units of its length
+        float u;          // barycentric weight of face vertexId[1]
+        float v;          // barycentric weight of face vertexId[2]
+    };
+
+    CAL3D_ALIGN_HEAD(16)
+    struct Node {
+        CalVector4 min;
+        CalVector4 max;
+        unsigned first; // leaf: first entry in triangles; otherwise left child
+        unsigned count; // leaf: triangle count; 0 for interior nodes
+        unsigned padding[2];
+    }
+    CAL3D_ALIGN_TAIL(16);
+
+    struct Triangle {
+        unsigned submesh;
+        unsigned face;
+    };
+
+    static const unsigned MaxLeafTriangles = 4;
+
+    explicit CalSkinnedBVH(const std::vector<CalCoreSubmeshPtr>& submeshes);
+
+    // vertexBuffers[i] is submesh i's skinned output as written by
+    // CalPhysique (two CalVector4 per vertex).  The buffers are read again
+    // by queries, so keep them alive and unchanged until the next refit.
+    void refit(const std::vector<const float*>& vertexBuffers);
+
+    // As refit(), but only recomputes nodes over triangles touching
+    // dirtyRanges[i], e.g. from CalPhysique::calculateDirtyVerticesAndNormals.
+    void refitDirty(
+        const std::vector<const float*>& vertexBuffers,
+        const std::vector<CalCoreSubmesh::VertexRangeVector>& dirtyRanges);
+
+    // Nearest hit with distance in [0, maxDistance].  Back faces count.
+    bool intersectRay(const CalVector& origin, const CalVector& direction, float maxDistance, Hit& hit) const;
+    bool intersectSegment(const CalVector& from, const CalVector& to, Hit& hit) const;
+
+    const cal3d::SSEArray<Node>& getNodes() const {
+        return nodes;
+    }
+
+    const std::vector<Triangle>& getTriangles() const {
+        return triangles;
+    }
+
+private:
+    std::vector<CalCoreSubmeshPtr> submeshes;
+    std::vector<const float*> positions; // per submesh, stride 8 floats
+    cal3d::SSEArray<Node> nodes; // children always follow their parent
+    std::vector<Triangle> triangles; // leaf order
+
+    // vertex -> leaves using it, per submesh, for dirty refits
+    std::vector<std::vector<unsigned>> vertexLeafStarts;
+    std::vector<std::vector<unsigned>> vertexLeaves;
+    std::vector<bool> dirtyNodes;
+
+    struct BuildTriangle;
+    void build(unsigned node, unsigned first, unsigned count, std::vector<BuildTriangle>& buildTriangles);
+    template<typename F>
+    void forEachLeafVertex(F f) const;
+    void refitLeaf(Node& node) const;
+    void refitInterior(Node& node) const;
+    void refitNodes(bool onlyDirty);
+    const CalVector4& position(unsigned submesh, unsigned vertex) const;
+};
@@ -47,9 +47,15 @@ std::ostream& operator<<(std::ostream& os, const CalAABox& box) {
 std::ostream& operator<<(std::ostream& os, const CalCoreAnimation& animation) {
     os << "CalCoreAnimation(" << animation.duration << ", ";
     writeIterable(os, animation.tracks);
+    os << ", ";
+    writeIterable(os, animation.constantTracks);
     return os << ")";
 }
 
+std::ostream& operator<<(std::ostream& os, const CalCoreAnimation::ConstantTrack& ct) {
+    return os << "ConstantTrack(" << ct.trackIndex << ", " << ct.coreBoneId << ", " << ct.keyframeCount << ", " << ct.transform << ")";
+}
+
 std::ostream& operator<<(std::ostream& os, const CalCoreKeyframe& keyframe) {
     return os << "CalCoreKeyframe(" << keyframe.time << ", " << keyframe.transform << ")";
 }
@@ -1,10 +1,10 @@
 #pragma once
 
+#include <cal3d/coreanimation.h>
 #include <cal3d/coresubmesh.h>
 
 #include <iosfwd>
 
-class CalCoreAnimation;
 class CalCoreKeyframe;
 class CalCoreTrack;
 class CalQuaternion;
@@ -24,6 +24,7 @@ CAL3D_API std::ostream& operator<<(std::ostream& os, const cal3d::RotateTranslat
 CAL3D_API std::ostream& operator<<(std::ostream& os, const cal3d::Transform& t);
 CAL3D_API std::ostream& operator<<(std::ostream& os, const CalAABox& box);
 CAL3D_API std::ostream& operator<<(std::ostream& os, const CalCoreAnimation& animation);
+CAL3D_API std::ostream& operator<<(std::ostream& os, const CalCoreAnimation::ConstantTrack& ct);
 CAL3D_API std::ostream& operator<<(std::ostream& os, const CalCoreKeyframe& keyframe);
 CAL3D_API std::ostream& operator<<(std::ostream& os, const CalCoreSubmesh::TextureCoordinate& tc);
 CAL3D_API std::ostream& operator<<(std::ostream& os, const CalCoreSubmesh::Vertex& vertex);
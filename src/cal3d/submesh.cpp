@@ -12,6 +12,7 @@
 #include "config.h"
 #endif
 
+#include <algorithm>
 #include <string>
 #include <boost/static_assert.hpp>
 #include "cal3d/submesh.h"
@@ -40,6 +41,9 @@ void cal3d::MorphTarget::resetState() {
 
 CalSubmesh::CalSubmesh(const CalCoreSubmeshPtr& pCoreSubmesh)
     : coreSubmesh(pCoreSubmesh)
+    , morphedLastDirtySkin(false)
+    , skinnedVertexCount(unsigned(pCoreSubmesh->getVertexCount()))
+    , lodLevel(1.0f)
 {
     assert(pCoreSubmesh);
 
@@ -51,6 +55,73 @@ CalSubmesh::CalSubmesh(const CalCoreSubmeshPtr& pCoreSubmesh)
     }
 }
 
+cal3d::SkinningCache::SkinningCache()
+    : enabled(false)
+    , hits(0)
+    , misses(0)
+    , bytesSaved(0)
+    , valid(false)
+    , vertexBuffer(0)
+    , vertexCount(0)
+{}
+
+float cal3d::SkinningCache::getHitRate() const {
+    const unsigned lookups = hits + misses;
+    return lookups ? float(hits) / float(lookups) : 0.0f;
+}
+
+void cal3d::SkinningCache::resetCounters() {
+    hits = 0;
+    misses = 0;
+    bytesSaved = 0;
+}
+
+void cal3d::SkinningCache::invalidate() {
+    valid = false;
+}
+
+bool cal3d::SkinningCache::lookup(
+    const BoneTransform* bonePalette,
+    const CalSubmesh& submesh,
+    const float* buffer
+) {
+    const size_t paletteSize = submesh.coreSubmesh->getPaletteBoneIds().size();
+    const size_t count = submesh.getLodPrefix().vertexCount;
+
+    bool hit = valid
+        && buffer == vertexBuffer
+        && count == vertexCount
+        && paletteSize == palette.size()
+        && submesh.morphTargets.size() == morphWeights.size();
+
+    for (size_t i = 0; hit && i < morphWeights.size(); ++i) {
+        hit = submesh.morphTargets[i].weight == morphWeights[i];
+    }
+    for (size_t i = 0; hit && i < paletteSize; ++i) {
+        hit = bonePalette[i] == palette[i];
+    }
+
+    if (hit) {
+        ++hits;
+        bytesSaved += count * 2 * sizeof(CalVector4);
+        return true;
+    }
+    ++misses;
+
+    palette.destructive_resize(paletteSize);
+    std::copy(bonePalette, bonePalette + paletteSize, palette.begin());
+
+    morphWeights.resize(submesh.morphTargets.size());
+    for (size_t i = 0; i < morphWeights.size(); ++i) {
+        morphWeights[i] = submesh.morphTargets[i].weight;
+    }
+
+    vertexBuffer = buffer;
+    vertexCount = count;
+    valid = true;
+    return false;
+}
+
 void CalSubmesh::setMorphTargetWeight(std::string const& morphName, float weight) {
     for (size_t i = 0; i < morphTargets.size(); i++) {
         const CalCoreMorphTargetPtr& target = coreSubmesh->getMorphTargets()[i];
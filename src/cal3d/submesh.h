@@ -11,11 +11,14 @@
 #pragma once
 
 #include <boost/shared_ptr.hpp>
+#include "cal3d/bonetransform.h"
 #include "cal3d/coresubmesh.h"
 #include "cal3d/global.h"
+#include "cal3d/memory.h"
 #include "cal3d/vector.h"
 
 CAL3D_PTR(CalCoreMaterial);
+class CalSubmesh;
 
 namespace cal3d {
     class CAL3D_API MorphTarget {
@@ -30,6 +33,37 @@ namespace cal3d {
         float replacementAttenuation;
     };
     CAL3D_PTR(MorphTarget);
+
+    // Remembers what a submesh was last skinned from: its gathered bone
+    // palette, its morph weights and the output buffer.  If none of them
+    // changed, the buffer already holds the result.  Disabled by default.
+    // Call invalidate() after writing to the buffer behind its back.
+    class CAL3D_API SkinningCache {
+    public:
+        SkinningCache();
+
+        bool enabled;
+
+        unsigned hits;
+        unsigned misses;
+        size_t bytesSaved; // output not rewritten because of hits
+
+        float getHitRate() const;
+        void resetCounters();
+        void invalidate();
+
+        // True if vertexBuffer still holds the skinned submesh.  Otherwise
+        // remembers these inputs for the next lookup.  palette is laid out
+        // as CalCoreSubmesh::getPaletteBoneIds().
+        bool lookup(const BoneTransform* palette, const CalSubmesh& submesh, const float* vertexBuffer);
+
+    private:
+        bool valid;
+        const float* vertexBuffer;
+        size_t vertexCount;
+        SSEArray<BoneTransform> palette;
+        std::vector<float> morphWeights;
+    };
 }
 
 
@@ -38,6 +72,28 @@ public:
     const CalCoreSubmeshPtr coreSubmesh;
     std::vector<cal3d::MorphTarget> morphTargets; // index maps to CoreSubMorphTarget in CoreSubmesh
 
+    // consulted by CalPhysique::calculateVerticesAndNormals
+    mutable cal3d::SkinningCache skinningCache;
+
+    // Whether the last CalPhysique::calculateDirtyVerticesAndNormals had
+    // morph targets active, so the buffer still holds morphed vertices.
+    mutable bool morphedLastDirtySkin;
+
+    // How many leading vertices CalPhysique last wrote, so the partial
+    // skinning paths can fill in the tail when lodLevel rises.  Starts at
+    // every vertex, as those paths expect an already skinned buffer.
+    mutable unsigned skinnedVertexCount;
+
+    // From 0 (every progressive mesh collapse) to 1 (full detail, the
+    // default).  CalPhysique::calculateVerticesAndNormals skins only
+    // getLodPrefix().vertexCount vertices; draw getLodPrefix().faceCount
+    // faces from CalCoreSubmesh::getLodFaces().
+    float lodLevel;
+
+    CalCoreSubmesh::LodPrefix getLodPrefix() const {
+        return coreSubmesh->getLodPrefix(lodLevel);
+    }
+
     CalSubmesh(const CalCoreSubmeshPtr& coreSubmesh);
 
     void setMorphTargetWeight(std::string const& morphName, float weight);
@@ -1,5 +1,12 @@
+#include <algorithm>
+#include <utility>
 #include <vector>
+#include <math.h>
 #include <stddef.h>
+#include <string.h>
+#ifndef IMVU_NO_INTRINSICS
+#include <xmmintrin.h>
+#endif
 
 #include "trisort.h"
 
@@ -38,17 +45,22 @@ namespace {
         return rv;
     }
 
+    template<typename Index>
     struct Triangle {
-        unsigned short v0, v1, v2;
+        Index v0, v1, v2;
     };
 }
 
+template<typename Index>
 struct TriangleSorter {
-    TriangleSorter(unsigned triangleCount, Triangle* triangles, const float* positions, unsigned positionStride)
+    typedef ::Triangle<Index> Triangle;
+
+    TriangleSorter(unsigned triangleCount, Triangle* triangles, const float* positions, unsigned positionStride, float reach)
         : triangleCount(triangleCount)
         , triangles(triangles)
         , positions(positions)
         , positionStride(positionStride)
+        , reach(reach)
     {}
 
     void heuristicCycleBreaker() {
@@ -63,50 +75,99 @@ struct TriangleSorter {
         // but there is a least bad ordering, and we can get close
         // without much work.
 
-        struct SortByArea {
-            SortByArea(TriangleSorter* ts)
-                : ts(ts)
-            {}
+        // Areas are computed once rather than per comparison.  std::sort
+        // moves elements based only on comparison results, so this sorts
+        // exactly as comparing triangles by area would.
+        struct AreaTriangle {
+            float area;
+            Triangle triangle;
 
-            bool operator()(const Triangle& lhs, const Triangle& rhs) {
-                return ts->area(lhs) < ts->area(rhs);
+            bool operator<(const AreaTriangle& rhs) const {
+                return area < rhs.area;
             }
-
-        private:
-            TriangleSorter* ts;
         };
-        std::sort(triangles, triangles + triangleCount, SortByArea(this));
+        std::vector<AreaTriangle> sorted(triangleCount);
+        for (unsigned t = 0; t < triangleCount; ++t) {
+            sorted[t].area = area(triangles[t]);
+            sorted[t].triangle = triangles[t];
+        }
+        std::sort(sorted.begin(), sorted.end());
+        for (unsigned t = 0; t < triangleCount; ++t) {
+            triangles[t] = sorted[t].triangle;
+        }
     }
 
+    // Planes and bounds are computed once, triangles are binned into a
+    // uniform grid, and only pairs whose bounds overlap after growing each
+    // by half its longest edge and half the reach are tested, four at a
+    // time.  Pairs further apart get no edge, so they are only ordered
+    // through the triangles between them.
     void buildDigraph() {
-        edges.resize(triangleCount);
+        precalculatePlanes();
+        binTriangles();
+
+        std::vector<unsigned> from;
+        std::vector<unsigned> to;
+        std::vector<unsigned> stamps(triangleCount, static_cast<unsigned>(-1));
+        std::vector<unsigned> candidates;
         for (unsigned a = 0; a < triangleCount; ++a) {
-            for (unsigned b = 0; b < a; ++b) {
-                bool a_facing_b = isFacing(a, b);
-                bool b_facing_a = isFacing(b, a);
-                if (a_facing_b != b_facing_a) {
-                    std::vector<unsigned>& edgelist = edges[a_facing_b ? a : b];
-                    unsigned edge = a_facing_b ? b : a;
-                    edgelist.push_back(edge);
+            candidates.clear();
+            int lo[3], hi[3];
+            cellRange(a, lo, hi);
+            for (int z = lo[2]; z <= hi[2]; ++z) {
+                for (int y = lo[1]; y <= hi[1]; ++y) {
+                    for (int x = lo[0]; x <= hi[0]; ++x) {
+                        const unsigned cell = (z * gridDims[1] + y) * gridDims[0] + x;
+                        for (unsigned i = cellStarts[cell]; i < cellStarts[cell + 1]; ++i) {
+                            const unsigned b = cellTriangles[i];
+                            if (b < a && stamps[b] != a && overlaps(a, b)) {
+                                stamps[b] = a;
+                                candidates.push_back(b);
+                            }
+                        }
+                    }
                 }
             }
-        }
-    }
 
-    void topologicalSort() {
-        // assert empty?
-        fastedge_storage.reserve(triangleCount);
-        for (auto i = edges.begin(); i != edges.end(); ++i) {
-            FastEdge fe;
-            fe.begin = vec_data(*i);
-            fe.end = fe.begin + i->size();
-            fastedge_storage.push_back(fe);
+            const size_t candidateCount = candidates.size();
+            // pad to a multiple of four with copies of the last candidate
+            while (candidates.size() % 4) {
+                candidates.push_back(candidates.back());
+            }
+            for (size_t i = 0; i < candidateCount; i += 4) {
+                unsigned facing = facingMask(a, &candidates[i]);
+                for (size_t k = 0; k < 4 && i + k < candidateCount; ++k) {
+                    const bool a_facing_b = (facing >> k) & 1;
+                    const bool b_facing_a = (facing >> (k + 4)) & 1;
+                    if (a_facing_b != b_facing_a) {
+                        from.push_back(a_facing_b ? a : candidates[i + k]);
+                        to.push_back(a_facing_b ? candidates[i + k] : a);
+                    }
+                }
+            }
         }
-        fastedges = vec_data(fastedge_storage);
 
-        visited_storage.resize(triangleCount);
-        visited = vec_data(visited_storage);
+        // CSR, with each triangle's targets ascending as the all-pairs
+        // loop produced them, so the sort's output doesn't change.
+        edgeStarts.assign(triangleCount + 1, 0);
+        for (size_t e = 0; e < from.size(); ++e) {
+            ++edgeStarts[from[e] + 1];
+        }
+        for (unsigned t = 0; t < triangleCount; ++t) {
+            edgeStarts[t + 1] += edgeStarts[t];
+        }
+        edgeTargets.resize(from.size());
+        std::vector<unsigned> cursors(edgeStarts.begin(), edgeStarts.end() - 1);
+        for (size_t e = 0; e < from.size(); ++e) {
+            edgeTargets[cursors[from[e]]++] = to[e];
+        }
+        for (unsigned t = 0; t < triangleCount; ++t) {
+            std::sort(edgeTargets.begin() + edgeStarts[t], edgeTargets.begin() + edgeStarts[t + 1]);
+        }
+    }
 
+    void topologicalSort() {
+        visited_storage.assign(triangleCount, 0);
         output_storage.resize(triangleCount);
         output = vec_data(output_storage);
 
@@ -130,7 +191,7 @@ struct TriangleSorter {
     }
 
 private:
-    const Vec3f& getPosition(unsigned short i) {
+    const Vec3f& getPosition(Index i) {
         return *reinterpret_cast<const Vec3f*>(positions + i * positionStride);
     }
 
@@ -141,44 +202,187 @@ private:
         return length(cross(v1 - v0, v2 - v0)) / 2;
     }
 
-    bool inFront(const Vec3f& p, const Triangle& t) {
-        // TODO: precalculate planes
-        // TODO: vectorize
+    void precalculatePlanes() {
+        for (int k = 0; k < 4; ++k) {
+            planes[k].resize(triangleCount);
+        }
+        for (int k = 0; k < 9; ++k) {
+            corners[k].resize(triangleCount);
+        }
+        boundsMin.resize(triangleCount);
+        boundsMax.resize(triangleCount);
+
+        for (unsigned t = 0; t < triangleCount; ++t) {
+            const Vec3f& v1 = getPosition(triangles[t].v0);
+            const Vec3f& v2 = getPosition(triangles[t].v1);
+            const Vec3f& v3 = getPosition(triangles[t].v2);
+
+            planes[0][t] = v1.y * (v2.z - v3.z) + v2.y * (v3.z - v1.z) + v3.y * (v1.z - v2.z);
+            planes[1][t] = v1.z * (v2.x - v3.x) + v2.z * (v3.x - v1.x) + v3.z * (v1.x - v2.x);
+            planes[2][t] = v1.x * (v2.y - v3.y) + v2.x * (v3.y - v1.y) + v3.x * (v1.y - v2.y);
+            planes[3][t] =  ( v1.x * ( v2.y * v3.z - v3.y * v2.z ) +
+                                v2.x * (v3.y * v1.z - v1.y * v3.z) +
+                                v3.x * (v1.y * v2.z - v2.y * v1.z) );
+
+            const Vec3f* v[3] = { &v1, &v2, &v3 };
+            for (int i = 0; i < 3; ++i) {
+                corners[3 * i + 0][t] = v[i]->x;
+                corners[3 * i + 1][t] = v[i]->y;
+                corners[3 * i + 2][t] = v[i]->z;
+            }
 
-        const auto& v1 = getPosition(t.v0);
-        const auto& v2 = getPosition(t.v1);
-        const auto& v3 = getPosition(t.v2);
+            const float grow = 0.5f * (std::max(length(v2 - v1), std::max(length(v3 - v2), length(v1 - v3))) + reach);
+            boundsMin[t].x = std::min(v1.x, std::min(v2.x, v3.x)) - grow;
+            boundsMin[t].y = std::min(v1.y, std::min(v2.y, v3.y)) - grow;
+            boundsMin[t].z = std::min(v1.z, std::min(v2.z, v3.z)) - grow;
+            boundsMax[t].x = std::max(v1.x, std::max(v2.x, v3.x)) + grow;
+            boundsMax[t].y = std::max(v1.y, std::max(v2.y, v3.y)) + grow;
+            boundsMax[t].z = std::max(v1.z, std::max(v2.z, v3.z)) + grow;
+        }
+    }
 
-        float plane_a = v1.y * (v2.z - v3.z) + v2.y * (v3.z - v1.z) + v3.y * (v1.z - v2.z);
-        float plane_b = v1.z * (v2.x - v3.x) + v2.z * (v3.x - v1.x) + v3.z * (v1.x - v2.x);
-        float plane_c = v1.x * (v2.y - v3.y) + v2.x * (v3.y - v1.y) + v3.x * (v1.y - v2.y);
-        float plane_d =  ( v1.x * ( v2.y * v3.z - v3.y * v2.z ) +
-                            v2.x * (v3.y * v1.z - v1.y * v3.z) +
-                            v3.x * (v1.y * v2.z - v2.y * v1.z) );
+    bool overlaps(unsigned a, unsigned b) const {
+        return boundsMin[a].x <= boundsMax[b].x && boundsMin[b].x <= boundsMax[a].x
+            && boundsMin[a].y <= boundsMax[b].y && boundsMin[b].y <= boundsMax[a].y
+            && boundsMin[a].z <= boundsMax[b].z && boundsMin[b].z <= boundsMax[a].z;
+    }
 
-        return plane_a * p.x + plane_b * p.y + plane_c * p.z >= plane_d;
+    void cellRange(unsigned t, int lo[3], int hi[3]) const {
+        const float* tMin = &boundsMin[t].x;
+        const float* tMax = &boundsMax[t].x;
+        const float* o = &gridOrigin.x;
+        for (int k = 0; k < 3; ++k) {
+            lo[k] = std::min(gridDims[k] - 1, std::max(0, int((tMin[k] - o[k]) * inverseCellSize)));
+            hi[k] = std::min(gridDims[k] - 1, std::max(0, int((tMax[k] - o[k]) * inverseCellSize)));
+        }
     }
 
-    bool isFacing(unsigned a, unsigned b) {
-        return inFront(getPosition(triangles[b].v0), triangles[a])
-            && inFront(getPosition(triangles[b].v1), triangles[a])
-            && inFront(getPosition(triangles[b].v2), triangles[a]);
+    // cells about as big as a triangle's grown bounds, but no more cells
+    // than triangles
+    void binTriangles() {
+        Vec3f lo = boundsMin[0];
+        Vec3f hi = boundsMax[0];
+        float extentSum = 0.0f;
+        for (unsigned t = 0; t < triangleCount; ++t) {
+            lo.x = std::min(lo.x, boundsMin[t].x);
+            lo.y = std::min(lo.y, boundsMin[t].y);
+            lo.z = std::min(lo.z, boundsMin[t].z);
+            hi.x = std::max(hi.x, boundsMax[t].x);
+            hi.y = std::max(hi.y, boundsMax[t].y);
+            hi.z = std::max(hi.z, boundsMax[t].z);
+            const Vec3f size = boundsMax[t] - boundsMin[t];
+            extentSum += std::max(size.x, std::max(size.y, size.z));
+        }
+        gridOrigin = lo;
+        const Vec3f size = hi - lo;
+        float cellSize = std::max(extentSum / triangleCount, 1e-6f);
+        while ((floor(size.x / cellSize) + 1) * (floor(size.y / cellSize) + 1) * (floor(size.z / cellSize) + 1) > triangleCount) {
+            cellSize *= 1.25f;
+        }
+        inverseCellSize = 1.0f / cellSize;
+        gridDims[0] = int(size.x * inverseCellSize) + 1;
+        gridDims[1] = int(size.y * inverseCellSize) + 1;
+        gridDims[2] = int(size.z * inverseCellSize) + 1;
+
+        cellStarts.assign(gridDims[0] * gridDims[1] * gridDims[2] + 1, 0);
+        for (int pass = 0; pass < 2; ++pass) {
+            if (pass) {
+                for (size_t c = 1; c < cellStarts.size(); ++c) {
+                    cellStarts[c] += cellStarts[c - 1];
+                }
+                cellTriangles.resize(cellStarts.back());
+            }
+            std::vector<unsigned> cursors(cellStarts.begin(), cellStarts.end() - 1);
+            for (unsigned t = 0; t < triangleCount; ++t) {
+                int lo[3], hi[3];
+                cellRange(t, lo, hi);
+                for (int z = lo[2]; z <= hi[2]; ++z) {
+                    for (int y = lo[1]; y <= hi[1]; ++y) {
+                        for (int x = lo[0]; x <= hi[0]; ++x) {
+                            const unsigned cell = (z * gridDims[1] + y) * gridDims[0] + x;
+                            if (pass) {
+                                cellTriangles[cursors[cell]++] = t;
+                            } else {
+                                ++cellStarts[cell + 1];
+                            }
+                        }
+                    }
+                }
+            }
+        }
     }
 
-    // TODO: could make this non-recursive but it should only recurse
-    // triangleCount times, which ought to fit in a 1 MB stack...
-    void visit(unsigned i) {
-        if (visited[i]) {
-            return;
+    // Bit k: triangle a faces bs[k]; bit k + 4: bs[k] faces a.
+    unsigned facingMask(unsigned a, const unsigned* bs) const {
+#ifndef IMVU_NO_INTRINSICS
+        #define GATHER(array) _mm_setr_ps(array[bs[0]], array[bs[1]], array[bs[2]], array[bs[3]])
+        const __m128 pa = _mm_set1_ps(planes[0][a]);
+        const __m128 pb = _mm_set1_ps(planes[1][a]);
+        const __m128 pc = _mm_set1_ps(planes[2][a]);
+        const __m128 pd = _mm_set1_ps(planes[3][a]);
+        const __m128 qa = GATHER(planes[0]);
+        const __m128 qb = GATHER(planes[1]);
+        const __m128 qc = GATHER(planes[2]);
+        const __m128 qd = GATHER(planes[3]);
+        __m128 aFacingB = _mm_cmpeq_ps(pa, pa); // all ones
+        __m128 bFacingA = aFacingB;
+        for (int i = 0; i < 3; ++i) {
+            // b's corner against a's plane
+            const __m128 bx = GATHER(corners[3 * i + 0]);
+            const __m128 by = GATHER(corners[3 * i + 1]);
+            const __m128 bz = GATHER(corners[3 * i + 2]);
+            aFacingB = _mm_and_ps(aFacingB, _mm_cmpge_ps(
+                _mm_add_ps(_mm_add_ps(_mm_mul_ps(pa, bx), _mm_mul_ps(pb, by)), _mm_mul_ps(pc, bz)), pd));
+
+            // a's corner against b's plane
+            const __m128 ax = _mm_set1_ps(corners[3 * i + 0][a]);
+            const __m128 ay = _mm_set1_ps(corners[3 * i + 1][a]);
+            const __m128 az = _mm_set1_ps(corners[3 * i + 2][a]);
+            bFacingA = _mm_and_ps(bFacingA, _mm_cmpge_ps(
+                _mm_add_ps(_mm_add_ps(_mm_mul_ps(qa, ax), _mm_mul_ps(qb, ay)), _mm_mul_ps(qc, az)), qd));
         }
-        visited[i] = true;
-        
-        FastEdge fe = fastedges[i];
-        for (unsigned* e = fe.begin; e != fe.end; ++e) {
-            visit(*e);
+        #undef GATHER
+        return _mm_movemask_ps(aFacingB) | (_mm_movemask_ps(bFacingA) << 4);
+#else
+        unsigned mask = 0;
+        for (int k = 0; k < 4; ++k) {
+            mask |= unsigned(isFacing(a, bs[k])) << k;
+            mask |= unsigned(isFacing(bs[k], a)) << (k + 4);
         }
+        return mask;
+#endif
+    }
+
+    bool inFront(unsigned corner, unsigned p, unsigned t) const {
+        return planes[0][t] * corners[3 * corner + 0][p] + planes[1][t] * corners[3 * corner + 1][p] + planes[2][t] * corners[3 * corner + 2][p] >= planes[3][t];
+    }
 
-        *output++ = i;
+    bool isFacing(unsigned a, unsigned b) const {
+        return inFront(0, b, a) && inFront(1, b, a) && inFront(2, b, a);
+    }
+
+    // Iterative depth-first search, emitting triangles in post-order.
+    void visit(unsigned root) {
+        if (visited_storage[root]) {
+            return;
+        }
+        visited_storage[root] = true;
+        stack.clear();
+        stack.push_back(std::make_pair(root, edgeStarts[root]));
+        while (!stack.empty()) {
+            const unsigned i = stack.back().first;
+            unsigned& e = stack.back().second;
+            if (e == edgeStarts[i + 1]) {
+                *output++ = i;
+                stack.pop_back();
+                continue;
+            }
+            const unsigned next = edgeTargets[e++];
+            if (!visited_storage[next]) {
+                visited_storage[next] = true;
+                stack.push_back(std::make_pair(next, edgeStarts[next]));
+            }
+        }
     }
 
     // inputs
@@ -186,43 +390,259 @@ private:
     Triangle* const triangles;
     const float* const positions;
     const unsigned positionStride;
+    const float reach;
 
-    // dense adjacency list, a -> b
+    // SoA planes (a, b, c, d) and corners (x0, y0, z0, x1, ...)
+    std::vector<float> planes[4];
+    std::vector<float> corners[9];
+    std::vector<Vec3f> boundsMin;
+    std::vector<Vec3f> boundsMax;
+
+    Vec3f gridOrigin;
+    float inverseCellSize;
+    int gridDims[3];
+    std::vector<unsigned> cellStarts; // CSR: cell -> triangles
+    std::vector<unsigned> cellTriangles;
+
+    // CSR adjacency, a -> b
     // a -> b means "b behind a", thus b should be rendered first
-    // worst case storage is something like triangleCount^2 * sizeof(unsigned)
-    // for 100k triangles, that's 40 GB
-    std::vector<std::vector<unsigned> > edges;
-    struct FastEdge {
-        unsigned* begin;
-        unsigned* end;
-    };
-    std::vector<FastEdge> fastedge_storage;
-    FastEdge* fastedges; // fast access
-    
+    std::vector<unsigned> edgeStarts;
+    std::vector<unsigned> edgeTargets;
+
     std::vector<char> visited_storage;
-    char* visited; // fast access
+    std::vector<std::pair<unsigned, unsigned> > stack; // triangle, next edge
 
     // reversed
     std::vector<unsigned> output_storage;
     unsigned* output; // fast access
 };
 
-void sortTrianglesBackToFront(
+template<typename Index>
+static void sortTriangles(
     unsigned triangleCount,
-    unsigned short* indices,
+    Index* indices,
     const float* positions,
-    unsigned positionStride
+    unsigned positionStride,
+    float reach
 ) {
     // so we can count on there being at least one entry in all the arrays
     if (!triangleCount) {
         return;
     }
 
-    Triangle* triangles = reinterpret_cast<Triangle*>(indices);
+    Triangle<Index>* triangles = reinterpret_cast<Triangle<Index>*>(indices);
 
-    TriangleSorter ts(triangleCount, triangles, positions, positionStride);
+    TriangleSorter<Index> ts(triangleCount, triangles, positions, positionStride, reach);
     ts.heuristicCycleBreaker();
     ts.buildDigraph();
     ts.topologicalSort();
     ts.writeOutput();
 }
+
+void sortTrianglesBackToFront(
+    unsigned triangleCount,
+    unsigned short* indices,
+    const float* positions,
+    unsigned positionStride,
+    float reach
+) {
+    sortTriangles(triangleCount, indices, positions, positionStride, reach);
+}
+
+void sortTrianglesBackToFront(
+    unsigned triangleCount,
+    unsigned* indices,
+    const float* positions,
+    unsigned positionStride,
+    float reach
+) {
+    sortTriangles(triangleCount, indices, positions, positionStride, reach);
+}
+
+static const unsigned KeyBits = 22;
+
+CalTriangleDepthSorter::CalTriangleDepthSorter()
+    : incremental(false)
+{}
+
+// Squared centroid distances (times nine, which doesn't change the order),
+// as keys that sort ascending farthest first: the bits of a non-negative
+// float compare like the float, so complement them.  Only the top
+// KeyBits are kept, about 1 part in 16000 of the distance, so depths
+// closer than that keep last frame's order instead of flickering, and
+// the radix sort needs two passes instead of three.
+template<typename Index>
+void CalTriangleDepthSorter::computeKeys(
+    const Index* indices,
+    const float* positions,
+    unsigned positionStride,
+    const float* viewPoint
+) {
+    const size_t triangleCount = order.size();
+    keys.resize(triangleCount);
+#ifndef IMVU_NO_INTRINSICS
+    // unaligned four-float loads read one float past each position
+    if (positionStride >= 4) {
+        const __m128 eye3 = _mm_setr_ps(3.0f * viewPoint[0], 3.0f * viewPoint[1], 3.0f * viewPoint[2], 0.0f);
+        const __m128 xyz = _mm_cmplt_ps(_mm_setzero_ps(), _mm_setr_ps(1.0f, 1.0f, 1.0f, 0.0f)); // lane mask
+        for (size_t i = 0; i < triangleCount; ++i) {
+            const Index* t = indices + 3 * order[i];
+            __m128 c = _mm_add_ps(
+                _mm_add_ps(_mm_loadu_ps(positions + t[0] * positionStride), _mm_loadu_ps(positions + t[1] * positionStride)),
+                _mm_loadu_ps(positions + t[2] * positionStride));
+            c = _mm_and_ps(_mm_sub_ps(c, eye3), xyz);
+            c = _mm_mul_ps(c, c);
+            c = _mm_add_ps(c, _mm_movehl_ps(c, c));
+            c = _mm_add_ss(c, _mm_shuffle_ps(c, c, _MM_SHUFFLE(1, 1, 1, 1)));
+            float distance;
+            _mm_store_ss(&distance, c);
+            unsigned bits;
+            memcpy(&bits, &distance, sizeof(bits));
+            keys[i] = ~bits >> (32 - KeyBits);
+        }
+        return;
+    }
+#endif
+    for (size_t i = 0; i < triangleCount; ++i) {
+        const Index* t = indices + 3 * order[i];
+        float distance = 0.0f;
+        for (int k = 0; k < 3; ++k) {
+            const float c =
+                positions[t[0] * positionStride + k] +
+                positions[t[1] * positionStride + k] +
+                positions[t[2] * positionStride + k] -
+                3.0f * viewPoint[k];
+            distance += c * c;
+        }
+        unsigned bits;
+        memcpy(&bits, &distance, sizeof(bits));
+        keys[i] = ~bits >> (32 - KeyBits);
+    }
+}
+
+// Gives up, leaving a valid permutation, once moveLimit elements moved.
+bool CalTriangleDepthSorter::insertionSort(size_t moveLimit) {
+    const size_t triangleCount = order.size();
+    size_t moves = 0;
+    for (size_t i = 1; i < triangleCount; ++i) {
+        const unsigned key = keys[i];
+        if (keys[i - 1] <= key) {
+            continue;
+        }
+        const unsigned triangle = order[i];
+        size_t j = i;
+        do {
+            keys[j] = keys[j - 1];
+            order[j] = order[j - 1];
+            --j;
+        } while (j > 0 && keys[j - 1] > key);
+        keys[j] = key;
+        order[j] = triangle;
+
+        moves += i - j;
+        if (moves > moveLimit) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Two stable LSD passes, skipping one if every key has the same digit
+// there.
+void CalTriangleDepthSorter::radixSort() {
+    const size_t triangleCount = order.size();
+    scratchOrder.resize(triangleCount);
+    scratchKeys.resize(triangleCount);
+
+    const unsigned RadixBits = KeyBits / 2;
+    const unsigned BucketCount = 1 << RadixBits;
+    unsigned counts[2][BucketCount];
+    memset(counts, 0, sizeof(counts));
+    for (size_t i = 0; i < triangleCount; ++i) {
+        const unsigned key = keys[i];
+        ++counts[0][key & (BucketCount - 1)];
+        ++counts[1][key >> RadixBits];
+    }
+
+    for (unsigned pass = 0; pass < 2; ++pass) {
+        const unsigned shift = pass * RadixBits;
+        unsigned* count = counts[pass];
+        if (count[(keys[0] >> shift) & (BucketCount - 1)] == triangleCount) {
+            continue;
+        }
+        unsigned offset = 0;
+        for (unsigned b = 0; b < BucketCount; ++b) {
+            const unsigned c = count[b];
+            count[b] = offset;
+            offset += c;
+        }
+        for (size_t i = 0; i < triangleCount; ++i) {
+            const unsigned destination = count[(keys[i] >> shift) & (BucketCount - 1)]++;
+            scratchKeys[destination] = keys[i];
+            scratchOrder[destination] = order[i];
+        }
+        keys.swap(scratchKeys);
+        order.swap(scratchOrder);
+    }
+}
+
+template<typename Index>
+void CalTriangleDepthSorter::sortIndices(
+    unsigned triangleCount,
+    const Index* indices,
+    const float* positions,
+    unsigned positionStride,
+    const float* viewPoint,
+    Index* sortedIndices
+) {
+    bool coherent = order.size() == triangleCount;
+    if (!coherent) {
+        order.resize(triangleCount);
+        for (unsigned i = 0; i < triangleCount; ++i) {
+            order[i] = i;
+        }
+    }
+    incremental = false;
+    if (!triangleCount) {
+        return;
+    }
+
+    computeKeys(indices, positions, positionStride, viewPoint);
+
+    // Give up on the insertion pass once it has done about as much work
+    // as one radix pass.
+    if (coherent && insertionSort(triangleCount)) {
+        incremental = true;
+    } else {
+        radixSort();
+    }
+
+    for (unsigned i = 0; i < triangleCount; ++i) {
+        const Index* t = indices + 3 * order[i];
+        sortedIndices[3 * i + 0] = t[0];
+        sortedIndices[3 * i + 1] = t[1];
+        sortedIndices[3 * i + 2] = t[2];
+    }
+}
+
+void CalTriangleDepthSorter::sort(
+    unsigned triangleCount,
+    const unsigned short* indices,
+    const float* positions,
+    unsigned positionStride,
+    const float* viewPoint,
+    unsigned short* sortedIndices
+) {
+    sortIndices(triangleCount, indices, positions, positionStride, viewPoint, sortedIndices);
+}
+
+void CalTriangleDepthSorter::sort(
+    unsigned triangleCount,
+    const unsigned* indices,
+    const float* positions,
+    unsigned positionStride,
+    const float* viewPoint,
+    unsigned* sortedIndices
+) {
+    sortIndices(triangleCount, indices, positions, positionStride, viewPoint, sortedIndices);
+}
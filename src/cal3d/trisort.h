@@ -1,10 +1,82 @@
 #pragma once
 
+#include <vector>
 #include "cal3d/global.h"
 
+// Only triangles whose bounds come within reach plus half their longest
+// edges of each other are compared, so layers further apart than that,
+// such as hair cards standing off a scalp, aren't ordered against each
+// other unless faces in between connect them.  Pass the widest gap that
+// must stay ordered as reach; a larger reach compares more pairs.
 CAL3D_API void sortTrianglesBackToFront(
     unsigned triangleCount,
     unsigned short* indices,      // indexed trilist, triangleCount*3 entries
     const float* positions, // vec3f
-    unsigned positionStride = 3); // in floats, defaults to packed
+    unsigned positionStride = 3, // in floats, defaults to packed
+    float reach = 0.0f);
 
+// The same, for 32-bit indices.
+CAL3D_API void sortTrianglesBackToFront(
+    unsigned triangleCount,
+    unsigned* indices,
+    const float* positions,
+    unsigned positionStride = 3,
+    float reach = 0.0f);
+
+
+// Per-frame back-to-front ordering for skinned transparent geometry (hair,
+// clothing layers), where sortTrianglesBackToFront's view-independent
+// order breaks as soon as the mesh animates.  Triangles are ordered by the
+// distance from the view point to their centroids, which is only
+// approximate where triangles intersect or are very uneven in size.
+class CAL3D_API CalTriangleDepthSorter {
+public:
+    CalTriangleDepthSorter();
+
+    // Writes the triangles of indices to sortedIndices, farthest first.
+    // positions are vec3f, positionStride floats apart (8 for CalPhysique
+    // output).  Each call starts from the previous call's order, so if the
+    // mesh and view barely moved it finishes with a linear insertion pass;
+    // otherwise it radix sorts.  Equal depths keep last frame's order, so
+    // they don't flicker.  Pass the same triangles every frame.
+    void sort(
+        unsigned triangleCount,
+        const unsigned short* indices,
+        const float* positions,
+        unsigned positionStride,
+        const float* viewPoint, // vec3f
+        unsigned short* sortedIndices);
+
+    // The same, for 32-bit indices.
+    void sort(
+        unsigned triangleCount,
+        const unsigned* indices,
+        const float* positions,
+        unsigned positionStride,
+        const float* viewPoint, // vec3f
+        unsigned* sortedIndices);
+
+    // The last sort()'s order, as triangle indices into its input.
+    const std::vector<unsigned>& getOrder() const {
+        return order;
+    }
+
+    // Whether the last sort() got away with the insertion pass.
+    bool wasIncremental() const {
+        return incremental;
+    }
+
+private:
+    std::vector<unsigned> order;
+    std::vector<unsigned> keys; // parallel to order
+    std::vector<unsigned> scratchOrder;
+    std::vector<unsigned> scratchKeys;
+    bool incremental;
+
+    template<typename Index>
+    void sortIndices(unsigned triangleCount, const Index* indices, const float* positions, unsigned positionStride, const float* viewPoint, Index* sortedIndices);
+    template<typename Index>
+    void computeKeys(const Index* indices, const float* positions, unsigned positionStride, const float* viewPoint);
+    bool insertionSort(size_t moveLimit);
+    void radixSort();
+};
@@ -710,10 +710,15 @@ CalCoreMeshPtr CalLoader::loadXmlCoreMeshDoc(const rapidxml::xml_document<>& doc
         int springCount = get_int_attribute(submesh, "NUMSPRINGS");
         int textureCoordinateCount = get_int_attribute(submesh, "NUMTEXCOORDS");
         int morphCount = get_int_attribute(submesh, "nummorphs");
+        int lodCount = get_int_attribute(submesh, "NUMLODSTEPS");
 
         CalCoreSubmeshPtr pCoreSubmesh(new CalCoreSubmesh(vertexCount, textureCoordinateCount ? true : false, faceCount));
         pCoreSubmesh->coreMaterialThreadId = coreMaterialThreadId;
 
+        // as in the binary format, the last lodCount vertices collapse
+        CalCoreSubmesh::LodCollapseVector lodCollapses;
+        const int firstCollapsedVertex = vertexCount - lodCount;
+
         xml_node* vertex = submesh->first_node();
 
         for (int vertexId = 0; vertexId < vertexCount; ++vertexId) {
@@ -768,6 +773,14 @@ CalCoreMeshPtr CalLoader::loadXmlCoreMeshDoc(const rapidxml::xml_document<>& doc
                 if (!collapseCountData) {
                     return InvalidFileFormat();
                 }
+
+                const int collapseId = atoi(collapseid);
+                const int faceCollapseCount = atoi(collapseCountData);
+                if (lodCount > 0 && vertexId >= firstCollapsedVertex &&
+                    collapseId >= 0 && collapseId < vertexId &&
+                    faceCollapseCount >= 0) {
+                    lodCollapses.push_back(CalCoreSubmesh::LodCollapse(collapseId, faceCollapseCount));
+                }
                 collapse = collapseCount->next_sibling();
             }
 
@@ -911,16 +924,25 @@ CalCoreMeshPtr CalLoader::loadXmlCoreMeshDoc(const rapidxml::xml_document<>& doc
             int tmp[3];
             ReadTripleInt(get_string_attribute(face, "VERTEXID"), tmp, tmp + 1, tmp + 2);
 
-            if (sizeof(CalIndex) == 2) {
+            if (tmp[0] < 0 || tmp[1] < 0 || tmp[2] < 0) {
+                return InvalidFileFormat();
+            }
+            if (pCoreSubmesh->getIndexSize() == 2) {
                 if (tmp[0] > 65535 || tmp[1] > 65535 || tmp[2] > 65535) {
                     return InvalidFileFormat();
                 }
             }
-            pCoreSubmesh->addFace(CalCoreSubmesh::Face(tmp[0], tmp[1], tmp[2]));
+            pCoreSubmesh->addFace(CalCoreSubmesh::WideFace(tmp[0], tmp[1], tmp[2]));
 
             face = face->next_sibling();
         }
 
+        // Collapse data that doesn't fit is dropped; the full mesh still
+        // loads.
+        if (lodCount > 0 && int(lodCollapses.size()) == lodCount) {
+            pCoreSubmesh->setLodCollapses(lodCollapses);
+        }
+
         // add the core submesh to the core mesh instance
         pCoreMesh->submeshes.push_back(pCoreSubmesh);
     }
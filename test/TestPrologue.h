@@ -12,6 +12,19 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/scoped_array.hpp>
 
+#if defined(_MSC_VER)
+#   include <intrin.h>
+#else
+
+inline cal3d_uint64 __rdtsc(void) {
+    // "=A" only means edx:eax on 32-bit x86, so read the halves explicitly
+    unsigned lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((cal3d_uint64)hi << 32) | lo;
+}
+
+#endif
+
 using boost::scoped_ptr;
 using boost::shared_ptr;
 using boost::lexical_cast;
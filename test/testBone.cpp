@@ -4,6 +4,7 @@
 #include <cal3d/coreskeleton.h>
 #include <cal3d/mixer.h>
 #include <cal3d/skeleton.h>
+#include <time.h>
 
 inline CalVector transformPoint(const BoneTransform& bt, const CalVector& point) {
     return CalVector(
@@ -156,3 +157,193 @@ TEST_F(BoneScaleFixture, scale_is_in_bone_space) {
 
     CHECK_EQUAL(CalVector(-1, 6, 32), transformPoint(skeleton.boneTransforms[0], CalVector(2, 4, 8)));
 }
+
+// Bone i hangs off bone (i - 1) / fanOut, so a fanOut of 1 is a chain.
+static CalCoreSkeletonPtr makeBoneTree(int boneCount, int fanOut) {
+    CalCoreSkeletonPtr cs(new CalCoreSkeleton);
+    for (int i = 0; i < boneCount; ++i) {
+        CalCoreBonePtr bone(new CalCoreBone("bone", i ? (i - 1) / fanOut : -1));
+        bone->relativeTransform.rotation.setAxisAngle(CalVector(1, 2, 3) / CalVector(1, 2, 3).length(), 0.1f * i);
+        bone->relativeTransform.translation = CalVector(1, 0.5f, 0.25f);
+        bone->inverseBindPoseTransform.translation = CalVector(-1, -2, -3);
+        cs->addCoreBone(bone);
+    }
+    return cs;
+}
+
+static void checkMatchesGeneralPose(CalSkeleton& skeleton) {
+    skeleton.calculateAbsolutePose();
+
+    CalBone* bones = cal3d::pointerFromVector(skeleton.bones);
+    for (unsigned i = 0; i < skeleton.bones.size(); ++i) {
+        BoneTransform fast = skeleton.boneTransforms[i];
+        bones[i].calculateAbsolutePose(bones);
+        BoneTransform general = bones[i].absoluteTransform * skeleton.inverseBindPoseTransforms[i];
+
+        CHECK_CLOSE(general.rowx.x, fast.rowx.x, 1.e-4);
+        CHECK_CLOSE(general.rowy.z, fast.rowy.z, 1.e-4);
+        CHECK_CLOSE(general.rowz.y, fast.rowz.y, 1.e-4);
+        CHECK_CLOSE(general.rowx.w, fast.rowx.w, 1.e-3);
+        CHECK_CLOSE(general.rowy.w, fast.rowy.w, 1.e-3);
+        CHECK_CLOSE(general.rowz.w, fast.rowz.w, 1.e-3);
+    }
+}
+
+// The scale-free solve keeps absoluteRotateTranslate current too.
+static void checkAbsoluteRotateTranslates(CalSkeleton& skeleton) {
+    skeleton.calculateAbsolutePose();
+
+    const CalBone* bones = cal3d::pointerFromVector(skeleton.bones);
+    for (unsigned i = 0; i < skeleton.bones.size(); ++i) {
+        const cal3d::RotateTranslate expected = (bones[i].parentId == -1)
+            ? bones[i].getRelativeTransform()
+            : bones[bones[i].parentId].absoluteRotateTranslate * bones[i].getRelativeTransform();
+        const cal3d::RotateTranslate& actual = bones[i].absoluteRotateTranslate;
+
+        CHECK_CLOSE(expected.rotation.x, actual.rotation.x, 1.e-5);
+        CHECK_CLOSE(expected.rotation.y, actual.rotation.y, 1.e-5);
+        CHECK_CLOSE(expected.rotation.z, actual.rotation.z, 1.e-5);
+        CHECK_CLOSE(expected.rotation.w, actual.rotation.w, 1.e-5);
+        CHECK_CLOSE(expected.translation.x, actual.translation.x, 1.e-4);
+        CHECK_CLOSE(expected.translation.y, actual.translation.y, 1.e-4);
+        CHECK_CLOSE(expected.translation.z, actual.translation.z, 1.e-4);
+        CHECK_CLOSE(actual.translation.x, bones[i].absoluteTransform.translation.x, 1.e-4);
+    }
+}
+
+static int calculateAbsolutePoseCyclesPerBone(CalSkeleton& skeleton) {
+    const int TrialCount = 1000;
+
+    cal3d_int64 min = 99999999999999LL;
+    for (int t = 0; t < TrialCount; ++t) {
+        skeleton.invalidatePose();
+        cal3d_int64 start = __rdtsc();
+        skeleton.calculateAbsolutePose();
+        cal3d_int64 elapsed = __rdtsc() - start;
+        if (elapsed < min) {
+            min = elapsed;
+        }
+    }
+    return (int)(min / (cal3d_int64)skeleton.bones.size());
+}
+
+static int calculateAbsolutePoseUpdatesPerSecond(CalSkeleton& skeleton) {
+    const int UpdateCount = 20000;
+
+    clock_t start = clock();
+    for (int u = 0; u < UpdateCount; ++u) {
+        skeleton.invalidatePose();
+        skeleton.calculateAbsolutePose();
+    }
+    double seconds = double(clock() - start) / CLOCKS_PER_SEC;
+    return seconds > 0 ? int(UpdateCount / seconds) : 0;
+}
+
+FIXTURE(BoneChainFixture) {
+    SETUP(BoneChainFixture)
+        : skeleton(makeBoneTree(BoneCount, 1))
+    {}
+
+    enum { BoneCount = 64 };
+    CalSkeleton skeleton;
+};
+
+TEST_F(BoneChainFixture, scale_free_pose_matches_general_pose) {
+    CHECK(skeleton.isScaleFree());
+    checkMatchesGeneralPose(skeleton);
+}
+
+TEST_F(BoneChainFixture, scale_free_pose_updates_absolute_rotate_translate) {
+    checkAbsoluteRotateTranslates(skeleton);
+}
+
+TEST_F(BoneChainFixture, any_scale_disables_scale_free_path) {
+    skeleton.bones[BoneCount / 2].scale = cal3d::Scale(CalVector(2, 2, 2));
+    CHECK(!skeleton.isScaleFree());
+}
+
+TEST_F(BoneChainFixture, calculateAbsolutePose_cycle_count) {
+    printf("Cycles per bone (chain, scale-free): %d\n", calculateAbsolutePoseCyclesPerBone(skeleton));
+    printf("Skeleton updates per second (chain, scale-free): %d\n", calculateAbsolutePoseUpdatesPerSecond(skeleton));
+    skeleton.bones[0].scale = cal3d::Scale(CalVector(2, 2, 2));
+    printf("Cycles per bone (chain, scaled): %d\n", calculateAbsolutePoseCyclesPerBone(skeleton));
+    printf("Skeleton updates per second (chain, scaled): %d\n", calculateAbsolutePoseUpdatesPerSecond(skeleton));
+}
+
+FIXTURE(BoneTreeFixture) {
+    SETUP(BoneTreeFixture)
+        : skeleton(makeBoneTree(BoneCount, 8))
+    {}
+
+    enum { BoneCount = 64 };
+    CalSkeleton skeleton;
+};
+
+TEST_F(BoneTreeFixture, scale_free_pose_matches_general_pose) {
+    checkMatchesGeneralPose(skeleton);
+}
+
+TEST_F(BoneTreeFixture, scale_free_pose_updates_absolute_rotate_translate) {
+    checkAbsoluteRotateTranslates(skeleton);
+
+    // and again for only the bones a new pose dirties
+    skeleton.resetPose();
+    skeleton.bones[2].blendPose(1.0f, cal3d::RotateTranslate(CalQuaternion(0.6f, 0.0f, 0.0f, 0.8f), CalVector(5, 5, 5)), 0.0f);
+    checkAbsoluteRotateTranslates(skeleton);
+    checkMatchesGeneralPose(skeleton);
+}
+
+TEST_F(BoneTreeFixture, scaled_pose_matches_general_pose) {
+    for (unsigned i = 0; i < skeleton.bones.size(); i += 3) {
+        skeleton.bones[i].scale = cal3d::Scale(CalVector(1.5f, 0.5f, 2.0f));
+    }
+    checkMatchesGeneralPose(skeleton);
+}
+
+TEST_F(BoneTreeFixture, calculateAbsolutePose_cycle_count) {
+    printf("Cycles per bone (tree, scale-free): %d\n", calculateAbsolutePoseCyclesPerBone(skeleton));
+    printf("Skeleton updates per second (tree, scale-free): %d\n", calculateAbsolutePoseUpdatesPerSecond(skeleton));
+    skeleton.bones[0].scale = cal3d::Scale(CalVector(2, 2, 2));
+    printf("Cycles per bone (tree, scaled): %d\n", calculateAbsolutePoseCyclesPerBone(skeleton));
+    printf("Skeleton updates per second (tree, scaled): %d\n", calculateAbsolutePoseUpdatesPerSecond(skeleton));
+}
+
+TEST_F(BoneTreeFixture, first_pose_dirties_every_bone) {
+    skeleton.calculateAbsolutePose();
+    CHECK_EQUAL(size_t(BoneCount), skeleton.getDirtyBones().size());
+}
+
+TEST_F(BoneTreeFixture, unchanged_pose_dirties_nothing) {
+    skeleton.calculateAbsolutePose();
+    skeleton.resetPose();
+    skeleton.calculateAbsolutePose();
+    CHECK_EQUAL(0u, skeleton.getDirtyBones().size());
+}
+
+TEST_F(BoneTreeFixture, changed_bone_dirties_its_subtree) {
+    skeleton.calculateAbsolutePose();
+
+    // bone 2's children are 17..24, which have no children of their own
+    skeleton.resetPose();
+    skeleton.bones[2].blendPose(1.0f, cal3d::RotateTranslate(CalQuaternion(), CalVector(5, 5, 5)), 0.0f);
+    skeleton.calculateAbsolutePose();
+
+    const std::vector<unsigned>& dirty = skeleton.getDirtyBones();
+    CHECK_EQUAL(9u, dirty.size());
+    CHECK_EQUAL(2u, dirty[0]);
+    CHECK_EQUAL(17u, dirty[1]);
+    CHECK_EQUAL(24u, dirty[8]);
+
+    checkMatchesGeneralPose(skeleton);
+}
+
+TEST_F(BoneTreeFixture, changed_scale_dirties_its_subtree) {
+    skeleton.bones[0].scale = cal3d::Scale(CalVector(2, 2, 2));
+    skeleton.calculateAbsolutePose();
+
+    skeleton.bones[3].scale = cal3d::Scale(CalVector(1, 3, 1));
+    skeleton.calculateAbsolutePose();
+    CHECK_EQUAL(9u, skeleton.getDirtyBones().size());
+
+    checkMatchesGeneralPose(skeleton);
+}
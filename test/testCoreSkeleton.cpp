@@ -281,3 +281,126 @@ TEST_F(CoreSkeletonFixture, loader_zeroes_out_root_transform_of_skeleton) {
     CHECK_EQUAL(CalVector(0, 0, 0), root0->relativeTransform.translation);
     CHECK_EQUAL(CalVector(3, 3, 3), root1->relativeTransform.translation);
 }
+
+static float distanceToSegment(const CalVector& p, const CalVector& a, const CalVector& b) {
+    const CalVector ab = b - a;
+    const float lengthSquared = ab.lengthSquared();
+    float t = lengthSquared > 0.0f ? dot(p - a, ab) / lengthSquared : 0.0f;
+    t = std::max(0.0f, std::min(1.0f, t));
+    return (p - (a + ab * t)).length();
+}
+
+// Bone 0 dominates a radius-0.5 tube along x from 0 to 4; bone 1 only
+// carries minor weight.  Bone 2 dominates a small cluster.
+static CalCoreSubmeshPtr capsuleFittingCoreSubmesh() {
+    const int Rings = 9;
+    const int Spokes = 8;
+    CalCoreSubmeshPtr coreSubmesh(new CalCoreSubmesh(Rings * Spokes + 3, 0, 0));
+    for (int r = 0; r < Rings; ++r) {
+        for (int s = 0; s < Spokes; ++s) {
+            const float angle = 6.2831853f * s / Spokes;
+            CalCoreSubmesh::Vertex v;
+            v.position = CalPoint4(CalVector(0.5f * r, 0.5f * cosf(angle), 0.5f * sinf(angle)));
+            v.normal = CalVector4(0.0f, cosf(angle), sinf(angle), 0.0f);
+            std::vector<CalCoreSubmesh::Influence> inf;
+            inf.push_back(CalCoreSubmesh::Influence(1, 0.25f, false));
+            inf.push_back(CalCoreSubmesh::Influence(0, 0.75f, true));
+            coreSubmesh->addVertex(v, 0, inf);
+        }
+    }
+    for (int i = 0; i < 3; ++i) {
+        CalCoreSubmesh::Vertex v;
+        v.position = CalPoint4(CalVector(10.0f + 0.1f * i, 0.0f, 0.0f));
+        v.normal = CalVector4(0.0f, 0.0f, 1.0f, 0.0f);
+        std::vector<CalCoreSubmesh::Influence> inf(1, CalCoreSubmesh::Influence(2, 1.0f, true));
+        coreSubmesh->addVertex(v, 0, inf);
+    }
+    return coreSubmesh;
+}
+
+static CalCoreSkeletonPtr threeBoneSkeleton() {
+    CalCoreSkeletonPtr cs(new CalCoreSkeleton);
+    cs->addCoreBone(CalCoreBonePtr(new CalCoreBone("root")));
+    CalCoreBonePtr child1(new CalCoreBone("child1", 0));
+    cs->addCoreBone(child1);
+    CalCoreBonePtr child2(new CalCoreBone("child2", 0));
+    cs->addCoreBone(child2);
+    return cs;
+}
+
+TEST_F(CoreSkeletonFixture, fitted_bone_capsules_contain_dominated_vertices) {
+    CalCoreSkeletonPtr cs(threeBoneSkeleton());
+    CalCoreSubmeshPtr coreSubmesh(capsuleFittingCoreSubmesh());
+    cs->fitBoneCapsules(std::vector<CalCoreSubmeshPtr>(1, coreSubmesh));
+    CHECK_EQUAL(3u, cs->boneCapsules.size());
+
+    const CalBoneCapsule& tube = cs->boneCapsules[0];
+    CHECK_CLOSE(0.5f, tube.radius, 1e-4f);
+    CHECK_CLOSE(0.0f, fabsf(tube.a.y) + fabsf(tube.a.z) + fabsf(tube.b.y) + fabsf(tube.b.z), 1e-4f);
+    CHECK_CLOSE(4.0f, fabsf(tube.b.x - tube.a.x), 1e-3f);
+
+    CHECK_EQUAL(0.0f, cs->boneCapsules[1].radius);
+
+    const CalCoreSubmesh::VectorVertex& vertices = coreSubmesh->getVectorVertex();
+    const CalCoreSubmesh::InfluenceVector& influences = coreSubmesh->getInfluences();
+    size_t influence = 0;
+    for (size_t v = 0; v < vertices.size(); ++v) {
+        const CalBoneCapsule& capsule = cs->boneCapsules[influences[influence].boneId];
+        CHECK(distanceToSegment(vertices[v].position.asCalVector(), capsule.a.asCalVector(), capsule.b.asCalVector()) <= capsule.radius + 1e-4f);
+        while (!influences[influence++].lastInfluenceForThisVertex) {
+        }
+    }
+}
+
+TEST_F(CoreSkeletonFixture, fitting_capsules_rejects_influences_outside_the_skeleton) {
+    CalCoreSkeleton cs;
+    cs.addCoreBone(CalCoreBonePtr(new CalCoreBone("root")));
+    CHECK_THROW(cs.fitBoneCapsules(std::vector<CalCoreSubmeshPtr>(1, capsuleFittingCoreSubmesh())), std::exception);
+}
+
+TEST_F(CoreSkeletonFixture, transformed_bone_capsules_follow_bone_transforms) {
+    CalBoneCapsule capsule;
+    capsule.a = CalPoint4(1.0f, 2.0f, 3.0f);
+    capsule.b = CalPoint4(-1.0f, 0.5f, 2.0f);
+    capsule.radius = 0.25f;
+
+    // a quarter turn about z, then a translation
+    BoneTransform bt(
+        CalVector4(0, -1, 0, 10.0f),
+        CalVector4(1, 0, 0, 20.0f),
+        CalVector4(0, 0, 1, 30.0f));
+
+    CalBoneCapsule posed;
+    cal3d::transformBoneCapsules(&bt, 1, &capsule, &posed);
+    CHECK_EQUAL(CalPoint4(8.0f, 21.0f, 33.0f), posed.a);
+    CHECK_EQUAL(CalPoint4(9.5f, 19.0f, 32.0f), posed.b);
+    CHECK_EQUAL(0.25f, posed.radius);
+}
+
+TEST_F(CoreSkeletonFixture, transform_bone_capsules_cycle_count) {
+    const int N = 100;
+    const int TrialCount = 10;
+
+    cal3d::SSEArray<BoneTransform> bt(N);
+    cal3d::SSEArray<CalBoneCapsule> capsules(N);
+    cal3d::SSEArray<CalBoneCapsule> posed(N);
+    for (int i = 0; i < N; ++i) {
+        bt[i].rowx.set(1, 0, 0, float(i));
+        bt[i].rowy.set(0, 1, 0, 0);
+        bt[i].rowz.set(0, 0, 1, 0);
+        capsules[i].a = CalPoint4(0.0f, float(i), 0.0f);
+        capsules[i].b = CalPoint4(1.0f, float(i), 0.0f);
+        capsules[i].radius = 0.1f;
+    }
+
+    cal3d_int64 min = 99999999999999LL;
+    for (int t = 0; t < TrialCount; ++t) {
+        cal3d_int64 start = __rdtsc();
+        cal3d::transformBoneCapsules(bt.data(), N, capsules.data(), posed.data());
+        cal3d_int64 end = __rdtsc();
+        min = std::min(min, end - start);
+    }
+    CHECK_EQUAL(CalPoint4(float(N), float(N - 1), 0.0f), posed[N - 1].b);
+
+    printf("Cycles per bone capsule: %d\n", (int)(min / N));
+}
@@ -82,3 +82,46 @@ TEST_F(TrackFixture, getState_with_two_keyframes_at_same_time) {
     CHECK_EQUAL(CalQuaternion(), t.rotation);
     CHECK_EQUAL(CalVector(6, 6, 6), t.translation);
 }
+
+TEST_F(TrackFixture, classify_detects_constant_track) {
+    CalCoreTrack::KeyframeList keyframes;
+    keyframes.push_back(CalCoreKeyframe(0, CalVector(2, 2, 2), CalQuaternion()));
+    keyframes.push_back(CalCoreKeyframe(1, CalVector(2, 2, 2.0001f), CalQuaternion()));
+    keyframes.push_back(CalCoreKeyframe(2, CalVector(2, 2, 2), CalQuaternion()));
+    CalCoreTrack track(0, keyframes);
+    track.classify(0.01, 0.1);
+
+    CHECK(track.isConstant());
+    CHECK_EQUAL(CalVector(2, 2, 2), track.getCurrentTransform(1).translation);
+}
+
+TEST_F(TrackFixture, classify_snaps_constant_translation_and_keeps_rotation_animated) {
+    CalQuaternion turned;
+    turned.setAxisAngle(CalVector(0, 0, 1), 1.0f);
+
+    CalCoreTrack::KeyframeList keyframes;
+    keyframes.push_back(CalCoreKeyframe(0, CalVector(2, 2, 2), CalQuaternion()));
+    keyframes.push_back(CalCoreKeyframe(1, CalVector(2, 2, 2.0001f), turned));
+    CalCoreTrack track(0, keyframes);
+    track.classify(0.01, 0.1);
+
+    CHECK(track.translationIsConstant);
+    CHECK(!track.rotationIsConstant);
+    CHECK_EQUAL(CalVector(2, 2, 2), track.keyframes[1].transform.translation);
+
+    t = track.getCurrentTransform(1);
+    CHECK_EQUAL(CalVector(2, 2, 2), t.translation);
+    CHECK_EQUAL(turned, t.rotation);
+}
+
+TEST_F(TrackFixture, classify_detects_constant_rotation) {
+    CalCoreTrack::KeyframeList keyframes;
+    keyframes.push_back(CalCoreKeyframe(0, CalVector(2, 2, 2), CalQuaternion()));
+    keyframes.push_back(CalCoreKeyframe(1, CalVector(4, 4, 4), CalQuaternion()));
+    CalCoreTrack track(0, keyframes);
+    track.classify(0.01, 0.1);
+
+    CHECK(!track.translationIsConstant);
+    CHECK(track.rotationIsConstant);
+    CHECK_EQUAL(CalVector(3, 3, 3), track.getCurrentTransform(0.5).translation);
+}
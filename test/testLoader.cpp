@@ -197,9 +197,10 @@ TEST_F(LoaderFixture, LoadSimpleXmlAnimation) {
     CHECK_EQUAL(anim->duration, 40);
 
     const CalCoreTrack* track1 = &anim->tracks[0];
-    const CalCoreTrack* track2 = anim->getCoreTrack(/*boneid*/ 0);
-    CHECK(track1);
-    CHECK_EQUAL(track1, track2);
+    CalCoreTrackPtr track2 = anim->getCoreTrack(/*boneid*/ 0);
+    CHECK(track2);
+    CHECK_EQUAL(*track1, *track2);
+    CHECK_EQUAL(track1, anim->findTrack(/*boneid*/ 0));
 
     CHECK_EQUAL(track1->translationRequired, false);
     CHECK_EQUAL(track1->translationIsDynamic, false);
@@ -650,6 +651,68 @@ TEST_F(LoaderFixture, converting_xml_to_binary_then_back_to_xml_does_not_modify_
     CHECK_EQUAL(*anim1, *anim2);
 }
 
+static CalCoreAnimationPtr makePartlyConstantAnimation() {
+    CalCoreAnimationPtr anim(new CalCoreAnimation());
+    anim->duration = 1;
+    // bones 2 and 0 move, bones 3 and 1 hold still
+    const unsigned boneIds[] = {3, 2, 1, 0};
+    for (unsigned i = 0; i < 4; ++i) {
+        CalCoreTrack::KeyframeList keyframes;
+        keyframes.push_back(CalCoreKeyframe(0, CalVector(1, 1, 1), CalQuaternion()));
+        const float z = boneIds[i] % 2 ? 1.0f : 2.0f;
+        keyframes.push_back(CalCoreKeyframe(1, CalVector(1, 1, z), CalQuaternion()));
+        anim->tracks.push_back(CalCoreTrack(boneIds[i], keyframes));
+    }
+    // folding must keep the flags the savers write
+    anim->tracks[2].translationRequired = false;
+    return anim;
+}
+
+TEST_F(LoaderFixture, folded_animation_saves_tracks_in_original_order) {
+    CalCoreAnimationPtr anim = makePartlyConstantAnimation();
+    std::ostringstream before;
+    CalSaver::saveXmlCoreAnimation(before, anim.get());
+
+    anim->foldConstantTracks(0.01, 0.1);
+    CHECK_EQUAL(2u, anim->tracks.size());
+    CHECK_EQUAL(2u, anim->constantTracks.size());
+
+    std::ostringstream after;
+    CalSaver::saveXmlCoreAnimation(after, anim.get());
+    CHECK_EQUAL(before.str(), after.str());
+
+    std::stringstream binary;
+    CalSaver::saveCoreAnimation(binary, anim.get());
+    std::string str = binary.str();
+    CalBufferSource cbs(str.data(), str.size());
+    CalCoreAnimationPtr loaded = CalLoader::loadCoreAnimation(cbs);
+    CHECK(loaded);
+    CHECK_EQUAL(*makePartlyConstantAnimation(), *loaded);
+}
+
+TEST_F(LoaderFixture, unfolding_restores_folded_animation) {
+    CalCoreAnimationPtr anim = makePartlyConstantAnimation();
+    const unsigned generation = anim->getGeneration();
+
+    anim->foldConstantTracks(0.01, 0.1);
+    CHECK(anim->getGeneration() != generation);
+    CHECK(!anim->findTrack(/*boneid*/ 3));
+    CalCoreTrackPtr folded = anim->getCoreTrack(/*boneid*/ 3);
+    CHECK(folded);
+    CHECK_EQUAL(makePartlyConstantAnimation()->tracks[0], *folded);
+    CHECK(folded->isConstant());
+
+    // both folded tracks are sampled at the same times, which are kept once
+    CHECK_EQUAL(2u, anim->constantKeyframeTimes.size());
+    CHECK_EQUAL(anim->constantTracks[0].firstKeyframeTime, anim->constantTracks[1].firstKeyframeTime);
+
+    // folding twice must not lose the original positions
+    anim->foldConstantTracks(0.01, 0.1);
+    anim->unfoldConstantTracks();
+    CHECK_EQUAL(0u, anim->constantTracks.size());
+    CHECK_EQUAL(*makePartlyConstantAnimation(), *anim);
+}
+
 TEST_F(LoaderFixture, converting_xml_to_binary_then_test_nan_duration_animation) {
     CalBufferSource cbs(fromString(animationText));
     CalCoreAnimationPtr anim1 = CalLoader::loadCoreAnimation(cbs);
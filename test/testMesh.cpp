@@ -60,3 +60,89 @@ TEST_F(MeshFixture, can_replace_base_mesh_with_morph_target) {
     CHECK_EQUAL(CalPoint4(4, 4, 4), submesh->getVectorVertex()[0].position);
     CHECK_EQUAL(CalVector4(4, 4, 4), submesh->getVectorVertex()[0].normal);
 }
+
+// A strip of vertexCount vertices, each influenced by bone firstBone + i % boneCount.
+static CalCoreSubmeshPtr stripCoreSubmesh(int material, unsigned vertexCount, unsigned firstBone, unsigned boneCount) {
+    CalCoreSubmeshPtr submesh(new CalCoreSubmesh(vertexCount, true, vertexCount - 2));
+    submesh->coreMaterialThreadId = material;
+    for (unsigned i = 0; i < vertexCount; ++i) {
+        CalCoreSubmesh::Vertex vertex;
+        vertex.position = CalPoint4(float(i), float(material), 0.0f);
+        vertex.normal = CalVector4(0, 0, 1, 0);
+        const std::vector<CalCoreSubmesh::Influence> influences(1, CalCoreSubmesh::Influence(firstBone + i % boneCount, 1.0f, true));
+        submesh->addVertex(vertex, CalColor32(i), influences);
+        submesh->setTextureCoordinate(i, CalCoreSubmesh::TextureCoordinate(float(i), 0.0f));
+    }
+    for (unsigned i = 0; i + 2 < vertexCount; ++i) {
+        submesh->addFace(CalCoreSubmesh::WideFace(i, i + 1, i + 2));
+    }
+    return submesh;
+}
+
+TEST_F(MeshFixture, merge_submeshes_joins_neighbours_of_the_same_material_within_the_bone_limit) {
+    CalCoreMesh mesh;
+    mesh.submeshes.push_back(stripCoreSubmesh(1, 3, 0, 1));
+    mesh.submeshes.push_back(stripCoreSubmesh(1, 4, 2, 1));
+    mesh.submeshes.push_back(stripCoreSubmesh(1, 3, 3, 2)); // one bone too many to join
+    mesh.submeshes.push_back(stripCoreSubmesh(2, 3, 1, 1));
+    mesh.submeshes.push_back(stripCoreSubmesh(1, 3, 3, 1)); // fits the third, but isn't next to it
+    CalCoreMorphTarget::VertexOffsetArray offsets;
+    offsets.push_back(VertexOffset(1, CalPoint4(0, 1, 0), CalVector4()));
+    mesh.submeshes[1]->addMorphTarget(CalCoreMorphTargetPtr(new CalCoreMorphTarget("smile", 4, offsets)));
+    mesh.submeshes[1]->dedupeInfluenceSets();
+    const CalCoreSubmeshPtr first = mesh.submeshes[0];
+
+    const CalCoreMesh::SubmeshRemapVector remaps = mesh.mergeSubmeshes(2);
+
+    CHECK_EQUAL(4u, mesh.submeshes.size());
+    CHECK_EQUAL(5u, remaps.size());
+    CHECK_EQUAL(0u, remaps[0].submesh);
+    CHECK_EQUAL(0u, remaps[1].submesh);
+    CHECK_EQUAL(3u, remaps[1].firstVertex);
+    CHECK_EQUAL(1u, remaps[1].firstFace);
+    CHECK_EQUAL(1u, remaps[2].submesh);
+    CHECK_EQUAL(0u, remaps[2].firstVertex);
+    CHECK_EQUAL(2u, remaps[3].submesh);
+    CHECK_EQUAL(3u, remaps[4].submesh);
+    CHECK_EQUAL(2, mesh.submeshes[2]->coreMaterialThreadId);
+
+    const CalCoreSubmesh& merged = *mesh.submeshes[0];
+    CHECK_EQUAL(1, merged.coreMaterialThreadId);
+    CHECK_EQUAL(7u, merged.getVertexCount());
+    CHECK_EQUAL(3u, merged.getFaceCount());
+    CHECK_EQUAL(5u, merged.getFaces()[2].vertexId[1]);
+    CHECK_EQUAL(2u, merged.getPaletteBoneIds().size());
+    CHECK_EQUAL(2u, merged.getInfluences()[4].boneId);
+    CHECK_EQUAL(1u, merged.getVertexColors()[4]);
+    CHECK_EQUAL(CalPoint4(1, 1, 0), merged.getVectorVertex()[4].position);
+    CHECK_EQUAL(CalVector(3, 1, 0), merged.getBoundingVolume().max);
+
+    CHECK_EQUAL(1u, merged.getMorphTargets().size());
+    CHECK_EQUAL(4u, merged.getMorphTargets()[0]->vertexOffsets[0].vertexId);
+
+    // influence sets cover the joined vertices, as one side had them
+    CHECK(merged.hasInfluenceSets());
+    CHECK_EQUAL(7u, merged.getVertexInfluenceSets().size());
+    CHECK_EQUAL(2u, merged.getInfluenceSetCount());
+
+    // the originals are untouched
+    CHECK_EQUAL(3u, first->getVertexCount());
+    CHECK(mesh.submeshes[1] != first);
+}
+
+TEST_F(MeshFixture, merge_submeshes_respects_the_index_width) {
+    CalCoreMesh mesh;
+    mesh.submeshes.push_back(stripCoreSubmesh(0, 40000, 0, 1));
+    mesh.submeshes.push_back(stripCoreSubmesh(0, 40000, 0, 1));
+
+    mesh.mergeSubmeshes(8);
+    CHECK_EQUAL(2u, mesh.submeshes.size());
+
+    const CalCoreMesh::SubmeshRemapVector remaps = mesh.mergeSubmeshes(8, 4);
+    CHECK_EQUAL(1u, mesh.submeshes.size());
+    CHECK_EQUAL(40000u, remaps[1].firstVertex);
+    CHECK_EQUAL(4u, mesh.submeshes[0]->getIndexSize());
+    CHECK_EQUAL(2u * 39998u, mesh.submeshes[0]->getFaceCount());
+    CHECK_EQUAL(79999u, mesh.submeshes[0]->getFace(2u * 39998u - 1).vertexId[2]);
+    CHECK(mesh.submeshes[0]->isStatic());
+}
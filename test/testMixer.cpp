@@ -87,3 +87,126 @@ TEST_F(MixerFixture, second_high_priority_trumps_first) {
     updateSkeleton();
     CHECK_EQUAL(CalVector(-1, -1, -1), skeleton.bones[0].absoluteTransform.translation);
 }
+
+FIXTURE(MaskedMixerFixture) {
+    SETUP(MaskedMixerFixture)
+        : coreSkeleton(fakeMaskedSkeleton())
+        , skeleton(coreSkeleton)
+    {}
+
+    // root -> spine -> arm, root -> leg
+    static CalCoreSkeletonPtr fakeMaskedSkeleton() {
+        CalCoreSkeletonPtr p(new CalCoreSkeleton());
+        p->addCoreBone(CalCoreBonePtr(new CalCoreBone("root")));
+        p->addCoreBone(CalCoreBonePtr(new CalCoreBone("spine", 0)));
+        p->addCoreBone(CalCoreBonePtr(new CalCoreBone("arm", 1)));
+        p->addCoreBone(CalCoreBonePtr(new CalCoreBone("leg", 0)));
+        return p;
+    }
+
+    static CalAnimationPtr makeFullBodyAnimation(CalVector t) {
+        CalCoreAnimationPtr coreAnimation(new CalCoreAnimation());
+        // one track per bone plus one for a bone the skeleton lacks
+        for (unsigned boneId = 0; boneId < 5; ++boneId) {
+            CalCoreTrack::KeyframeList keyframes;
+            keyframes.push_back(CalCoreKeyframe(0, t, CalQuaternion()));
+            coreAnimation->tracks.push_back(CalCoreTrack(boneId, keyframes));
+        }
+        return CalAnimationPtr(new CalAnimation(coreAnimation, 1.0f, 0));
+    }
+
+    void updateSkeleton() {
+        mixer.updateSkeleton(
+            &skeleton,
+            std::vector<BoneTransformAdjustment>(),
+            std::vector<BoneScaleAdjustment>());
+    }
+
+    CalCoreSkeletonPtr coreSkeleton;
+    CalSkeleton skeleton;
+    CalMixer mixer;
+};
+
+TEST_F(MaskedMixerFixture, subtree_mask_covers_bone_and_descendants) {
+    std::vector<bool> mask = coreSkeleton->getSubtreeMask(1);
+    CHECK_EQUAL(4u, mask.size());
+    CHECK(!mask[0]);
+    CHECK(mask[1]);
+    CHECK(mask[2]);
+    CHECK(!mask[3]);
+}
+
+TEST_F(MaskedMixerFixture, track_bindings_skip_absent_bones) {
+    CalAnimationPtr anim(makeFullBodyAnimation(CalVector(1, 1, 1)));
+    CHECK_EQUAL(4u, anim->getTrackBindings(skeleton.bones.size()).size());
+}
+
+TEST_F(MaskedMixerFixture, track_bindings_skip_masked_bones) {
+    CalAnimationPtr anim(makeFullBodyAnimation(CalVector(1, 1, 1)));
+    anim->setBoneMask(coreSkeleton->getSubtreeMask(1));
+
+    const CalAnimation::TrackBindingList& bindings = anim->getTrackBindings(skeleton.bones.size());
+    CHECK_EQUAL(2u, bindings.size());
+    CHECK_EQUAL(1u, bindings[0].boneId);
+    CHECK_EQUAL(2u, bindings[1].boneId);
+}
+
+TEST_F(MaskedMixerFixture, masked_animation_leaves_other_bones_in_bind_pose) {
+    CalAnimationPtr anim(makeFullBodyAnimation(CalVector(1, 1, 1)));
+    anim->setBoneMask(coreSkeleton->getSubtreeMask(1));
+
+    mixer.addAnimation(anim);
+    updateSkeleton();
+
+    CHECK_EQUAL(CalVector(0, 0, 0), skeleton.bones[0].getRelativeTransform().translation);
+    CHECK_EQUAL(CalVector(1, 1, 1), skeleton.bones[1].getRelativeTransform().translation);
+    CHECK_EQUAL(CalVector(1, 1, 1), skeleton.bones[2].getRelativeTransform().translation);
+    CHECK_EQUAL(CalVector(0, 0, 0), skeleton.bones[3].getRelativeTransform().translation);
+}
+
+TEST_F(MaskedMixerFixture, changing_mask_rebinds_tracks) {
+    CalAnimationPtr anim(makeFullBodyAnimation(CalVector(1, 1, 1)));
+    anim->setBoneMask(coreSkeleton->getSubtreeMask(3));
+    CHECK_EQUAL(1u, anim->getTrackBindings(skeleton.bones.size()).size());
+
+    anim->setBoneMask(CalAnimation::BoneMask());
+    CHECK_EQUAL(4u, anim->getTrackBindings(skeleton.bones.size()).size());
+}
+
+TEST_F(MaskedMixerFixture, folded_tracks_pose_bones_like_keyframed_tracks) {
+    CalAnimationPtr anim(makeFullBodyAnimation(CalVector(1, 1, 1)));
+    CalCoreAnimation& coreAnimation = *anim->coreAnimation;
+    coreAnimation.foldConstantTracks(0.01, 0.1);
+
+    CHECK_EQUAL(0u, coreAnimation.tracks.size());
+    CHECK_EQUAL(5u, coreAnimation.constantTracks.size());
+    CHECK_EQUAL(4u, anim->getConstantTrackBindings(skeleton.bones.size()).size());
+
+    mixer.addAnimation(anim);
+    updateSkeleton();
+
+    CHECK_EQUAL(CalVector(1, 1, 1), skeleton.bones[0].getRelativeTransform().translation);
+    CHECK_EQUAL(CalVector(1, 1, 1), skeleton.bones[3].getRelativeTransform().translation);
+}
+
+TEST_F(MaskedMixerFixture, folding_after_binding_rebinds_tracks) {
+    CalAnimationPtr anim(makeFullBodyAnimation(CalVector(1, 1, 1)));
+    CalCoreAnimation& coreAnimation = *anim->coreAnimation;
+    coreAnimation.tracks[2].keyframes.push_back(CalCoreKeyframe(1, CalVector(3, 3, 3), CalQuaternion()));
+    CHECK_EQUAL(4u, anim->getTrackBindings(skeleton.bones.size()).size());
+
+    coreAnimation.foldConstantTracks(0.01, 0.1);
+
+    const CalAnimation::TrackBindingList& bindings = anim->getTrackBindings(skeleton.bones.size());
+    CHECK_EQUAL(1u, bindings.size());
+    CHECK_EQUAL(0u, bindings[0].trackIndex);
+    CHECK_EQUAL(2u, bindings[0].boneId);
+    CHECK_EQUAL(3u, anim->getConstantTrackBindings(skeleton.bones.size()).size());
+
+    anim->time = 1;
+    mixer.addAnimation(anim);
+    updateSkeleton();
+
+    CHECK_EQUAL(CalVector(1, 1, 1), skeleton.bones[1].getRelativeTransform().translation);
+    CHECK_EQUAL(CalVector(3, 3, 3), skeleton.bones[2].getRelativeTransform().translation);
+}
@@ -6,18 +6,6 @@
 
 #include <cstring>
 
-#if defined(_MSC_VER)
-#   include <intrin.h>
-#else
-
-inline cal3d_uint64 __rdtsc(void) {
-    cal3d_uint64 myvar;
-    __asm__ volatile("rdtsc \n\t" : "=A"(myvar));
-    return myvar;
-}
-
-#endif
-
 FIXTURE(PhysiqueFixture) {
 };
 
@@ -501,3 +489,840 @@ TEST_F(PhysiqueFixture, two_disjoint_morph_targets) {
     CHECK_EQUAL(1, output[2].y);
     CHECK_EQUAL(1, output[2].z);
 }
+
+TEST_F(PhysiqueFixture, dirty_bones_reskin_only_their_vertex_ranges) {
+    // vertex 0 -> bone 0, 1 -> bones 0 and 1, 2 -> bone 1, 3 -> bone 2
+    CalCoreSubmeshPtr coreSubmesh(new CalCoreSubmesh(4, 0, 0));
+    CalCoreSubmesh::Vertex v;
+    v.position = CalPoint4(CalVector(0, 0, 0));
+    v.normal = CalVector4(0, 0, 1, 0);
+    std::vector<CalCoreSubmesh::Influence> inf(1, CalCoreSubmesh::Influence(0, 1.0f, true));
+    coreSubmesh->addVertex(v, 0, inf);
+    inf[0].weight = 0.5f;
+    inf.push_back(CalCoreSubmesh::Influence(1, 0.5f, true));
+    coreSubmesh->addVertex(v, 0, inf);
+    inf.resize(1);
+    inf[0] = CalCoreSubmesh::Influence(1, 1.0f, true);
+    coreSubmesh->addVertex(v, 0, inf);
+    inf[0] = CalCoreSubmesh::Influence(2, 1.0f, true);
+    coreSubmesh->addVertex(v, 0, inf);
+
+    CalSubmesh submesh(coreSubmesh);
+
+    BoneTransform bt[3];
+    for (int i = 0; i < 3; ++i) {
+        bt[i].rowx.set(1, 0, 0, 0);
+        bt[i].rowy.set(0, 1, 0, 0);
+        bt[i].rowz.set(0, 0, 1, 0);
+    }
+
+    CAL3D_ALIGN_HEAD(16) CalVector4 output[4 * 2] CAL3D_ALIGN_TAIL(16);
+    CalPhysique::calculateVerticesAndNormals(bt, &submesh, &output[0].x);
+
+    bt[1].rowx.w = 2.0f;
+    std::vector<unsigned> dirtyBones(1, 1);
+    CalCoreSubmesh::VertexRangeVector dirtyRanges;
+    CalPhysique::calculateDirtyVerticesAndNormals(bt, &submesh, dirtyBones, &output[0].x, dirtyRanges);
+
+    CHECK_EQUAL(1u, dirtyRanges.size());
+    CHECK_EQUAL(1u, dirtyRanges[0].begin);
+    CHECK_EQUAL(3u, dirtyRanges[0].end);
+
+    CHECK_EQUAL(0, output[0].x);
+    CHECK_EQUAL(1, output[2].x);
+    CHECK_EQUAL(2, output[4].x);
+    CHECK_EQUAL(0, output[6].x);
+}
+
+TEST_F(PhysiqueFixture, dirty_reskin_clears_morphs_after_they_turn_off) {
+    // vertex i -> bone i, and a morph target moving vertex 2
+    CalCoreSubmeshPtr coreSubmesh(new CalCoreSubmesh(3, 0, 0));
+    CalCoreSubmesh::Vertex v;
+    v.position = CalPoint4(CalVector(0, 0, 0));
+    v.normal = CalVector4(0, 0, 1, 0);
+    for (unsigned i = 0; i < 3; ++i) {
+        coreSubmesh->addVertex(v, 0, std::vector<CalCoreSubmesh::Influence>(1, CalCoreSubmesh::Influence(i, 1.0f, true)));
+    }
+    CalCoreMorphTarget::VertexOffsetArray offsets;
+    offsets.push_back(VertexOffset(2, CalPoint4(5, 0, 0), CalVector4()));
+    coreSubmesh->addMorphTarget(CalCoreMorphTargetPtr(new CalCoreMorphTarget("morph", 3, offsets)));
+    CalSubmesh submesh(coreSubmesh);
+
+    BoneTransform bt[3];
+    for (int i = 0; i < 3; ++i) {
+        bt[i].rowx.set(1, 0, 0, 0);
+        bt[i].rowy.set(0, 1, 0, 0);
+        bt[i].rowz.set(0, 0, 1, 0);
+    }
+
+    CAL3D_ALIGN_HEAD(16) CalVector4 output[3 * 2] CAL3D_ALIGN_TAIL(16);
+    CalPhysique::calculateVerticesAndNormals(bt, &submesh, &output[0].x);
+    CHECK_EQUAL(0, output[4].x);
+
+    // only bone 0 moves each time; vertex 2 changes through the morph
+    const std::vector<unsigned> dirtyBones(1, 0);
+    CalCoreSubmesh::VertexRangeVector dirtyRanges;
+    submesh.morphTargets[0].weight = 1.0f;
+    CalPhysique::calculateDirtyVerticesAndNormals(bt, &submesh, dirtyBones, &output[0].x, dirtyRanges);
+    CHECK_EQUAL(5, output[4].x);
+
+    submesh.morphTargets[0].weight = 0.0f;
+    CalPhysique::calculateDirtyVerticesAndNormals(bt, &submesh, dirtyBones, &output[0].x, dirtyRanges);
+    CHECK_EQUAL(0, output[4].x);
+    CHECK_EQUAL(1u, dirtyRanges.size());
+    CHECK_EQUAL(3u, dirtyRanges[0].end);
+
+    // and partial again from then on
+    CalPhysique::calculateDirtyVerticesAndNormals(bt, &submesh, dirtyBones, &output[0].x, dirtyRanges);
+    CHECK_EQUAL(1u, dirtyRanges.size());
+    CHECK_EQUAL(1u, dirtyRanges[0].end);
+}
+
+TEST_F(PhysiqueFixture, dirty_ranges_of_several_bones_are_merged) {
+    CalCoreSubmeshPtr coreSubmesh(djinnCoreSubmesh(4));
+    CalSubmesh submesh(coreSubmesh);
+
+    BoneTransform bt;
+    bt.rowx.set(1, 0, 0, 0);
+    bt.rowy.set(0, 1, 0, 0);
+    bt.rowz.set(0, 0, 1, 0);
+
+    CAL3D_ALIGN_HEAD(16) CalVector4 output[4 * 2] CAL3D_ALIGN_TAIL(16);
+    std::vector<unsigned> dirtyBones;
+    dirtyBones.push_back(5); // not used by this submesh
+    CalCoreSubmesh::VertexRangeVector dirtyRanges;
+    CalPhysique::calculateDirtyVerticesAndNormals(&bt, &submesh, dirtyBones, &output[0].x, dirtyRanges);
+    CHECK_EQUAL(0u, dirtyRanges.size());
+
+    dirtyBones.push_back(0);
+    CalPhysique::calculateDirtyVerticesAndNormals(&bt, &submesh, dirtyBones, &output[0].x, dirtyRanges);
+    CHECK_EQUAL(1u, dirtyRanges.size());
+    CHECK_EQUAL(0u, dirtyRanges[0].begin);
+    CHECK_EQUAL(4u, dirtyRanges[0].end);
+    CHECK_EQUAL(3, output[6].z);
+}
+
+TEST_F(PhysiqueFixture, skinning_cache_is_disabled_by_default) {
+    CalCoreSubmeshPtr coreSubmesh(djinnCoreSubmesh(4));
+    CalSubmesh submesh(coreSubmesh);
+
+    BoneTransform bt;
+    bt.rowx.set(1, 0, 0, 0);
+    bt.rowy.set(0, 1, 0, 0);
+    bt.rowz.set(0, 0, 1, 0);
+
+    CAL3D_ALIGN_HEAD(16) CalVector4 output[4 * 2] CAL3D_ALIGN_TAIL(16);
+    CalPhysique::calculateVerticesAndNormals(&bt, &submesh, &output[0].x);
+    output[0].x = 42.0f;
+    CalPhysique::calculateVerticesAndNormals(&bt, &submesh, &output[0].x);
+
+    CHECK_EQUAL(1, output[0].x);
+    CHECK_EQUAL(0u, submesh.skinningCache.hits);
+    CHECK_EQUAL(0u, submesh.skinningCache.misses);
+}
+
+TEST_F(PhysiqueFixture, skinning_cache_leaves_output_alone_until_pose_or_morphs_change) {
+    CalCoreSubmeshPtr coreSubmesh(djinnCoreSubmesh(4));
+    coreSubmesh->addMorphTarget(djinnMorphTarget(4, "foo"));
+    CalSubmesh submesh(coreSubmesh);
+    submesh.skinningCache.enabled = true;
+
+    BoneTransform bt;
+    bt.rowx.set(1, 0, 0, 0);
+    bt.rowy.set(0, 1, 0, 0);
+    bt.rowz.set(0, 0, 1, 0);
+
+    CAL3D_ALIGN_HEAD(16) CalVector4 output[4 * 2] CAL3D_ALIGN_TAIL(16);
+    CalPhysique::calculateVerticesAndNormals(&bt, &submesh, &output[0].x);
+    output[0].x = 42.0f;
+
+    CalPhysique::calculateVerticesAndNormals(&bt, &submesh, &output[0].x);
+    CHECK_EQUAL(42, output[0].x);
+    CHECK_EQUAL(1u, submesh.skinningCache.hits);
+    CHECK_EQUAL(1u, submesh.skinningCache.misses);
+    CHECK_EQUAL(4 * 2 * sizeof(CalVector4), submesh.skinningCache.bytesSaved);
+    CHECK_EQUAL(0.5f, submesh.skinningCache.getHitRate());
+
+    bt.rowx.w = 1.0f;
+    CalPhysique::calculateVerticesAndNormals(&bt, &submesh, &output[0].x);
+    CHECK_EQUAL(2, output[0].x);
+
+    output[0].x = 42.0f;
+    bt.rowx.w = 0.0f;
+    CalPhysique::calculateVerticesAndNormals(&bt, &submesh, &output[0].x);
+    CHECK_EQUAL(1, output[0].x);
+
+    output[0].x = 42.0f;
+    submesh.setMorphTargetWeight("foo", 0.5f);
+    CalPhysique::calculateVerticesAndNormals(&bt, &submesh, &output[0].x);
+    CHECK_EQUAL(1.5, output[0].x);
+    CHECK_EQUAL(1u, submesh.skinningCache.hits);
+    CHECK_EQUAL(4u, submesh.skinningCache.misses);
+}
+
+TEST_F(PhysiqueFixture, skinning_writes_only_the_level_of_detail_prefix) {
+    CalCoreSubmeshPtr coreSubmesh(djinnCoreSubmesh(4));
+    CHECK(coreSubmesh->setLodCollapses(CalCoreSubmesh::LodCollapseVector(1, CalCoreSubmesh::LodCollapse(0, 0))));
+    CalSubmesh submesh(coreSubmesh);
+    submesh.skinningCache.enabled = true;
+    submesh.lodLevel = 0.0f;
+
+    BoneTransform bt;
+    bt.rowx.set(1, 0, 0, 0);
+    bt.rowy.set(0, 1, 0, 0);
+    bt.rowz.set(0, 0, 1, 0);
+
+    CAL3D_ALIGN_HEAD(16) CalVector4 output[4 * 2] CAL3D_ALIGN_TAIL(16);
+    output[6].x = 42.0f;
+    CalPhysique::calculateVerticesAndNormals(&bt, &submesh, &output[0].x);
+    CHECK_EQUAL(1, output[4].x);
+    CHECK_EQUAL(42, output[6].x);
+
+    // the larger prefix misses the cache
+    submesh.lodLevel = 1.0f;
+    CalPhysique::calculateVerticesAndNormals(&bt, &submesh, &output[0].x);
+    CHECK_EQUAL(1, output[6].x);
+    CHECK_EQUAL(0u, submesh.skinningCache.hits);
+    CHECK_EQUAL(2u, submesh.skinningCache.misses);
+}
+
+TEST_F(PhysiqueFixture, every_skinning_path_writes_only_the_level_of_detail_prefix) {
+    CalCoreSubmeshPtr coreSubmesh(djinnCoreSubmesh(4));
+    CHECK(coreSubmesh->setLodCollapses(CalCoreSubmesh::LodCollapseVector(1, CalCoreSubmesh::LodCollapse(0, 0))));
+    coreSubmesh->dedupeInfluenceSets();
+    coreSubmesh->addMorphTarget(djinnMorphTarget(4, "foo"));
+    CalSubmesh submesh(coreSubmesh);
+    submesh.lodLevel = 0.0f;
+
+    BoneTransform bt;
+    bt.rowx.set(1, 0, 0, 0);
+    bt.rowy.set(0, 1, 0, 0);
+    bt.rowz.set(0, 0, 1, 0);
+
+    CAL3D_ALIGN_HEAD(16) CalVector4 output[4 * 2] CAL3D_ALIGN_TAIL(16);
+    output[6].x = 42.0f;
+    CalPhysique::calculateVerticesAndNormalsByInfluenceSet(&bt, &submesh, &output[0].x);
+    CHECK_EQUAL(1, output[4].x);
+    CHECK_EQUAL(42, output[6].x);
+
+    std::vector<unsigned> dirtyBones(1, 0);
+    CalCoreSubmesh::VertexRangeVector dirtyRanges;
+    CalPhysique::calculateDirtyVerticesAndNormals(&bt, &submesh, dirtyBones, &output[0].x, dirtyRanges);
+    CHECK_EQUAL(1u, dirtyRanges.size());
+    CHECK_EQUAL(3u, dirtyRanges[0].end);
+    CHECK_EQUAL(42, output[6].x);
+
+    // morphed, through the full path
+    submesh.setMorphTargetWeight("foo", 0.5f);
+    CalPhysique::calculateVerticesAndNormals(&bt, &submesh, &output[0].x);
+    CHECK_EQUAL(1.5, output[4].x);
+    CHECK_EQUAL(42, output[6].x);
+    CalPhysique::calculateDirtyVerticesAndNormals(&bt, &submesh, dirtyBones, &output[0].x, dirtyRanges);
+    CHECK_EQUAL(1u, dirtyRanges.size());
+    CHECK_EQUAL(3u, dirtyRanges[0].end);
+    CHECK_EQUAL(42, output[6].x);
+}
+
+TEST_F(PhysiqueFixture, partial_reskinning_invalidates_skinning_cache) {
+    CalCoreSubmeshPtr coreSubmesh(djinnCoreSubmesh(4));
+    CalSubmesh submesh(coreSubmesh);
+    submesh.skinningCache.enabled = true;
+
+    BoneTransform bt;
+    bt.rowx.set(1, 0, 0, 0);
+    bt.rowy.set(0, 1, 0, 0);
+    bt.rowz.set(0, 0, 1, 0);
+
+    CAL3D_ALIGN_HEAD(16) CalVector4 output[4 * 2] CAL3D_ALIGN_TAIL(16);
+    CalPhysique::calculateVerticesAndNormals(&bt, &submesh, &output[0].x);
+
+    BoneTransform moved = bt;
+    moved.rowx.w = 1.0f;
+    std::vector<unsigned> dirtyBones(1, 0);
+    CalCoreSubmesh::VertexRangeVector dirtyRanges;
+    CalPhysique::calculateDirtyVerticesAndNormals(&moved, &submesh, dirtyBones, &output[0].x, dirtyRanges);
+    CHECK_EQUAL(2, output[0].x);
+
+    // back to the remembered pose, but the buffer no longer holds it
+    CalPhysique::calculateVerticesAndNormals(&bt, &submesh, &output[0].x);
+    CHECK_EQUAL(1, output[0].x);
+    CHECK_EQUAL(0u, submesh.skinningCache.hits);
+}
+
+TEST_F(PhysiqueFixture, compact_palette_skinning_matches_full_palette_skinning) {
+    const int BoneCount = 64;
+    const int N = 16;
+
+    CalCoreSubmeshPtr coreSubmesh(new CalCoreSubmesh(N, 0, 0));
+    for (int k = 0; k < N; ++k) {
+        CalCoreSubmesh::Vertex v;
+        v.position = CalPoint4(CalVector(float(k), 1.0f, 2.0f));
+        v.normal = CalVector4(0, 0, 1, 0);
+        std::vector<CalCoreSubmesh::Influence> inf;
+        inf.push_back(CalCoreSubmesh::Influence(40 - k % 3, 0.75f, false));
+        inf.push_back(CalCoreSubmesh::Influence(5 + k % 2, 0.25f, true));
+        coreSubmesh->addVertex(v, 0, inf);
+    }
+    CalSubmesh submesh(coreSubmesh);
+
+    cal3d::SSEArray<BoneTransform> bt(BoneCount);
+    for (int i = 0; i < BoneCount; ++i) {
+        bt[i].rowx.set(1, 0, 0, float(i));
+        bt[i].rowy.set(0, 1, 0, 0);
+        bt[i].rowz.set(0, 0, 1, float(-i));
+    }
+
+    const std::vector<unsigned>& boneIds = coreSubmesh->getPaletteBoneIds();
+    CHECK_EQUAL(5u, boneIds.size());
+    cal3d::SSEArray<BoneTransform> palette(boneIds.size());
+    CalPhysique::gatherBonePalette(bt.data(), *coreSubmesh, palette.data());
+    for (size_t i = 0; i < boneIds.size(); ++i) {
+        CHECK_EQUAL(bt[boneIds[i]], palette[i]);
+    }
+
+    CAL3D_ALIGN_HEAD(16) CalVector4 expected[N * 2] CAL3D_ALIGN_TAIL(16);
+    CAL3D_ALIGN_HEAD(16) CalVector4 output[N * 2] CAL3D_ALIGN_TAIL(16);
+    CalPhysique::calculateVerticesAndNormals_x87(
+        bt.data(),
+        N,
+        cal3d::pointerFromVector(coreSubmesh->getVectorVertex()),
+        cal3d::pointerFromVector(coreSubmesh->getInfluences()),
+        expected);
+    CalPhysique::calculateVerticesAndNormals(bt.data(), &submesh, &output[0].x);
+
+    for (int i = 0; i < N * 2; ++i) {
+        CHECK_EQUAL(expected[i].x, output[i].x);
+        CHECK_EQUAL(expected[i].y, output[i].y);
+        CHECK_EQUAL(expected[i].z, output[i].z);
+    }
+}
+
+static CalCoreSubmeshPtr sharedInfluenceSetCoreSubmesh(int N, int setCount) {
+    CalCoreSubmeshPtr coreSubmesh(new CalCoreSubmesh(N, 0, 0));
+    for (int k = 0; k < N; ++k) {
+        CalCoreSubmesh::Vertex v;
+        v.position = CalPoint4(CalVector(float(k % 7), 1.0f, float(k % 5)));
+        v.normal = CalVector4(0.0f, 0.6f, 0.8f, 0.0f);
+        const unsigned set = k % setCount;
+        std::vector<CalCoreSubmesh::Influence> inf;
+        inf.push_back(CalCoreSubmesh::Influence(set, 0.4f, false));
+        inf.push_back(CalCoreSubmesh::Influence(set + 1, 0.3f, false));
+        inf.push_back(CalCoreSubmesh::Influence(set + 2, 0.2f, false));
+        inf.push_back(CalCoreSubmesh::Influence(set + 3, 0.1f, true));
+        coreSubmesh->addVertex(v, 0, inf);
+    }
+    coreSubmesh->dedupeInfluenceSets();
+    return coreSubmesh;
+}
+
+static void setTranslatedBoneTransforms(cal3d::SSEArray<BoneTransform>& bt) {
+    for (size_t i = 0; i < bt.size(); ++i) {
+        bt[i].rowx.set(1, 0, 0, float(i));
+        bt[i].rowy.set(0, 0, -1, 0.5f * i);
+        bt[i].rowz.set(0, 1, 0, 2.0f);
+    }
+}
+
+TEST_F(PhysiqueFixture, skinning_by_influence_set_matches_per_vertex_blending) {
+    const int N = 64;
+    CalCoreSubmeshPtr coreSubmesh(sharedInfluenceSetCoreSubmesh(N, 8));
+    CHECK_EQUAL(8u, coreSubmesh->getInfluenceSetCount());
+    CHECK_EQUAL(8.0f, coreSubmesh->getInfluenceSetDedupeRatio());
+    CalSubmesh submesh(coreSubmesh);
+
+    cal3d::SSEArray<BoneTransform> bt(11);
+    setTranslatedBoneTransforms(bt);
+
+    CAL3D_ALIGN_HEAD(16) CalVector4 expected[N * 2] CAL3D_ALIGN_TAIL(16);
+    CAL3D_ALIGN_HEAD(16) CalVector4 output[N * 2] CAL3D_ALIGN_TAIL(16);
+    CalPhysique::calculateVerticesAndNormals(bt.data(), &submesh, &expected[0].x);
+    CalPhysique::calculateVerticesAndNormalsByInfluenceSet(bt.data(), &submesh, &output[0].x);
+
+    for (int i = 0; i < N * 2; ++i) {
+        CHECK_CLOSE(expected[i].x, output[i].x, 1e-5f);
+        CHECK_CLOSE(expected[i].y, output[i].y, 1e-5f);
+        CHECK_CLOSE(expected[i].z, output[i].z, 1e-5f);
+    }
+}
+
+TEST_F(PhysiqueFixture, skinning_by_influence_set_requires_dedupe) {
+    CalCoreSubmeshPtr coreSubmesh(djinnCoreSubmesh(4));
+    CalSubmesh submesh(coreSubmesh);
+
+    BoneTransform bt;
+    memset(&bt, 0, sizeof(bt));
+    CAL3D_ALIGN_HEAD(16) CalVector4 output[4 * 2] CAL3D_ALIGN_TAIL(16);
+    CHECK_THROW(CalPhysique::calculateVerticesAndNormalsByInfluenceSet(&bt, &submesh, &output[0].x), std::exception);
+}
+
+TEST_F(PhysiqueFixture, skinning_by_influence_set_cycle_count) {
+    const int N = 10000;
+    const int TrialCount = 10;
+
+    CalCoreSubmeshPtr coreSubmesh(sharedInfluenceSetCoreSubmesh(N, 64));
+    CalSubmesh submesh(coreSubmesh);
+
+    cal3d::SSEArray<BoneTransform> bt(67);
+    setTranslatedBoneTransforms(bt);
+
+    CAL3D_ALIGN_HEAD(16) CalVector4 output[N * 2] CAL3D_ALIGN_TAIL(16);
+
+    cal3d_int64 perVertex = 99999999999999LL;
+    cal3d_int64 bySet = 99999999999999LL;
+    for (int t = 0; t < TrialCount; ++t) {
+        cal3d_int64 start = __rdtsc();
+        CalPhysique::calculateVerticesAndNormals(bt.data(), &submesh, &output[0].x);
+        cal3d_int64 middle = __rdtsc();
+        CalPhysique::calculateVerticesAndNormalsByInfluenceSet(bt.data(), &submesh, &output[0].x);
+        cal3d_int64 end = __rdtsc();
+        perVertex = std::min(perVertex, middle - start);
+        bySet = std::min(bySet, end - middle);
+    }
+
+    printf("Cycles per vertex (4 influences, dedupe ratio %g): per vertex %d, by influence set %d\n",
+        coreSubmesh->getInfluenceSetDedupeRatio(),
+        (int)(perVertex / N),
+        (int)(bySet / N));
+}
+
+TEST_F(PhysiqueFixture, sort_vertices_by_bone_cycle_count) {
+    const int N = 10000;
+    const int BoneCount = 1000;
+    const int TrialCount = 10;
+
+    // scatter dominant bones the way an unsorted export might
+    CalCoreSubmeshPtr coreSubmesh(new CalCoreSubmesh(N, 0, 0));
+    unsigned seed = 12345;
+    for (int k = 0; k < N; ++k) {
+        seed = seed * 1103515245 + 12345;
+        const unsigned bone = (seed >> 8) % (BoneCount - 1);
+        CalCoreSubmesh::Vertex v;
+        v.position = CalPoint4(CalVector(1.0f, 2.0f, 3.0f));
+        v.normal = CalVector4(0.0f, 0.0f, 1.0f, 0.0f);
+        std::vector<CalCoreSubmesh::Influence> inf;
+        inf.push_back(CalCoreSubmesh::Influence(bone, 0.75f, false));
+        inf.push_back(CalCoreSubmesh::Influence(bone + 1, 0.25f, true));
+        coreSubmesh->addVertex(v, 0, inf);
+    }
+    CalSubmesh submesh(coreSubmesh);
+
+    cal3d::SSEArray<BoneTransform> bt(BoneCount);
+    setTranslatedBoneTransforms(bt);
+
+    CAL3D_ALIGN_HEAD(16) CalVector4 output[N * 2] CAL3D_ALIGN_TAIL(16);
+
+    cal3d_int64 cycles[2];
+    for (int pass = 0; pass < 2; ++pass) {
+        if (pass) {
+            coreSubmesh->sortVerticesByBone();
+        }
+        cycles[pass] = 99999999999999LL;
+        for (int t = 0; t < TrialCount; ++t) {
+            cal3d_int64 start = __rdtsc();
+            CalPhysique::calculateVerticesAndNormals(bt.data(), &submesh, &output[0].x);
+            cal3d_int64 end = __rdtsc();
+            cycles[pass] = std::min(cycles[pass], end - start);
+        }
+    }
+
+    printf("Cycles per vertex (%d scattered bones): unsorted %d, sorted by bone %d\n",
+        BoneCount,
+        (int)(cycles[0] / N),
+        (int)(cycles[1] / N));
+}
+
+TEST_F(PhysiqueFixture, animated_bounding_volume_contains_skinned_vertices) {
+    const int N = 64;
+    CalCoreSubmeshPtr coreSubmesh(sharedInfluenceSetCoreSubmesh(N, 8));
+    CalSubmesh submesh(coreSubmesh);
+
+    cal3d::SSEArray<BoneTransform> bt(11);
+    for (size_t i = 0; i < bt.size(); ++i) {
+        const float c = cosf(0.3f * i);
+        const float s = sinf(0.3f * i);
+        bt[i].rowx.set(c, -s, 0, float(i));
+        bt[i].rowy.set(s, c, 0, -2.0f * i);
+        bt[i].rowz.set(0, 0, 1.5f, 1.0f);
+    }
+
+    CAL3D_ALIGN_HEAD(16) CalVector4 output[N * 2] CAL3D_ALIGN_TAIL(16);
+    CalPhysique::calculateVerticesAndNormals(bt.data(), &submesh, &output[0].x);
+
+    const CalAABox box = coreSubmesh->getAnimatedBoundingVolume(bt.data());
+    const float tolerance = 1e-4f;
+    for (int i = 0; i < N; ++i) {
+        const CalVector4& p = output[2 * i];
+        CHECK(p.x >= box.min.x - tolerance && p.x <= box.max.x + tolerance);
+        CHECK(p.y >= box.min.y - tolerance && p.y <= box.max.y + tolerance);
+        CHECK(p.z >= box.min.z - tolerance && p.z <= box.max.z + tolerance);
+    }
+}
+
+// An outward-facing unit sphere; the top follows bone 0, the bottom bone 1,
+// and a band around the equator blends both.
+static CalCoreSubmeshPtr blendedSphereCoreSubmesh(int rings, int segments) {
+    const float Pi = 3.14159265f;
+    CalCoreSubmeshPtr coreSubmesh(new CalCoreSubmesh((rings + 1) * (segments + 1), 0, 0));
+    for (int r = 0; r <= rings; ++r) {
+        const float theta = Pi * r / rings;
+        for (int s = 0; s <= segments; ++s) {
+            const float phi = 2.0f * Pi * s / segments;
+            const CalVector p(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi));
+            CalCoreSubmesh::Vertex v;
+            v.position = CalPoint4(p);
+            v.normal = CalVector4(p);
+            std::vector<CalCoreSubmesh::Influence> inf;
+            if (p.y > 0.2f) {
+                inf.push_back(CalCoreSubmesh::Influence(0, 1.0f, true));
+            } else if (p.y < -0.2f) {
+                inf.push_back(CalCoreSubmesh::Influence(1, 1.0f, true));
+            } else {
+                inf.push_back(CalCoreSubmesh::Influence(0, 0.6f, false));
+                inf.push_back(CalCoreSubmesh::Influence(1, 0.4f, true));
+            }
+            coreSubmesh->addVertex(v, 0, inf);
+        }
+    }
+
+    const CalCoreSubmesh::VectorVertex& vertices = coreSubmesh->getVectorVertex();
+    for (int r = 0; r < rings; ++r) {
+        for (int s = 0; s < segments; ++s) {
+            const CalIndex i = CalIndex(r * (segments + 1) + s);
+            const CalIndex row = CalIndex(segments + 1);
+            const CalCoreSubmesh::Face quad[2] = {
+                CalCoreSubmesh::Face(i, i + 1, i + row),
+                CalCoreSubmesh::Face(i + 1, i + row + 1, i + row),
+            };
+            for (int q = 0; q < 2; ++q) {
+                CalCoreSubmesh::Face face = quad[q];
+                const CalVector a = vertices[face.vertexId[0]].position.asCalVector();
+                const CalVector n = cross(
+                    vertices[face.vertexId[1]].position.asCalVector() - a,
+                    vertices[face.vertexId[2]].position.asCalVector() - a);
+                if (n.lengthSquared() < 1e-12f) {
+                    continue; // pole slivers
+                }
+                if (dot(n, a) < 0.0f) {
+                    std::swap(face.vertexId[1], face.vertexId[2]);
+                }
+                coreSubmesh->addFace(face);
+            }
+        }
+    }
+    return coreSubmesh;
+}
+
+static void setSwayedBoneTransforms(BoneTransform* bt) {
+    // bone 0 turns 20 degrees about y and shifts; bone 1 turns -10 degrees about x
+    const float c0 = cosf(0.35f), s0 = sinf(0.35f);
+    bt[0].rowx.set(c0, 0, s0, 0.25f);
+    bt[0].rowy.set(0, 1, 0, 0.1f);
+    bt[0].rowz.set(-s0, 0, c0, 0.0f);
+    const float c1 = cosf(-0.17f), s1 = sinf(-0.17f);
+    bt[1].rowx.set(1, 0, 0, 0.0f);
+    bt[1].rowy.set(0, c1, -s1, 0.0f);
+    bt[1].rowz.set(0, s1, c1, 0.0f);
+}
+
+TEST_F(PhysiqueFixture, animated_bounding_volume_contains_morphed_vertices) {
+    CalCoreSubmeshPtr coreSubmesh(blendedSphereCoreSubmesh(8, 16));
+    const int N = int(coreSubmesh->getVertexCount());
+
+    // one target swells the sphere, another pushes its top sideways
+    CalCoreMorphTarget::VertexOffsetArray swell;
+    CalCoreMorphTarget::VertexOffsetArray lean;
+    const CalCoreSubmesh::VectorVertex& vertices = coreSubmesh->getVectorVertex();
+    for (int i = 0; i < N; ++i) {
+        // offsets are differences of points, so w is 0
+        const CalVector p = vertices[i].position.asCalVector();
+        VertexOffset offset(i, CalPoint4(0.5f * p), CalVector4());
+        offset.position.w = 0.0f;
+        swell.push_back(offset);
+        if (p.y > 0.2f) {
+            offset.position.set(1.0f, 0.0f, 0.0f, 0.0f);
+            lean.push_back(offset);
+        }
+    }
+    coreSubmesh->addMorphTarget(CalCoreMorphTargetPtr(new CalCoreMorphTarget("swell", N, swell)));
+    coreSubmesh->addMorphTarget(CalCoreMorphTargetPtr(new CalCoreMorphTarget("lean", N, lean)));
+    CalSubmesh submesh(coreSubmesh);
+    submesh.setMorphTargetWeight("swell", 1.0f);
+    submesh.setMorphTargetWeight("lean", 1.0f);
+
+    BoneTransform bt[2];
+    setSwayedBoneTransforms(bt);
+    std::vector<CalVector4> output(2 * N);
+    CalPhysique::calculateVerticesAndNormals(bt, &submesh, &output[0].x);
+
+    const CalAABox box = coreSubmesh->getAnimatedBoundingVolume(bt);
+    const float tolerance = 1e-4f;
+    for (int i = 0; i < N; ++i) {
+        const CalVector4& p = output[2 * i];
+        CHECK(p.x >= box.min.x - tolerance && p.x <= box.max.x + tolerance);
+        CHECK(p.y >= box.min.y - tolerance && p.y <= box.max.y + tolerance);
+        CHECK(p.z >= box.min.z - tolerance && p.z <= box.max.z + tolerance);
+    }
+}
+
+TEST_F(PhysiqueFixture, visible_skinning_requires_clusters) {
+    CalSubmesh submesh(blendedSphereCoreSubmesh(4, 8));
+    BoneTransform bt[2];
+    setSwayedBoneTransforms(bt);
+    std::vector<CalVector4> output(2 * submesh.coreSubmesh->getVertexCount());
+    CalCoreSubmesh::VertexRangeVector ranges;
+    CHECK_THROW(
+        CalPhysique::calculateVisibleVerticesAndNormals(bt, &submesh, CalVector(0, 0, 10), 0, 0, true, &output[0].x, ranges),
+        std::exception);
+}
+
+TEST_F(PhysiqueFixture, visible_skinning_keeps_front_faces_and_skips_back_faces) {
+    CalCoreSubmeshPtr coreSubmesh(blendedSphereCoreSubmesh(16, 32));
+    coreSubmesh->buildClusters(16, 24);
+    CalSubmesh submesh(coreSubmesh);
+    const size_t N = coreSubmesh->getVertexCount();
+
+    BoneTransform bt[2];
+    setSwayedBoneTransforms(bt);
+
+    std::vector<CalVector4> expected(2 * N);
+    CalPhysique::calculateVerticesAndNormals(bt, &submesh, &expected[0].x);
+
+    const CalVector4 Sentinel(1e9f, 1e9f, 1e9f, 1e9f);
+    std::vector<CalVector4> output(2 * N, Sentinel);
+    const CalVector camera(0.0f, 0.5f, 20.0f);
+    CalCoreSubmesh::VertexRangeVector ranges;
+    CalPhysique::calculateVisibleVerticesAndNormals(bt, &submesh, camera, 0, 0, true, &output[0].x, ranges);
+
+    std::vector<bool> skinned(N, false);
+    size_t skinnedCount = 0;
+    for (auto range = ranges.begin(); range != ranges.end(); ++range) {
+        for (unsigned v = range->begin; v < range->end; ++v) {
+            skinned[v] = true;
+            ++skinnedCount;
+            CHECK_EQUAL(expected[2 * v].asCalVector(), output[2 * v].asCalVector());
+            CHECK_EQUAL(expected[2 * v + 1].asCalVector(), output[2 * v + 1].asCalVector());
+        }
+    }
+    for (size_t v = 0; v < N; ++v) {
+        if (!skinned[v]) {
+            CHECK_EQUAL(Sentinel, output[2 * v]);
+        }
+    }
+
+    // every face the camera can see was skinned
+    const CalCoreSubmesh::VectorFace& faces = coreSubmesh->getFaces();
+    for (auto f = faces.begin(); f != faces.end(); ++f) {
+        const CalVector a = expected[2 * f->vertexId[0]].asCalVector();
+        const CalVector b = expected[2 * f->vertexId[1]].asCalVector();
+        const CalVector c = expected[2 * f->vertexId[2]].asCalVector();
+        if (dot(a - camera, cross(b - a, c - a)) < 0.0f) {
+            CHECK(skinned[f->vertexId[0]] && skinned[f->vertexId[1]] && skinned[f->vertexId[2]]);
+        }
+    }
+    // cone culling only rejects clusters facing well away, and shares
+    // border vertices with the survivors
+    CHECK(skinnedCount < 9 * N / 10);
+}
+
+TEST_F(PhysiqueFixture, visible_skinning_writes_only_the_level_of_detail_prefix) {
+    CalCoreSubmeshPtr coreSubmesh(blendedSphereCoreSubmesh(16, 32));
+    coreSubmesh->buildClusters(32, 48);
+    const unsigned N = unsigned(coreSubmesh->getVertexCount());
+    const unsigned CollapseCount = 40;
+    CHECK(coreSubmesh->setLodCollapses(CalCoreSubmesh::LodCollapseVector(CollapseCount, CalCoreSubmesh::LodCollapse(0, 0))));
+    CalSubmesh submesh(coreSubmesh);
+    submesh.lodLevel = 0.0f;
+
+    BoneTransform bt[2];
+    setSwayedBoneTransforms(bt);
+
+    const CalVector4 Sentinel(1e9f, 1e9f, 1e9f, 1e9f);
+    std::vector<CalVector4> output(2 * N, Sentinel);
+    CalCoreSubmesh::VertexRangeVector ranges;
+    const CalVector4 around(0, 0, 1, 5); // z >= -5
+    CalPhysique::calculateVisibleVerticesAndNormals(bt, &submesh, CalVector(0, 0, 10), &around, 1, false, &output[0].x, ranges);
+    CHECK(!ranges.empty());
+    for (auto range = ranges.begin(); range != ranges.end(); ++range) {
+        CHECK(range->end <= N - CollapseCount);
+    }
+    for (unsigned v = N - CollapseCount; v < N; ++v) {
+        CHECK_EQUAL(Sentinel, output[2 * v]);
+    }
+}
+
+TEST_F(PhysiqueFixture, raising_the_level_of_detail_skins_the_new_vertices) {
+    CalCoreSubmeshPtr coreSubmesh(blendedSphereCoreSubmesh(16, 32));
+    coreSubmesh->buildClusters(32, 48);
+    const unsigned N = unsigned(coreSubmesh->getVertexCount());
+    const unsigned CollapseCount = 40;
+    CHECK(coreSubmesh->setLodCollapses(CalCoreSubmesh::LodCollapseVector(CollapseCount, CalCoreSubmesh::LodCollapse(0, 0))));
+    CalSubmesh submesh(coreSubmesh);
+
+    BoneTransform bt[2];
+    setSwayedBoneTransforms(bt);
+    std::vector<CalVector4> expected(2 * N);
+    CalPhysique::calculateVerticesAndNormals(bt, &submesh, &expected[0].x);
+
+    const CalVector4 Sentinel(1e9f, 1e9f, 1e9f, 1e9f);
+    std::vector<CalVector4> output(2 * N, Sentinel);
+    submesh.lodLevel = 0.0f;
+    CalPhysique::calculateVerticesAndNormals(bt, &submesh, &output[0].x);
+    CHECK_EQUAL(Sentinel, output[2 * (N - 1)]);
+
+    // no bone moved, but the prefix grew
+    const std::vector<unsigned> noDirtyBones;
+    CalCoreSubmesh::VertexRangeVector ranges;
+    submesh.lodLevel = 1.0f;
+    CalPhysique::calculateDirtyVerticesAndNormals(bt, &submesh, noDirtyBones, &output[0].x, ranges);
+    CHECK_EQUAL(1u, ranges.size());
+    CHECK_EQUAL(N - CollapseCount, ranges[0].begin);
+    CHECK_EQUAL(N, ranges[0].end);
+    for (unsigned v = 0; v < N; ++v) {
+        CHECK_EQUAL(expected[2 * v].asCalVector(), output[2 * v].asCalVector());
+    }
+
+    CalPhysique::calculateDirtyVerticesAndNormals(bt, &submesh, noDirtyBones, &output[0].x, ranges);
+    CHECK_EQUAL(0u, ranges.size());
+
+    // the visible path fills in the tail even when every cluster is culled
+    submesh.lodLevel = 0.0f;
+    CalPhysique::calculateDirtyVerticesAndNormals(bt, &submesh, noDirtyBones, &output[0].x, ranges);
+    std::fill(output.begin() + 2 * (N - CollapseCount), output.end(), Sentinel);
+    submesh.lodLevel = 1.0f;
+    const CalVector4 inFront(0, 0, 1, -5); // z >= 5
+    CalPhysique::calculateVisibleVerticesAndNormals(bt, &submesh, CalVector(0, 0, 10), &inFront, 1, false, &output[0].x, ranges);
+    CHECK_EQUAL(1u, ranges.size());
+    CHECK_EQUAL(N - CollapseCount, ranges[0].begin);
+    for (unsigned v = N - CollapseCount; v < N; ++v) {
+        CHECK_EQUAL(expected[2 * v].asCalVector(), output[2 * v].asCalVector());
+    }
+}
+
+TEST_F(PhysiqueFixture, visible_skinning_skips_clusters_behind_a_plane) {
+    CalCoreSubmeshPtr coreSubmesh(blendedSphereCoreSubmesh(16, 32));
+    coreSubmesh->buildClusters(32, 48);
+    CalSubmesh submesh(coreSubmesh);
+    std::vector<CalVector4> output(2 * coreSubmesh->getVertexCount());
+
+    BoneTransform bt[2];
+    setSwayedBoneTransforms(bt);
+
+    CalCoreSubmesh::VertexRangeVector ranges;
+    const CalVector4 inFront(0, 0, 1, -5); // z >= 5
+    CalPhysique::calculateVisibleVerticesAndNormals(bt, &submesh, CalVector(0, 0, 10), &inFront, 1, false, &output[0].x, ranges);
+    CHECK_EQUAL(0u, ranges.size());
+
+    // everything but the unused pole vertices
+    const CalVector4 around(0, 0, 1, 5); // z >= -5
+    CalPhysique::calculateVisibleVerticesAndNormals(bt, &submesh, CalVector(0, 0, 10), &around, 1, false, &output[0].x, ranges);
+    std::set<unsigned> used;
+    const CalCoreSubmesh::VectorFace& faces = coreSubmesh->getFaces();
+    for (auto f = faces.begin(); f != faces.end(); ++f) {
+        used.insert(f->vertexId, f->vertexId + 3);
+    }
+    size_t skinnedCount = 0;
+    for (auto range = ranges.begin(); range != ranges.end(); ++range) {
+        skinnedCount += range->end - range->begin;
+    }
+    CHECK_EQUAL(used.size(), skinnedCount);
+}
+
+TEST_F(PhysiqueFixture, visible_skinning_takes_planes_of_any_length) {
+    CalCoreSubmeshPtr coreSubmesh(blendedSphereCoreSubmesh(16, 32));
+    coreSubmesh->buildClusters(16, 24);
+    CalSubmesh submesh(coreSubmesh);
+    std::vector<CalVector4> output(2 * coreSubmesh->getVertexCount());
+
+    BoneTransform bt[2];
+    setSwayedBoneTransforms(bt);
+
+    // z >= 0.5, as a unit plane and as one from a projection matrix
+    const CalVector4 unit(0, 0, 1, -0.5f);
+    const CalVector4 scaled(0, 0, 10, -5);
+    CalCoreSubmesh::VertexRangeVector expected;
+    CalPhysique::calculateVisibleVerticesAndNormals(bt, &submesh, CalVector(0, 0, 10), &unit, 1, false, &output[0].x, expected);
+    CalCoreSubmesh::VertexRangeVector ranges;
+    CalPhysique::calculateVisibleVerticesAndNormals(bt, &submesh, CalVector(0, 0, 10), &scaled, 1, false, &output[0].x, ranges);
+
+    CHECK(!expected.empty());
+    CHECK_EQUAL(expected.size(), ranges.size());
+    for (size_t i = 0; i < std::min(expected.size(), ranges.size()); ++i) {
+        CHECK_EQUAL(expected[i].begin, ranges[i].begin);
+        CHECK_EQUAL(expected[i].end, ranges[i].end);
+    }
+}
+
+TEST_F(PhysiqueFixture, visible_skinning_keeps_scaled_bones_visible) {
+    CalCoreSubmeshPtr coreSubmesh(blendedSphereCoreSubmesh(16, 32));
+    coreSubmesh->buildClusters(16, 24);
+    CalSubmesh submesh(coreSubmesh);
+    const size_t N = coreSubmesh->getVertexCount();
+
+    // bone 0 doubles in size and bone 1 stretches along z
+    BoneTransform bt[2];
+    setSwayedBoneTransforms(bt);
+    bt[0].rowx.x *= 2; bt[0].rowx.y *= 2; bt[0].rowx.z *= 2;
+    bt[0].rowy.x *= 2; bt[0].rowy.y *= 2; bt[0].rowy.z *= 2;
+    bt[0].rowz.x *= 2; bt[0].rowz.y *= 2; bt[0].rowz.z *= 2;
+    bt[1].rowz.x *= 3; bt[1].rowz.y *= 3; bt[1].rowz.z *= 3;
+
+    std::vector<CalVector4> expected(2 * N);
+    CalPhysique::calculateVerticesAndNormals(bt, &submesh, &expected[0].x);
+
+    const CalVector camera(0.0f, 0.5f, 20.0f);
+    const CalVector4 inFront(0, 0, 1, -1.2f); // z >= 1.2
+    for (int backFaces = 0; backFaces < 2; ++backFaces) {
+        std::vector<CalVector4> output(2 * N);
+        CalCoreSubmesh::VertexRangeVector ranges;
+        CalPhysique::calculateVisibleVerticesAndNormals(bt, &submesh, camera, &inFront, 1, backFaces != 0, &output[0].x, ranges);
+
+        std::vector<bool> skinned(N, false);
+        for (auto range = ranges.begin(); range != ranges.end(); ++range) {
+            std::fill(skinned.begin() + range->begin, skinned.begin() + range->end, true);
+        }
+
+        // every face in front of the plane, and facing the camera when
+        // culling back faces, was skinned
+        const CalCoreSubmesh::VectorFace& faces = coreSubmesh->getFaces();
+        for (auto f = faces.begin(); f != faces.end(); ++f) {
+            const CalVector a = expected[2 * f->vertexId[0]].asCalVector();
+            const CalVector b = expected[2 * f->vertexId[1]].asCalVector();
+            const CalVector c = expected[2 * f->vertexId[2]].asCalVector();
+            const bool inside = a.z >= 1.2f || b.z >= 1.2f || c.z >= 1.2f;
+            const bool facing = !backFaces || dot(a - camera, cross(b - a, c - a)) < 0.0f;
+            if (inside && facing) {
+                CHECK(skinned[f->vertexId[0]] && skinned[f->vertexId[1]] && skinned[f->vertexId[2]]);
+            }
+        }
+    }
+}
+
+TEST_F(PhysiqueFixture, visible_skinning_cycle_count) {
+    const int TrialCount = 10;
+
+    CalCoreSubmeshPtr coreSubmesh(blendedSphereCoreSubmesh(64, 128));
+    coreSubmesh->buildClusters();
+    coreSubmesh->renumberIndices();
+    CalSubmesh submesh(coreSubmesh);
+    const size_t N = coreSubmesh->getVertexCount();
+
+    BoneTransform bt[2];
+    setSwayedBoneTransforms(bt);
+    std::vector<CalVector4> output(2 * N);
+    CalCoreSubmesh::VertexRangeVector ranges;
+
+    cal3d_int64 full = 99999999999999LL;
+    cal3d_int64 visible = 99999999999999LL;
+    for (int t = 0; t < TrialCount; ++t) {
+        cal3d_int64 start = __rdtsc();
+        CalPhysique::calculateVerticesAndNormals(bt, &submesh, &output[0].x);
+        cal3d_int64 middle = __rdtsc();
+        CalPhysique::calculateVisibleVerticesAndNormals(bt, &submesh, CalVector(0, 0.5f, 3.0f), 0, 0, true, &output[0].x, ranges);
+        cal3d_int64 end = __rdtsc();
+        full = std::min(full, middle - start);
+        visible = std::min(visible, end - middle);
+    }
+    CHECK(!ranges.empty());
+    printf("Cycles per vertex (all): %d\n", (int)(full / N));
+    printf("Cycles per vertex (visible clusters): %d\n", (int)(visible / N));
+}
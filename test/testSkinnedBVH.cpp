@@ -0,0 +1,298 @@
+#include "TestPrologue.h"
+#include <math.h>
+#include <cal3d/bonetransform.h>
+#include <cal3d/physique.h>
+#include <cal3d/skinnedbvh.h>
+#include <cal3d/submesh.h>
+
+// A W x H quad grid near the plane at height z, bound entirely to boneId.
+static CalCoreSubmeshPtr gridCoreSubmesh(int W, int H, float z, unsigned boneId) {
+    CalCoreSubmeshPtr coreSubmesh(new CalCoreSubmesh((W + 1) * (H + 1), 0, 2 * W * H));
+    for (int y = 0; y <= H; ++y) {
+        for (int x = 0; x <= W; ++x) {
+            CalCoreSubmesh::Vertex v;
+            v.position = CalPoint4(CalVector(
+                float(x),
+                float(y),
+                z + 0.25f * sinf(0.7f * x) * cosf(0.3f * y)));
+            v.normal = CalVector4(0.0f, 0.0f, 1.0f, 0.0f);
+            std::vector<CalCoreSubmesh::Influence> inf(1);
+            inf[0].boneId = boneId;
+            inf[0].weight = 1.0f;
+            inf[0].lastInfluenceForThisVertex = true;
+            coreSubmesh->addVertex(v, 0, inf);
+        }
+    }
+    for (int y = 0; y < H; ++y) {
+        for (int x = 0; x < W; ++x) {
+            const CalIndex32 i = y * (W + 1) + x;
+            const CalIndex32 row = W + 1;
+            coreSubmesh->addFace(CalCoreSubmesh::WideFace(i, i + 1, i + row));
+            coreSubmesh->addFace(CalCoreSubmesh::WideFace(i + 1, i + row + 1, i + row));
+        }
+    }
+    return coreSubmesh;
+}
+
+static void setBoneTranslations(cal3d::SSEArray<BoneTransform>& bt, const CalVector* translations) {
+    for (size_t i = 0; i < bt.size(); ++i) {
+        bt[i].rowx.set(1, 0, 0, translations[i].x);
+        bt[i].rowy.set(0, 1, 0, translations[i].y);
+        bt[i].rowz.set(0, 0, 1, translations[i].z);
+    }
+}
+
+static bool bruteForceIntersectRay(
+    const std::vector<CalCoreSubmeshPtr>& submeshes,
+    const std::vector<const float*>& vertexBuffers,
+    const CalVector& origin,
+    const CalVector& direction,
+    float maxDistance,
+    CalSkinnedBVH::Hit& hit
+) {
+    bool found = false;
+    for (unsigned s = 0; s < submeshes.size(); ++s) {
+        for (unsigned f = 0; f < submeshes[s]->getFaceCount(); ++f) {
+            const CalCoreSubmesh::WideFace face = submeshes[s]->getFace(f);
+            CalVector p[3];
+            for (int k = 0; k < 3; ++k) {
+                const float* q = vertexBuffers[s] + 8 * face.vertexId[k];
+                p[k].set(q[0], q[1], q[2]);
+            }
+            const CalVector e1 = p[1] - p[0];
+            const CalVector e2 = p[2] - p[0];
+            const CalVector pv = cross(direction, e2);
+            const float det = dot(e1, pv);
+            if (det == 0.0f) {
+                continue;
+            }
+            const CalVector tv = origin - p[0];
+            const float u = dot(tv, pv) / det;
+            const CalVector qv = cross(tv, e1);
+            const float v = dot(direction, qv) / det;
+            const float t = dot(e2, qv) / det;
+            if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t >= 0.0f && t <= maxDistance) {
+                maxDistance = t;
+                hit.submesh = s;
+                hit.face = f;
+                hit.distance = t;
+                hit.u = u;
+                hit.v = v;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+struct SkinnedGrids {
+    static const int W = 24;
+    static const int H = 16;
+
+    SkinnedGrids(int w = W, int h = H)
+        : boneTransforms(2)
+    {
+        coreSubmeshes.push_back(gridCoreSubmesh(w, h, 0.0f, 0));
+        coreSubmeshes.push_back(gridCoreSubmesh(w, h, 5.0f, 1));
+        for (size_t s = 0; s < coreSubmeshes.size(); ++s) {
+            submeshes.push_back(boost::shared_ptr<CalSubmesh>(new CalSubmesh(coreSubmeshes[s])));
+            outputs.push_back(std::vector<float>(8 * coreSubmeshes[s]->getVertexCount() + 4));
+            // deliberately not 16-byte aligned
+            vertexBuffers.push_back(&outputs.back()[1]);
+        }
+        const CalVector identity[2];
+        setBoneTranslations(boneTransforms, identity);
+    }
+
+    void skin() {
+        for (size_t s = 0; s < submeshes.size(); ++s) {
+            CalPhysique::calculateVerticesAndNormals(boneTransforms.data(), submeshes[s].get(), &outputs[s][1]);
+        }
+    }
+
+    void checkRaysMatchBruteForce(const CalSkinnedBVH& bvh) {
+        for (int i = 0; i < 200; ++i) {
+            const CalVector origin(0.13f * (i % 29) - 1.0f, 0.11f * (i % 37) - 1.0f, -2.0f);
+            const CalVector direction(0.01f * (i % 7), 0.02f * (i % 5) - 0.04f, 1.0f);
+
+            CalSkinnedBVH::Hit expected = {0};
+            CalSkinnedBVH::Hit actual = {0};
+            const bool expectedFound = bruteForceIntersectRay(coreSubmeshes, vertexBuffers, origin, direction, 100.0f, expected);
+            CHECK_EQUAL(expectedFound, bvh.intersectRay(origin, direction, 100.0f, actual));
+            if (expectedFound) {
+                CHECK_EQUAL(expected.submesh, actual.submesh);
+                CHECK_EQUAL(expected.face, actual.face);
+                CHECK_CLOSE(expected.distance, actual.distance, 1e-5f);
+                CHECK_CLOSE(expected.u, actual.u, 1e-5f);
+                CHECK_CLOSE(expected.v, actual.v, 1e-5f);
+            }
+        }
+    }
+
+    std::vector<CalCoreSubmeshPtr> coreSubmeshes;
+    std::vector<boost::shared_ptr<CalSubmesh>> submeshes;
+    std::vector<std::vector<float>> outputs;
+    std::vector<const float*> vertexBuffers;
+    cal3d::SSEArray<BoneTransform> boneTransforms;
+};
+
+TEST(skinned_bvh_over_nothing_hits_nothing) {
+    CalSkinnedBVH bvh((std::vector<CalCoreSubmeshPtr>()));
+    CHECK_EQUAL(0u, bvh.getNodes().size());
+
+    CalSkinnedBVH::Hit hit;
+    CHECK(!bvh.intersectRay(CalVector(0, 0, 0), CalVector(0, 0, 1), 100.0f, hit));
+}
+
+TEST(skinned_bvh_leaves_cover_every_face_once) {
+    SkinnedGrids grids;
+    CalSkinnedBVH bvh(grids.coreSubmeshes);
+
+    const unsigned faceCount = 2 * 2 * SkinnedGrids::W * SkinnedGrids::H;
+    CHECK_EQUAL(faceCount, bvh.getTriangles().size());
+
+    unsigned leafFaces = 0;
+    for (size_t i = 0; i < bvh.getNodes().size(); ++i) {
+        const CalSkinnedBVH::Node& node = bvh.getNodes()[i];
+        if (node.count) {
+            CHECK(node.count <= CalSkinnedBVH::MaxLeafTriangles);
+            leafFaces += node.count;
+        } else {
+            CHECK(node.first > i);
+        }
+    }
+    CHECK_EQUAL(faceCount, leafFaces);
+}
+
+TEST(skinned_bvh_ray_hits_match_brute_force_in_bind_pose) {
+    SkinnedGrids grids;
+    CalSkinnedBVH bvh(grids.coreSubmeshes);
+
+    grids.skin();
+    bvh.refit(grids.vertexBuffers);
+    grids.checkRaysMatchBruteForce(bvh);
+
+    CalSkinnedBVH::Hit hit;
+    CHECK(bvh.intersectRay(CalVector(3.3f, 4.6f, -1.0f), CalVector(0, 0, 1), 100.0f, hit));
+    CHECK_EQUAL(0u, hit.submesh);
+}
+
+TEST(skinned_bvh_ray_hits_match_brute_force_with_32_bit_faces) {
+    SkinnedGrids grids(300, 220);
+    CHECK_EQUAL(4u, grids.coreSubmeshes[0]->getIndexSize());
+    CalSkinnedBVH bvh(grids.coreSubmeshes);
+
+    grids.skin();
+    bvh.refit(grids.vertexBuffers);
+    grids.checkRaysMatchBruteForce(bvh);
+}
+
+TEST(skinned_bvh_refit_follows_skinned_vertices) {
+    SkinnedGrids grids;
+    CalSkinnedBVH bvh(grids.coreSubmeshes);
+
+    // lift the lower grid above the upper one
+    const CalVector translations[2] = { CalVector(0, 0, 10.0f), CalVector(2.0f, 0, 0) };
+    setBoneTranslations(grids.boneTransforms, translations);
+    grids.skin();
+    bvh.refit(grids.vertexBuffers);
+    grids.checkRaysMatchBruteForce(bvh);
+
+    CalSkinnedBVH::Hit hit;
+    CHECK(bvh.intersectRay(CalVector(3.3f, 4.6f, -1.0f), CalVector(0, 0, 1), 100.0f, hit));
+    CHECK_EQUAL(1u, hit.submesh);
+    CHECK_CLOSE(6.0f, hit.distance, 0.26f);
+}
+
+TEST(skinned_bvh_dirty_refit_matches_full_refit) {
+    SkinnedGrids grids;
+    CalSkinnedBVH dirty(grids.coreSubmeshes);
+    CalSkinnedBVH full(grids.coreSubmeshes);
+    grids.skin();
+    dirty.refit(grids.vertexBuffers);
+
+    const CalVector translations[2] = { CalVector(0, 0, 0), CalVector(1.5f, -3.0f, 2.0f) };
+    setBoneTranslations(grids.boneTransforms, translations);
+
+    std::vector<unsigned> dirtyBones(1, 1);
+    std::vector<CalCoreSubmesh::VertexRangeVector> dirtyRanges(grids.submeshes.size());
+    for (size_t s = 0; s < grids.submeshes.size(); ++s) {
+        CalPhysique::calculateDirtyVerticesAndNormals(
+            grids.boneTransforms.data(), grids.submeshes[s].get(), dirtyBones, &grids.outputs[s][1], dirtyRanges[s]);
+    }
+    CHECK_EQUAL(0u, dirtyRanges[0].size());
+    CHECK_EQUAL(1u, dirtyRanges[1].size());
+
+    dirty.refitDirty(grids.vertexBuffers, dirtyRanges);
+    full.refit(grids.vertexBuffers);
+
+    CHECK_EQUAL(full.getNodes().size(), dirty.getNodes().size());
+    for (size_t i = 0; i < full.getNodes().size(); ++i) {
+        CHECK_EQUAL(full.getNodes()[i].min, dirty.getNodes()[i].min);
+        CHECK_EQUAL(full.getNodes()[i].max, dirty.getNodes()[i].max);
+    }
+    grids.checkRaysMatchBruteForce(dirty);
+}
+
+TEST(skinned_bvh_segment_stops_at_its_end) {
+    SkinnedGrids grids;
+    CalSkinnedBVH bvh(grids.coreSubmeshes);
+
+    CalSkinnedBVH::Hit hit;
+    CHECK(!bvh.intersectSegment(CalVector(3.3f, 4.6f, -2.0f), CalVector(3.3f, 4.6f, -1.0f), hit));
+    CHECK(!bvh.intersectSegment(CalVector(3.3f, 4.6f, 1.0f), CalVector(3.3f, 4.6f, 4.0f), hit));
+
+    CHECK(bvh.intersectSegment(CalVector(3.3f, 4.6f, 8.0f), CalVector(3.3f, 4.6f, -2.0f), hit));
+    CHECK_EQUAL(1u, hit.submesh);
+    CHECK(hit.distance > 0.0f && hit.distance < 1.0f);
+}
+
+TEST(skinned_bvh_refit_and_query_cycle_count) {
+    const int TrialCount = 10;
+    const int RayCount = 1000;
+
+    std::vector<CalCoreSubmeshPtr> coreSubmeshes;
+    std::vector<const float*> vertexBuffers;
+    for (int s = 0; s < 4; ++s) {
+        coreSubmeshes.push_back(gridCoreSubmesh(64, 64, 2.0f * s, 0));
+        const CalCoreSubmesh::VectorVertex& vertices = coreSubmeshes.back()->getVectorVertex();
+        vertexBuffers.push_back(&vertices[0].position.x);
+    }
+    const unsigned triangleCount = 4 * 2 * 64 * 64;
+
+    CalSkinnedBVH bvh(coreSubmeshes);
+
+    cal3d_int64 refit = 99999999999999LL;
+    cal3d_int64 query = 99999999999999LL;
+    cal3d_int64 bruteForce = 99999999999999LL;
+    int hits = 0;
+    for (int t = 0; t < TrialCount; ++t) {
+        cal3d_int64 start = __rdtsc();
+        bvh.refit(vertexBuffers);
+        cal3d_int64 end = __rdtsc();
+        refit = std::min(refit, end - start);
+
+        hits = 0;
+        start = __rdtsc();
+        for (int i = 0; i < RayCount; ++i) {
+            CalSkinnedBVH::Hit hit;
+            hits += bvh.intersectRay(CalVector(0.061f * i, 0.047f * (i % 97), -1.0f), CalVector(0.01f, 0.0f, 1.0f), 100.0f, hit);
+        }
+        end = __rdtsc();
+        query = std::min(query, end - start);
+
+        // brute force is slow enough that a tenth of the rays will do
+        start = __rdtsc();
+        for (int i = 0; i < RayCount / 10; ++i) {
+            CalSkinnedBVH::Hit hit;
+            bruteForceIntersectRay(coreSubmeshes, vertexBuffers, CalVector(0.061f * i, 0.047f * (i % 97), -1.0f), CalVector(0.01f, 0.0f, 1.0f), 100.0f, hit);
+        }
+        end = __rdtsc();
+        bruteForce = std::min(bruteForce, 10 * (end - start));
+    }
+    CHECK(hits > 0);
+
+    printf("Cycles per triangle refit: %d\n", (int)(refit / triangleCount));
+    printf("Cycles per ray (BVH): %d\n", (int)(query / RayCount));
+    printf("Cycles per ray (brute force): %d\n", (int)(bruteForce / RayCount));
+}
@@ -10,8 +10,11 @@
 #include <cal3d/coreskeleton.h>
 #include <cal3d/coremorphtarget.h>
 
+#include <algorithm>
 #include <cmath>
+#include <fstream>
 #include <limits>
+#include <sstream>
 
 inline std::ostream& operator<<(std::ostream& os, const CalCoreSubmesh::Face& f) {
     return os << '(' << f.vertexId[0] << ", " << f.vertexId[1] << ", " << f.vertexId[2] << ')';
@@ -250,6 +253,254 @@ TEST_F(SubmeshFixture, not_static_if_two_vertices_are_influenced_by_different_bo
     CHECK(!csm.isStatic());
 }
 
+TEST_F(SubmeshFixture, bone_vertex_ranges_track_runs_of_influenced_vertices) {
+    CalCoreSubmesh csm(4, 0, 0);
+
+    CalCoreSubmesh::Vertex v;
+    std::vector<CalCoreSubmesh::Influence> inf(1);
+    inf[0] = CalCoreSubmesh::Influence(0, 1.0f, true);
+    csm.addVertex(v, BLACK, inf);
+    inf.push_back(CalCoreSubmesh::Influence(1, 0.5f, true));
+    inf[0].weight = 0.5f;
+    csm.addVertex(v, BLACK, inf);
+    inf.resize(1);
+    inf[0] = CalCoreSubmesh::Influence(1, 1.0f, true);
+    csm.addVertex(v, BLACK, inf);
+    inf[0] = CalCoreSubmesh::Influence(0, 1.0f, true);
+    csm.addVertex(v, BLACK, inf);
+
+    const std::vector<CalCoreSubmesh::VertexRangeVector>& ranges = csm.getBoneVertexRanges();
+    CHECK_EQUAL(2u, ranges.size());
+
+    CHECK_EQUAL(2u, ranges[0].size());
+    CHECK_EQUAL(0u, ranges[0][0].begin);
+    CHECK_EQUAL(2u, ranges[0][0].end);
+    CHECK_EQUAL(0u, ranges[0][0].firstInfluence);
+    CHECK_EQUAL(3u, ranges[0][1].begin);
+    CHECK_EQUAL(4u, ranges[0][1].end);
+    CHECK_EQUAL(4u, ranges[0][1].firstInfluence);
+
+    CHECK_EQUAL(1u, ranges[1].size());
+    CHECK_EQUAL(1u, ranges[1][0].begin);
+    CHECK_EQUAL(3u, ranges[1][0].end);
+    CHECK_EQUAL(1u, ranges[1][0].firstInfluence);
+}
+
+TEST_F(SubmeshFixture, palette_influences_index_used_bones_in_first_use_order) {
+    CalCoreSubmesh csm(3, 0, 0);
+
+    CalCoreSubmesh::Vertex v;
+    std::vector<CalCoreSubmesh::Influence> inf;
+    inf.push_back(CalCoreSubmesh::Influence(40, 0.75f, false));
+    inf.push_back(CalCoreSubmesh::Influence(7, 0.25f, true));
+    csm.addVertex(v, BLACK, inf);
+    inf.resize(1);
+    inf[0] = CalCoreSubmesh::Influence(7, 1.0f, true);
+    csm.addVertex(v, BLACK, inf);
+    inf[0] = CalCoreSubmesh::Influence(12, 1.0f, true);
+    csm.addVertex(v, BLACK, inf);
+
+    const std::vector<unsigned>& boneIds = csm.getPaletteBoneIds();
+    CHECK_EQUAL(3u, boneIds.size());
+    CHECK_EQUAL(40u, boneIds[0]);
+    CHECK_EQUAL(7u, boneIds[1]);
+    CHECK_EQUAL(12u, boneIds[2]);
+
+    const CalCoreSubmesh::InfluenceVector& influences = csm.getInfluences();
+    const CalCoreSubmesh::InfluenceVector& paletteInfluences = csm.getPaletteInfluences();
+    CHECK_EQUAL(influences.size(), paletteInfluences.size());
+    for (size_t i = 0; i < influences.size(); ++i) {
+        CHECK_EQUAL(influences[i].boneId, boneIds[paletteInfluences[i].boneId]);
+        CHECK_EQUAL(influences[i].weight, paletteInfluences[i].weight);
+        CHECK_EQUAL(influences[i].lastInfluenceForThisVertex, paletteInfluences[i].lastInfluenceForThisVertex);
+    }
+}
+
+TEST_F(SubmeshFixture, dedupe_influence_sets_shares_identical_sets_between_vertices) {
+    CalCoreSubmesh csm(4, 0, 0);
+
+    CalCoreSubmesh::Vertex v;
+    std::vector<CalCoreSubmesh::Influence> shared;
+    shared.push_back(CalCoreSubmesh::Influence(9, 0.25f, false));
+    shared.push_back(CalCoreSubmesh::Influence(3, 0.75f, true));
+    std::vector<CalCoreSubmesh::Influence> other(1, CalCoreSubmesh::Influence(3, 1.0f, true));
+
+    csm.addVertex(v, BLACK, shared);
+    csm.addVertex(v, BLACK, other);
+    std::reverse(shared.begin(), shared.end());
+    csm.addVertex(v, BLACK, shared);
+    csm.addVertex(v, BLACK, shared);
+
+    CHECK(!csm.hasInfluenceSets());
+    CHECK_EQUAL(0.0f, csm.getInfluenceSetDedupeRatio());
+
+    csm.dedupeInfluenceSets();
+    CHECK(csm.hasInfluenceSets());
+    CHECK_EQUAL(2u, csm.getInfluenceSetCount());
+    CHECK_EQUAL(2.0f, csm.getInfluenceSetDedupeRatio());
+
+    const CalCoreSubmesh::InfluenceVector& vertexSets = csm.getVertexInfluenceSets();
+    CHECK_EQUAL(4u, vertexSets.size());
+    CHECK_EQUAL(0u, vertexSets[0].boneId);
+    CHECK_EQUAL(1u, vertexSets[1].boneId);
+    CHECK_EQUAL(0u, vertexSets[2].boneId);
+    CHECK_EQUAL(0u, vertexSets[3].boneId);
+    CHECK_EQUAL(1.0f, vertexSets[3].weight);
+
+    // sets index the compact palette: bone 3 is entry 0, bone 9 entry 1
+    const CalCoreSubmesh::InfluenceVector& sets = csm.getInfluenceSets();
+    CHECK_EQUAL(3u, sets.size());
+    CHECK_EQUAL(CalCoreSubmesh::Influence(0, 0.75f, false), sets[0]);
+    CHECK_EQUAL(CalCoreSubmesh::Influence(1, 0.25f, true), sets[1]);
+    CHECK(sets[1].lastInfluenceForThisVertex);
+    CHECK_EQUAL(CalCoreSubmesh::Influence(0, 1.0f, true), sets[2]);
+}
+
+TEST_F(SubmeshFixture, dedupe_influence_sets_keeps_weights_exact) {
+    CalCoreSubmesh csm(2, 0, 0);
+    CalCoreSubmesh::Vertex v;
+    std::vector<CalCoreSubmesh::Influence> inf;
+    inf.push_back(CalCoreSubmesh::Influence(3, 0.50001f, false));
+    inf.push_back(CalCoreSubmesh::Influence(9, 0.49999f, true));
+    csm.addVertex(v, BLACK, inf);
+    // the same to four decimal places
+    inf[0].weight = 0.50004f;
+    inf[1].weight = 0.49996f;
+    csm.addVertex(v, BLACK, inf);
+
+    csm.dedupeInfluenceSets();
+    CHECK_EQUAL(2u, csm.getInfluenceSetCount());
+    const CalCoreSubmesh::InfluenceVector& sets = csm.getInfluenceSets();
+    CHECK_EQUAL(0.50004f, sets[csm.getVertexInfluenceSets()[1].boneId * 2].weight);
+}
+
+// The meshes a sample model under data/ lists in its .cfg, found from
+// this file's path.  Empty if the data isn't there.
+static std::vector<CalCoreMeshPtr> loadSampleMeshes(const std::string& model) {
+    std::string root(__FILE__);
+    const size_t slash = root.find_last_of("/\\");
+    root = (slash == std::string::npos ? std::string(".") : root.substr(0, slash)) + "/../data/" + model + "/";
+
+    std::vector<CalCoreMeshPtr> meshes;
+    std::ifstream cfg((root + model + ".cfg").c_str());
+    std::string line;
+    while (std::getline(cfg, line)) {
+        if (line.compare(0, 5, "mesh=") != 0) {
+            continue;
+        }
+        std::string name = line.substr(5);
+        name.erase(name.find_last_not_of(" \t\r") + 1);
+        std::ifstream file((root + name).c_str(), std::ios::binary);
+        std::stringstream contents;
+        contents << file.rdbuf();
+        const std::string data = contents.str();
+        CalBufferSource source(data.data(), data.size());
+        CalCoreMeshPtr mesh = CalLoader::loadCoreMesh(source);
+        CHECK(mesh);
+        if (mesh) {
+            meshes.push_back(mesh);
+        }
+    }
+    if (meshes.empty()) {
+        printf("Sample model %s not found under %s\n", model.c_str(), root.c_str());
+    }
+    return meshes;
+}
+
+TEST_F(SubmeshFixture, dedupe_influence_sets_on_sample_models) {
+    const char* models[3] = { "cally", "paladin", "skeleton" };
+    const size_t expectedVertices[3] = { 1844, 2235, 2527 };
+    const size_t expectedSets[3] = { 764, 630, 21 };
+    for (int m = 0; m < 3; ++m) {
+        const std::vector<CalCoreMeshPtr> meshes = loadSampleMeshes(models[m]);
+        if (meshes.empty()) {
+            continue;
+        }
+        size_t vertexCount = 0;
+        size_t setCount = 0;
+        for (auto mesh = meshes.begin(); mesh != meshes.end(); ++mesh) {
+            for (auto submesh = (*mesh)->submeshes.begin(); submesh != (*mesh)->submeshes.end(); ++submesh) {
+                (*submesh)->dedupeInfluenceSets();
+                vertexCount += (*submesh)->getVertexCount();
+                setCount += (*submesh)->getInfluenceSetCount();
+            }
+        }
+        printf("Influence set dedupe ratio (%s): %d vertices, %d sets, %.2f\n",
+               models[m], (int)vertexCount, (int)setCount, double(vertexCount) / setCount);
+        CHECK_EQUAL(expectedVertices[m], vertexCount);
+        CHECK_EQUAL(expectedSets[m], setCount);
+    }
+}
+
+TEST_F(SubmeshFixture, palette_bounds_cover_vertices_each_bone_influences) {
+    CalCoreSubmesh csm(3, 0, 0);
+
+    CalCoreSubmesh::Vertex v;
+    std::vector<CalCoreSubmesh::Influence> inf(1, CalCoreSubmesh::Influence(0, 1.0f, true));
+    v.position = CalPoint4(CalVector(0, 0, 0));
+    csm.addVertex(v, BLACK, inf);
+    inf[0].boneId = 1;
+    v.position = CalPoint4(CalVector(1, 1, 1));
+    csm.addVertex(v, BLACK, inf);
+    inf[0] = CalCoreSubmesh::Influence(0, 0.5f, false);
+    inf.push_back(CalCoreSubmesh::Influence(1, 0.5f, true));
+    v.position = CalPoint4(CalVector(2, 0, 0));
+    csm.addVertex(v, BLACK, inf);
+
+    const std::vector<CalAABox>& bounds = csm.getPaletteBounds();
+    CHECK_EQUAL(2u, bounds.size());
+    CHECK_EQUAL(CalAABox(CalVector(0, 0, 0), CalVector(2, 0, 0)), bounds[0]);
+    CHECK_EQUAL(CalAABox(CalVector(1, 0, 0), CalVector(2, 1, 1)), bounds[1]);
+
+    BoneTransform bt[2];
+    bt[0].rowx.set(1, 0, 0, 0);
+    bt[0].rowy.set(0, 1, 0, 0);
+    bt[0].rowz.set(0, 0, 1, 0);
+    // bone 1 turns 90 degrees about z, then moves 10 along x
+    bt[1].rowx.set(0, -1, 0, 10);
+    bt[1].rowy.set(1, 0, 0, 0);
+    bt[1].rowz.set(0, 0, 1, 0);
+
+    CHECK_EQUAL(
+        CalAABox(CalVector(0, 0, 0), CalVector(10, 2, 1)),
+        csm.getAnimatedBoundingVolume(bt));
+}
+
+TEST_F(SubmeshFixture, replacing_the_mesh_with_a_morph_target_moves_its_bounds) {
+    CalCoreSubmesh csm(3, 0, 1);
+    const std::vector<CalCoreSubmesh::Influence> inf(1, CalCoreSubmesh::Influence(0, 1.0f, true));
+    for (int i = 0; i < 3; ++i) {
+        CalCoreSubmesh::Vertex v;
+        v.position = CalPoint4(CalVector(float(i == 1), float(i == 2), 0));
+        v.normal = CalVector4(0, 0, 1, 0);
+        csm.addVertex(v, BLACK, inf);
+    }
+    csm.addFace(CalCoreSubmesh::Face(0, 1, 2));
+    csm.buildClusters();
+    CalCoreMorphTarget::VertexOffsetArray offsets;
+    offsets.push_back(VertexOffset(1, CalPoint4(9, 0, 0), CalVector4()));
+    csm.addMorphTarget(CalCoreMorphTargetPtr(new CalCoreMorphTarget("stretch", 3, offsets)));
+
+    csm.replaceMeshWithMorphTarget("stretch");
+
+    CHECK_EQUAL(10.0f, csm.getBoundingVolume().max.x);
+    CHECK_EQUAL(10.0f, csm.getPaletteBounds()[0].max.x);
+    const CalCoreSubmesh::Cluster& cluster = csm.getClusters()[0];
+    CHECK((CalVector(10, 0, 0) - cluster.center).length() <= cluster.radius + 1e-4f);
+}
+
+TEST_F(SubmeshFixture, boxes_behind_any_plane_are_outside) {
+    // the slab 0 <= x <= 10
+    CalVector4 planes[2];
+    planes[0] = CalVector4(1, 0, 0, 0);
+    planes[1] = CalVector4(-1, 0, 0, 10);
+
+    CHECK(!cal3d::isOutsidePlanes(CalAABox(CalVector(1, 5, 5), CalVector(2, 6, 6)), planes, 2));
+    CHECK(!cal3d::isOutsidePlanes(CalAABox(CalVector(-1, 0, 0), CalVector(1, 1, 1)), planes, 2));
+    CHECK(cal3d::isOutsidePlanes(CalAABox(CalVector(-3, 0, 0), CalVector(-1, 1, 1)), planes, 2));
+    CHECK(cal3d::isOutsidePlanes(CalAABox(CalVector(11, 0, 0), CalVector(12, 1, 1)), planes, 2));
+}
+
 TEST_F(SubmeshFixture, is_not_static_if_first_and_third_vertices_have_same_influence) {
     CalCoreSubmesh csm(3, 0, 0);
 
@@ -632,6 +883,1254 @@ TEST_F(SubmeshFixture, minimumVertexBufferSize_is_changed_if_vertex_list_is_shru
     CHECK_EQUAL(3u, csm.getMinimumVertexBufferSize());
 }
 
+TEST_F(SubmeshFixture, copy_vertices_gathers_every_vertex_attribute) {
+    CalCoreSubmesh csm(3, true, 0);
+    std::vector<CalCoreSubmesh::Influence> inf;
+    inf.push_back(CalCoreSubmesh::Influence(4, 0.75f, false));
+    inf.push_back(CalCoreSubmesh::Influence(5, 0.25f, true));
+    csm.addVertex(makeVertex(0), 10, inf);
+    csm.addVertex(makeVertex(1), 11, std::vector<CalCoreSubmesh::Influence>(1, CalCoreSubmesh::Influence(6, 1.0f, true)));
+    csm.addVertex(makeVertex(2), 12, inf);
+    for (int i = 0; i < 3; ++i) {
+        csm.setTextureCoordinate(i, CalCoreSubmesh::TextureCoordinate(float(i), 0.5f));
+    }
+    CalCoreMorphTarget::VertexOffsetArray offsets;
+    offsets.push_back(VertexOffset(2, CalPoint4(1, 0, 0), CalVector4()));
+    offsets.push_back(VertexOffset(1, CalPoint4(2, 0, 0), CalVector4()));
+    csm.addMorphTarget(CalCoreMorphTargetPtr(new CalCoreMorphTarget("morph", 3, offsets)));
+    CHECK(!csm.isStatic());
+
+    std::vector<unsigned> newToOld;
+    newToOld.push_back(2);
+    newToOld.push_back(0);
+    newToOld.push_back(2);
+    CalCoreSubmesh copy(3, false, 0);
+    copy.copyVertices(csm, newToOld);
+
+    CHECK_EQUAL(3u, copy.getVertexCount());
+    CHECK_EQUAL(makeVertex(2).position, copy.getVectorVertex()[0].position);
+    CHECK_EQUAL(makeVertex(0).position, copy.getVectorVertex()[1].position);
+    CHECK_EQUAL(12u, copy.getVertexColors()[2]);
+    CHECK_EQUAL(2.0f, copy.getTextureCoordinates()[0].u);
+    CHECK_EQUAL(0.0f, copy.getTextureCoordinates()[1].u);
+
+    CHECK_EQUAL(6u, copy.getInfluences().size());
+    for (size_t i = 0; i < 6; ++i) {
+        CHECK_EQUAL(inf[i % 2].boneId, copy.getInfluences()[i].boneId);
+        CHECK_EQUAL(inf[i % 2].lastInfluenceForThisVertex, copy.getInfluences()[i].lastInfluenceForThisVertex);
+    }
+    CHECK_EQUAL(CalVector(0, 0, 0), copy.getBoundingVolume().min);
+    CHECK_EQUAL(CalVector(2, 2, 2), copy.getBoundingVolume().max);
+
+    // the offset of vertex 2 follows both copies; vertex 1's is dropped
+    const CalCoreMorphTarget::VertexOffsetArray& copied = copy.getMorphTargets()[0]->vertexOffsets;
+    CHECK_EQUAL(2u, copied.size());
+    CHECK_EQUAL(0u, copied[0].vertexId);
+    CHECK_EQUAL(2u, copied[1].vertexId);
+    CHECK_EQUAL(1.0f, copied[1].position.x);
+
+}
+
+TEST_F(SubmeshFixture, copy_vertices_is_static_if_the_copies_share_influences) {
+    CalCoreSubmesh csm(3, false, 0);
+    std::vector<CalCoreSubmesh::Influence> inf(1, CalCoreSubmesh::Influence(4, 1.0f, true));
+    csm.addVertex(makeVertex(0), 0, inf);
+    csm.addVertex(makeVertex(1), 0, std::vector<CalCoreSubmesh::Influence>(1, CalCoreSubmesh::Influence(6, 1.0f, true)));
+    csm.addVertex(makeVertex(2), 0, inf);
+    CHECK(!csm.isStatic());
+
+    std::vector<unsigned> newToOld(2, 0);
+    newToOld[1] = 2;
+    csm.permuteVertices(newToOld);
+    CHECK(csm.isStatic());
+    CHECK_EQUAL(2u, csm.getVertexCount());
+}
+
+TEST_F(SubmeshFixture, weld_merges_duplicate_vertices_and_remaps_faces_and_morph_targets) {
+    // two triangles of a quad, each with its own copy of the diagonal
+    CalCoreSubmesh csm(7, true, 3);
+    const int positions[7] = { 0, 1, 2, 2, 1, 3, 1 };
+    const std::vector<CalCoreSubmesh::Influence> inf(1, CalCoreSubmesh::Influence(4, 1.0f, true));
+    for (int i = 0; i < 7; ++i) {
+        // the last copy of vertex 1 differs only in color
+        csm.addVertex(makeVertex(positions[i]), i == 6 ? 1 : BLACK, inf);
+        csm.setTextureCoordinate(i, CalCoreSubmesh::TextureCoordinate(float(positions[i]), 0.0f));
+    }
+    csm.addFace(CalCoreSubmesh::Face(0, 1, 2));
+    csm.addFace(CalCoreSubmesh::Face(3, 4, 5));
+    csm.addFace(CalCoreSubmesh::Face(6, 5, 3));
+    CalCoreMorphTarget::VertexOffsetArray offsets;
+    offsets.push_back(VertexOffset(2, CalPoint4(1, 0, 0), CalVector4()));
+    offsets.push_back(VertexOffset(3, CalPoint4(1, 0, 0), CalVector4()));
+    offsets.push_back(VertexOffset(5, CalPoint4(2, 0, 0), CalVector4()));
+    csm.addMorphTarget(CalCoreMorphTargetPtr(new CalCoreMorphTarget("morph", 7, offsets)));
+
+    const CalCoreSubmesh::WeldReport report = csm.weldVertices();
+    CHECK_EQUAL(7u, report.verticesBefore);
+    CHECK_EQUAL(5u, report.verticesAfter);
+    CHECK_EQUAL(0u, report.facesRemoved);
+    CHECK_EQUAL(5u, csm.getVertexCount());
+    CHECK_EQUAL(5u, csm.getMinimumVertexBufferSize());
+
+    CHECK_EQUAL(CalCoreSubmesh::Face(0, 1, 2), csm.getFaces()[0]);
+    CHECK_EQUAL(CalCoreSubmesh::Face(2, 1, 3), csm.getFaces()[1]);
+    CHECK_EQUAL(CalCoreSubmesh::Face(4, 3, 2), csm.getFaces()[2]);
+    CHECK_EQUAL(makeVertex(3).position, csm.getVectorVertex()[3].position);
+    CHECK_EQUAL(1u, csm.getVertexColors()[4]);
+    CHECK_EQUAL(3.0f, csm.getTextureCoordinates()[3].u);
+    CHECK_EQUAL(5u, csm.getInfluences().size());
+
+    const CalCoreMorphTarget::VertexOffsetArray& welded = csm.getMorphTargets()[0]->vertexOffsets;
+    CHECK_EQUAL(2u, welded.size());
+    CHECK_EQUAL(2u, welded[0].vertexId);
+    CHECK_EQUAL(3u, welded[1].vertexId);
+}
+
+TEST_F(SubmeshFixture, weld_epsilon_reaches_across_cells_and_drops_collapsed_faces) {
+    CalCoreSubmesh csm(5, false, 2);
+    const float xs[5] = { 0.999f, 1.001f, 2.0f, 3.0f, 1.5f };
+    for (int i = 0; i < 5; ++i) {
+        CalCoreSubmesh::Vertex v;
+        v.position = CalPoint4(xs[i], 0.0f, 0.0f);
+        v.normal = CalVector4(0, 0, 1, 0);
+        csm.addVertex(v, BLACK, std::vector<CalCoreSubmesh::Influence>(1, CalCoreSubmesh::Influence(0, 1.0f, true)));
+    }
+    csm.addFace(CalCoreSubmesh::Face(0, 1, 2));
+    csm.addFace(CalCoreSubmesh::Face(1, 2, 3));
+
+    // 0.999 and 1.001 hash to different cells at this epsilon
+    CHECK_EQUAL(5u, csm.weldVertices().verticesAfter);
+    const CalCoreSubmesh::WeldReport report = csm.weldVertices(0.01f);
+    CHECK_EQUAL(4u, report.verticesAfter);
+    CHECK_EQUAL(1u, report.facesRemoved);
+    CHECK_EQUAL(1u, csm.getFaceCount());
+    CHECK_EQUAL(CalCoreSubmesh::Face(0, 1, 2), csm.getFaces()[0]);
+    CHECK_EQUAL(0.999f, csm.getVectorVertex()[0].position.x);
+    CHECK_EQUAL(3u, csm.getMinimumVertexBufferSize());
+
+    CHECK_THROW(csm.weldVertices(-1.0f), std::exception);
+}
+
+TEST_F(SubmeshFixture, weld_matches_influences_in_any_order) {
+    CalCoreSubmesh csm(3, false, 0);
+    std::vector<CalCoreSubmesh::Influence> inf;
+    inf.push_back(CalCoreSubmesh::Influence(0, 0.6f, false));
+    inf.push_back(CalCoreSubmesh::Influence(1, 0.4f, true));
+    csm.addVertex(makeVertex(0), BLACK, inf);
+    std::swap(inf[0].boneId, inf[1].boneId);
+    std::swap(inf[0].weight, inf[1].weight);
+    csm.addVertex(makeVertex(0), BLACK, inf);
+    inf[0].boneId = 2;
+    csm.addVertex(makeVertex(0), BLACK, inf);
+
+    const CalCoreSubmesh::WeldReport report = csm.weldVertices();
+    CHECK_EQUAL(2u, report.verticesAfter);
+    const CalCoreSubmesh::InfluenceVector& influences = csm.getInfluences();
+    CHECK_EQUAL(4u, influences.size());
+    CHECK(influences[2].boneId == 2 || influences[3].boneId == 2);
+}
+
+TEST_F(SubmeshFixture, weld_takes_any_finite_epsilon) {
+    CalCoreSubmesh csm(3, false, 0);
+    const float xs[3] = { 1e20f, 1e20f, -3e25f };
+    for (int i = 0; i < 3; ++i) {
+        CalCoreSubmesh::Vertex v;
+        v.position = CalPoint4(xs[i], 0.0f, 0.0f);
+        v.normal = CalVector4(0, 0, 1, 0);
+        csm.addVertex(v, BLACK, std::vector<CalCoreSubmesh::Influence>(1, CalCoreSubmesh::Influence(0, 1.0f, true)));
+    }
+    // cells far past the range of a long long
+    CHECK_EQUAL(2u, csm.weldVertices(1e-30f).verticesAfter);
+    CHECK_EQUAL(1u, csm.weldVertices(std::numeric_limits<float>::max()).verticesAfter);
+    CHECK_THROW(csm.weldVertices(std::numeric_limits<float>::infinity()), std::exception);
+}
+
+TEST_F(SubmeshFixture, weld_compares_offsets_across_many_sparse_morph_targets) {
+    const int TargetCount = 100;
+    CalCoreSubmesh csm(5, false, 0);
+    for (int i = 0; i < 5; ++i) {
+        csm.addVertex(makeVertex(i / 4), BLACK, std::vector<CalCoreSubmesh::Influence>(1, CalCoreSubmesh::Influence(0, 1.0f, true)));
+    }
+    // vertices 0 and 1 move alike in every target; 2 and 3 don't move in
+    // the same targets; 4, elsewhere, keeps the other targets non-empty
+    for (int t = 0; t < TargetCount; ++t) {
+        CalCoreMorphTarget::VertexOffsetArray offsets;
+        if (t % 10 == 0) {
+            offsets.push_back(VertexOffset(1, CalPoint4(float(t), 0, 0), CalVector4()));
+            offsets.push_back(VertexOffset(0, CalPoint4(float(t), 0, 0), CalVector4()));
+        }
+        if (t == 57) {
+            offsets.push_back(VertexOffset(3, CalPoint4(1, 0, 0), CalVector4()));
+        }
+        if (t == 58) {
+            offsets.push_back(VertexOffset(2, CalPoint4(1, 0, 0), CalVector4()));
+        }
+        if (offsets.size() == 0) {
+            offsets.push_back(VertexOffset(4, CalPoint4(1, 0, 0), CalVector4()));
+        }
+        csm.addMorphTarget(CalCoreMorphTargetPtr(new CalCoreMorphTarget("t" + boost::lexical_cast<std::string>(t), 5, offsets)));
+    }
+
+    const CalCoreSubmesh::WeldReport report = csm.weldVertices();
+    CHECK_EQUAL(4u, report.verticesAfter);
+    CHECK_EQUAL(size_t(TargetCount), csm.getMorphTargets().size());
+    CHECK_EQUAL(1u, csm.getMorphTargets()[10]->vertexOffsets.size());
+    CHECK_EQUAL(1u, csm.getMorphTargets()[57]->vertexOffsets.size());
+    CHECK_EQUAL(2u, csm.getMorphTargets()[57]->vertexOffsets[0].vertexId);
+}
+
+TEST_F(SubmeshFixture, weld_cycle_count) {
+    // a grid exported with every triangle's vertices unshared
+    const int W = 160;
+    const int vertexCount = 6 * W * W;
+    CalCoreSubmesh csm(vertexCount, true, 2 * W * W);
+    const std::vector<CalCoreSubmesh::Influence> inf(1, CalCoreSubmesh::Influence(0, 1.0f, true));
+    const int corners[6][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 0 }, { 1, 1 }, { 0, 1 } };
+    unsigned vertexId = 0;
+    for (int y = 0; y < W; ++y) {
+        for (int x = 0; x < W; ++x) {
+            for (int c = 0; c < 6; ++c) {
+                CalCoreSubmesh::Vertex v;
+                v.position = CalPoint4(float(x + corners[c][0]), float(y + corners[c][1]), 0.0f);
+                v.normal = CalVector4(0, 0, 1, 0);
+                csm.addVertex(v, BLACK, inf);
+                csm.setTextureCoordinate(vertexId++, CalCoreSubmesh::TextureCoordinate(v.position.x / W, v.position.y / W));
+            }
+            const unsigned first = vertexId - 6;
+            csm.addFace(CalCoreSubmesh::WideFace(first, first + 1, first + 2));
+            csm.addFace(CalCoreSubmesh::WideFace(first + 3, first + 4, first + 5));
+        }
+    }
+
+    cal3d_int64 start = __rdtsc();
+    const CalCoreSubmesh::WeldReport report = csm.weldVertices(1e-4f);
+    cal3d_int64 end = __rdtsc();
+    printf("Cycles per vertex welded (%d vertices): %d, %d left\n",
+           vertexCount, (int)((end - start) / vertexCount), (int)report.verticesAfter);
+    CHECK_EQUAL(size_t((W + 1) * (W + 1)), report.verticesAfter);
+    CHECK_EQUAL(size_t(2 * W * W), csm.getFaceCount());
+}
+
+TEST_F(SubmeshFixture, sort_vertices_by_bone_groups_dominant_bones_and_remaps_vertex_data) {
+    CalCoreSubmesh csm(4, true, 2);
+    csm.addFace(CalCoreSubmesh::Face(0, 1, 2));
+    csm.addFace(CalCoreSubmesh::Face(2, 3, 0));
+
+    std::vector<CalCoreSubmesh::Influence> inf;
+    inf.push_back(CalCoreSubmesh::Influence(2, 0.4f, false));
+    inf.push_back(CalCoreSubmesh::Influence(1, 0.6f, true));
+    csm.addVertex(makeVertex(0), 0, inf);
+    csm.setTextureCoordinate(0, makeTextureCoordinate(0));
+    inf.resize(1);
+    inf[0] = CalCoreSubmesh::Influence(0, 1.0f, true);
+    csm.addVertex(makeVertex(1), 1, inf);
+    csm.setTextureCoordinate(1, makeTextureCoordinate(1));
+    inf[0] = CalCoreSubmesh::Influence(2, 1.0f, true);
+    csm.addVertex(makeVertex(2), 2, inf);
+    csm.setTextureCoordinate(2, makeTextureCoordinate(2));
+    inf[0] = CalCoreSubmesh::Influence(1, 1.0f, true);
+    csm.addVertex(makeVertex(3), 3, inf);
+    csm.setTextureCoordinate(3, makeTextureCoordinate(3));
+
+    CalCoreMorphTarget::VertexOffsetArray offsets;
+    offsets.push_back(VertexOffset(1, CalPoint4(), CalVector4()));
+    offsets.push_back(VertexOffset(3, CalPoint4(), CalVector4()));
+    csm.addMorphTarget(CalCoreMorphTargetPtr(new CalCoreMorphTarget("morph", 4, offsets)));
+
+    csm.sortVerticesByBone();
+
+    // vertex 0 is dominated by bone 1 and sorts before vertex 3's set
+    CHECK_EQUAL(makeVertex(1), csm.getVectorVertex()[0]);
+    CHECK_EQUAL(makeVertex(0), csm.getVectorVertex()[1]);
+    CHECK_EQUAL(makeVertex(3), csm.getVectorVertex()[2]);
+    CHECK_EQUAL(makeVertex(2), csm.getVectorVertex()[3]);
+
+    CHECK_EQUAL(CalColor32(1), csm.getVertexColors()[0]);
+    CHECK_EQUAL(CalColor32(2), csm.getVertexColors()[3]);
+    CHECK_EQUAL(makeTextureCoordinate(0), csm.getTextureCoordinates()[1]);
+    CHECK_EQUAL(makeTextureCoordinate(3), csm.getTextureCoordinates()[2]);
+
+    CHECK_EQUAL(CalCoreSubmesh::Face(1, 0, 3), csm.getFaces()[0]);
+    CHECK_EQUAL(CalCoreSubmesh::Face(3, 2, 1), csm.getFaces()[1]);
+
+    const CalCoreSubmesh::InfluenceVector& influences = csm.getInfluences();
+    CHECK_EQUAL(5u, influences.size());
+    CHECK_EQUAL(0u, influences[0].boneId);
+    CHECK_EQUAL(2u, influences[2].boneId);
+    CHECK(influences[2].lastInfluenceForThisVertex);
+    CHECK_EQUAL(1u, influences[3].boneId);
+    CHECK_EQUAL(2u, influences[4].boneId);
+
+    const CalCoreMorphTarget::VertexOffsetArray& morphOffsets = csm.getMorphTargets()[0]->vertexOffsets;
+    CHECK_EQUAL(2u, morphOffsets.size());
+    CHECK_EQUAL(0u, morphOffsets[0].vertexId);
+    CHECK_EQUAL(2u, morphOffsets[1].vertexId);
+}
+
+// The W x H quad grids the tests below build submeshes from.  By default
+// a sheet rippled by 0.5 sin(0.9 x + 0.4 y), whose vertices left of the
+// middle follow bone 0 and the rest bone 1.
+struct TestGrid {
+    enum Skinning { LeftRightBones, SingleBone, PatchBones };
+
+    TestGrid(int W, int H)
+        : W(W), H(H), layers(1), spacing(0.3f), ripple(0.5f), skinning(LeftRightBones), patch(0), seamed(false), scattered(false)
+    {}
+
+    // layers sheets spacing apart, like layered hair cards, all on bone 0
+    // and rippled gently enough not to intersect.
+    TestGrid& stacked(int layers, float spacing = 0.3f) {
+        this->layers = layers;
+        this->spacing = spacing;
+        ripple = 0.1f;
+        skinning = SingleBone;
+        return *this;
+    }
+
+    // A texture seam down column W / 2: faces right of it use copies of
+    // the seam vertices, appended after the grid, with their own texture
+    // coordinates.  Single layer grids only.
+    TestGrid& withSeam() {
+        seamed = true;
+        return *this;
+    }
+
+    // Flat, skinned to square patches of bones, each vertex also weighted
+    // to the patch grid offset by half a patch, with its faces in
+    // scattered order as an exporter might leave them.
+    TestGrid& bonePatches(int patch) {
+        this->patch = patch;
+        ripple = 0.0f;
+        skinning = PatchBones;
+        scattered = true;
+        return *this;
+    }
+
+    int W, H;
+    int layers;
+    float spacing;
+    float ripple;
+    Skinning skinning;
+    int patch;
+    bool seamed;
+    bool scattered;
+};
+
+static CalCoreSubmeshPtr gridCoreSubmesh(const TestGrid& grid) {
+    const int W = grid.W, H = grid.H;
+    const int seam = W / 2;
+    const int gridVertexCount = grid.layers * (W + 1) * (H + 1);
+    CalCoreSubmeshPtr csm(new CalCoreSubmesh(gridVertexCount + (grid.seamed ? H + 1 : 0), grid.seamed, grid.layers * 2 * W * H));
+    for (int copy = 0; copy < (grid.seamed ? 2 : 1); ++copy) {
+        for (int layer = 0; layer < (copy == 0 ? grid.layers : 1); ++layer) {
+            for (int y = 0; y <= H; ++y) {
+                for (int x = 0; x <= W; ++x) {
+                    if (copy == 1 && x != seam) {
+                        continue;
+                    }
+                    CalCoreSubmesh::Vertex v;
+                    v.position = CalPoint4(CalVector(float(x), float(y), grid.spacing * layer + grid.ripple * sinf(0.9f * x + 0.4f * y)));
+                    v.normal = CalVector4(0, 0, 1, 0);
+                    std::vector<CalCoreSubmesh::Influence> inf;
+                    switch (grid.skinning) {
+                    case TestGrid::LeftRightBones:
+                        inf.push_back(CalCoreSubmesh::Influence(2 * x < W ? 0 : 1, 1.0f, true));
+                        break;
+                    case TestGrid::SingleBone:
+                        inf.push_back(CalCoreSubmesh::Influence(0, 1.0f, true));
+                        break;
+                    case TestGrid::PatchBones:
+                        inf.push_back(CalCoreSubmesh::Influence(x / grid.patch + 100 * (y / grid.patch), 0.7f, false));
+                        inf.push_back(CalCoreSubmesh::Influence(10000 + (x + grid.patch / 2) / grid.patch + 100 * ((y + grid.patch / 2) / grid.patch), 0.3f, true));
+                        break;
+                    }
+                    csm->addVertex(v, BLACK, inf);
+                    if (grid.seamed) {
+                        const int id = copy == 0 ? y * (W + 1) + x : gridVertexCount + y;
+                        csm->setTextureCoordinate(id, CalCoreSubmesh::TextureCoordinate(float(x) / W + copy, float(y) / H));
+                    }
+                }
+            }
+        }
+    }
+    std::vector<CalCoreSubmesh::WideFace> faces;
+    for (int layer = 0; layer < grid.layers; ++layer) {
+        for (int y = 0; y < H; ++y) {
+            for (int x = 0; x < W; ++x) {
+                const CalIndex32 i = CalIndex32((layer * (H + 1) + y) * (W + 1) + x);
+                CalIndex32 corner[4] = { i, i + 1, i + W + 1, i + W + 2 };
+                if (grid.seamed && x == seam) {
+                    corner[0] = CalIndex32(gridVertexCount + y);
+                    corner[2] = CalIndex32(gridVertexCount + y + 1);
+                }
+                faces.push_back(CalCoreSubmesh::WideFace(corner[0], corner[1], corner[2]));
+                faces.push_back(CalCoreSubmesh::WideFace(corner[1], corner[3], corner[2]));
+            }
+        }
+    }
+    for (size_t f = 0; f < faces.size(); ++f) {
+        csm->addFace(faces[grid.scattered ? f * 7919 % faces.size() : f]);
+    }
+    return csm;
+}
+
+TEST_F(SubmeshFixture, clusters_partition_faces_within_limits_and_bound_them) {
+    CalCoreSubmeshPtr csm(gridCoreSubmesh(TestGrid(12, 10)));
+    CHECK(!csm->hasClusters());
+    csm->buildClusters(16, 20);
+    CHECK(csm->hasClusters());
+
+    const CalCoreSubmesh::ClusterVector& clusters = csm->getClusters();
+    const CalCoreSubmesh::VectorVertex& vertices = csm->getVectorVertex();
+    const CalCoreSubmesh::VectorFace& faces = csm->getFaces();
+    unsigned nextFace = 0;
+    for (auto cluster = clusters.begin(); cluster != clusters.end(); ++cluster) {
+        CHECK_EQUAL(nextFace, cluster->firstFace);
+        CHECK(cluster->faceCount >= 1 && cluster->faceCount <= 20);
+        nextFace += cluster->faceCount;
+
+        std::set<unsigned> used;
+        for (unsigned f = cluster->firstFace; f < cluster->firstFace + cluster->faceCount; ++f) {
+            const CalVector a = vertices[faces[f].vertexId[0]].position.asCalVector();
+            const CalVector b = vertices[faces[f].vertexId[1]].position.asCalVector();
+            const CalVector c = vertices[faces[f].vertexId[2]].position.asCalVector();
+            const CalVector n = cross(b - a, c - a);
+            CHECK(cluster->coneCutoff <= 1.0f);
+            // inside the cone: cos(angle to axis) >= cos(half angle)
+            CHECK(dot(n, cluster->coneAxis) / n.length() >= sqrtf(1.0f - cluster->coneCutoff * cluster->coneCutoff) - 1e-5f);
+
+            for (int k = 0; k < 3; ++k) {
+                used.insert(faces[f].vertexId[k]);
+                CHECK((vertices[faces[f].vertexId[k]].position.asCalVector() - cluster->center).length() <= cluster->radius + 1e-5f);
+            }
+        }
+        CHECK(used.size() <= 16u);
+
+        std::set<unsigned> ranged;
+        for (unsigned r = cluster->firstRange; r < cluster->firstRange + cluster->rangeCount; ++r) {
+            const CalCoreSubmesh::VertexRange& range = csm->getClusterVertexRanges()[csm->getClusterRangeIndices()[r]];
+            CHECK_EQUAL(range.begin, range.firstInfluence); // one influence per vertex
+            for (unsigned v = range.begin; v < range.end; ++v) {
+                ranged.insert(v);
+            }
+        }
+        CHECK(used == ranged);
+
+        std::set<unsigned> bones(
+            csm->getClusterBones().begin() + cluster->firstBone,
+            csm->getClusterBones().begin() + cluster->firstBone + cluster->boneCount);
+        std::set<unsigned> expectedBones;
+        for (auto v = used.begin(); v != used.end(); ++v) {
+            expectedBones.insert(csm->getPaletteInfluences()[*v].boneId);
+        }
+        CHECK(bones == expectedBones);
+    }
+    CHECK_EQUAL(faces.size(), nextFace);
+
+    const CalCoreSubmesh::VertexRangeVector& ranges = csm->getClusterVertexRanges();
+    for (size_t r = 1; r < ranges.size(); ++r) {
+        CHECK(ranges[r - 1].end <= ranges[r].begin);
+    }
+}
+
+TEST_F(SubmeshFixture, renumbering_updates_clusters_and_face_rewrites_discard_them) {
+    CalCoreSubmeshPtr csm(gridCoreSubmesh(TestGrid(4, 4)));
+    csm->buildClusters(8, 8);
+    const size_t clusterCount = csm->getClusters().size();
+
+    csm->renumberIndices();
+    CHECK_EQUAL(clusterCount, csm->getClusters().size());
+    const CalCoreSubmesh::Cluster& first = csm->getClusters()[0];
+    std::set<unsigned> used;
+    for (unsigned f = first.firstFace; f < first.firstFace + first.faceCount; ++f) {
+        used.insert(csm->getFaces()[f].vertexId, csm->getFaces()[f].vertexId + 3);
+    }
+    std::set<unsigned> ranged;
+    for (unsigned r = first.firstRange; r < first.firstRange + first.rangeCount; ++r) {
+        const CalCoreSubmesh::VertexRange& range = csm->getClusterVertexRanges()[csm->getClusterRangeIndices()[r]];
+        for (unsigned v = range.begin; v < range.end; ++v) {
+            ranged.insert(v);
+        }
+    }
+    CHECK(used == ranged);
+
+    csm->optimizeVertexCache();
+    CHECK(!csm->hasClusters());
+}
+
+// The original all-pairs, linear-scan sortTris, to check the pruned one
+// against on meshes small enough that it compares every pair anyway.
+// With pruneDistant it skips the same pairs sortTris does, by testing
+// every pair's grown bounds instead of going through the grid.
+static CalCoreSubmesh::VectorFace allPairsSortTris(const CalCoreSubmesh& csm, bool pruneDistant = false) {
+    struct SortFace {
+        CalIndex ix[3];
+        CalVector fnorm;
+        float fdist;
+        float score;
+        float area;
+        std::vector<std::pair<size_t, float> > infront;
+    };
+    const size_t numVertices = csm.getVertexCount();
+    const size_t numFaces = csm.getFaces().size();
+    const CalCoreSubmesh::VectorVertex& vertices = csm.getVectorVertex();
+    std::vector<SortFace> faces(2 * numFaces);
+    std::vector<CalAABox> bounds(numFaces);
+    for (size_t f = 0; f < numFaces; ++f) {
+        const CalCoreSubmesh::Face& face = csm.getFaces()[f];
+        const CalVector a = vertices[face.vertexId[0]].position.asCalVector();
+        const CalVector b = vertices[face.vertexId[1]].position.asCalVector();
+        const CalVector c = vertices[face.vertexId[2]].position.asCalVector();
+        const float grow = 0.5f * sqrtf(std::max((b - a).lengthSquared(), std::max((c - b).lengthSquared(), (a - c).lengthSquared())));
+        bounds[f].min = CalVector(std::min(a.x, std::min(b.x, c.x)) - grow, std::min(a.y, std::min(b.y, c.y)) - grow, std::min(a.z, std::min(b.z, c.z)) - grow);
+        bounds[f].max = CalVector(std::max(a.x, std::max(b.x, c.x)) + grow, std::max(a.y, std::max(b.y, c.y)) + grow, std::max(a.z, std::max(b.z, c.z)) + grow);
+        CalVector n = cross(vertices[face.vertexId[1]].position.asCalVector() - a, vertices[face.vertexId[2]].position.asCalVector() - a);
+        faces[f].area = n.length() * 0.5f;
+        n.normalize();
+        std::copy(face.vertexId, face.vertexId + 3, faces[f].ix);
+        faces[f].fnorm = n;
+        faces[f].fdist = dot(a, n);
+        faces[f].score = 0;
+
+        SortFace& back = faces[f + numFaces];
+        back = faces[f];
+        back.ix[0] = CalIndex(face.vertexId[1] + numVertices);
+        back.ix[1] = CalIndex(face.vertexId[0] + numVertices);
+        back.ix[2] = CalIndex(face.vertexId[2] + numVertices);
+        back.fnorm *= -1;
+        back.fdist *= -1;
+    }
+    for (size_t g = 0; g < 2 * numFaces; ++g) {
+        for (size_t f = 0; f < 2 * numFaces; ++f) {
+            if (f == g) {
+                continue;
+            }
+            if (pruneDistant) {
+                const CalAABox& gb = bounds[g % numFaces];
+                const CalAABox& fb = bounds[f % numFaces];
+                if (gb.min.x > fb.max.x || fb.min.x > gb.max.x ||
+                    gb.min.y > fb.max.y || fb.min.y > gb.max.y ||
+                    gb.min.z > fb.max.z || fb.min.z > gb.max.z) {
+                    continue;
+                }
+            }
+            int vfront = 0, gfront = 0;
+            for (int i = 0; i < 3; ++i) {
+                if (dot(vertices[faces[g].ix[i] % numVertices].position.asCalVector(), faces[f].fnorm) - faces[f].fdist < -1e-4) {
+                    vfront++;
+                }
+                if (dot(vertices[faces[f].ix[i] % numVertices].position.asCalVector(), faces[g].fnorm) - faces[g].fdist < 1e-4) {
+                    gfront++;
+                }
+            }
+            if (vfront && gfront < 3) {
+                const float fscore = (float)(std::max(faces[f].area, faces[g].area) * (1 + dot(faces[f].fnorm, faces[g].fnorm)) * 0.5 * vfront / 3);
+                faces[g].infront.push_back(std::make_pair(f, fscore));
+                faces[f].score += fscore;
+            }
+        }
+    }
+    CalCoreSubmesh::VectorFace result;
+    for (size_t i = 0; i < 2 * numFaces; ++i) {
+        float lowest = faces[i].score;
+        size_t lowestIx = i;
+        for (size_t f = 0; f < 2 * numFaces; ++f) {
+            if (faces[f].score < lowest) {
+                lowest = faces[f].score;
+                lowestIx = f;
+            }
+        }
+        result.push_back(CalCoreSubmesh::Face(faces[lowestIx].ix[0], faces[lowestIx].ix[1], faces[lowestIx].ix[2]));
+        faces[lowestIx].score = 1e20f;
+        for (size_t q = 0; q < faces[lowestIx].infront.size(); ++q) {
+            faces[faces[lowestIx].infront[q].first].score -= faces[lowestIx].infront[q].second;
+        }
+    }
+    return result;
+}
+
+static void checkSameFaces(const CalCoreSubmesh::VectorFace& expected, const CalCoreSubmesh::VectorFace& actual) {
+    CHECK_EQUAL(expected.size(), actual.size());
+    for (size_t f = 0; f < std::min(expected.size(), actual.size()); ++f) {
+        for (int k = 0; k < 3; ++k) {
+            CHECK_EQUAL(expected[f].vertexId[k], actual[f].vertexId[k]);
+        }
+    }
+}
+
+TEST_F(SubmeshFixture, sort_tris_matches_all_pairs_sort_on_small_meshes) {
+    CalCoreSubmeshPtr sheets(gridCoreSubmesh(TestGrid(2, 2).stacked(3)));
+    CalCoreSubmesh sortedSheets(2 * sheets->getVertexCount(), 0, 2 * sheets->getFaces().size());
+    sheets->sortTris(sortedSheets);
+    CHECK_EQUAL(2 * sheets->getVertexCount(), sortedSheets.getVertexCount());
+    checkSameFaces(allPairsSortTris(*sheets), sortedSheets.getFaces());
+
+    CalCoreSubmeshPtr cube(MakeCube());
+    CalCoreSubmesh sortedCube(2 * cube->getVertexCount(), true, 2 * cube->getFaces().size());
+    cube->sortTris(sortedCube);
+    checkSameFaces(allPairsSortTris(*cube), sortedCube.getFaces());
+}
+
+TEST_F(SubmeshFixture, sort_tris_grid_finds_the_same_pairs_as_a_linear_scan) {
+    // big enough that most pairs are too far apart to compare
+    CalCoreSubmeshPtr sheets(gridCoreSubmesh(TestGrid(20, 16).stacked(3)));
+    CalCoreSubmesh sorted(2 * sheets->getVertexCount(), 0, 2 * sheets->getFaces().size());
+    sheets->sortTris(sorted);
+    checkSameFaces(allPairsSortTris(*sheets, true), sorted.getFaces());
+}
+
+// Sheets 3 apart, with edges under 1.5, are beyond the default reach.
+TEST_F(SubmeshFixture, sort_tris_reaches_across_widely_spaced_layers) {
+    CalCoreSubmeshPtr sheets(gridCoreSubmesh(TestGrid(2, 2).stacked(3, 3.0f)));
+    const CalCoreSubmesh::VectorFace expected = allPairsSortTris(*sheets);
+
+    CalCoreSubmesh pruned(2 * sheets->getVertexCount(), 0, 2 * sheets->getFaces().size());
+    sheets->sortTris(pruned);
+    CHECK(expected != pruned.getFaces());
+
+    CalCoreSubmesh sorted(2 * sheets->getVertexCount(), 0, 2 * sheets->getFaces().size());
+    sheets->sortTris(sorted, 6.0f);
+    checkSameFaces(expected, sorted.getFaces());
+}
+
+TEST_F(SubmeshFixture, sort_tris_emits_32_bit_faces_past_16_bit_vertex_ids) {
+    CalCoreSubmeshPtr sheet(gridCoreSubmesh(TestGrid(190, 180).stacked(1)));
+    const size_t V = sheet->getVertexCount();
+    const size_t faceCount = sheet->getFaces().size();
+    CHECK(2 * V > 65536);
+    CHECK_EQUAL(2u, sheet->getIndexSize());
+
+    CalCoreSubmesh sorted(0, 0, 0);
+    sheet->sortTris(sorted);
+    CHECK_EQUAL(4u, sorted.getIndexSize());
+    CHECK_EQUAL(2 * V, sorted.getVertexCount());
+    CHECK_EQUAL(2 * faceCount, sorted.getFaceCount());
+
+    // every face once as it was and once flipped onto the copies
+    std::set<cal3d_uint64> original;
+    for (size_t f = 0; f < faceCount; ++f) {
+        const CalCoreSubmesh::Face& face = sheet->getFaces()[f];
+        original.insert((cal3d_uint64(face.vertexId[0]) << 40) | (cal3d_uint64(face.vertexId[1]) << 20) | face.vertexId[2]);
+    }
+    std::set<cal3d_uint64> front, back;
+    for (size_t f = 0; f < sorted.getFaceCount(); ++f) {
+        const CalCoreSubmesh::WideFace face = sorted.getFace(f);
+        if (face.vertexId[0] < V) {
+            front.insert((cal3d_uint64(face.vertexId[0]) << 40) | (cal3d_uint64(face.vertexId[1]) << 20) | face.vertexId[2]);
+        } else {
+            back.insert((cal3d_uint64(face.vertexId[1] - V) << 40) | (cal3d_uint64(face.vertexId[0] - V) << 20) | (face.vertexId[2] - V));
+        }
+    }
+    CHECK(front == original);
+    CHECK(back == original);
+}
+
+TEST_F(SubmeshFixture, sort_tris_puts_lower_sheets_first_for_upward_faces) {
+    CalCoreSubmeshPtr sheets(gridCoreSubmesh(TestGrid(11, 11).stacked(4)));
+    CalCoreSubmesh sorted(2 * sheets->getVertexCount(), 0, 2 * sheets->getFaces().size());
+    sheets->sortTris(sorted);
+    const size_t V = sheets->getVertexCount();
+    const size_t layerVertices = V / 4;
+    CHECK_EQUAL(2 * sheets->getFaces().size(), sorted.getFaces().size());
+
+    // mean output position of each layer's faces, per winding
+    double position[2][4] = {};
+    for (size_t f = 0; f < sorted.getFaces().size(); ++f) {
+        const CalIndex v = sorted.getFaces()[f].vertexId[0];
+        const int flipped = v >= V;
+        position[flipped][(v % V) / layerVertices] += double(f);
+    }
+    for (int layer = 1; layer < 4; ++layer) {
+        CHECK(position[0][layer - 1] < position[0][layer]);
+        CHECK(position[1][layer - 1] > position[1][layer]);
+    }
+}
+
+TEST_F(SubmeshFixture, sort_tris_cycle_count) {
+    const int sizes[4] = { 11, 35, 61, 80 }; // about 1k, 10k, 30k and 50k faces
+    for (int s = 0; s < 4; ++s) {
+        CalCoreSubmeshPtr sheets(gridCoreSubmesh(TestGrid(sizes[s], sizes[s]).stacked(4)));
+        const size_t faceCount = sheets->getFaces().size();
+        CalCoreSubmesh sorted(2 * sheets->getVertexCount(), 0, 2 * sheets->getFaces().size());
+        cal3d_int64 start = __rdtsc();
+        sheets->sortTris(sorted);
+        cal3d_int64 end = __rdtsc();
+        printf("Cycles per face sorted (%d faces): %d\n", (int)faceCount, (int)((end - start) / faceCount));
+
+        if (s == 0) {
+            start = __rdtsc();
+            allPairsSortTris(*sheets);
+            end = __rdtsc();
+            printf("Cycles per face sorted (%d faces, all pairs): %d\n", (int)faceCount, (int)((end - start) / faceCount));
+        }
+    }
+}
+
+static bool usesOnlyExistingVertices(const CalCoreSubmesh& csm, const CalCoreSubmesh::VectorFace& faces) {
+    for (size_t f = 0; f < faces.size(); ++f) {
+        const CalIndex* ix = faces[f].vertexId;
+        for (int k = 0; k < 3; ++k) {
+            if (ix[k] >= csm.getVertexCount() || ix[k] == ix[(k + 1) % 3]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool facesPointUp(const CalCoreSubmesh& csm, const CalCoreSubmesh::VectorFace& faces) {
+    for (size_t f = 0; f < faces.size(); ++f) {
+        const CalPoint4& p0 = csm.getVectorVertex()[faces[f].vertexId[0]].position;
+        const CalPoint4& p1 = csm.getVectorVertex()[faces[f].vertexId[1]].position;
+        const CalPoint4& p2 = csm.getVectorVertex()[faces[f].vertexId[2]].position;
+        const CalVector n = cross(CalVector(p1.x - p0.x, p1.y - p0.y, p1.z - p0.z), CalVector(p2.x - p0.x, p2.y - p0.y, p2.z - p0.z));
+        if (n.z <= 0.0f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+TEST_F(SubmeshFixture, simplify_reaches_target_and_keeps_grid_outline) {
+    CalCoreSubmeshPtr csm(gridCoreSubmesh(TestGrid(16, 16)));
+    const size_t vertexCount = csm->getVertexCount();
+    CHECK(csm->simplifySubmesh(128, 100));
+
+    const CalCoreSubmesh::VectorFace& faces = csm->getFaces();
+    CHECK(faces.size() <= 128u);
+    CHECK(faces.size() >= 64u);
+    CHECK_EQUAL(vertexCount, csm->getVertexCount());
+    CHECK(usesOnlyExistingVertices(*csm, faces));
+    CHECK(facesPointUp(*csm, faces));
+
+    // border vertices only slide along the border, so the corners stay
+    const CalIndex corners[4] = { 0, 16, 16 * 17, 17 * 17 - 1 };
+    for (int c = 0; c < 4; ++c) {
+        bool used = false;
+        for (size_t f = 0; f < faces.size(); ++f) {
+            used = used || std::count(faces[f].vertexId, faces[f].vertexId + 3, corners[c]) > 0;
+        }
+        CHECK(used);
+    }
+
+    CHECK(!csm->simplifySubmesh(128, 100));
+}
+
+TEST_F(SubmeshFixture, lod_chain_keeps_texture_seams_closed) {
+    const int W = 16, H = 16;
+    CalCoreSubmeshPtr csm(gridCoreSubmesh(TestGrid(W, H).withSeam()));
+    const size_t faceCount = csm->getFaces().size();
+    const int gridVertexCount = (W + 1) * (H + 1);
+
+    std::vector<size_t> targets;
+    targets.push_back(faceCount * 3 / 4);
+    targets.push_back(faceCount / 2);
+    targets.push_back(faceCount / 4);
+    std::vector<CalCoreSubmesh::VectorFace> levels = csm->buildLodChain(targets);
+    CHECK_EQUAL(3u, levels.size());
+
+    for (size_t level = 0; level < levels.size(); ++level) {
+        const CalCoreSubmesh::VectorFace& faces = levels[level];
+        CHECK(faces.size() <= targets[level]);
+        CHECK(level == 0 || faces.size() <= levels[level - 1].size());
+        CHECK(usesOnlyExistingVertices(*csm, faces));
+        CHECK(facesPointUp(*csm, faces));
+
+        // Every face stays on one side, and both sides have the same
+        // seam edges, by row.
+        std::vector<std::pair<int, int> > seamEdges[2];
+        for (size_t f = 0; f < faces.size(); ++f) {
+            int side = -1;
+            bool mixed = false;
+            std::vector<int> seamRows;
+            for (int k = 0; k < 3; ++k) {
+                const int v = faces[f].vertexId[k];
+                int vertexSide;
+                if (v >= gridVertexCount) {
+                    vertexSide = 1;
+                    seamRows.push_back(v - gridVertexCount);
+                } else if (v % (W + 1) == W / 2) {
+                    vertexSide = 0;
+                    seamRows.push_back(v / (W + 1));
+                } else {
+                    vertexSide = v % (W + 1) < W / 2 ? 0 : 1;
+                }
+                mixed = mixed || (side != -1 && side != vertexSide);
+                side = vertexSide;
+            }
+            CHECK(!mixed);
+            if (seamRows.size() == 2) {
+                seamEdges[side].push_back(std::make_pair(std::min(seamRows[0], seamRows[1]), std::max(seamRows[0], seamRows[1])));
+            }
+        }
+        std::sort(seamEdges[0].begin(), seamEdges[0].end());
+        std::sort(seamEdges[1].begin(), seamEdges[1].end());
+        CHECK(seamEdges[0] == seamEdges[1]);
+        CHECK(!seamEdges[0].empty());
+    }
+
+    // one pass gives the same levels as separate runs
+    std::vector<size_t> middle(1, faceCount / 2);
+    CHECK(csm->buildLodChain(middle)[0] == levels[1]);
+}
+
+TEST_F(SubmeshFixture, simplify_cycle_count) {
+    const int sizes[3] = { 22, 70, 122 }; // about 1k, 10k and 30k faces
+    for (int s = 0; s < 3; ++s) {
+        CalCoreSubmeshPtr csm(gridCoreSubmesh(TestGrid(sizes[s], sizes[s])));
+        const size_t faceCount = csm->getFaces().size();
+        std::vector<size_t> targets;
+        targets.push_back(faceCount / 2);
+        targets.push_back(faceCount / 4);
+        targets.push_back(faceCount / 10);
+        cal3d_int64 start = __rdtsc();
+        std::vector<CalCoreSubmesh::VectorFace> levels = csm->buildLodChain(targets);
+        cal3d_int64 end = __rdtsc();
+        printf("Cycles per face simplified (%d faces to %d): %d\n", (int)faceCount, (int)levels.back().size(), (int)((end - start) / faceCount));
+    }
+}
+
+// A unit square fanned around a centre vertex that the exporter
+// collapses onto corner 0, removing the last two faces.
+static CalCoreSubmeshPtr progressiveSquareCoreSubmesh() {
+    const float corners[5][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 }, { 0.5f, 0.5f } };
+    CalCoreSubmeshPtr csm(new CalCoreSubmesh(5, 0, 4));
+    for (int i = 0; i < 5; ++i) {
+        CalCoreSubmesh::Vertex v;
+        v.position = CalPoint4(CalVector(corners[i][0], corners[i][1], 0));
+        v.normal = CalVector4(0, 0, 1, 0);
+        csm->addVertex(v, BLACK, std::vector<CalCoreSubmesh::Influence>(1, CalCoreSubmesh::Influence(0, 1.0f, true)));
+    }
+    csm->addFace(CalCoreSubmesh::Face(1, 2, 4));
+    csm->addFace(CalCoreSubmesh::Face(2, 3, 4));
+    csm->addFace(CalCoreSubmesh::Face(0, 1, 4));
+    csm->addFace(CalCoreSubmesh::Face(3, 0, 4));
+    CHECK(csm->setLodCollapses(CalCoreSubmesh::LodCollapseVector(1, CalCoreSubmesh::LodCollapse(0, 2))));
+    return csm;
+}
+
+TEST_F(SubmeshFixture, lod_prefix_collapses_trailing_vertices_and_faces) {
+    CalCoreSubmeshPtr csm(progressiveSquareCoreSubmesh());
+    CHECK_EQUAL(1u, csm->getLodCount());
+
+    CalCoreSubmesh::LodPrefix full = csm->getLodPrefix(1.0f);
+    CHECK_EQUAL(5u, full.vertexCount);
+    CHECK_EQUAL(4u, full.faceCount);
+    CalCoreSubmesh::VectorFace faces(full.faceCount);
+    csm->getLodFaces(full, &faces[0]);
+    CHECK(faces == csm->getFaces());
+
+    CalCoreSubmesh::LodPrefix coarse = csm->getLodPrefix(0.0f);
+    CHECK_EQUAL(4u, coarse.vertexCount);
+    CHECK_EQUAL(2u, coarse.faceCount);
+    csm->getLodFaces(coarse, &faces[0]);
+    CHECK_EQUAL(CalCoreSubmesh::Face(1, 2, 0), faces[0]);
+    CHECK_EQUAL(CalCoreSubmesh::Face(2, 3, 0), faces[1]);
+
+    CHECK_EQUAL(4u, csm->getLodPrefix(-1.0f).vertexCount);
+    CHECK_EQUAL(5u, csm->getLodPrefix(0.5f).vertexCount);
+}
+
+TEST_F(SubmeshFixture, lod_collapses_must_fit_the_submesh) {
+    CalCoreSubmeshPtr csm(progressiveSquareCoreSubmesh());
+    // onto itself
+    CHECK(!csm->setLodCollapses(CalCoreSubmesh::LodCollapseVector(1, CalCoreSubmesh::LodCollapse(4, 2))));
+    CHECK_EQUAL(0u, csm->getLodCount());
+    // more faces than there are
+    CHECK(!csm->setLodCollapses(CalCoreSubmesh::LodCollapseVector(1, CalCoreSubmesh::LodCollapse(0, 5))));
+    CHECK_EQUAL(0u, csm->getLodCount());
+
+    CalCoreSubmesh::LodPrefix prefix = csm->getLodPrefix(0.0f);
+    CHECK_EQUAL(5u, prefix.vertexCount);
+    CHECK_EQUAL(4u, prefix.faceCount);
+
+    CHECK(csm->setLodCollapses(CalCoreSubmesh::LodCollapseVector(1, CalCoreSubmesh::LodCollapse(0, 2))));
+    csm->optimizeVertexCache();
+    CHECK_EQUAL(0u, csm->getLodCount());
+}
+
+TEST_F(SubmeshFixture, lod_collapses_survive_saving_and_loading) {
+    CalCoreMesh cm;
+    cm.submeshes.push_back(progressiveSquareCoreSubmesh());
+
+    for (int xml = 0; xml < 2; ++xml) {
+        std::ostringstream os;
+        CHECK(xml ? CalSaver::saveXmlCoreMesh(os, &cm) : CalSaver::saveCoreMesh(os, &cm));
+        std::string buffer = os.str();
+        CalBufferSource source(buffer.c_str(), buffer.size());
+        CalCoreMeshPtr loaded = CalLoader::loadCoreMesh(source);
+        CHECK(loaded);
+
+        const CalCoreSubmesh::LodCollapseVector& collapses = loaded->submeshes[0]->getLodCollapses();
+        CHECK_EQUAL(1u, collapses.size());
+        CHECK_EQUAL(0u, collapses[0].collapseId);
+        CHECK_EQUAL(2u, collapses[0].faceCollapseCount);
+    }
+}
+
+static CalCoreSubmeshPtr unitVerticesCoreSubmesh(int vertexCount, int faceCount) {
+    CalCoreSubmeshPtr csm(new CalCoreSubmesh(vertexCount, 0, faceCount));
+    for (int i = 0; i < vertexCount; ++i) {
+        CalCoreSubmesh::Vertex v;
+        v.position = CalPoint4(CalVector(float(i % 3), float(i / 3), 0));
+        v.normal = CalVector4(0, 0, 1, 0);
+        csm->addVertex(v, BLACK, std::vector<CalCoreSubmesh::Influence>(1, CalCoreSubmesh::Influence(0, 1.0f, true)));
+    }
+    return csm;
+}
+
+TEST_F(SubmeshFixture, analyze_mesh_simulates_lru_and_fifo_caches) {
+    CalCoreSubmeshPtr csm(unitVerticesCoreSubmesh(5, 3));
+    csm->addFace(CalCoreSubmesh::Face(0, 1, 2));
+    csm->addFace(CalCoreSubmesh::Face(0, 3, 4));
+    csm->addFace(CalCoreSubmesh::Face(0, 1, 2));
+
+    // LRU keeps 0 on its second use; FIFO evicts it anyway
+    CalCoreSubmesh::MeshStatistics lru = csm->analyzeMesh(CalCoreSubmesh::VertexCacheModel(CalCoreSubmesh::VertexCacheModel::LRU, 4));
+    CHECK_CLOSE(7.0f / 3.0f, lru.acmr, 1e-5f);
+    CHECK_CLOSE(7.0f / 5.0f, lru.atvr, 1e-5f);
+
+    CalCoreSubmesh::MeshStatistics fifo = csm->analyzeMesh(CalCoreSubmesh::VertexCacheModel(CalCoreSubmesh::VertexCacheModel::FIFO, 4));
+    CHECK_CLOSE(8.0f / 3.0f, fifo.acmr, 1e-5f);
+    CHECK_CLOSE(8.0f / 5.0f, fifo.atvr, 1e-5f);
+}
+
+// A copy of a single-bone submesh drawing faces instead.
+static CalCoreSubmeshPtr withFaces(const CalCoreSubmesh& csm, const CalCoreSubmesh::VectorFace& faces) {
+    CalCoreSubmeshPtr copy(new CalCoreSubmesh(csm.getVertexCount(), 0, faces.size()));
+    for (size_t i = 0; i < csm.getVertexCount(); ++i) {
+        copy->addVertex(csm.getVectorVertex()[i], BLACK, std::vector<CalCoreSubmesh::Influence>(1, CalCoreSubmesh::Influence(0, 1.0f, true)));
+    }
+    for (size_t f = 0; f < faces.size(); ++f) {
+        copy->addFace(faces[f]);
+    }
+    return copy;
+}
+
+TEST_F(SubmeshFixture, analyze_mesh_estimates_overdraw_of_stacked_sheets) {
+    CalCoreSubmeshPtr sheets(gridCoreSubmesh(TestGrid(8, 8).stacked(3)));
+    const CalCoreSubmesh::VertexCacheModel cache;
+    // drawn bottom sheet first, so each one shades over the one below
+    CHECK(sheets->analyzeMesh(cache).overdraw > 2.5f);
+
+    CalCoreSubmesh::VectorFace topFirst(sheets->getFaces().rbegin(), sheets->getFaces().rend());
+    CHECK(withFaces(*sheets, topFirst)->analyzeMesh(cache).overdraw < 1.2f);
+}
+
+TEST_F(SubmeshFixture, optimize_mesh_reports_better_cache_use_and_less_overdraw) {
+    CalCoreSubmeshPtr ordered(gridCoreSubmesh(TestGrid(16, 16).stacked(4)));
+    CalCoreSubmesh::VectorFace faces = ordered->getFaces();
+    unsigned seed = 1;
+    for (size_t i = faces.size() - 1; i > 0; --i) {
+        seed = seed * 1664525u + 1013904223u;
+        std::swap(faces[i], faces[(seed >> 8) % (i + 1)]);
+    }
+    CalCoreSubmeshPtr sheets(withFaces(*ordered, faces));
+    const size_t vertexCount = sheets->getVertexCount();
+    const size_t faceCount = sheets->getFaces().size();
+
+    CalCoreSubmesh::MeshOptimizationReport report = sheets->optimizeMesh();
+    CHECK(report.after.acmr < report.before.acmr);
+    CHECK(report.after.acmr < 0.8f);
+    CHECK(report.after.atvr < report.before.atvr);
+    CHECK(report.after.overdraw < report.before.overdraw);
+    CHECK(report.after.overdraw < 1.5f);
+    printf("Sheets ACMR %.2f -> %.2f, ATVR %.2f -> %.2f, overdraw %.2f -> %.2f\n",
+           report.before.acmr, report.after.acmr,
+           report.before.atvr, report.after.atvr,
+           report.before.overdraw, report.after.overdraw);
+
+    CHECK_EQUAL(vertexCount, sheets->getVertexCount());
+    CHECK_EQUAL(faceCount, sheets->getFaces().size());
+    CHECK(sheets->validateSubmesh());
+
+    // fetch order: vertices are first used in order
+    CalIndex next = 0;
+    for (size_t f = 0; f < faceCount; ++f) {
+        for (int k = 0; k < 3; ++k) {
+            CHECK(sheets->getFaces()[f].vertexId[k] <= next);
+            next = std::max<CalIndex>(next, sheets->getFaces()[f].vertexId[k] + 1);
+        }
+    }
+
+    CalCoreSubmesh::MeshStatistics stats = sheets->analyzeMesh(CalCoreSubmesh::VertexCacheModel());
+    CHECK_EQUAL(report.after.acmr, stats.acmr);
+}
+
+TEST_F(SubmeshFixture, optimize_mesh_on_sample_models) {
+    const char* models[3] = { "cally", "paladin", "skeleton" };
+    for (int m = 0; m < 3; ++m) {
+        const std::vector<CalCoreMeshPtr> meshes = loadSampleMeshes(models[m]);
+        if (meshes.empty()) {
+            continue;
+        }
+        // weighted by faces, as the statistics are per face or per pixel
+        double faces = 0;
+        double before[3] = {};
+        double after[3] = {};
+        for (auto mesh = meshes.begin(); mesh != meshes.end(); ++mesh) {
+            for (auto submesh = (*mesh)->submeshes.begin(); submesh != (*mesh)->submeshes.end(); ++submesh) {
+                const size_t faceCount = (*submesh)->getFaceCount();
+                const CalCoreSubmesh::MeshOptimizationReport report = (*submesh)->optimizeMesh();
+                CHECK_EQUAL(faceCount, (*submesh)->getFaceCount());
+                CHECK((*submesh)->validateSubmesh());
+                faces += faceCount;
+                before[0] += faceCount * report.before.acmr;
+                before[1] += faceCount * report.before.atvr;
+                before[2] += faceCount * report.before.overdraw;
+                after[0] += faceCount * report.after.acmr;
+                after[1] += faceCount * report.after.atvr;
+                after[2] += faceCount * report.after.overdraw;
+            }
+        }
+        printf("%s ACMR %.3f -> %.3f, ATVR %.3f -> %.3f, overdraw %.3f -> %.3f\n", models[m],
+               before[0] / faces, after[0] / faces,
+               before[1] / faces, after[1] / faces,
+               before[2] / faces, after[2] / faces);
+        CHECK(after[0] < before[0]);
+        CHECK(after[1] < before[1]);
+        // exported orders are already near 1, so just not much worse
+        CHECK(after[2] < 1.05 * before[2]);
+    }
+}
+
+TEST_F(SubmeshFixture, optimize_mesh_rejects_tiny_caches) {
+    CalCoreSubmeshPtr sheets(gridCoreSubmesh(TestGrid(2, 2).stacked(1)));
+    CalCoreSubmesh::MeshOptimizationOptions options;
+    options.cache.size = 3;
+    CHECK_THROW(sheets->optimizeMesh(options), std::exception);
+}
+
+TEST_F(SubmeshFixture, wide_faces_optimize_and_renumber_like_compact_ones) {
+    CalCoreSubmeshPtr compact(gridCoreSubmesh(TestGrid(12, 10)));
+    CalCoreSubmeshPtr wide(gridCoreSubmesh(TestGrid(12, 10)));
+    CHECK_EQUAL(2u, compact->getIndexSize());
+    wide->setIndexSize(4);
+    CHECK_EQUAL(4u, wide->getIndexSize());
+    CHECK_EQUAL(compact->getFaceCount(), wide->getWideFaces().size());
+    CHECK_THROW(wide->getFaces(), std::exception);
+    CHECK_THROW(compact->getWideFaces(), std::exception);
+
+    compact->optimizeVertexCache();
+    wide->optimizeVertexCache();
+    compact->renumberIndices();
+    wide->renumberIndices();
+    for (size_t f = 0; f < compact->getFaceCount(); ++f) {
+        CHECK(compact->getFace(f) == wide->getFace(f));
+    }
+    CHECK(wide->validateSubmesh());
+
+    wide->setIndexSize(2);
+    CHECK(compact->getFaces() == wide->getFaces());
+    CHECK_THROW(compact->addFace(CalCoreSubmesh::WideFace(0, 1, 70000)), std::exception);
+}
+
+static CalCoreSubmesh::VectorWideFace wideFacesOf(const CalCoreSubmesh& csm) {
+    CalCoreSubmesh::VectorWideFace faces;
+    for (size_t f = 0; f < csm.getFaceCount(); ++f) {
+        faces.push_back(csm.getFace(f));
+    }
+    return faces;
+}
+
+TEST_F(SubmeshFixture, mesh_tools_treat_wide_faces_like_compact_ones) {
+    const TestGrid grid = TestGrid(12, 10).bonePatches(4);
+    CalCoreSubmeshPtr compact(gridCoreSubmesh(grid));
+    CalCoreSubmeshPtr wide(gridCoreSubmesh(grid));
+    wide->setIndexSize(4);
+
+    compact->buildClusters(16, 20);
+    wide->buildClusters(16, 20);
+    CHECK(wideFacesOf(*compact) == wideFacesOf(*wide));
+    CHECK_EQUAL(compact->getClusters().size(), wide->getClusters().size());
+    CHECK_EQUAL(compact->getClusterVertexRanges().size(), wide->getClusterVertexRanges().size());
+
+    CalCoreSubmesh::CalCoreSubmeshPtrVector compactPieces;
+    CalCoreSubmesh::CalCoreSubmeshPtrVector widePieces;
+    CHECK_EQUAL(SplitMeshBoneLimitOK, compact->splitMeshBasedOnBoneLimit(compactPieces, 12));
+    CHECK_EQUAL(SplitMeshBoneLimitOK, wide->splitMeshBasedOnBoneLimit(widePieces, 12));
+    CHECK_EQUAL(compactPieces.size(), widePieces.size());
+    for (size_t p = 0; p < compactPieces.size() && p < widePieces.size(); ++p) {
+        CHECK(wideFacesOf(*compactPieces[p]) == wideFacesOf(*widePieces[p]));
+    }
+
+    CalCoreSubmesh sortedCompact(2 * compact->getVertexCount(), 0, 2 * compact->getFaceCount());
+    CalCoreSubmesh sortedWide(2 * wide->getVertexCount(), 0, 2 * wide->getFaceCount());
+    compact->sortTris(sortedCompact);
+    wide->sortTris(sortedWide);
+    CHECK(wideFacesOf(sortedCompact) == wideFacesOf(sortedWide));
+
+    const CalCoreSubmesh::MeshOptimizationReport compactReport = compact->optimizeMesh();
+    const CalCoreSubmesh::MeshOptimizationReport wideReport = wide->optimizeMesh();
+    CHECK_EQUAL(compactReport.after.acmr, wideReport.after.acmr);
+    CHECK_EQUAL(compactReport.after.overdraw, wideReport.after.overdraw);
+    CHECK(wideFacesOf(*compact) == wideFacesOf(*wide));
+
+    std::vector<size_t> targets;
+    targets.push_back(compact->getFaceCount() / 2);
+    targets.push_back(compact->getFaceCount() / 4);
+    const std::vector<CalCoreSubmesh::VectorFace> compactLevels = compact->buildLodChain(targets);
+    const std::vector<CalCoreSubmesh::VectorWideFace> wideLevels = wide->buildWideLodChain(targets);
+    CHECK_EQUAL(compactLevels.size(), wideLevels.size());
+    for (size_t level = 0; level < compactLevels.size() && level < wideLevels.size(); ++level) {
+        CHECK_EQUAL(compactLevels[level].size(), wideLevels[level].size());
+        for (size_t f = 0; f < compactLevels[level].size() && f < wideLevels[level].size(); ++f) {
+            const CalCoreSubmesh::Face& face = compactLevels[level][f];
+            CHECK(CalCoreSubmesh::WideFace(face.vertexId[0], face.vertexId[1], face.vertexId[2]) == wideLevels[level][f]);
+        }
+    }
+    CHECK_THROW(wide->buildLodChain(targets), std::exception);
+
+    CHECK(compact->simplifySubmesh(unsigned(targets[0]), 100));
+    CHECK(wide->simplifySubmesh(unsigned(targets[0]), 100));
+    CHECK_EQUAL(4u, wide->getIndexSize());
+    CHECK(wideFacesOf(*compact) == wideFacesOf(*wide));
+
+    compact->duplicateTriangles();
+    wide->duplicateTriangles();
+    CHECK(wideFacesOf(*compact) == wideFacesOf(*wide));
+}
+
+TEST_F(SubmeshFixture, wide_submeshes_keep_lod_collapses) {
+    CalCoreSubmeshPtr compact(progressiveSquareCoreSubmesh());
+    CalCoreSubmeshPtr wide(progressiveSquareCoreSubmesh());
+    wide->setIndexSize(4);
+    CHECK(wide->setLodCollapses(compact->getLodCollapses()));
+
+    const CalCoreSubmesh::LodPrefix coarse = wide->getLodPrefix(0.0f);
+    CHECK_EQUAL(2u, coarse.faceCount);
+    CalCoreSubmesh::VectorFace compactFaces(coarse.faceCount);
+    CalCoreSubmesh::VectorWideFace wideFaces(coarse.faceCount);
+    compact->getLodFaces(coarse, &compactFaces[0]);
+    wide->getLodFaces(coarse, &wideFaces[0]);
+    CHECK_EQUAL(CalCoreSubmesh::WideFace(1, 2, 0), wideFaces[0]);
+    CHECK_EQUAL(CalCoreSubmesh::WideFace(2, 3, 0), wideFaces[1]);
+    CHECK_THROW(wide->getLodFaces(coarse, &compactFaces[0]), std::exception);
+}
+
+static std::set<unsigned> bonesOf(const CalCoreSubmesh& csm, const CalCoreSubmesh::Face& face) {
+    std::vector<std::vector<unsigned> > vertexBones(csm.getVertexCount());
+    size_t v = 0;
+    const CalCoreSubmesh::InfluenceVector& influences = csm.getInfluences();
+    for (size_t i = 0; i < influences.size(); ++i) {
+        vertexBones[v].push_back(influences[i].boneId);
+        v += influences[i].lastInfluenceForThisVertex;
+    }
+    std::set<unsigned> bones;
+    for (int k = 0; k < 3; ++k) {
+        bones.insert(vertexBones[face.vertexId[k]].begin(), vertexBones[face.vertexId[k]].end());
+    }
+    return bones;
+}
+
+// The split as it was: faces in order, starting a new submesh whenever
+// the next face would take this one past the limit.
+static size_t greedyBoneLimitSplitCount(const CalCoreSubmesh& csm, size_t boneLimit) {
+    size_t count = 0;
+    std::set<unsigned> bones;
+    for (size_t f = 0; f < csm.getFaceCount(); ++f) {
+        const std::set<unsigned> faceBones = bonesOf(csm, csm.getFaces()[f]);
+        std::set<unsigned> merged(bones);
+        merged.insert(faceBones.begin(), faceBones.end());
+        if (f == 0 || merged.size() > boneLimit) {
+            ++count;
+            bones = faceBones;
+        } else {
+            bones.swap(merged);
+        }
+    }
+    return count;
+}
+
+TEST_F(SubmeshFixture, split_keeps_every_face_and_stays_within_the_bone_limit) {
+    const int W = 24;
+    CalCoreSubmeshPtr grid(gridCoreSubmesh(TestGrid(W, 16).bonePatches(4)));
+    CalCoreSubmesh::CalCoreSubmeshPtrVector pieces;
+    CHECK_EQUAL(SplitMeshBoneLimitOK, grid->splitMeshBasedOnBoneLimit(pieces, 12));
+
+    std::vector<std::vector<int> > expected;
+    for (size_t f = 0; f < grid->getFaceCount(); ++f) {
+        const CalCoreSubmesh::Face& face = grid->getFaces()[f];
+        expected.push_back(std::vector<int>(face.vertexId, face.vertexId + 3));
+    }
+    std::vector<std::vector<int> > actual;
+    for (size_t p = 0; p < pieces.size(); ++p) {
+        const CalCoreSubmesh& piece = *pieces[p];
+        CHECK(piece.validateSubmesh());
+        std::set<unsigned> bones;
+        for (size_t i = 0; i < piece.getInfluences().size(); ++i) {
+            bones.insert(piece.getInfluences()[i].boneId);
+        }
+        CHECK(bones.size() <= 12u);
+        for (size_t f = 0; f < piece.getFaceCount(); ++f) {
+            std::vector<int> face;
+            for (int k = 0; k < 3; ++k) {
+                const CalVector position = piece.getVectorVertex()[piece.getFaces()[f].vertexId[k]].position.asCalVector();
+                face.push_back(int(position.y) * (W + 1) + int(position.x));
+            }
+            actual.push_back(face);
+        }
+    }
+    std::sort(expected.begin(), expected.end());
+    std::sort(actual.begin(), actual.end());
+    CHECK(expected == actual);
+
+    CHECK(pieces.size() < greedyBoneLimitSplitCount(*grid, 12));
+}
+
+TEST_F(SubmeshFixture, split_cycle_count) {
+    const int sizes[3] = { 22, 70, 122 }; // about 1k, 10k and 30k faces
+    for (int s = 0; s < 3; ++s) {
+        CalCoreSubmeshPtr grid(gridCoreSubmesh(TestGrid(sizes[s], sizes[s]).bonePatches(6)));
+        const size_t faceCount = grid->getFaceCount();
+        CalCoreSubmesh::CalCoreSubmeshPtrVector pieces;
+        cal3d_int64 start = __rdtsc();
+        grid->splitMeshBasedOnBoneLimit(pieces, 24);
+        cal3d_int64 end = __rdtsc();
+        const size_t greedyCount = greedyBoneLimitSplitCount(*grid, 24);
+        printf("Cycles per face split (%d faces): %d, %d submeshes (in face order: %d)\n",
+               (int)faceCount, (int)((end - start) / faceCount), (int)pieces.size(), (int)greedyCount);
+        CHECK(pieces.size() <= greedyCount);
+    }
+}
+
+TEST_F(SubmeshFixture, submeshes_past_65536_vertices_save_and_load_32_bit_faces) {
+    CalCoreSubmeshPtr csm(unitVerticesCoreSubmesh(65540, 2));
+    CHECK_EQUAL(4u, csm->getIndexSize());
+    csm->addFace(CalCoreSubmesh::WideFace(0, 65538, 65539));
+    csm->addFace(CalCoreSubmesh::Face(1, 2, 3));
+    csm->addFace(CalCoreSubmesh::WideFace(65537, 65538, 65539));
+    CHECK_EQUAL(65540u, csm->getMinimumVertexBufferSize());
+    CHECK(csm->setLodCollapses(CalCoreSubmesh::LodCollapseVector(1, CalCoreSubmesh::LodCollapse(65538, 1))));
+
+    CalCoreMorphTarget::VertexOffsetArray vertexOffsets;
+    VertexOffset mv;
+    mv.vertexId = 65539;
+    mv.position = CalVector4(0, 0, 1, 0);
+    mv.normal = CalVector4(0, 0, 0, 0);
+    vertexOffsets.push_back(mv);
+    csm->addMorphTarget(CalCoreMorphTargetPtr(new CalCoreMorphTarget("m", 65540, vertexOffsets)));
+
+    CalCoreMesh cm;
+    cm.submeshes.push_back(csm);
+    std::ostringstream os;
+    CHECK(CalSaver::saveCoreMesh(os, &cm));
+    std::string buffer = os.str();
+    CalBufferSource source(buffer.c_str(), buffer.size());
+    CalCoreMeshPtr loaded = CalLoader::loadCoreMesh(source);
+    CHECK(loaded);
+
+    const CalCoreSubmesh& submesh = *loaded->submeshes[0];
+    CHECK_EQUAL(4u, submesh.getIndexSize());
+    CHECK(csm->getWideFaces() == submesh.getWideFaces());
+    CHECK(submesh.validateSubmesh());
+    CHECK_EQUAL(1u, submesh.getMorphTargets()[0]->vertexOffsets.size());
+    CHECK_EQUAL(65539u, submesh.getMorphTargets()[0]->vertexOffsets[0].vertexId);
+    CHECK_EQUAL(1u, submesh.getLodCount());
+    CHECK_EQUAL(65538u, submesh.getLodCollapses()[0].collapseId);
+    CHECK_EQUAL(1u, submesh.getLodCollapses()[0].faceCollapseCount);
+}
+
 FIXTURE(SubmeshNormalFixture) {
     static void checkNormalizedNormals(
         const CalVector4& exp,
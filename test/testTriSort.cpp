@@ -1,5 +1,7 @@
 #include "TestPrologue.h"
 
+#include <algorithm>
+#include <math.h>
 #include <cal3d/trisort.h>
 
 TEST(triangle_sorting_works) {
@@ -35,3 +37,376 @@ TEST(triangle_sorting_works) {
     CHECK_EQUAL(10, indices[10]);
     CHECK_EQUAL(11, indices[11]);
 }
+
+// Stacked wavy sheets of packed positions, like layered hair cards.
+static void stackedSheets(unsigned layers, unsigned width, unsigned height, std::vector<float>& positions, std::vector<unsigned short>& indices, float spacing = 0.3f) {
+    positions.clear();
+    indices.clear();
+    for (unsigned layer = 0; layer < layers; ++layer) {
+        for (unsigned y = 0; y <= height; ++y) {
+            for (unsigned x = 0; x <= width; ++x) {
+                const float vertex[3] = { float(x), float(y), spacing * layer + 0.1f * sinf(0.9f * x + 0.4f * y) };
+                positions.insert(positions.end(), vertex, vertex + 3);
+            }
+        }
+    }
+    for (unsigned layer = 0; layer < layers; ++layer) {
+        for (unsigned y = 0; y < height; ++y) {
+            for (unsigned x = 0; x < width; ++x) {
+                const unsigned short v = (layer * (height + 1) + y) * (width + 1) + x;
+                const unsigned short quad[6] = {
+                    v, (unsigned short)(v + 1), (unsigned short)(v + width + 1),
+                    (unsigned short)(v + 1), (unsigned short)(v + width + 2), (unsigned short)(v + width + 1),
+                };
+                indices.insert(indices.end(), quad, quad + 6);
+            }
+        }
+    }
+}
+
+// The original all-pairs sort, to check the binned one against on meshes
+// small enough that it compares every pair anyway.
+struct AllPairsTriangleSort {
+    struct Triangle {
+        unsigned short v[3];
+    };
+
+    const float* positions;
+    std::vector<Triangle> triangles;
+    std::vector<std::vector<unsigned> > edges;
+    std::vector<char> visited;
+    std::vector<unsigned> output;
+
+    const float* position(unsigned short i) const {
+        return positions + 3 * i;
+    }
+
+    float area(const Triangle& t) const {
+        const float* p0 = position(t.v[0]);
+        const float* p1 = position(t.v[1]);
+        const float* p2 = position(t.v[2]);
+        const float u[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+        const float w[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+        const float c[3] = { u[1] * w[2] - u[2] * w[1], u[2] * w[0] - u[0] * w[2], u[0] * w[1] - u[1] * w[0] };
+        return sqrtf(c[0] * c[0] + c[1] * c[1] + c[2] * c[2]) / 2;
+    }
+
+    bool inFront(const float* p, const Triangle& t) const {
+        const float* v1 = position(t.v[0]);
+        const float* v2 = position(t.v[1]);
+        const float* v3 = position(t.v[2]);
+        const float a = v1[1] * (v2[2] - v3[2]) + v2[1] * (v3[2] - v1[2]) + v3[1] * (v1[2] - v2[2]);
+        const float b = v1[2] * (v2[0] - v3[0]) + v2[2] * (v3[0] - v1[0]) + v3[2] * (v1[0] - v2[0]);
+        const float c = v1[0] * (v2[1] - v3[1]) + v2[0] * (v3[1] - v1[1]) + v3[0] * (v1[1] - v2[1]);
+        const float d = v1[0] * (v2[1] * v3[2] - v3[1] * v2[2]) + v2[0] * (v3[1] * v1[2] - v1[1] * v3[2]) + v3[0] * (v1[1] * v2[2] - v2[1] * v1[2]);
+        return a * p[0] + b * p[1] + c * p[2] >= d;
+    }
+
+    bool isFacing(unsigned a, unsigned b) const {
+        return inFront(position(triangles[b].v[0]), triangles[a])
+            && inFront(position(triangles[b].v[1]), triangles[a])
+            && inFront(position(triangles[b].v[2]), triangles[a]);
+    }
+
+    bool byArea(const Triangle& lhs, const Triangle& rhs) const {
+        return area(lhs) < area(rhs);
+    }
+
+    void visit(unsigned i) {
+        if (visited[i]) {
+            return;
+        }
+        visited[i] = true;
+        for (size_t e = 0; e < edges[i].size(); ++e) {
+            visit(edges[i][e]);
+        }
+        output.push_back(i);
+    }
+
+    std::vector<unsigned short> sort(const std::vector<unsigned short>& indices, const std::vector<float>& packedPositions) {
+        positions = &packedPositions[0];
+        triangles.resize(indices.size() / 3);
+        std::copy(indices.begin(), indices.end(), &triangles[0].v[0]);
+        std::sort(triangles.begin(), triangles.end(), [this](const Triangle& lhs, const Triangle& rhs) { return byArea(lhs, rhs); });
+
+        edges.assign(triangles.size(), std::vector<unsigned>());
+        for (unsigned a = 0; a < triangles.size(); ++a) {
+            for (unsigned b = 0; b < a; ++b) {
+                const bool a_facing_b = isFacing(a, b);
+                if (a_facing_b != isFacing(b, a)) {
+                    edges[a_facing_b ? a : b].push_back(a_facing_b ? b : a);
+                }
+            }
+        }
+        visited.assign(triangles.size(), 0);
+        for (unsigned i = 0; i < triangles.size(); ++i) {
+            visit(i);
+        }
+
+        std::vector<unsigned short> result;
+        for (auto i = output.rbegin(); i != output.rend(); ++i) {
+            result.insert(result.end(), triangles[*i].v, triangles[*i].v + 3);
+        }
+        return result;
+    }
+};
+
+TEST(triangle_sorting_matches_all_pairs_sort_on_small_meshes) {
+    std::vector<float> positions;
+    std::vector<unsigned short> indices;
+    stackedSheets(3, 2, 2, positions, indices);
+    const std::vector<unsigned short> expected = AllPairsTriangleSort().sort(indices, positions);
+
+    sortTrianglesBackToFront(indices.size() / 3, &indices[0], &positions[0]);
+    CHECK(expected == indices);
+}
+
+// Sheets 3 apart, with edges under 1.5, are beyond the default reach.
+TEST(triangle_sorting_reaches_across_widely_spaced_layers) {
+    std::vector<float> positions;
+    std::vector<unsigned short> indices;
+    stackedSheets(3, 2, 2, positions, indices, 3.0f);
+    const std::vector<unsigned short> expected = AllPairsTriangleSort().sort(indices, positions);
+
+    std::vector<unsigned short> pruned(indices);
+    sortTrianglesBackToFront(pruned.size() / 3, &pruned[0], &positions[0]);
+    CHECK(expected != pruned);
+
+    sortTrianglesBackToFront(indices.size() / 3, &indices[0], &positions[0], 3, 6.0f);
+    CHECK(expected == indices);
+    for (size_t t = 1; t < indices.size() / 3; ++t) {
+        CHECK(indices[3 * (t - 1)] / 9 <= indices[3 * t] / 9);
+    }
+}
+
+TEST(triangle_sorting_orders_stacked_sheets_bottom_up) {
+    std::vector<float> positions;
+    std::vector<unsigned short> indices;
+    stackedSheets(4, 20, 20, positions, indices);
+    const unsigned layerVertices = 21 * 21;
+
+    sortTrianglesBackToFront(indices.size() / 3, &indices[0], &positions[0]);
+    double position[4] = {};
+    for (size_t t = 0; t < indices.size() / 3; ++t) {
+        position[indices[3 * t] / layerVertices] += double(t);
+    }
+    for (int layer = 1; layer < 4; ++layer) {
+        CHECK(position[layer - 1] < position[layer]);
+    }
+}
+
+TEST(triangle_sorting_cycle_count) {
+    const unsigned sizes[3] = { 11, 35, 112 }; // about 1k, 10k and 100k triangles
+    for (int s = 0; s < 3; ++s) {
+        std::vector<float> positions;
+        std::vector<unsigned short> indices;
+        stackedSheets(4, sizes[s], sizes[s], positions, indices);
+        const unsigned triangleCount = indices.size() / 3;
+
+        cal3d_int64 start = __rdtsc();
+        sortTrianglesBackToFront(triangleCount, &indices[0], &positions[0]);
+        cal3d_int64 end = __rdtsc();
+        printf("Cycles per triangle sorted (%d triangles): %d\n", (int)triangleCount, (int)((end - start) / triangleCount));
+
+        if (s == 0) {
+            stackedSheets(4, sizes[s], sizes[s], positions, indices);
+            start = __rdtsc();
+            AllPairsTriangleSort().sort(indices, positions);
+            end = __rdtsc();
+            printf("Cycles per triangle sorted (%d triangles, all pairs): %d\n", (int)triangleCount, (int)((end - start) / triangleCount));
+        }
+    }
+}
+
+// A wavy grid laid out like CalPhysique output: position then normal.
+static void wavyGrid(unsigned width, unsigned height, std::vector<float>& positions, std::vector<unsigned short>& indices) {
+    positions.clear();
+    indices.clear();
+    for (unsigned y = 0; y <= height; ++y) {
+        for (unsigned x = 0; x <= width; ++x) {
+            const float vertex[8] = {
+                float(x) / width, float(y) / height, 0.1f * sinf(0.7f * x) * cosf(0.3f * y), 1.0f,
+                0.0f, 0.0f, 1.0f, 0.0f,
+            };
+            positions.insert(positions.end(), vertex, vertex + 8);
+        }
+    }
+    for (unsigned y = 0; y < height; ++y) {
+        for (unsigned x = 0; x < width; ++x) {
+            const unsigned short v = y * (width + 1) + x;
+            const unsigned short quad[6] = {
+                v, (unsigned short)(v + 1), (unsigned short)(v + width + 1),
+                (unsigned short)(v + 1), (unsigned short)(v + width + 2), (unsigned short)(v + width + 1),
+            };
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+}
+
+static float centroidDistanceSquared(const unsigned short* t, const std::vector<float>& positions, const float* viewPoint) {
+    float d = 0.0f;
+    for (int k = 0; k < 3; ++k) {
+        const float c = (positions[8 * t[0] + k] + positions[8 * t[1] + k] + positions[8 * t[2] + k]) / 3.0f - viewPoint[k];
+        d += c * c;
+    }
+    return d;
+}
+
+static void checkBackToFront(
+    const std::vector<unsigned short>& indices,
+    const std::vector<unsigned short>& sorted,
+    const CalTriangleDepthSorter& sorter,
+    const std::vector<float>& positions,
+    const float* viewPoint
+) {
+    const unsigned triangleCount = indices.size() / 3;
+    std::vector<unsigned> order(sorter.getOrder());
+    std::sort(order.begin(), order.end());
+    for (unsigned i = 0; i < triangleCount; ++i) {
+        CHECK_EQUAL(i, order[i]);
+    }
+    for (unsigned i = 0; i < triangleCount; ++i) {
+        const unsigned t = sorter.getOrder()[i];
+        CHECK_EQUAL(indices[3 * t + 0], sorted[3 * i + 0]);
+        CHECK_EQUAL(indices[3 * t + 1], sorted[3 * i + 1]);
+        CHECK_EQUAL(indices[3 * t + 2], sorted[3 * i + 2]);
+        if (i) {
+            CHECK(centroidDistanceSquared(&sorted[3 * i - 3], positions, viewPoint) >= centroidDistanceSquared(&sorted[3 * i], positions, viewPoint) * 0.9999f);
+        }
+    }
+}
+
+TEST(depth_sorter_orders_triangles_farthest_first) {
+    std::vector<float> positions;
+    std::vector<unsigned short> indices;
+    wavyGrid(20, 15, positions, indices);
+    const unsigned triangleCount = indices.size() / 3;
+    std::vector<unsigned short> sorted(indices.size());
+
+    CalTriangleDepthSorter sorter;
+    const float viewPoint[3] = { 0.2f, 0.3f, 2.0f };
+    sorter.sort(triangleCount, &indices[0], &positions[0], 8, viewPoint, &sorted[0]);
+    CHECK(!sorter.wasIncremental());
+    checkBackToFront(indices, sorted, sorter, positions, viewPoint);
+
+    // packed positions take the scalar path and agree
+    std::vector<float> packed;
+    for (size_t i = 0; i < positions.size(); i += 8) {
+        packed.insert(packed.end(), &positions[i], &positions[i] + 3);
+    }
+    CalTriangleDepthSorter packedSorter;
+    std::vector<unsigned short> packedSorted(indices.size());
+    packedSorter.sort(triangleCount, &indices[0], &packed[0], 3, viewPoint, &packedSorted[0]);
+    checkBackToFront(indices, packedSorted, packedSorter, positions, viewPoint);
+}
+
+TEST(depth_sorter_resorts_incrementally_when_the_view_barely_moves) {
+    std::vector<float> positions;
+    std::vector<unsigned short> indices;
+    wavyGrid(20, 15, positions, indices);
+    const unsigned triangleCount = indices.size() / 3;
+    std::vector<unsigned short> sorted(indices.size());
+
+    CalTriangleDepthSorter sorter;
+    float viewPoint[3] = { 0.2f, 0.3f, 2.0f };
+    sorter.sort(triangleCount, &indices[0], &positions[0], 8, viewPoint, &sorted[0]);
+
+    viewPoint[0] += 0.001f;
+    sorter.sort(triangleCount, &indices[0], &positions[0], 8, viewPoint, &sorted[0]);
+    CHECK(sorter.wasIncremental());
+    checkBackToFront(indices, sorted, sorter, positions, viewPoint);
+
+    // from the other side, last frame's order is no help
+    viewPoint[0] = 1.5f;
+    viewPoint[1] = 1.5f;
+    viewPoint[2] = -1.0f;
+    sorter.sort(triangleCount, &indices[0], &positions[0], 8, viewPoint, &sorted[0]);
+    CHECK(!sorter.wasIncremental());
+    checkBackToFront(indices, sorted, sorter, positions, viewPoint);
+}
+
+TEST(depth_sorter_keeps_last_order_for_equal_depths) {
+    // two triangles mirrored across the view axis
+    const float positions[18] = {
+        1,0,0, 2,0,0, 1,1,0,
+        -1,0,0, -2,0,0, -1,1,0,
+    };
+    const unsigned short indices[6] = { 0,1,2, 3,4,5 };
+    unsigned short sorted[6];
+    const float fromRight[3] = { 5, 0, 5 };
+    const float fromLeft[3] = { -5, 0, 5 };
+    const float viewPoint[3] = { 0, 0, 5 };
+
+    // seed with triangle 1 first, which is not the input order
+    CalTriangleDepthSorter sorter;
+    sorter.sort(2, indices, positions, 3, fromRight, sorted);
+    CHECK_EQUAL(1u, sorter.getOrder()[0]);
+    sorter.sort(2, indices, positions, 3, viewPoint, sorted);
+    CHECK_EQUAL(1u, sorter.getOrder()[0]);
+    CHECK_EQUAL(3, sorted[0]);
+    sorter.sort(2, indices, positions, 3, viewPoint, sorted);
+    CHECK_EQUAL(1u, sorter.getOrder()[0]);
+
+    // and back again
+    sorter.sort(2, indices, positions, 3, fromLeft, sorted);
+    CHECK_EQUAL(0u, sorter.getOrder()[0]);
+    sorter.sort(2, indices, positions, 3, viewPoint, sorted);
+    CHECK_EQUAL(0u, sorter.getOrder()[0]);
+    CHECK_EQUAL(0, sorted[0]);
+}
+
+TEST(sorting_32_bit_indices_matches_16_bit_ones) {
+    std::vector<float> positions;
+    std::vector<unsigned short> indices;
+    wavyGrid(20, 15, positions, indices);
+    const unsigned triangleCount = indices.size() / 3;
+    std::vector<unsigned> wideIndices(indices.begin(), indices.end());
+
+    std::vector<unsigned short> sorted(indices.size());
+    std::vector<unsigned> wideSorted(indices.size());
+    const float viewPoint[3] = { 0.2f, 0.3f, 2.0f };
+    CalTriangleDepthSorter sorter;
+    sorter.sort(triangleCount, &indices[0], &positions[0], 8, viewPoint, &sorted[0]);
+    CalTriangleDepthSorter wideSorter;
+    wideSorter.sort(triangleCount, &wideIndices[0], &positions[0], 8, viewPoint, &wideSorted[0]);
+    CHECK(std::equal(sorted.begin(), sorted.end(), wideSorted.begin()));
+
+    sortTrianglesBackToFront(triangleCount, &indices[0], &positions[0], 8);
+    sortTrianglesBackToFront(triangleCount, &wideIndices[0], &positions[0], 8);
+    CHECK(std::equal(indices.begin(), indices.end(), wideIndices.begin()));
+}
+
+TEST(depth_sorter_cycle_count) {
+    const int TrialCount = 10;
+    std::vector<float> positions;
+    std::vector<unsigned short> indices;
+    wavyGrid(150, 100, positions, indices);
+    const unsigned triangleCount = indices.size() / 3;
+    std::vector<unsigned short> sorted(indices.size());
+
+    cal3d_int64 fresh = 99999999999999LL;
+    cal3d_int64 still = 99999999999999LL;
+    cal3d_int64 moved = 99999999999999LL;
+    for (int t = 0; t < TrialCount; ++t) {
+        CalTriangleDepthSorter sorter;
+        float viewPoint[3] = { 0.2f, 0.3f, 2.0f };
+        cal3d_int64 start = __rdtsc();
+        sorter.sort(triangleCount, &indices[0], &positions[0], 8, viewPoint, &sorted[0]);
+        cal3d_int64 end = __rdtsc();
+        fresh = std::min(fresh, end - start);
+
+        start = __rdtsc();
+        sorter.sort(triangleCount, &indices[0], &positions[0], 8, viewPoint, &sorted[0]);
+        end = __rdtsc();
+        CHECK(sorter.wasIncremental());
+        still = std::min(still, end - start);
+
+        viewPoint[0] += 0.001f;
+        start = __rdtsc();
+        sorter.sort(triangleCount, &indices[0], &positions[0], 8, viewPoint, &sorted[0]);
+        end = __rdtsc();
+        moved = std::min(moved, end - start);
+    }
+    printf("Cycles per triangle sorted: first frame %d, same view %d, view moved %d\n",
+        (int)(fresh / triangleCount), (int)(still / triangleCount), (int)(moved / triangleCount));
+}